@@ -14,8 +14,10 @@
 #include "../common/utils.h"
 #include "../common/version.h"
 #include "inter.h"
+#include "int_auction.h"
 #include "int_guild.h"
 #include "int_homun.h"
+#include "int_mail.h"
 #include "int_mercenary.h"
 #include "int_party.h"
 #include "int_storage.h"
@@ -3546,6 +3548,7 @@ int parse_char(int fd)
 			char_id = atoi(data);
 			Sql_FreeResult(sql_handle);
 			mmo_char_fromsql(char_id, &char_dat, true);
+			mail_cache_invalidate(char_id); // reload the inbox in case the mail table was edited while offline
 
 			//Have to switch over to the DB instance otherwise data won't propagate [Kevin]
 			cd = (struct mmo_charstatus *)idb_get(char_db_, char_id);
@@ -3929,13 +3932,27 @@ int parse_console(const char* command)
 	if( strcmpi("shutdown", command) == 0 || strcmpi("exit", command) == 0 || strcmpi("quit", command) == 0 || strcmpi("end", command) == 0 )
 		runflag = SERVER_STATE_STOP;
 	else if( strcmpi("alive", command) == 0 || strcmpi("status", command) == 0 )
+	{
 		ShowInfo(CL_CYAN"Console: "CL_BOLD"I'm Alive."CL_RESET"\n");
+		if( strcmpi("status", command) == 0 )
+			socket_showusage();
+	}
+	else if( strncmpi("auctionbench", command, 12) == 0 )
+	{
+		int count = 100000, searches = 10000;
+		sscanf(command+12, "%d %d", &count, &searches);
+		inter_auction_bench(count, searches);
+	}
 	else if( strcmpi("help", command) == 0 )
 	{
 		ShowInfo("To shutdown the server:\n");
 		ShowInfo("  'shutdown|exit|quit|end'\n");
 		ShowInfo("To know if server is alive:\n");
 		ShowInfo("  'alive|status'\n");
+		ShowInfo("To show the sessions and their buffer memory:\n");
+		ShowInfo("  'status'\n");
+		ShowInfo("To time the auction searches with synthetic auctions:\n");
+		ShowInfo("  'auctionbench [auctions] [searches]'\n");
 	}
 
 	return 0;
@@ -4351,6 +4368,14 @@ int char_config_read(const char* cfgName)
 			autosave_interval = atoi(w2)*1000;
 			if (autosave_interval <= 0)
 				autosave_interval = DEFAULT_AUTOSAVE_INTERVAL;
+		} else if (strcmpi(w1, "guild_save_rate") == 0) {
+			guild_save_rate = atoi(w2);
+			if (guild_save_rate < 0)
+				guild_save_rate = 0;
+		} else if (strcmpi(w1, "mail_cache_size") == 0) {
+			mail_cache_size = atoi(w2);
+			if (mail_cache_size < 0)
+				mail_cache_size = 0;
 		} else if (strcmpi(w1, "save_log") == 0) {
 			save_log = config_switch(w2);
 		} else if (strcmpi(w1, "start_point") == 0) {
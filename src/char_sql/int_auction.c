@@ -9,6 +9,7 @@
 #include "../common/strlib.h"
 #include "../common/sql.h"
 #include "../common/timer.h"
+#include "../common/random.h"
 #include "char.h"
 #include "inter.h"
 #include "int_mail.h"
@@ -20,25 +21,289 @@
 
 static DBMap* auction_db_ = NULL; // int auction_id -> struct auction_data*
 
+#define AUCTION_PAGE_SIZE 5
+#define AUCTION_SEARCH_TYPES 4 // item type searches (armor, weapon, card, etc)
+
+/// Auctions sorted by auction_id, or by price for the price index.
+VECTOR_STRUCT_DECL(auction_list, struct auction_data*);
+
+// Search indexes over auction_db_.
+// Auction ids only grow, so new auctions are appended and the pages
+// of a search do not shift while players browse them.
+static struct auction_list auction_all_list; // all auctions
+static struct auction_list auction_type_list[AUCTION_SEARCH_TYPES]; // by search type 0-3
+static struct auction_list auction_price_list; // by price, then auction_id
+static DBMap* auction_seller_db = NULL; // int seller_id -> struct auction_list*
+static DBMap* auction_buyer_db = NULL; // int buyer_id -> struct auction_list*
+static DBMap* auction_trigram_db = NULL; // int trigram of item_name -> struct auction_list*
+static unsigned int auction_index_version = 0; // changes whenever an auction is added to or removed from the indexes
+
+/// Recent name search results, so paging through them does not repeat the search.
+#define AUCTION_NAME_CACHE 4
+static struct {
+	char searchtext[NAME_LENGTH];
+	unsigned int version; // auction_index_version of the results
+	struct auction_list result;
+} auction_name_cache[AUCTION_NAME_CACHE];
+static int auction_name_cache_next = 0;
+
 void auction_delete(struct auction_data *auction);
 static int auction_end_timer(int tid, unsigned int tick, int id, intptr_t data);
 
+static int auction_cmp_id(const struct auction_data* a, const struct auction_data* b)
+{
+	if( a->auction_id != b->auction_id )
+		return ( a->auction_id < b->auction_id ) ? -1 : 1;
+	return 0;
+}
+
+static int auction_cmp_price(const struct auction_data* a, const struct auction_data* b)
+{
+	if( a->price != b->price )
+		return ( a->price < b->price ) ? -1 : 1;
+	return auction_cmp_id(a, b);
+}
+
+/// Returns the position of the first auction in the list that is not less than 'auction'.
+static size_t auction_list_bound(struct auction_list* list, const struct auction_data* auction, int (*cmp)(const struct auction_data*, const struct auction_data*))
+{
+	size_t lo = 0, hi = VECTOR_LENGTH(*list);
+
+	if( hi > 0 && cmp(VECTOR_LAST(*list), auction) < 0 )
+		return hi; // appending
+
+	while( lo < hi )
+	{
+		size_t mid = (lo + hi) / 2;
+		if( cmp(VECTOR_INDEX(*list,mid), auction) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void auction_list_insert(struct auction_list* list, struct auction_data* auction, int (*cmp)(const struct auction_data*, const struct auction_data*))
+{
+	size_t i = auction_list_bound(list, auction, cmp);
+
+	if( i < VECTOR_LENGTH(*list) && VECTOR_INDEX(*list,i) == auction )
+		return; // already listed
+
+	VECTOR_ENSURE(*list, 1, VECTOR_LENGTH(*list) + 8);
+	VECTOR_INSERT(*list, i, auction);
+}
+
+static void auction_list_remove(struct auction_list* list, struct auction_data* auction, int (*cmp)(const struct auction_data*, const struct auction_data*))
+{
+	size_t i = auction_list_bound(list, auction, cmp);
+
+	if( i < VECTOR_LENGTH(*list) && VECTOR_INDEX(*list,i) == auction )
+		VECTOR_ERASE(*list, i);
+}
+
+/// Returns the list of the key, or NULL if it does not exist and 'create' is false.
+static struct auction_list* auction_keylist_get(DBMap* db, int key, bool create)
+{
+	struct auction_list* list = (struct auction_list*)idb_get(db, key);
+
+	if( list == NULL && create )
+	{
+		CREATE(list, struct auction_list, 1);
+		idb_put(db, key, list);
+	}
+
+	return list;
+}
+
+static void auction_keylist_insert(DBMap* db, int key, struct auction_data* auction)
+{
+	auction_list_insert(auction_keylist_get(db, key, true), auction, auction_cmp_id);
+}
+
+static void auction_keylist_remove(DBMap* db, int key, struct auction_data* auction)
+{
+	struct auction_list* list = auction_keylist_get(db, key, false);
+
+	if( list == NULL )
+		return;
+
+	auction_list_remove(list, auction, auction_cmp_id);
+	if( VECTOR_LENGTH(*list) == 0 )
+	{
+		idb_remove(db, key);
+		VECTOR_CLEAR(*list);
+		aFree(list);
+	}
+}
+
+static int auction_keylist_final(DBKey key, void* data, va_list ap)
+{
+	struct auction_list* list = (struct auction_list*)data;
+
+	VECTOR_CLEAR(*list);
+	aFree(list);
+	return 0;
+}
+
+#define auction_trigram(p) ( (int)(unsigned char)(p)[0] | (int)(unsigned char)(p)[1]<<8 | (int)(unsigned char)(p)[2]<<16 )
+
+/// Returns the item type search (0-3) that lists the auction, or -1.
+static int auction_search_type(struct auction_data* auction)
+{
+	switch( auction->type )
+	{
+	case IT_ARMOR:
+	case IT_PETARMOR: return 0;
+	case IT_WEAPON:   return 1;
+	case IT_CARD:     return 2;
+	case IT_ETC:      return 3;
+	}
+	return -1;
+}
+
+/// Adds the auction to the search indexes.
+static void auction_index_add(struct auction_data* auction)
+{
+	int type = auction_search_type(auction);
+	size_t i, len;
+
+	auction_index_version++;
+	auction_list_insert(&auction_all_list, auction, auction_cmp_id);
+	auction_list_insert(&auction_price_list, auction, auction_cmp_price);
+	if( type >= 0 )
+		auction_list_insert(&auction_type_list[type], auction, auction_cmp_id);
+	auction_keylist_insert(auction_seller_db, auction->seller_id, auction);
+	if( auction->buyer_id )
+		auction_keylist_insert(auction_buyer_db, auction->buyer_id, auction);
+
+	len = strnlen(auction->item_name, ITEM_NAME_LENGTH);
+	for( i = 0; i + 3 <= len; ++i )
+		auction_keylist_insert(auction_trigram_db, auction_trigram(auction->item_name + i), auction);
+}
+
+/// Removes the auction from the search indexes.
+/// Must be called before changing its price or buyer, the indexes are sorted by them.
+static void auction_index_remove(struct auction_data* auction)
+{
+	int type = auction_search_type(auction);
+	size_t i, len;
+
+	auction_index_version++;
+	auction_list_remove(&auction_all_list, auction, auction_cmp_id);
+	auction_list_remove(&auction_price_list, auction, auction_cmp_price);
+	if( type >= 0 )
+		auction_list_remove(&auction_type_list[type], auction, auction_cmp_id);
+	auction_keylist_remove(auction_seller_db, auction->seller_id, auction);
+	if( auction->buyer_id )
+		auction_keylist_remove(auction_buyer_db, auction->buyer_id, auction);
+
+	len = strnlen(auction->item_name, ITEM_NAME_LENGTH);
+	for( i = 0; i + 3 <= len; ++i )
+		auction_keylist_remove(auction_trigram_db, auction_trigram(auction->item_name + i), auction);
+}
+
 static int auction_count(int char_id, bool buy)
 {
-	int i = 0;
-	struct auction_data *auction;
-	DBIterator* iter;
-	DBKey key;
+	struct auction_list* list = auction_keylist_get(buy ? auction_buyer_db : auction_seller_db, char_id, false);
+
+	return list ? (int)VECTOR_LENGTH(*list) : 0;
+}
 
-	iter = auction_db_->iterator(auction_db_);
-	for( auction = (struct auction_data*)iter->first(iter,&key); iter->exists(iter); auction = (struct auction_data*)iter->next(iter,&key) )
+/// Returns the auctions whose item name contains the search text, sorted by auction_id.
+static struct auction_list* auction_search_name(const char* searchtext)
+{
+	struct auction_list* list = &auction_all_list;
+	struct auction_list* result;
+	size_t i, len = strlen(searchtext);
+
+	ARR_FIND(0, AUCTION_NAME_CACHE, i, auction_name_cache[i].version == auction_index_version && strncmp(auction_name_cache[i].searchtext, searchtext, NAME_LENGTH) == 0);
+	if( i < AUCTION_NAME_CACHE )
+		return &auction_name_cache[i].result;
+
+	i = auction_name_cache_next;
+	auction_name_cache_next = (auction_name_cache_next + 1) % AUCTION_NAME_CACHE;
+	safestrncpy(auction_name_cache[i].searchtext, searchtext, NAME_LENGTH);
+	auction_name_cache[i].version = auction_index_version;
+	result = &auction_name_cache[i].result;
+	VECTOR_LENGTH(*result) = 0;
+
+	for( i = 0; i + 3 <= len && list != NULL; ++i )
+	{// the rarest trigram gives the fewest candidates
+		struct auction_list* candidates = auction_keylist_get(auction_trigram_db, auction_trigram(searchtext + i), false);
+		if( candidates == NULL || VECTOR_LENGTH(*candidates) < VECTOR_LENGTH(*list) )
+			list = candidates;
+	}
+	if( list == NULL )
+		return result;
+
+	for( i = 0; i < VECTOR_LENGTH(*list); ++i )
 	{
-		if( (buy && auction->buyer_id == char_id) || (!buy && auction->seller_id == char_id) )
-			i++;
+		struct auction_data* auction = VECTOR_INDEX(*list,i);
+		if( !strstr(auction->item_name, searchtext) )
+			continue;
+		VECTOR_ENSURE(*result, 1, VECTOR_LENGTH(*result) + 8);
+		VECTOR_PUSH(*result, auction);
 	}
-	iter->destroy(iter);
 
-	return i;
+	return result;
+}
+
+/*==========================================
+ * Finds the auctions of a search page.
+ * Writes up to AUCTION_PAGE_SIZE auctions of the requested page to 'result',
+ * returns how many and stores the number of pages in 'pages'.
+ * Exact searches jump straight to the page, name searches only check the
+ * auctions that share the rarest trigram of the search text and keep the
+ * results until the next change to the auction house.
+ *------------------------------------------*/
+static int auction_search(short type, int char_id, int price, const char* searchtext, short page, struct auction_data** result, short* pages)
+{
+	struct auction_list* list = NULL;
+	size_t first, limit = 0, i;
+	int n = 0;
+
+	switch( type )
+	{
+	case 0:
+	case 1:
+	case 2:
+	case 3:
+		list = &auction_type_list[type];
+		break;
+	case 4:
+		list = auction_search_name(searchtext);
+		break;
+	case 5:
+	{// price index, cut at the first auction above the price
+		size_t lo = 0, hi = VECTOR_LENGTH(auction_price_list);
+		while( lo < hi )
+		{
+			size_t mid = (lo + hi) / 2;
+			if( VECTOR_INDEX(auction_price_list,mid)->price > price )
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		list = &auction_price_list;
+		limit = lo;
+		break;
+	}
+	case 6: list = auction_keylist_get(auction_seller_db, char_id, false); break;
+	case 7: list = auction_keylist_get(auction_buyer_db, char_id, false); break;
+	default: list = &auction_all_list; break;
+	}
+
+	if( list != NULL && type != 5 )
+		limit = VECTOR_LENGTH(*list);
+
+	first = ( page > 0 ) ? (size_t)(page - 1) * AUCTION_PAGE_SIZE : limit;
+	for( i = first; i < limit && n < AUCTION_PAGE_SIZE; ++i )
+		result[n++] = VECTOR_INDEX(*list,i);
+
+	*pages = (short)( limit > 0 ? (limit + AUCTION_PAGE_SIZE - 1) / AUCTION_PAGE_SIZE : 1 );
+	return n;
 }
 
 void auction_save(struct auction_data *auction)
@@ -118,6 +383,7 @@ unsigned int auction_create(struct auction_data *auction)
 		CREATE(auction_, struct auction_data, 1);
 		memcpy(auction_, auction, sizeof(struct auction_data));
 		idb_put(auction_db_, auction_->auction_id, auction_);
+		auction_index_add(auction_);
 	}
 
 	SqlStmt_Free(stmt);
@@ -169,6 +435,7 @@ void auction_delete(struct auction_data *auction)
 	if( auction->auction_end_timer != INVALID_TIMER )
 		delete_timer(auction->auction_end_timer, auction_end_timer);
 
+	auction_index_remove(auction);
 	idb_remove(auction_db_, auction_id);
 }
 
@@ -232,6 +499,7 @@ void inter_auctions_fromsql(void)
 
 		auction->auction_end_timer = add_timer(endtick, auction_end_timer, auction->auction_id, 0);
 		idb_put(auction_db_, auction->auction_id, auction);
+		auction_index_add(auction);
 	}
 
 	Sql_FreeResult(sql_handle);
@@ -257,43 +525,17 @@ static void mapif_parse_Auction_requestlist(int fd)
 	int char_id = RFIFOL(fd,4), len = sizeof(struct auction_data);
 	int price = RFIFOL(fd,10);
 	short type = RFIFOW(fd,8), page = max(1,RFIFOW(fd,14));
-	unsigned char buf[5 * sizeof(struct auction_data)];
-	DBIterator* iter;
-	DBKey key;
-	struct auction_data *auction;
-	short i = 0, j = 0, pages = 1;
+	unsigned char buf[AUCTION_PAGE_SIZE * sizeof(struct auction_data)];
+	struct auction_data* result[AUCTION_PAGE_SIZE];
+	short j, count, pages;
 
-	memcpy(searchtext, RFIFOP(fd,16), NAME_LENGTH);
+	safestrncpy(searchtext, (char*)RFIFOP(fd,16), NAME_LENGTH);
 
-	iter = auction_db_->iterator(auction_db_);
-	for( auction = (struct auction_data*)iter->first(iter,&key); iter->exists(iter); auction = (struct auction_data*)iter->next(iter,&key) )
-	{
-		if( (type == 0 && auction->type != IT_ARMOR && auction->type != IT_PETARMOR) || 
-			(type == 1 && auction->type != IT_WEAPON) ||
-			(type == 2 && auction->type != IT_CARD) ||
-			(type == 3 && auction->type != IT_ETC) ||
-			(type == 4 && !strstr(auction->item_name, searchtext)) ||
-			(type == 5 && auction->price > price) ||
-			(type == 6 && auction->seller_id != char_id) ||
-			(type == 7 && auction->buyer_id != char_id) )
-			continue;
-
-		i++;
-		if( i > 5 )
-		{ // Counting Pages of Total Results (5 Results per Page)
-			pages++;
-			i = 1; // First Result of This Page
-		}
-
-		if( page != pages )
-			continue; // This is not the requested Page
+	count = auction_search(type, char_id, price, searchtext, page, result, &pages);
+	for( j = 0; j < count; j++ )
+		memcpy(WBUFP(buf, j * len), result[j], len);
 
-		memcpy(WBUFP(buf, j * len), auction, len);
-		j++; // Found Results
-	}
-	iter->destroy(iter);
-
-	mapif_Auction_sendlist(fd, char_id, j, pages, buf);
+	mapif_Auction_sendlist(fd, char_id, count, pages, buf);
 }
 
 static void mapif_Auction_register(int fd, struct auction_data *auction)
@@ -439,9 +681,11 @@ static void mapif_parse_Auction_bid(int fd)
 			mail_sendmail(0, "Auction Manager", auction->buyer_id, auction->buyer_name, "Auction", "You have placed a higher bid.", auction->price, NULL);
 	}
 
+	auction_index_remove(auction);
 	auction->buyer_id = char_id;
 	safestrncpy(auction->buyer_name, (char*)RFIFOP(fd,16), NAME_LENGTH);
 	auction->price = bid;
+	auction_index_add(auction);
 
 	if( bid >= auction->buynow )
 	{ // Automatic won the auction
@@ -478,9 +722,94 @@ int inter_auction_parse_frommap(int fd)
 	return 1;
 }
 
+/*==========================================
+ * Search benchmark, fills the auction house with synthetic auctions,
+ * times each kind of search and removes them again.
+ * The synthetic auctions are not saved and have no end timer.
+ *------------------------------------------*/
+void inter_auction_bench(int count, int searches)
+{
+	static const char* words[] = { "Red", "Blue", "Elder", "Holy", "Cursed", "Sharp", "Heavy", "Fine", "Poring", "Orc", "Sword", "Bow", "Staff", "Mail", "Boots", "Card", "Potion", "Gem" };
+	static const short types[] = { IT_ARMOR, IT_PETARMOR, IT_WEAPON, IT_CARD, IT_ETC, IT_USABLE };
+	struct auction_data** bench;
+	struct auction_data* result[AUCTION_PAGE_SIZE];
+	unsigned int first_id = 1, tick;
+	short type, pages;
+	int i, found;
+
+	if( count <= 0 || searches <= 0 )
+		return;
+
+	if( VECTOR_LENGTH(auction_all_list) > 0 )
+		first_id = VECTOR_LAST(auction_all_list)->auction_id + 1;
+
+	rnd_seed(20101019);
+	CREATE(bench, struct auction_data*, count);
+
+	tick = gettick();
+	for( i = 0; i < count; ++i )
+	{
+		struct auction_data* auction;
+
+		CREATE(auction, struct auction_data, 1);
+		auction->auction_id = first_id + i;
+		auction->seller_id = 150000 + rnd_value(0, count/5);
+		safestrncpy(auction->seller_name, "Bench Seller", NAME_LENGTH);
+		if( rnd_value(0, 3) == 0 )
+		{
+			auction->buyer_id = 150000 + rnd_value(0, count/5);
+			safestrncpy(auction->buyer_name, "Bench Buyer", NAME_LENGTH);
+		}
+		auction->type = types[rnd_value(0, ARRAYLENGTH(types)-1)];
+		snprintf(auction->item_name, ITEM_NAME_LENGTH, "%s %s %s", words[rnd_value(0, ARRAYLENGTH(words)-1)], words[rnd_value(0, ARRAYLENGTH(words)-1)], words[rnd_value(0, ARRAYLENGTH(words)-1)]);
+		auction->price = rnd_value(1, 100000000);
+		auction->buynow = auction->price * 2;
+		auction->hours = 24;
+		auction->auction_end_timer = INVALID_TIMER;
+
+		idb_put(auction_db_, auction->auction_id, auction);
+		auction_index_add(auction);
+		bench[i] = auction;
+	}
+	ShowInfo("Auction bench: %d auctions indexed in %d ms.\n", count, DIFF_TICK(gettick(), tick));
+
+	for( type = 0; type <= 7; ++type )
+	{
+		found = 0;
+		tick = gettick();
+		for( i = 0; i < searches; ++i )
+		{
+			int char_id = 150000 + rnd_value(0, count/5);
+			short page = (short)rnd_value(1, 50);
+			found += auction_search(type, char_id, rnd_value(1, 100000000), words[rnd_value(0, ARRAYLENGTH(words)-1)], page, result, &pages);
+		}
+		ShowInfo("Auction bench: search type %d, %d searches in %d ms (%d results).\n", type, searches, DIFF_TICK(gettick(), tick), found);
+	}
+
+	tick = gettick();
+	for( i = 0; i < count; ++i )
+	{
+		auction_index_remove(bench[i]);
+		idb_remove(auction_db_, bench[i]->auction_id);
+	}
+	ShowInfo("Auction bench: %d auctions removed in %d ms.\n", count, DIFF_TICK(gettick(), tick));
+
+	aFree(bench);
+}
+
 int inter_auction_sql_init(void)
 {
+	int i;
+
 	auction_db_ = idb_alloc(DB_OPT_RELEASE_DATA);
+	auction_seller_db = idb_alloc(DB_OPT_BASE);
+	auction_buyer_db = idb_alloc(DB_OPT_BASE);
+	auction_trigram_db = idb_alloc(DB_OPT_BASE);
+	VECTOR_INIT(auction_all_list);
+	VECTOR_INIT(auction_price_list);
+	for( i = 0; i < AUCTION_SEARCH_TYPES; ++i )
+		VECTOR_INIT(auction_type_list[i]);
+	memset(auction_name_cache, 0, sizeof(auction_name_cache));
 	inter_auctions_fromsql();
 
 	return 0;
@@ -488,6 +817,17 @@ int inter_auction_sql_init(void)
 
 void inter_auction_sql_final(void)
 {
+	int i;
+
+	auction_seller_db->destroy(auction_seller_db, auction_keylist_final);
+	auction_buyer_db->destroy(auction_buyer_db, auction_keylist_final);
+	auction_trigram_db->destroy(auction_trigram_db, auction_keylist_final);
+	VECTOR_CLEAR(auction_all_list);
+	VECTOR_CLEAR(auction_price_list);
+	for( i = 0; i < AUCTION_SEARCH_TYPES; ++i )
+		VECTOR_CLEAR(auction_type_list[i]);
+	for( i = 0; i < AUCTION_NAME_CACHE; ++i )
+		VECTOR_CLEAR(auction_name_cache[i].result);
 	auction_db_->destroy(auction_db_,NULL);
 
 	return;
@@ -5,6 +5,7 @@
 #define _INT_AUCTION_SQL_H_
 
 int inter_auction_parse_frommap(int fd);
+void inter_auction_bench(int count, int searches);
 
 int inter_auction_sql_init(void);
 void inter_auction_sql_final(void);
@@ -47,48 +47,101 @@ int mapif_guild_info(int fd,struct guild *g);
 int guild_break_sub(int key,void *data,va_list ap);
 int inter_guild_tosql(struct guild *g,int flag);
 
+// Guild save queue.
+// Guilds with pending changes (save_flag&GS_MASK) or pending unload (GS_REMOVE)
+// are queued once by id (GS_QUEUED) and written out by guild_save_timer,
+// so the timer never has to walk the whole cache.
+static int* guild_save_queue = NULL; // ring buffer of guild ids
+static int guild_save_queue_max = 0;
+static int guild_save_queue_head = 0;
+static int guild_save_queue_len = 0;
+static int guild_save_drain = 0; // saves per run while draining the queue (guild_save_rate 0)
+
+/// Guilds written per second by the save timer (0 = spread the queue over autosave_time).
+int guild_save_rate = 0;
+
+#define GUILD_SAVE_INTERVAL 1000
+
+/// Flags guild data for saving and queues the guild if it isn't queued yet.
+/// Repeated changes to the same guild are coalesced into a single save.
+static void guild_set_save_flag(struct guild* g, unsigned short flag)
+{
+	g->save_flag |= flag;
+	if( g->save_flag&GS_QUEUED )
+		return;// already queued
+
+	if( guild_save_queue_len == guild_save_queue_max )
+	{// grow, unwrapping the ring buffer
+		int i, n = guild_save_queue_max + 256;
+		int* queue;
+		CREATE(queue, int, n);
+		for( i = 0; i < guild_save_queue_len; ++i )
+			queue[i] = guild_save_queue[(guild_save_queue_head + i) % guild_save_queue_max];
+		aFree(guild_save_queue);
+		guild_save_queue = queue;
+		guild_save_queue_max = n;
+		guild_save_queue_head = 0;
+	}
+	guild_save_queue[(guild_save_queue_head + guild_save_queue_len) % guild_save_queue_max] = g->guild_id;
+	++guild_save_queue_len;
+	g->save_flag |= GS_QUEUED;
+}
+
 static int guild_save_timer(int tid, unsigned int tick, int id, intptr_t data)
 {
-	static int last_id = 0; //To know in which guild we were.
-	int state = 0; //0: Have not reached last guild. 1: Reached last guild, ready for save. 2: Some guild saved, don't do further saving.
-	DBIterator* iter;
-	DBKey key;
-	struct guild* g;
+	int count; // guilds left to process in this run
+	int budget; // saves allowed in this run
+	int interval = autosave_interval;
+
+	if( interval < GUILD_SAVE_INTERVAL )
+		interval = GUILD_SAVE_INTERVAL;
+	if( guild_save_rate > 0 )
+		budget = guild_save_rate * GUILD_SAVE_INTERVAL / 1000;
+	else if( guild_save_queue_len == 0 )
+		budget = guild_save_drain = 0;
+	else
+	{// drain the queue within one autosave interval; the rate is set when the queue
+	 // starts draining and only goes up if the queue grows faster than it drains
+		budget = (int)(((int64)guild_save_queue_len * GUILD_SAVE_INTERVAL + interval - 1) / interval);
+		if( budget > guild_save_drain )
+			guild_save_drain = budget;
+		budget = guild_save_drain;
+	}
+	if( budget < 1 )
+		budget = 1;
+
+	// only entries queued before this run; guilds queued while saving wait for the next one
+	count = guild_save_queue_len;
+	while( count > 0 && budget > 0 )
+	{
+		struct guild* g;
+		int guild_id = guild_save_queue[guild_save_queue_head];
 
-	if( last_id == 0 ) //Save the first guild in the list.
-		state = 1;
+		guild_save_queue_head = (guild_save_queue_head + 1) % guild_save_queue_max;
+		--guild_save_queue_len;
+		--count;
 
-	iter = guild_db_->iterator(guild_db_);
-	for( g = (struct guild*)iter->first(iter,&key); iter->exists(iter); g = (struct guild*)iter->next(iter,&key) )
-	{
-		if( state == 0 && g->guild_id == last_id )
-			state++; //Save next guild in the list.
-		else
-		if( state == 1 && g->save_flag&GS_MASK )
+		g = (struct guild*)idb_get(guild_db_, guild_id);
+		if( g == NULL )
+			continue;// guild was broken or already unloaded
+		g->save_flag &= ~GS_QUEUED;
+
+		if( g->save_flag&GS_MASK )
 		{
 			inter_guild_tosql(g, g->save_flag&GS_MASK);
 			g->save_flag &= ~GS_MASK;
-
-			//Some guild saved.
-			last_id = g->guild_id;
-			state++;
+			--budget;
 		}
 
 		if( g->save_flag == GS_REMOVE )
 		{// Nothing to save, guild is ready for removal.
 			if (save_log)
 				ShowInfo("Guild Unloaded (%d - %s)\n", g->guild_id, g->name);
-			db_remove(guild_db_, key);
+			idb_remove(guild_db_, guild_id);
 		}
 	}
-	iter->destroy(iter);
-
-	if( state != 2 ) //Reached the end of the guild db without saving.
-		last_id = 0; //Reset guild saved, return to beginning.
 
-	state = guild_db_->size(guild_db_);
-	if( state < 1 ) state = 1; //Calculate the time slot for the next save.
-	add_timer(tick  + autosave_interval/state, guild_save_timer, 0, 0);
+	add_timer(tick + GUILD_SAVE_INTERVAL, guild_save_timer, 0, 0);
 	return 0;
 }
 
@@ -543,7 +596,7 @@ struct guild * inter_guild_fromsql(int guild_id)
 	Sql_FreeResult(sql_handle);
 
 	idb_put(guild_db_, guild_id, g); //Add to cache
-	g->save_flag |= GS_REMOVE; //But set it to be removed, in case it is not needed for long.
+	guild_set_save_flag(g, GS_REMOVE); //But set it to be removed, in case it is not needed for long.
 	
 	if (save_log)
 		ShowInfo("Guild loaded (%d - %s)\n", guild_id, g->name);
@@ -772,7 +825,7 @@ int inter_guild_CharOffline(int char_id, int guild_id)
 
 	// Remove guild from memory if no players online
 	if( online_count == 0 )
-		g->save_flag |= GS_REMOVE;
+		guild_set_save_flag(g, GS_REMOVE);
 
 	return 1;
 }
@@ -804,6 +857,10 @@ static int guild_db_final(DBKey key, void *data, va_list ap)
 void inter_guild_sql_final(void)
 {
 	guild_db_->destroy(guild_db_, guild_db_final);
+	aFree(guild_save_queue);
+	guild_save_queue = NULL;
+	guild_save_queue_max = guild_save_queue_head = guild_save_queue_len = 0;
+	guild_save_drain = 0;
 	return;
 }
 
@@ -925,7 +982,7 @@ int guild_calcinfo(struct guild *g)
 	// Check if guild stats has change
 	if(g->max_member != before.max_member || g->guild_lv != before.guild_lv || g->skill_point != before.skill_point	)
 	{
-		g->save_flag |= GS_LEVEL;
+		guild_set_save_flag(g, GS_LEVEL);
 		mapif_guild_info(-1,g);
 		return 1;
 	}
@@ -1353,7 +1410,7 @@ int mapif_parse_GuildAddMember(int fd,int guild_id,struct guild_member *m)
 			if (!guild_calcinfo(g)) //Send members if it was not invoked.
 				mapif_guild_info(-1,g);
 
-			g->save_flag |= GS_MEMBER;
+			guild_set_save_flag(g, GS_MEMBER);
 			if (g->save_flag&GS_REMOVE)
 				g->save_flag&=~GS_REMOVE;
 			return 0;
@@ -1416,7 +1473,7 @@ int mapif_parse_GuildLeave(int fd, int guild_id, int account_id, int char_id, in
 		//Update member info.
 		if (!guild_calcinfo(g))
 			mapif_guild_info(fd,g);
-		g->save_flag |= GS_EXPULSION;
+		guild_set_save_flag(g, GS_EXPULSION);
 	}
 
 	return 0;
@@ -1467,11 +1524,11 @@ int mapif_parse_GuildChangeMemberInfoShort(int fd,int guild_id,int account_id,in
 	{
 		g->average_lv = sum / c;
 		if( g->connect_member != prev_count || g->average_lv != prev_alv )
-			g->save_flag |= GS_CONNECT;
+			guild_set_save_flag(g, GS_CONNECT);
 		if( g->save_flag & GS_REMOVE )
 			g->save_flag &= ~GS_REMOVE;
 	}
-	g->save_flag |= GS_MEMBER; //Update guild member data
+	guild_set_save_flag(g, GS_MEMBER); //Update guild member data
 	return 0;
 }
 
@@ -1550,7 +1607,7 @@ int mapif_parse_GuildBasicInfoChange(int fd,int guild_id,int type,const char *da
 			else if(dw<0 && g->guild_lv+dw>=1)
 				g->guild_lv+=dw;
 			mapif_guild_info(-1,g);
-			g->save_flag |= GS_LEVEL;
+			guild_set_save_flag(g, GS_LEVEL);
 			return 0;
 		default:
 			ShowError("int_guild: GuildBasicInfoChange: Unknown type %d\n",type);
@@ -1591,7 +1648,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].position=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER;
+			guild_set_save_flag(g, GS_MEMBER);
 			break;
 		  }
 		case GMI_EXP:
@@ -1615,10 +1672,10 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 
 				guild_calcinfo(g);
 				mapif_guild_basicinfochanged(guild_id,GBI_EXP,&g->exp,sizeof(g->exp));
-				g->save_flag |= GS_LEVEL;
+				guild_set_save_flag(g, GS_LEVEL);
 			}
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER;
+			guild_set_save_flag(g, GS_MEMBER);
 			break;
 		}
 		case GMI_HAIR:
@@ -1626,7 +1683,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].hair=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER; //Save new data.
+			guild_set_save_flag(g, GS_MEMBER); //Save new data.
 			break;
 		}
 		case GMI_HAIR_COLOR:
@@ -1634,7 +1691,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].hair_color=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER; //Save new data.
+			guild_set_save_flag(g, GS_MEMBER); //Save new data.
 			break;
 		}
 		case GMI_GENDER:
@@ -1642,7 +1699,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].gender=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER; //Save new data.
+			guild_set_save_flag(g, GS_MEMBER); //Save new data.
 			break;
 		}
 		case GMI_CLASS:
@@ -1650,7 +1707,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].class_=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER; //Save new data.
+			guild_set_save_flag(g, GS_MEMBER); //Save new data.
 			break;
 		}
 		case GMI_LEVEL:
@@ -1658,7 +1715,7 @@ int mapif_parse_GuildMemberInfoChange(int fd,int guild_id,int account_id,int cha
 			g->member[i].lv=*((short *)data);
 			g->member[i].modified = GS_MEMBER_MODIFIED;
 			mapif_guild_memberinfochanged(guild_id,account_id,char_id,type,data,len);
-			g->save_flag |= GS_MEMBER; //Save new data.
+			guild_set_save_flag(g, GS_MEMBER); //Save new data.
 			break;
 		}
 		default:
@@ -1722,7 +1779,7 @@ int mapif_parse_GuildPosition(int fd,int guild_id,int idx,struct guild_position
 	memcpy(&g->position[idx],p,sizeof(struct guild_position));
 	mapif_guild_position(g,idx);
 	g->position[idx].modified = GS_POSITION_MODIFIED;
-	g->save_flag |= GS_POSITION; // Change guild_position
+	guild_set_save_flag(g, GS_POSITION); // Change guild_position
 	return 0;
 }
 
@@ -1743,7 +1800,7 @@ int mapif_parse_GuildSkillUp(int fd,int guild_id,int skill_num,int account_id,in
 		if (!guild_calcinfo(g))
 			mapif_guild_info(-1,g);
 		mapif_guild_skillupack(guild_id,skill_num,account_id);
-		g->save_flag |= (GS_LEVEL|GS_SKILL); // Change guild & guild_skill
+		guild_set_save_flag(g, GS_LEVEL|GS_SKILL); // Change guild & guild_skill
 	}
 	return 0;
 }
@@ -1762,7 +1819,7 @@ static int mapif_parse_GuildDeleteAlliance(struct guild *g, int guild_id, int ac
 	g->alliance[i].guild_id=0;
 	
 	mapif_guild_alliance(g->guild_id,guild_id,account_id1,account_id2,flag,g->name,name);
-	g->save_flag |= GS_ALLIANCE;
+	guild_set_save_flag(g, GS_ALLIANCE);
 	return 0;
 }
 
@@ -1812,8 +1869,8 @@ int mapif_parse_GuildAlliance(int fd,int guild_id1,int guild_id2,int account_id1
 	mapif_guild_alliance(guild_id1,guild_id2,account_id1,account_id2,flag,g[0]->name,g[1]->name);
 
 	// Mark the two guild to be saved
-	g[0]->save_flag |= GS_ALLIANCE;
-	g[1]->save_flag |= GS_ALLIANCE;
+	guild_set_save_flag(g[0], GS_ALLIANCE);
+	guild_set_save_flag(g[1], GS_ALLIANCE);
 	return 0;
 }
 
@@ -1828,7 +1885,7 @@ int mapif_parse_GuildNotice(int fd,int guild_id,const char *mes1,const char *mes
 
 	memcpy(g->mes1,mes1,MAX_GUILDMES1);
 	memcpy(g->mes2,mes2,MAX_GUILDMES2);
-	g->save_flag |= GS_MES;	//Change mes of guild
+	guild_set_save_flag(g, GS_MES);	//Change mes of guild
 	return mapif_guild_notice(g);
 }
 
@@ -1846,7 +1903,7 @@ int mapif_parse_GuildEmblem(int fd,int len,int guild_id,int dummy,const char *da
 	memcpy(g->emblem_data,data,len);
 	g->emblem_len=len;
 	g->emblem_id++;
-	g->save_flag |= GS_EMBLEM;	//Change guild
+	guild_set_save_flag(g, GS_EMBLEM);	//Change guild
 	return mapif_guild_emblem(g);
 }
 
@@ -1961,7 +2018,7 @@ int mapif_parse_GuildMasterChange(int fd, int guild_id, const char* name, int le
 		g->master[len] = '\0';
 
 	ShowInfo("int_guild: Guildmaster Changed to %s (Guild %d - %s)\n",g->master, guild_id, g->name);
-	g->save_flag |= (GS_BASIC|GS_MEMBER); //Save main data and member data.
+	guild_set_save_flag(g, GS_BASIC|GS_MEMBER); //Save main data and member data.
 	return mapif_guild_master_changed(g, g->member[0].account_id, g->member[0].char_id);
 }
 
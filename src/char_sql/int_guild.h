@@ -16,6 +16,7 @@
 #define GS_MES 0x0200
 #define GS_MASK 0x03FF
 #define GS_BASIC_MASK (GS_BASIC | GS_EMBLEM | GS_CONNECT | GS_LEVEL | GS_MES)
+#define GS_QUEUED 0x4000 // in the save queue
 #define GS_REMOVE 0x8000
 
 struct guild;
@@ -33,6 +34,8 @@ int inter_guild_charname_changed(int guild_id,int account_id, int char_id, char
 int inter_guild_CharOnline(int char_id, int guild_id);
 int inter_guild_CharOffline(int char_id, int guild_id);
 
+extern int guild_save_rate;
+
 //For the TXT->SQL converter.
 int inter_guild_tosql(struct guild *g,int flag);
 int inter_guildcastle_tosql(struct guild_castle *gc);
@@ -2,6 +2,7 @@
 // For more information, see LICENCE in the main folder
 
 #include "../common/mmo.h"
+#include "../common/db.h"
 #include "../common/malloc.h"
 #include "../common/showmsg.h"
 #include "../common/socket.h"
@@ -10,11 +11,136 @@
 #include "../common/timer.h"
 #include "char.h"
 #include "inter.h"
+#include "int_mail.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+// Inboxes are cached per character, the least recently used one is dropped
+// when the cache is full. Every change is written to the database, the
+// status changes (new -> unread -> read) are collected and written once per
+// MAIL_FLUSH_INTERVAL. The database must be up to date before anything is
+// read from it, see mail_flush.
+
+#define MAIL_FLUSH_INTERVAL 1000
+
+/// Cached inbox of a character.
+struct mail_cache {
+	int char_id;
+	struct mail_data md; // same messages as mail_fromsql
+	struct mail_cache* prev; // more recently used
+	struct mail_cache* next; // less recently used
+};
+
+/// Status change that is not written to the database yet.
+struct mail_status_change {
+	int mail_id;
+	mail_status status;
+};
+
+int mail_cache_size = 500;
+
+static DBMap* mail_cache_db = NULL; // int char_id -> struct mail_cache*
+static DBMap* mail_owner_db = NULL; // int mail_id -> struct mail_cache* of the cached inbox with the message
+static struct mail_cache* mail_cache_head = NULL; // most recently used
+static struct mail_cache* mail_cache_tail = NULL; // least recently used
+static int mail_cache_count = 0;
+static VECTOR_DECL(struct mail_status_change) mail_status_queue;
+
+/// Writes the queued status changes to the database.
+static void mail_flush(void)
+{
+	mail_status status;
+	size_t i;
+
+	for( status = MAIL_NEW; status <= MAIL_READ && VECTOR_LENGTH(mail_status_queue) > 0; ++status )
+	{
+		StringBuf buf;
+		int count = 0;
+
+		StringBuf_Init(&buf);
+		StringBuf_Printf(&buf, "UPDATE `%s` SET `status` = '%d' WHERE `id` IN (", mail_db, status);
+		for( i = 0; i < VECTOR_LENGTH(mail_status_queue); ++i )
+		{
+			struct mail_status_change* change = &VECTOR_INDEX(mail_status_queue,i);
+			if( change->status != status )
+				continue;
+			StringBuf_Printf(&buf, count ? ",'%d'" : "'%d'", change->mail_id);
+			count++;
+		}
+		StringBuf_AppendStr(&buf, ")");
+
+		if( count > 0 && SQL_ERROR == Sql_QueryStr(sql_handle, StringBuf_Value(&buf)) )
+			Sql_ShowDebug(sql_handle);
+		StringBuf_Destroy(&buf);
+	}
+
+	VECTOR_LENGTH(mail_status_queue) = 0;
+}
+
+static int mail_flush_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	mail_flush();
+	return 0;
+}
+
+/// Queues a status change of a message, replacing an earlier change of the same message.
+static void mail_queuestatus(int mail_id, mail_status status)
+{
+	size_t i;
+
+	ARR_FIND(0, VECTOR_LENGTH(mail_status_queue), i, VECTOR_INDEX(mail_status_queue,i).mail_id == mail_id);
+	if( i == VECTOR_LENGTH(mail_status_queue) )
+	{
+		VECTOR_ENSURE(mail_status_queue, 1, 32);
+		VECTOR_PUSHZEROED(mail_status_queue);
+		VECTOR_LAST(mail_status_queue).mail_id = mail_id;
+	}
+	VECTOR_INDEX(mail_status_queue,i).status = status;
+}
+
+/// Moves the inbox to the front of the LRU list.
+static void mail_cache_touch(struct mail_cache* mc)
+{
+	if( mc == mail_cache_head )
+		return;
+
+	// unlink
+	if( mc->prev ) mc->prev->next = mc->next;
+	if( mc->next ) mc->next->prev = mc->prev;
+	if( mc == mail_cache_tail ) mail_cache_tail = mc->prev;
+
+	// link at the front
+	mc->prev = NULL;
+	mc->next = mail_cache_head;
+	if( mail_cache_head ) mail_cache_head->prev = mc;
+	mail_cache_head = mc;
+	if( mail_cache_tail == NULL ) mail_cache_tail = mc;
+}
+
+/// Drops the cached inbox of a character, it is read from the database when needed again.
+void mail_cache_invalidate(int char_id)
+{
+	struct mail_cache* mc = (struct mail_cache*)idb_get(mail_cache_db, char_id);
+	int i;
+
+	if( mc == NULL )
+		return;
+
+	for( i = 0; i < mc->md.amount; ++i )
+		idb_remove(mail_owner_db, mc->md.msg[i].id);
+
+	if( mc->prev ) mc->prev->next = mc->next;
+	else mail_cache_head = mc->next;
+	if( mc->next ) mc->next->prev = mc->prev;
+	else mail_cache_tail = mc->prev;
+
+	idb_remove(mail_cache_db, char_id);
+	mail_cache_count--;
+	aFree(mc);
+}
+
 static int mail_fromsql(int char_id, struct mail_data* md)
 {
 	int i, j;
@@ -75,25 +201,110 @@ static int mail_fromsql(int char_id, struct mail_data* md)
 	md->amount = i;
 	Sql_FreeResult(sql_handle);
 
-	md->unchecked = 0;
-	md->unread = 0;
-	for (i = 0; i < md->amount; i++)
+	ShowInfo("mail load complete from DB - id: %d (total: %d)\n", char_id, md->amount);
+	return 1;
+}
+
+/// Returns the inbox of a character, from the cache if possible.
+static struct mail_data* mail_getinbox(int char_id)
+{
+	static struct mail_data md; // used when the cache is disabled
+	struct mail_cache* mc;
+	int i;
+
+	if( mail_cache_size <= 0 )
 	{
-		msg = &md->msg[i];
-		if( msg->status == MAIL_NEW )
-		{
-			if ( SQL_ERROR == Sql_Query(sql_handle, "UPDATE `%s` SET `status` = '%d' WHERE `id` = '%d'", mail_db, MAIL_UNREAD, msg->id) )
-				Sql_ShowDebug(sql_handle);
+		mail_flush();
+		mail_fromsql(char_id, &md);
+		return &md;
+	}
 
-			msg->status = MAIL_UNREAD;
-			md->unchecked++;
+	mc = (struct mail_cache*)idb_get(mail_cache_db, char_id);
+	if( mc != NULL )
+	{
+		mail_cache_touch(mc);
+		return &mc->md;
+	}
+
+	while( mail_cache_count >= mail_cache_size && mail_cache_tail != NULL )
+		mail_cache_invalidate(mail_cache_tail->char_id);
+
+	CREATE(mc, struct mail_cache, 1);
+	mc->char_id = char_id;
+	mail_flush();
+	mail_fromsql(char_id, &mc->md);
+	for( i = 0; i < mc->md.amount; ++i )
+		idb_put(mail_owner_db, mc->md.msg[i].id, mc);
+
+	idb_put(mail_cache_db, char_id, mc);
+	mail_cache_count++;
+	mail_cache_touch(mc);
+
+	return &mc->md;
+}
+
+/// Returns the cached copy of a message, or NULL if its inbox is not cached.
+static struct mail_message* mail_cache_getmessage(int mail_id)
+{
+	struct mail_cache* mc = (struct mail_cache*)idb_get(mail_owner_db, mail_id);
+	int i;
+
+	if( mc == NULL )
+		return NULL;
+
+	ARR_FIND(0, mc->md.amount, i, mc->md.msg[i].id == mail_id);
+	return ( i < mc->md.amount ) ? &mc->md.msg[i] : NULL;
+}
+
+/// Adds a new message to the cached inbox of its receiver.
+static void mail_cache_addmessage(struct mail_message* msg)
+{
+	struct mail_cache* mc = (struct mail_cache*)idb_get(mail_cache_db, msg->dest_id);
+
+	if( mc == NULL )
+		return;
+
+	if( mc->md.full || mc->md.amount >= MAIL_MAX_INBOX )
+	{// the inbox only lists the oldest messages
+		mc->md.full = true;
+		return;
+	}
+
+	memcpy(&mc->md.msg[mc->md.amount++], msg, sizeof(struct mail_message));
+	idb_put(mail_owner_db, msg->id, mc);
+}
+
+/// Removes a deleted message from the cache.
+static void mail_cache_delmessage(int mail_id)
+{
+	struct mail_cache* mc = (struct mail_cache*)idb_get(mail_owner_db, mail_id);
+	int i;
+
+	if( mc == NULL )
+	{// not listed in a cached inbox, but it might be one of the messages after a full inbox
+		struct mail_cache* next;
+		for( mc = mail_cache_head; mc != NULL; mc = next )
+		{
+			next = mc->next;
+			if( mc->md.full )
+				mail_cache_invalidate(mc->char_id);
 		}
-		else if ( msg->status == MAIL_UNREAD )
-			md->unread++;
+		return;
 	}
 
-	ShowInfo("mail load complete from DB - id: %d (total: %d)\n", char_id, md->amount);
-	return 1;
+	if( mc->md.full )
+	{// the next message in the database takes its place
+		mail_cache_invalidate(mc->char_id);
+		return;
+	}
+
+	ARR_FIND(0, mc->md.amount, i, mc->md.msg[i].id == mail_id);
+	if( i < mc->md.amount )
+	{
+		mc->md.amount--;
+		memmove(&mc->md.msg[i], &mc->md.msg[i+1], (mc->md.amount - i) * sizeof(struct mail_message));
+	}
+	idb_remove(mail_owner_db, mail_id);
 }
 
 /// Stores a single message in the database.
@@ -127,7 +338,10 @@ int mail_savemessage(struct mail_message* msg)
 		SqlStmt_ShowDebug(stmt);
 		msg->id = 0;
 	} else
+	{
 		msg->id = (int)SqlStmt_LastInsertId(stmt);
+		mail_cache_addmessage(msg);
+	}
 
 	SqlStmt_Free(stmt);
 	StringBuf_Destroy(&buf);
@@ -135,13 +349,22 @@ int mail_savemessage(struct mail_message* msg)
 	return msg->id;
 }
 
-/// Retrieves a single message from the database.
+/// Retrieves a single message from the cache or the database.
 /// Returns true if the operation succeeds (or false if it fails).
 static bool mail_loadmessage(int mail_id, struct mail_message* msg)
 {
+	struct mail_message* cached = mail_cache_getmessage(mail_id);
 	int j;
 	StringBuf buf;
 
+	if( cached != NULL )
+	{
+		memcpy(msg, cached, sizeof(struct mail_message));
+		return true;
+	}
+
+	mail_flush();
+
 	StringBuf_Init(&buf);
 	StringBuf_AppendStr(&buf, "SELECT `id`,`send_name`,`send_id`,`dest_name`,`dest_id`,`title`,`message`,`time`,`status`,"
 		"`zeny`,`amount`,`nameid`,`refine`,`attribute`,`identify`");
@@ -197,7 +420,24 @@ static bool mail_loadmessage(int mail_id, struct mail_message* msg)
 static void mapif_Mail_sendinbox(int fd, int char_id, unsigned char flag)
 {
 	struct mail_data md;
-	mail_fromsql(char_id, &md);
+	struct mail_data* inbox = mail_getinbox(char_id);
+	int i;
+
+	inbox->unchecked = 0;
+	inbox->unread = 0;
+	for( i = 0; i < inbox->amount; i++ )
+	{
+		struct mail_message* msg = &inbox->msg[i];
+		if( msg->status == MAIL_NEW )
+		{
+			mail_queuestatus(msg->id, MAIL_UNREAD);
+			msg->status = MAIL_UNREAD;
+			inbox->unchecked++;
+		}
+		else if( msg->status == MAIL_UNREAD )
+			inbox->unread++;
+	}
+	memcpy(&md, inbox, sizeof(md));
 
 	//FIXME: dumping the whole structure like this is unsafe [ultramage]
 	WFIFOHEAD(fd, sizeof(md) + 9);
@@ -220,8 +460,11 @@ static void mapif_parse_Mail_requestinbox(int fd)
 static void mapif_parse_Mail_read(int fd)
 {
 	int mail_id = RFIFOL(fd,2);
-	if( SQL_ERROR == Sql_Query(sql_handle, "UPDATE `%s` SET `status` = '%d' WHERE `id` = '%d'", mail_db, MAIL_READ, mail_id) )
-		Sql_ShowDebug(sql_handle);
+	struct mail_message* msg = mail_cache_getmessage(mail_id);
+
+	if( msg != NULL )
+		msg->status = MAIL_READ;
+	mail_queuestatus(mail_id, MAIL_READ);
 }
 
 /*==========================================
@@ -229,6 +472,7 @@ static void mapif_parse_Mail_read(int fd)
  *------------------------------------------*/
 static bool mail_DeleteAttach(int mail_id)
 {
+	struct mail_message* msg;
 	StringBuf buf;
 	int i;
 
@@ -246,6 +490,12 @@ static bool mail_DeleteAttach(int mail_id)
 		return false;
 	}
 
+	if( (msg = mail_cache_getmessage(mail_id)) != NULL )
+	{
+		msg->zeny = 0;
+		memset(&msg->item, 0, sizeof(struct item));
+	}
+
 	StringBuf_Destroy(&buf);
 	return true;
 }
@@ -294,6 +544,8 @@ static void mapif_Mail_delete(int fd, int char_id, int mail_id)
 		Sql_ShowDebug(sql_handle);
 		failed = true;
 	}
+	else
+		mail_cache_delmessage(mail_id);
 
 	WFIFOHEAD(fd,11);
 	WFIFOW(fd,0) = 0x384b;
@@ -344,6 +596,8 @@ static void mapif_Mail_return(int fd, int char_id, int mail_id)
 		{
 			char temp_[MAIL_TITLE_LENGTH];
 
+			mail_cache_delmessage(mail_id);
+
 			// swap sender and receiver
 			swap(msg.send_id, msg.dest_id);
 			safestrncpy(temp_, msg.send_name, NAME_LENGTH);
@@ -467,10 +721,23 @@ int inter_mail_parse_frommap(int fd)
 
 int inter_mail_sql_init(void)
 {
+	mail_cache_db = idb_alloc(DB_OPT_BASE);
+	mail_owner_db = idb_alloc(DB_OPT_BASE);
+	VECTOR_INIT(mail_status_queue);
+
+	add_timer_func_list(mail_flush_timer, "mail_flush_timer");
+	add_timer_interval(gettick() + MAIL_FLUSH_INTERVAL, mail_flush_timer, 0, 0, MAIL_FLUSH_INTERVAL);
 	return 1;
 }
 
 void inter_mail_sql_final(void)
 {
+	mail_flush();
+	VECTOR_CLEAR(mail_status_queue);
+
+	while( mail_cache_head != NULL )
+		mail_cache_invalidate(mail_cache_head->char_id);
+	mail_cache_db->destroy(mail_cache_db, NULL);
+	mail_owner_db->destroy(mail_owner_db, NULL);
 	return;
 }
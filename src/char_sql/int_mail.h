@@ -12,5 +12,8 @@ void inter_mail_sql_final(void);
 
 int mail_savemessage(struct mail_message* msg);
 void mapif_Mail_new(struct mail_message *msg);
+void mail_cache_invalidate(int char_id);
+
+extern int mail_cache_size;
 
 #endif /* _INT_MAIL_SQL_H_ */
@@ -7,8 +7,10 @@
 #include "../common/malloc.h"
 #include "../common/showmsg.h"
 #include "../common/strlib.h"
+#include "../common/thread.h"
 #include "socket.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -158,6 +160,7 @@ int sSocket(int af, int type, int protocol)
 #define sFD_CLR(fd,set) FD_CLR(fd2sock(fd),set)
 #define sFD_ISSET(fd,set) FD_ISSET(fd2sock(fd),set)
 #define sFD_ZERO FD_ZERO
+#define sGetsockname(fd,name,namelen) getsockname(fd2sock(fd),name,namelen)
 
 /////////////////////////////////////////////////////////////////////
 #else
@@ -189,6 +192,7 @@ int sSocket(int af, int type, int protocol)
 #define sFD_CLR FD_CLR
 #define sFD_ISSET FD_ISSET
 #define sFD_ZERO FD_ZERO
+#define sGetsockname getsockname
 
 /////////////////////////////////////////////////////////////////////
 #endif
@@ -206,12 +210,46 @@ int naddr_ = 0;   // # of ip addresses
 // Larger packets cause a buffer overflow and stack corruption.
 static size_t socket_max_client_packet = 20480;
 
-// initial recv buffer size (this will also be the max. size)
+// max. recv buffer size
 // biggest known packet: S 0153 <len>.w <emblem data>.?B -> 24x24 256 color .bmp (0153 + len.w + 1618/1654/1756 bytes)
 #define RFIFO_SIZE (2*1024)
-// initial send buffer size (will be resized as needed)
+// nominal send buffer size (will be resized as needed)
 #define WFIFO_SIZE (16*1024)
 
+// Fifo buffers start at FIFO_MIN_SIZE and grow by doubling up to WFIFO_SIZE.
+// Buffers of these size classes are carved from slabs shared by all sessions;
+// a slab is given back to the system when none of its buffers is in use.
+#define FIFO_MIN_SIZE 512
+#define FIFO_CLASSES 6 // 512, 1k, 2k, 4k, 8k, 16k
+#define FIFO_SLAB_SIZE (64*1024) // nominal payload of a slab
+#define FIFO_SLAB_MIN 4 // minimum buffers per slab
+
+/// Slab of fifo buffers of one size class.
+/// Each buffer is preceded by a pointer to its slab, free buffers are linked through their payload.
+struct fifo_slab {
+	struct fifo_slab* prev; // partial slabs of the class
+	struct fifo_slab* next;
+	int cls; // size class
+	int used; // buffers in use
+	int count; // buffers in the slab
+	uint8* free; // first free buffer
+};
+#define FIFO_SLAB_HEAD ((sizeof(struct fifo_slab) + 7) & ~7)
+#define FIFO_SLOT_HEAD 8 // room for the owner pointer, keeps buffers 8-byte aligned
+static struct fifo_slab* fifo_partial[FIFO_CLASSES]; // slabs with free buffers
+
+// fifo memory accounting
+size_t fifo_bytes_used = 0; // bytes of the buffers held by sessions
+size_t fifo_bytes_allocated = 0; // bytes of slabs and unclassed buffers
+
+// Released session objects kept for reuse
+#define SESSION_POOL_MAX 1024
+static struct socket_data* session_pool[SESSION_POOL_MAX];
+static int session_pool_count = 0;
+
+// Maximum connections accepted from a listening socket in one call of connect_client
+#define ACCEPT_BATCH 64
+
 // Maximum size of pending data in the write fifo. (for non-server connections)
 // The connection is closed if it goes over the limit.
 #define WFIFO_MAX (1*1024*1024)
@@ -225,6 +263,7 @@ uint32 send_shortlist_set[(FD_SETSIZE+31)/32];// to know if specific fd's are al
 #endif
 
 static int create_session(int fd, RecvFunc func_recv, SendFunc func_send, ParseFunc func_parse);
+static uint8* fifo_resize(uint8* buf, size_t size, size_t newsize, size_t used);
 
 int ip_rules = 1;
 static int connect_check(uint32 ip);
@@ -299,6 +338,556 @@ void set_eof(int fd)
 	}
 }
 
+/*======================================
+ *	CORE : I/O thread
+ *--------------------------------------*/
+// With socket_io_thread, the recv and send calls of the tcp sessions are made
+// by the I/O thread. The main thread hands it the data of the write fifos and
+// gets the data it read, through a pair of lock-free rings, so the fifo
+// functions work the same. Listening sockets, connecting and udp sessions
+// stay on the main thread. Each thread wakes the other with a byte on a
+// loopback udp socket pair.
+// The I/O thread only uses the system allocator and doesn't report errors.
+
+#define IO_RING_SIZE 4096
+#define IO_RECV_SIZE (64*1024)
+
+enum io_msg_type {
+	IO_OPEN,  // main -> io, new connection
+	IO_SEND,  // main -> io, data to send
+	IO_CLOSE, // main -> io, send what is left and close the connection
+	IO_STOP,  // main -> io, end the thread
+	IO_RECV,  // io -> main, data received
+	IO_SENT,  // io -> main, data sent
+	IO_EOF    // io -> main, the connection ended or failed
+};
+
+struct io_msg {
+	struct io_msg* next;
+	enum io_msg_type type;
+	int fd;
+	uint32 serial; // connection of the message, to ignore messages of closed connections
+	size_t len; // size of data (bytes sent for IO_SENT)
+	size_t pos; // data already handled
+	uint8 data[1];
+};
+
+struct io_queue {
+	struct io_msg* head;
+	struct io_msg* tail;
+};
+
+// state of a connection in the I/O thread
+struct io_conn {
+	uint32 serial; // 0 if not open
+	bool reading; // false once the connection ended
+	struct io_queue output; // data not sent yet
+};
+
+static bool socket_io_thread = false;
+static athread* io_thread = NULL;
+static aring* io_ring_out = NULL; // main -> io
+static aring* io_ring_in = NULL; // io -> main
+static int io_wake_main = -1; // main side of the wake sockets (a session)
+static int io_wake_io = -1; // I/O thread side of the wake sockets
+
+// main thread
+static uint32 io_serial[FD_SETSIZE]; // connection of the session, 0 if it isn't handled by the I/O thread
+static uint32 io_serial_next = 0;
+static struct io_queue io_input[FD_SETSIZE]; // received data that doesn't fit in the read fifo yet
+static size_t io_unsent[FD_SETSIZE]; // data handed to the I/O thread and not sent yet, counts towards WFIFO_MAX
+static struct io_queue io_out_backlog; // messages waiting for room in io_ring_out
+static bool io_wake_pending = false; // messages were pushed since the I/O thread was last woken
+static bool io_input_left = false; // a read fifo couldn't take all the data
+
+// I/O thread
+static struct io_conn io_conn[FD_SETSIZE];
+static int io_conn_max = 0;
+static struct io_queue io_in_backlog; // messages waiting for room in io_ring_in
+
+
+static void io_queue_push(struct io_queue* q, struct io_msg* msg)
+{
+	msg->next = NULL;
+	if( q->tail )
+		q->tail->next = msg;
+	else
+		q->head = msg;
+	q->tail = msg;
+}
+
+static struct io_msg* io_queue_pop(struct io_queue* q)
+{
+	struct io_msg* msg = q->head;
+
+	if( msg )
+	{
+		q->head = msg->next;
+		if( q->head == NULL )
+			q->tail = NULL;
+	}
+	return msg;
+}
+
+static void io_queue_clear(struct io_queue* q)
+{
+	struct io_msg* msg;
+
+	while( (msg = io_queue_pop(q)) != NULL )
+		free(msg);
+}
+
+/// Creates a message, or returns NULL if there is no memory.
+static struct io_msg* io_msg_create(enum io_msg_type type, int fd, uint32 serial, const uint8* data, size_t len)
+{
+	struct io_msg* msg = (struct io_msg*)malloc(sizeof(struct io_msg) + len);
+
+	if( msg == NULL )
+		return NULL;
+	msg->next = NULL;
+	msg->type = type;
+	msg->fd = fd;
+	msg->serial = serial;
+	msg->len = len;
+	msg->pos = 0;
+	if( len )
+		memcpy(msg->data, data, len);
+	return msg;
+}
+
+/// Pushes the backlog, then msg, into the ring as long as there is room.
+/// Whatever doesn't fit stays in the backlog, in order.
+static void io_ring_push(aring* ring, struct io_queue* backlog, struct io_msg* msg)
+{
+	struct io_msg* head;
+
+	if( msg )
+		io_queue_push(backlog, msg);
+	while( (head = backlog->head) != NULL )
+	{
+		struct io_msg* next = head->next;// the consumer owns head once it is pushed
+		if( !aring_push(ring, head) )
+			break;
+		backlog->head = next;
+		if( next == NULL )
+			backlog->tail = NULL;
+	}
+}
+
+/// Wakes the other thread.
+static void io_wake(int fd)
+{
+	char c = 0;
+	sSend(fd, &c, 1, 0);
+}
+
+/// Reads the pending wake bytes.
+static int io_wake_recv(int fd)
+{
+	char buf[64];
+	while( sRecv(fd, buf, sizeof(buf), 0) > 0 )
+		;
+	return 0;
+}
+
+/// Main thread, sends a message to the I/O thread.
+static void io_push(enum io_msg_type type, int fd, const uint8* data, size_t len)
+{
+	struct io_msg* msg = io_msg_create(type, fd, io_serial[fd], data, len);
+
+	if( msg == NULL )
+	{
+		ShowFatalError("io_push: out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	io_ring_push(io_ring_out, &io_out_backlog, msg);
+	io_wake_pending = true;
+}
+
+/// Main thread, hands a new tcp connection over to the I/O thread.
+static void io_open(int fd)
+{
+	if( ++io_serial_next == 0 )
+		io_serial_next = 1;
+	io_serial[fd] = io_serial_next;
+	io_unsent[fd] = 0;
+	io_push(IO_OPEN, fd, NULL, 0);
+}
+
+/// Main thread, hands the write fifo of a session over to the I/O thread.
+static void io_send(int fd)
+{
+	io_push(IO_SEND, fd, session[fd]->wdata, session[fd]->wdata_size);
+	io_unsent[fd] += session[fd]->wdata_size;
+	session[fd]->wdata_size = 0;
+}
+
+/// Main thread, lets the I/O thread close a connection.
+static void io_close(int fd)
+{
+	io_push(IO_CLOSE, fd, NULL, 0);
+	io_serial[fd] = 0;
+	io_unsent[fd] = 0;
+	io_queue_clear(&io_input[fd]);
+}
+
+/// Main thread, wakes the I/O thread if there are new messages for it.
+static void io_flush(void)
+{
+	if( io_out_backlog.head )
+		io_ring_push(io_ring_out, &io_out_backlog, NULL);
+	if( io_wake_pending )
+	{
+		io_wake(io_wake_main);
+		io_wake_pending = false;
+	}
+}
+
+/// Main thread, moves the data received by the I/O thread into the read fifos.
+static void io_receive(void)
+{
+	struct io_msg* msg;
+	int fd;
+
+	while( (msg = (struct io_msg*)aring_pop(io_ring_in)) != NULL )
+	{
+		if( io_serial[msg->fd] != msg->serial )
+			free(msg);// closed
+		else if( msg->type == IO_SENT )
+		{
+			io_unsent[msg->fd] -= min(msg->len, io_unsent[msg->fd]);
+			free(msg);
+		}
+		else
+			io_queue_push(&io_input[msg->fd], msg);
+	}
+
+	io_input_left = false;
+	for( fd = 1; fd < fd_max; ++fd )
+	{
+		struct socket_data* s = session[fd];
+
+		while( (msg = io_input[fd].head) != NULL )
+		{
+			size_t len;
+
+			if( s == NULL || s->flag.eof )
+			{
+				io_queue_clear(&io_input[fd]);
+				break;
+			}
+			if( msg->type == IO_EOF )
+			{
+				set_eof(fd);
+				continue;
+			}
+			if( RFIFOSPACE(fd) < s->max_rdata/4 && s->max_rdata < RFIFO_SIZE )
+			{// almost full, grow to the next size class
+				s->rdata = fifo_resize(s->rdata, s->max_rdata, s->max_rdata*2, s->rdata_size);
+				s->max_rdata *= 2;
+			}
+			len = msg->len - msg->pos;
+			if( len > RFIFOSPACE(fd) )
+				len = RFIFOSPACE(fd);
+			if( len == 0 )
+			{// the rest waits for the parse function
+				io_input_left = true;
+				break;
+			}
+			memcpy(s->rdata + s->rdata_size, msg->data + msg->pos, len);
+			s->rdata_size += len;
+			s->rdata_tick = last_tick;
+			msg->pos += len;
+			if( msg->pos < msg->len )
+			{
+				io_input_left = true;
+				break;
+			}
+			free(io_queue_pop(&io_input[fd]));
+		}
+	}
+}
+
+/// I/O thread, sends a message to the main thread.
+static void io_push_in(enum io_msg_type type, int fd, const uint8* data, size_t len)
+{
+	struct io_msg* msg = io_msg_create(type, fd, io_conn[fd].serial, data, len);
+
+	if( msg == NULL && type == IO_RECV )
+		msg = io_msg_create(IO_EOF, fd, io_conn[fd].serial, NULL, 0);// drop the connection instead of the data
+	if( msg != NULL )
+		io_queue_push(&io_in_backlog, msg);
+}
+
+/// I/O thread, sends the pending data of a connection and tells the main thread how much was sent.
+/// Returns false if the connection failed.
+static bool io_conn_send(int fd)
+{
+	struct io_conn* conn = &io_conn[fd];
+	struct io_msg* msg;
+	size_t sent = 0;
+	bool ok = true;
+
+	while( (msg = conn->output.head) != NULL )
+	{
+		int len = sSend(fd, (const char*)msg->data + msg->pos, (int)(msg->len - msg->pos), 0);
+		if( len == SOCKET_ERROR )
+		{
+			ok = ( sErrno == S_EWOULDBLOCK );
+			break;
+		}
+		msg->pos += len;
+		sent += len;
+		if( msg->pos < msg->len )
+			break;
+		free(io_queue_pop(&conn->output));
+	}
+	if( sent > 0 )
+	{// lets the main thread queue more data (see WFIFOSET)
+		struct io_msg* ack = io_msg_create(IO_SENT, fd, conn->serial, NULL, 0);
+		if( ack != NULL )
+		{
+			ack->len = sent;
+			io_queue_push(&io_in_backlog, ack);
+		}
+	}
+	return ok;
+}
+
+/// I/O thread, closes a connection.
+static void io_conn_close(int fd)
+{
+	struct io_conn* conn = &io_conn[fd];
+
+	io_queue_clear(&conn->output);
+	sShutdown(fd, SHUT_RDWR);
+	sClose(fd);
+	conn->serial = 0;
+	conn->reading = false;
+}
+
+/// I/O thread, handles the messages of the main thread.
+/// Returns false when the thread has to stop.
+static bool io_conn_messages(void)
+{
+	struct io_msg* msg;
+
+	while( (msg = (struct io_msg*)aring_pop(io_ring_out)) != NULL )
+	{
+		struct io_conn* conn = &io_conn[msg->fd];
+
+		switch( msg->type )
+		{
+		case IO_OPEN:
+			conn->serial = msg->serial;
+			conn->reading = true;
+			if( io_conn_max <= msg->fd )
+				io_conn_max = msg->fd + 1;
+			free(msg);
+			break;
+		case IO_SEND:
+			if( conn->serial == msg->serial )
+				io_queue_push(&conn->output, msg);
+			else
+				free(msg);
+			break;
+		case IO_CLOSE:
+			if( conn->serial == msg->serial )
+			{
+				io_conn_send(msg->fd);// best effort, like do_close
+				io_conn_close(msg->fd);
+			}
+			free(msg);
+			break;
+		default:// IO_STOP
+			free(msg);
+			return false;
+		}
+	}
+	return true;
+}
+
+/// I/O thread, waits for the sockets and moves data between them and the main thread.
+static void* io_main(void* param)
+{
+	static uint8 buf[IO_RECV_SIZE];
+	int fd;
+
+	for(;;)
+	{
+		fd_set rfd, wfd;
+		struct timeval timeout;
+		int n = io_wake_io + 1;
+
+		sFD_ZERO(&rfd);
+		sFD_ZERO(&wfd);
+		sFD_SET(io_wake_io, &rfd);
+		for( fd = 1; fd < io_conn_max; ++fd )
+		{
+			if( io_conn[fd].serial == 0 )
+				continue;
+			if( io_conn[fd].reading )
+				sFD_SET(fd, &rfd);
+			if( io_conn[fd].output.head )
+				sFD_SET(fd, &wfd);
+			if( n <= fd )
+				n = fd + 1;
+		}
+
+		// the main thread only wakes us for output, so poll while the backlog waits for room in the ring
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 1000;
+		if( sSelect(n, &rfd, &wfd, NULL, io_in_backlog.head ? &timeout : NULL) == SOCKET_ERROR )
+		{
+			if( sErrno != S_EINTR )
+				FD_ZERO(&rfd);// only the messages can help now
+			else
+				continue;
+		}
+
+		if( sFD_ISSET(io_wake_io, &rfd) )
+			io_wake_recv(io_wake_io);
+		if( !io_conn_messages() )
+			break;
+
+		for( fd = 1; fd < io_conn_max; ++fd )
+		{
+			struct io_conn* conn = &io_conn[fd];
+
+			if( conn->serial == 0 )
+				continue;
+			if( conn->reading && sFD_ISSET(fd, &rfd) )
+			{
+				int len = sRecv(fd, (char*)buf, sizeof(buf), 0);
+				if( len > 0 )
+					io_push_in(IO_RECV, fd, buf, len);
+				else if( len == 0 || sErrno != S_EWOULDBLOCK )
+				{
+					io_push_in(IO_EOF, fd, NULL, 0);
+					conn->reading = false;
+				}
+			}
+			if( conn->output.head && !io_conn_send(fd) )
+			{
+				io_queue_clear(&conn->output);
+				if( conn->reading )
+				{
+					io_push_in(IO_EOF, fd, NULL, 0);
+					conn->reading = false;
+				}
+			}
+		}
+
+		if( io_in_backlog.head )
+		{
+			io_ring_push(io_ring_in, &io_in_backlog, NULL);
+			io_wake(io_wake_io);
+		}
+	}
+
+	for( fd = 1; fd < io_conn_max; ++fd )
+		if( io_conn[fd].serial )
+			io_conn_close(fd);
+	io_queue_clear(&io_in_backlog);
+	return NULL;
+}
+
+/// Creates a udp socket on the loopback interface.
+static int io_wake_socket(struct sockaddr_in* addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd = sSocket(AF_INET, SOCK_DGRAM, 0);
+
+	if( fd == -1 )
+		return -1;
+	if( fd == 0 || fd >= FD_SETSIZE )
+	{
+		sClose(fd);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	if( sBind(fd, (struct sockaddr*)addr, sizeof(*addr)) == SOCKET_ERROR ||
+		sGetsockname(fd, (struct sockaddr*)addr, &len) == SOCKET_ERROR )
+	{
+		sClose(fd);
+		return -1;
+	}
+	set_nonblocking(fd, 1);
+	return fd;
+}
+
+/// Starts the I/O thread.
+static void io_init(void)
+{
+	struct sockaddr_in addr_main, addr_io;
+
+#ifdef WIN32
+	// the fd to socket table of the windows layer isn't thread-safe
+	ShowWarning("socket_io_thread is not supported on windows, ignoring.\n");
+	return;
+#endif
+	io_ring_out = aring_create(IO_RING_SIZE);
+	io_ring_in = aring_create(IO_RING_SIZE);
+	io_wake_main = io_wake_socket(&addr_main);
+	io_wake_io = io_wake_socket(&addr_io);
+	if( io_ring_out == NULL || io_ring_in == NULL || io_wake_main == -1 || io_wake_io == -1 ||
+		sConnect(io_wake_main, (struct sockaddr*)&addr_io, sizeof(addr_io)) == SOCKET_ERROR ||
+		sConnect(io_wake_io, (struct sockaddr*)&addr_main, sizeof(addr_main)) == SOCKET_ERROR ||
+		(io_thread = athread_create(io_main, NULL)) == NULL )
+	{
+		ShowError("io_init: failed to start the I/O thread, sockets are handled by the main thread.\n");
+		if( io_wake_main != -1 )
+			sClose(io_wake_main);
+		if( io_wake_io != -1 )
+			sClose(io_wake_io);
+		io_wake_main = io_wake_io = -1;
+		aring_destroy(io_ring_out);
+		aring_destroy(io_ring_in);
+		io_ring_out = io_ring_in = NULL;
+		return;
+	}
+
+	if( fd_max <= io_wake_main ) fd_max = io_wake_main + 1;
+	sFD_SET(io_wake_main, &readfds);
+	create_session(io_wake_main, io_wake_recv, null_send, null_parse);
+	session[io_wake_main]->client_addr = INADDR_LOOPBACK;
+	session[io_wake_main]->rdata_tick = 0;
+	ShowInfo("Socket I/O runs in its own thread.\n");
+}
+
+/// Stops the I/O thread, once all its connections are closed.
+static void io_final(void)
+{
+	struct io_msg* msg;
+	int fd;
+
+	if( io_thread == NULL )
+		return;
+	io_push(IO_STOP, 0, NULL, 0);
+	while( io_out_backlog.head )
+	{// the I/O thread is still emptying the ring
+		io_flush();
+		io_wake_recv(io_wake_main);
+	}
+	io_flush();
+	athread_join(io_thread);
+	io_thread = NULL;
+
+	while( (msg = (struct io_msg*)aring_pop(io_ring_in)) != NULL )
+		free(msg);
+	for( fd = 0; fd < FD_SETSIZE; ++fd )
+		io_queue_clear(&io_input[fd]);
+	aring_destroy(io_ring_out);
+	aring_destroy(io_ring_in);
+	io_ring_out = io_ring_in = NULL;
+	do_close(io_wake_main);
+	sClose(io_wake_io);
+	io_wake_main = io_wake_io = -1;
+}
+
 int recv_to_fifo(int fd)
 {
 	int len;
@@ -306,6 +895,12 @@ int recv_to_fifo(int fd)
 	if( !session_isActive(fd) )
 		return -1;
 
+	if( RFIFOSPACE(fd) < session[fd]->max_rdata/4 && session[fd]->max_rdata < RFIFO_SIZE )
+	{// almost full, grow to the next size class
+		session[fd]->rdata = fifo_resize(session[fd]->rdata, session[fd]->max_rdata, session[fd]->max_rdata*2, session[fd]->rdata_size);
+		session[fd]->max_rdata *= 2;
+	}
+
 	len = sRecv(fd, (char *) session[fd]->rdata + session[fd]->rdata_size, (int)RFIFOSPACE(fd), 0);
 
 	if( len == SOCKET_ERROR )
@@ -338,6 +933,12 @@ int send_from_fifo(int fd)
 	if( session[fd]->wdata_size == 0 )
 		return 0; // nothing to send
 
+	if( io_serial[fd] )
+	{// sent by the I/O thread
+		io_send(fd);
+		return 0;
+	}
+
 	len = sSend(fd, (const char *) session[fd]->wdata, (int)session[fd]->wdata_size, 0);
 
 	if( len == SOCKET_ERROR )
@@ -380,7 +981,9 @@ void flush_fifos(void)
 /*======================================
  *	CORE : Connection functions
  *--------------------------------------*/
-int connect_client(int listen_fd)
+/// Accepts one connection.
+/// Returns the new fd, 0 if the connection was refused, or -1 if nothing was accepted.
+static int accept_client(int listen_fd)
 {
 	int fd;
 	struct sockaddr_in client_address;
@@ -390,32 +993,38 @@ int connect_client(int listen_fd)
 
 	fd = sAccept(listen_fd, (struct sockaddr*)&client_address, &len);
 	if ( fd == -1 ) {
-		ShowError("connect_client: accept failed (code %d)!\n", sErrno);
+		if( sErrno == S_ECONNABORTED )
+			return 0;// gone before it was accepted
+		if( sErrno != S_EWOULDBLOCK )
+			ShowError("connect_client: accept failed (code %d)!\n", sErrno);
 		return -1;
 	}
 	if( fd == 0 )
 	{// reserved
 		ShowError("connect_client: Socket #0 is reserved - Please report this!!!\n");
 		sClose(fd);
-		return -1;
+		return 0;
 	}
 	if( fd >= FD_SETSIZE )
 	{// socket number too big
 		ShowError("connect_client: New socket #%d is greater than can we handle! Increase the value of FD_SETSIZE (currently %d) for your OS to fix this!\n", fd, FD_SETSIZE);
 		sClose(fd);
-		return -1;
+		return 0;
 	}
 
-	setsocketopts(fd);
-	set_nonblocking(fd, 1);
-
 	if( ip_rules && !connect_check(ntohl(client_address.sin_addr.s_addr)) ) {
-		do_close(fd);
-		return -1;
+		sClose(fd);
+		return 0;
 	}
 
+	setsocketopts(fd);
+	set_nonblocking(fd, 1);
+
 	if( fd_max <= fd ) fd_max = fd + 1;
-	sFD_SET(fd,&readfds);
+	if( io_thread )
+		io_open(fd);
+	else
+		sFD_SET(fd,&readfds);
 
 	create_session(fd, recv_to_fifo, send_from_fifo, default_func_parse);
 	session[fd]->client_addr = ntohl(client_address.sin_addr.s_addr);
@@ -423,6 +1032,19 @@ int connect_client(int listen_fd)
 	return fd;
 }
 
+/// Accepts the pending connections of a listening socket, until the queue is
+/// empty or ACCEPT_BATCH connections were taken.
+int connect_client(int listen_fd)
+{
+	int count;
+
+	for( count = 0; count < ACCEPT_BATCH; ++count )
+		if( accept_client(listen_fd) == -1 )
+			break;
+
+	return count;
+}
+
 int make_listen_bind(uint32 ip, uint16 port)
 {
 	struct sockaddr_in server_address;
@@ -461,7 +1083,7 @@ int make_listen_bind(uint32 ip, uint16 port)
 		ShowError("make_listen_bind: bind failed (socket #%d, code %d)!\n", fd, sErrno);
 		exit(EXIT_FAILURE);
 	}
-	result = sListen(fd,5);
+	result = sListen(fd,SOMAXCONN);
 	if( result == SOCKET_ERROR ) {
 		ShowError("make_listen_bind: listen failed (socket #%d, code %d)!\n", fd, sErrno);
 		exit(EXIT_FAILURE);
@@ -520,7 +1142,10 @@ int make_connection(uint32 ip, uint16 port)
 	set_nonblocking(fd, 1);
 
 	if (fd_max <= fd) fd_max = fd + 1;
-	sFD_SET(fd,&readfds);
+	if( io_thread )
+		io_open(fd);
+	else
+		sFD_SET(fd,&readfds);
 
 	create_session(fd, recv_to_fifo, send_from_fifo, default_func_parse);
 	session[fd]->client_addr = ntohl(remote_address.sin_addr.s_addr);
@@ -528,13 +1153,215 @@ int make_connection(uint32 ip, uint16 port)
 	return fd;
 }
 
+/// Creates a datagram (udp) session that talks to ip:port.
+/// Every flush of the write fifo is sent as one datagram and every recv reads
+/// one datagram, so the parse function has to consume the whole read fifo.
+/// The session never times out.
+int make_connection_udp(uint32 ip, uint16 port)
+{
+	struct sockaddr_in remote_address;
+	int fd;
+
+	fd = sSocket(AF_INET, SOCK_DGRAM, 0);
+
+	if (fd == -1) {
+		ShowError("make_connection_udp: socket creation failed (code %d)!\n", sErrno);
+		return -1;
+	}
+	if( fd == 0 )
+	{// reserved
+		ShowError("make_connection_udp: Socket #0 is reserved - Please report this!!!\n");
+		sClose(fd);
+		return -1;
+	}
+	if( fd >= FD_SETSIZE )
+	{// socket number too big
+		ShowError("make_connection_udp: New socket #%d is greater than can we handle! Increase the value of FD_SETSIZE (currently %d) for your OS to fix this!\n", fd, FD_SETSIZE);
+		sClose(fd);
+		return -1;
+	}
+
+	remote_address.sin_family      = AF_INET;
+	remote_address.sin_addr.s_addr = htonl(ip);
+	remote_address.sin_port        = htons(port);
+
+	// only sets the default destination and filters incoming datagrams by source
+	if( sConnect(fd, (struct sockaddr *)(&remote_address), sizeof(struct sockaddr_in)) == SOCKET_ERROR ) {
+		ShowError("make_connection_udp: connect failed (socket #%d, code %d)!\n", fd, sErrno);
+		sClose(fd);
+		return -1;
+	}
+	set_nonblocking(fd, 1);
+
+	if (fd_max <= fd) fd_max = fd + 1;
+	sFD_SET(fd,&readfds);
+
+	create_session(fd, recv_to_fifo, send_from_fifo, default_func_parse);
+	session[fd]->client_addr = ip;
+	session[fd]->rdata_tick = 0;
+
+	return fd;
+}
+
+/// Returns the size class of a fifo buffer, or -1 if it is not one of them.
+static int fifo_class(size_t size)
+{
+	int i;
+	for( i = 0; i < FIFO_CLASSES; ++i )
+		if( size == ((size_t)FIFO_MIN_SIZE << i) )
+			return i;
+	return -1;
+}
+
+/// Returns the number of buffers in a slab of size class c.
+static int fifo_slab_count(int c)
+{
+	int n = FIFO_SLAB_SIZE / ((FIFO_MIN_SIZE << c) + FIFO_SLOT_HEAD);
+	return ( n < FIFO_SLAB_MIN ) ? FIFO_SLAB_MIN : n;
+}
+
+/// Allocates a slab of size class c and links it to the partial slabs.
+static struct fifo_slab* fifo_slab_create(int c)
+{
+	size_t slot = (FIFO_MIN_SIZE << c) + FIFO_SLOT_HEAD;
+	int n = fifo_slab_count(c);
+	struct fifo_slab* slab;
+	uint8* p;
+	int i;
+
+	slab = (struct fifo_slab*)aMalloc(FIFO_SLAB_HEAD + n*slot);
+	slab->cls = c;
+	slab->used = 0;
+	slab->count = n;
+	slab->free = NULL;
+	p = (uint8*)slab + FIFO_SLAB_HEAD;
+	for( i = n - 1; i >= 0; --i )
+	{
+		uint8* buf = p + i*slot + FIFO_SLOT_HEAD;
+		*(struct fifo_slab**)(buf - FIFO_SLOT_HEAD) = slab;
+		*(uint8**)buf = slab->free;
+		slab->free = buf;
+	}
+	slab->prev = NULL;
+	slab->next = fifo_partial[c];
+	if( slab->next )
+		slab->next->prev = slab;
+	fifo_partial[c] = slab;
+	fifo_bytes_allocated += FIFO_SLAB_HEAD + n*slot;
+	return slab;
+}
+
+/// Removes a slab from the partial slabs of its class.
+static void fifo_slab_unlink(struct fifo_slab* slab)
+{
+	if( slab->prev )
+		slab->prev->next = slab->next;
+	else
+		fifo_partial[slab->cls] = slab->next;
+	if( slab->next )
+		slab->next->prev = slab->prev;
+	slab->prev = slab->next = NULL;
+}
+
+/// Returns a fifo buffer, from a slab if the size is one of the classes.
+static uint8* fifo_alloc(size_t size)
+{
+	int c = fifo_class(size);
+	struct fifo_slab* slab;
+	uint8* buf;
+
+	fifo_bytes_used += size;
+	if( c < 0 )
+	{
+		CREATE(buf, uint8, size);
+		fifo_bytes_allocated += size;
+		return buf;
+	}
+	slab = fifo_partial[c];
+	if( slab == NULL )
+		slab = fifo_slab_create(c);
+	buf = slab->free;
+	slab->free = *(uint8**)buf;
+	if( ++slab->used == slab->count )
+		fifo_slab_unlink(slab);// full
+	return buf;
+}
+
+/// Releases a fifo buffer.
+/// An empty slab is given back to the system unless it is the last one with free buffers.
+static void fifo_free(uint8* buf, size_t size)
+{
+	struct fifo_slab* slab;
+
+	fifo_bytes_used -= size;
+	if( fifo_class(size) < 0 )
+	{
+		aFree(buf);
+		fifo_bytes_allocated -= size;
+		return;
+	}
+	slab = *(struct fifo_slab**)(buf - FIFO_SLOT_HEAD);
+	*(uint8**)buf = slab->free;
+	slab->free = buf;
+	if( slab->used-- == slab->count )
+	{// was full
+		slab->next = fifo_partial[slab->cls];
+		if( slab->next )
+			slab->next->prev = slab;
+		fifo_partial[slab->cls] = slab;
+	}
+	if( slab->used == 0 && (slab->prev || slab->next) )
+	{
+		fifo_slab_unlink(slab);
+		fifo_bytes_allocated -= FIFO_SLAB_HEAD + slab->count*((FIFO_MIN_SIZE << slab->cls) + FIFO_SLOT_HEAD);
+		aFree(slab);
+	}
+}
+
+/// Moves the first used bytes of a fifo buffer into a buffer of another size.
+static uint8* fifo_resize(uint8* buf, size_t size, size_t newsize, size_t used)
+{
+	uint8* newbuf;
+
+	if( fifo_class(size) < 0 && fifo_class(newsize) < 0 )
+	{// neither comes from a slab
+		RECREATE(buf, uint8, newsize);
+		fifo_bytes_used += newsize - size;
+		fifo_bytes_allocated += newsize - size;
+		return buf;
+	}
+	newbuf = fifo_alloc(newsize);
+	memcpy(newbuf, buf, used);
+	fifo_free(buf, size);
+	return newbuf;
+}
+
+/// Returns the size of the smallest size class that holds size bytes.
+/// Sizes above the classes are rounded up to a multiple of WFIFO_SIZE.
+static size_t fifo_size(size_t size)
+{
+	size_t newsize = FIFO_MIN_SIZE;
+
+	if( size > WFIFO_SIZE )
+		return (size + WFIFO_SIZE - 1) / WFIFO_SIZE * WFIFO_SIZE;
+	while( newsize < size )
+		newsize *= 2;
+	return newsize;
+}
+
 static int create_session(int fd, RecvFunc func_recv, SendFunc func_send, ParseFunc func_parse)
 {
-	CREATE(session[fd], struct socket_data, 1);
-	CREATE(session[fd]->rdata, unsigned char, RFIFO_SIZE);
-	CREATE(session[fd]->wdata, unsigned char, WFIFO_SIZE);
-	session[fd]->max_rdata  = RFIFO_SIZE;
-	session[fd]->max_wdata  = WFIFO_SIZE;
+	if( session_pool_count > 0 )
+	{
+		session[fd] = session_pool[--session_pool_count];
+		memset(session[fd], 0, sizeof(struct socket_data));
+	}
+	else
+		CREATE(session[fd], struct socket_data, 1);
+	session[fd]->rdata      = fifo_alloc(FIFO_MIN_SIZE);
+	session[fd]->wdata      = fifo_alloc(FIFO_MIN_SIZE);
+	session[fd]->max_rdata  = FIFO_MIN_SIZE;
+	session[fd]->max_wdata  = FIFO_MIN_SIZE;
 	session[fd]->func_recv  = func_recv;
 	session[fd]->func_send  = func_send;
 	session[fd]->func_parse = func_parse;
@@ -546,10 +1373,13 @@ static void delete_session(int fd)
 {
 	if( session_isValid(fd) )
 	{
-		aFree(session[fd]->rdata);
-		aFree(session[fd]->wdata);
+		fifo_free(session[fd]->rdata, session[fd]->max_rdata);
+		fifo_free(session[fd]->wdata, session[fd]->max_wdata);
 		aFree(session[fd]->session_data);
-		aFree(session[fd]);
+		if( session_pool_count < SESSION_POOL_MAX )
+			session_pool[session_pool_count++] = session[fd];
+		else
+			aFree(session[fd]);
 		session[fd] = NULL;
 	}
 }
@@ -560,12 +1390,12 @@ int realloc_fifo(int fd, unsigned int rfifo_size, unsigned int wfifo_size)
 		return 0;
 
 	if( session[fd]->max_rdata != rfifo_size && session[fd]->rdata_size < rfifo_size) {
-		RECREATE(session[fd]->rdata, unsigned char, rfifo_size);
+		session[fd]->rdata = fifo_resize(session[fd]->rdata, session[fd]->max_rdata, rfifo_size, session[fd]->rdata_size);
 		session[fd]->max_rdata  = rfifo_size;
 	}
 
 	if( session[fd]->max_wdata != wfifo_size && session[fd]->wdata_size < wfifo_size) {
-		RECREATE(session[fd]->wdata, unsigned char, wfifo_size);
+		session[fd]->wdata = fifo_resize(session[fd]->wdata, session[fd]->max_wdata, wfifo_size, session[fd]->wdata_size);
 		session[fd]->max_wdata  = wfifo_size;
 	}
 	return 0;
@@ -579,9 +1409,8 @@ int realloc_writefifo(int fd, size_t addition)
 		return 0;
 
 	if( session[fd]->wdata_size + addition  > session[fd]->max_wdata )
-	{	// grow rule; grow in multiples of WFIFO_SIZE
-		newsize = WFIFO_SIZE;
-		while( session[fd]->wdata_size + addition > newsize ) newsize += WFIFO_SIZE;
+	{	// grow rule; next size class, or multiples of WFIFO_SIZE above them
+		newsize = fifo_size(session[fd]->wdata_size + addition);
 	}
 	else
 	if( session[fd]->max_wdata >= (size_t)2*(session[fd]->flag.server?FIFOSIZE_SERVERLINK:WFIFO_SIZE)
@@ -592,7 +1421,7 @@ int realloc_writefifo(int fd, size_t addition)
 	else // no change
 		return 0;
 
-	RECREATE(session[fd]->wdata, unsigned char, newsize);
+	session[fd]->wdata = fifo_resize(session[fd]->wdata, session[fd]->max_wdata, newsize, session[fd]->wdata_size);
 	session[fd]->max_wdata  = newsize;
 
 	return 0;
@@ -658,8 +1487,8 @@ int WFIFOSET(int fd, size_t len)
 		return 0;
 	}
 
-	if( !s->flag.server && s->wdata_size+len > WFIFO_MAX )
-	{// reached maximum write fifo size
+	if( !s->flag.server && s->wdata_size+io_unsent[fd]+len > WFIFO_MAX )
+	{// reached maximum write fifo size (with the data the I/O thread could not send yet)
 		ShowError("WFIFOSET: Maximum write buffer size for client connection %d exceeded, most likely caused by packet 0x%04x (len=%u, ip=%lu.%lu.%lu.%lu).\n", fd, WFIFOW(fd,0), len, CONVIP(s->client_addr));
 		set_eof(fd);
 		return 0;
@@ -670,9 +1499,11 @@ int WFIFOSET(int fd, size_t len)
 	if( s->flag.server && s->wdata_size >= 2*FIFOSIZE_SERVERLINK )
 		flush_fifo(fd);
 
-	// always keep a WFIFO_SIZE reserve in the buffer
+	// always keep a reserve in the buffer
 	// For inter-server connections, let the reserve be 1/4th of the link size.
-	newreserve = s->flag.server ? FIFOSIZE_SERVERLINK / 4 : WFIFO_SIZE;
+	// Client connections keep a small reserve so idle clients don't hold big buffers,
+	// packets are expected to be prepared with WFIFOHEAD.
+	newreserve = s->flag.server ? FIFOSIZE_SERVERLINK / 4 : FIFO_MIN_SIZE;
 
 	// readjust the buffer to include the chosen reserve
 	realloc_writefifo(fd, newreserve);
@@ -705,6 +1536,13 @@ int do_sockets(int next)
 	}
 #endif
 
+	if( io_thread )
+	{
+		io_flush();
+		if( io_input_left )
+			next = 0;// data is waiting for room in a read fifo
+	}
+
 	// can timeout until the next tick
 	timeout.tv_sec  = next/1000;
 	timeout.tv_usec = next%1000*1000;
@@ -744,6 +1582,9 @@ int do_sockets(int next)
 	}
 #endif
 
+	if( io_thread )
+		io_receive();
+
 	// POSTSEND Send remaining data and handle eof sessions.
 #ifdef SEND_SHORTLIST
 	send_shortlist_do_sends();
@@ -763,6 +1604,9 @@ int do_sockets(int next)
 	}
 #endif
 
+	if( io_thread )
+		io_flush();
+
 	// parse input data on each socket
 	for(i = 1; i < fd_max; i++)
 	{
@@ -793,13 +1637,15 @@ int do_sockets(int next)
 //////////////////////////////
 // IP rules and DDoS protection
 
-typedef struct _connect_history {
-	struct _connect_history* next;
+/// Connection rate of an ip (or subnet, see ddos_subnet), a token bucket
+/// that holds up to ddos_count connections and gets one back every ddos_interval.
+typedef struct _connect_bucket {
 	uint32 ip;
-	uint32 tick;
-	int count;
+	uint32 tick; // last refill, or start of the ban
+	int tokens; // connections left, negative while throttled
+	unsigned used : 1;
 	unsigned ddos : 1;
-} ConnectHistory;
+} ConnectBucket;
 
 typedef struct _access_control {
 	uint32 ip;
@@ -821,9 +1667,19 @@ static int access_debug    = 0;
 static int ddos_count      = 10;
 static int ddos_interval   = 3*1000;
 static int ddos_autoreset  = 10*60*1000;
-/// Connection history, an array of linked lists.
-/// The array's index for any ip is ip&0xFFFF
-static ConnectHistory* connect_history[0x10000];
+static uint32 ddos_mask    = 0xFFFFFFFF;
+
+/// Connection buckets, an open-addressed table of fixed size.
+/// An ip is looked for in CONNECT_PROBE slots starting at its hash. If it is
+/// not there, the least valuable of those slots is taken over (see connect_bucket).
+#define CONNECT_SLOTS 8192 // power of 2
+#define CONNECT_PROBE 8
+static ConnectBucket connect_table[CONNECT_SLOTS];
+
+// connection admission counters
+unsigned int connect_accepted  = 0;
+unsigned int connect_throttled = 0;
+unsigned int connect_banned    = 0;
 
 static int connect_check_(uint32 ip);
 
@@ -838,12 +1694,77 @@ static int connect_check(uint32 ip)
 	return result;
 }
 
+/// Returns the bucket of ip.
+/// If ip has no bucket, one of its probe slots is taken over: an empty slot or a
+/// refilled bucket if there is one, otherwise the bucket closest to refilled.
+/// Banned buckets go last, the one closest to the end of its ban first.
+static ConnectBucket* connect_bucket(uint32 ip, unsigned int tick)
+{
+	ConnectBucket* slot = NULL;
+	int slot_value = INT_MAX;
+	uint32 hash = (ip * 2654435761U) >> 19;// fibonacci hashing, 13 bits for CONNECT_SLOTS
+	int i;
+
+	for( i = 0; i < CONNECT_PROBE; ++i )
+	{
+		ConnectBucket* b = &connect_table[(hash + i) & (CONNECT_SLOTS - 1)];
+		int value;
+
+		if( b->used && b->ip == ip )
+			return b;
+
+		// how much is lost when this slot is taken over
+		if( !b->used )
+			value = -1;
+		else if( b->ddos )
+			value = ( DIFF_TICK(tick, b->tick) >= ddos_autoreset ) ? -1 : ddos_interval*ddos_count + ddos_autoreset - DIFF_TICK(tick, b->tick);
+		else if( b->tokens + DIFF_TICK(tick, b->tick) / max(ddos_interval, 1) >= ddos_count )
+			value = -1;// refilled
+		else
+			value = max(ddos_interval*ddos_count - DIFF_TICK(tick, b->tick), 0);
+		if( value < slot_value )
+		{
+			slot = b;
+			slot_value = value;
+		}
+	}
+
+	slot->used = 1;
+	slot->ddos = 0;
+	slot->ip = ip;
+	slot->tokens = ddos_count;
+	slot->tick = tick;
+	return slot;
+}
+
+/// Gives back the connections earned since the last refill.
+static void connect_refill(ConnectBucket* b, unsigned int tick)
+{
+	int diff = DIFF_TICK(tick, b->tick);
+	int gained;
+
+	if( diff <= 0 )
+		return;
+	gained = ( ddos_interval > 0 ) ? diff / ddos_interval : ddos_count;
+	if( gained >= ddos_count - b->tokens )
+	{
+		b->tokens = ddos_count;
+		b->tick = tick;
+	}
+	else
+	{
+		b->tokens += gained;
+		b->tick += gained * ddos_interval;
+	}
+}
+
 /// Verifies if the IP can connect.
 ///  0      : Connection Rejected
 ///  1 or 2 : Connection Accepted
 static int connect_check_(uint32 ip)
 {
-	ConnectHistory* hist = connect_history[ip&0xFFFF];
+	ConnectBucket* b;
+	unsigned int tick;
 	int i;
 	int is_allowip = 0;
 	int is_denyip = 0;
@@ -905,71 +1826,107 @@ static int connect_check_(uint32 ip)
 		break;
 	}
 
-	// Inspect connection history
-	while( hist ) {
-		if( ip == hist->ip )
-		{// IP found
-			if( hist->ddos )
-			{// flagged as DDoS
-				return (connect_ok == 2 ? 1 : 0);
-			} else if( DIFF_TICK(gettick(),hist->tick) < ddos_interval )
-			{// connection within ddos_interval
-				hist->tick = gettick();
-				if( hist->count++ >= ddos_count )
-				{// DDoS attack detected
-					hist->ddos = 1;
-					ShowWarning("connect_check: DDoS Attack detected from %d.%d.%d.%d!\n", CONVIP(ip));
-					return (connect_ok == 2 ? 1 : 0);
-				}
-				return connect_ok;
-			} else
-			{// not within ddos_interval, clear data
-				hist->tick  = gettick();
-				hist->count = 0;
-				return connect_ok;
-			}
+	if( connect_ok == 0 )
+		return 0;
+	if( connect_ok == 2 )
+	{// not rate limited
+		++connect_accepted;
+		return 2;
+	}
+
+	// Take a connection from the bucket
+	tick = gettick();
+	b = connect_bucket(ip & ddos_mask, tick);
+	if( b->ddos )
+	{// banned
+		if( DIFF_TICK(tick, b->tick) < ddos_autoreset )
+		{
+			++connect_banned;
+			return 0;
 		}
-		hist = hist->next;
+		b->ddos = 0;
+		b->tokens = ddos_count;
+		b->tick = tick;
 	}
-	// IP not found, add to history
-	CREATE(hist, ConnectHistory, 1);
-	memset(hist, 0, sizeof(ConnectHistory));
-	hist->ip   = ip;
-	hist->tick = gettick();
-	hist->next = connect_history[ip&0xFFFF];
-	connect_history[ip&0xFFFF] = hist;
-	return connect_ok;
+	connect_refill(b, tick);
+	if( b->tokens > 0 )
+	{
+		--b->tokens;
+		++connect_accepted;
+		return 1;
+	}
+	if( --b->tokens <= -ddos_count )
+	{// kept connecting with an empty bucket, DDoS attack detected
+		b->ddos = 1;
+		b->tick = tick;
+		ShowWarning("connect_check: DDoS Attack detected from %d.%d.%d.%d!\n", CONVIP(ip));
+		++connect_banned;
+		return 0;
+	}
+	++connect_throttled;
+	return 0;
+}
+
+/// Timer function.
+/// Shrinks the fifo buffers of idle client sessions back to the minimum size.
+static int socket_trim(int tid, unsigned int tick, int id, intptr_t data)
+{
+	int i;
+
+	for( i = 1; i < fd_max; ++i )
+	{
+		struct socket_data* s = session[i];
+
+		if( s == NULL || s->flag.server || s->rdata_size != 0 || s->wdata_size != 0 )
+			continue;
+		if( s->max_rdata > FIFO_MIN_SIZE )
+		{
+			s->rdata = fifo_resize(s->rdata, s->max_rdata, FIFO_MIN_SIZE, 0);
+			s->max_rdata = FIFO_MIN_SIZE;
+		}
+		if( s->max_wdata > FIFO_MIN_SIZE )
+		{
+			s->wdata = fifo_resize(s->wdata, s->max_wdata, FIFO_MIN_SIZE, 0);
+			s->max_wdata = FIFO_MIN_SIZE;
+		}
+	}
+	return 0;
+}
+
+/// Shows the number of sessions and the memory of their fifo buffers.
+void socket_showusage(void)
+{
+	int i, count = 0;
+
+	for( i = 1; i < fd_max; ++i )
+		if( session[i] )
+			++count;
+	ShowInfo("Sockets: %d session(s), fifo buffers use %uKB of %uKB allocated.\n", count, (unsigned int)(fifo_bytes_used/1024), (unsigned int)(fifo_bytes_allocated/1024));
 }
 
 /// Timer function.
-/// Deletes old connection history records.
+/// Frees the buckets that are refilled or whose ban is over.
+/// DIFF_TICK only spans about 24 days, a bucket left alone longer would look
+/// like it was touched in the future and never refill or leave its ban.
 static int connect_check_clear(int tid, unsigned int tick, int id, intptr_t data)
 {
 	int i;
 	int clear = 0;
 	int list  = 0;
-	ConnectHistory root;
-	ConnectHistory* prev_hist;
-	ConnectHistory* hist;
-
-	for( i=0; i < 0x10000 ; ++i ){
-		prev_hist = &root;
-		root.next = hist = connect_history[i];
-		while( hist ){
-			if( (!hist->ddos && DIFF_TICK(tick,hist->tick) > ddos_interval*3) ||
-					(hist->ddos && DIFF_TICK(tick,hist->tick) > ddos_autoreset) )
-			{// Remove connection history
-				prev_hist->next = hist->next;
-				aFree(hist);
-				hist = prev_hist->next;
-				clear++;
-			} else {
-				prev_hist = hist;
-				hist = hist->next;
-			}
-			list++;
+
+	for( i = 0; i < CONNECT_SLOTS; ++i )
+	{
+		ConnectBucket* b = &connect_table[i];
+
+		if( !b->used )
+			continue;
+		if( (!b->ddos && b->tokens + DIFF_TICK(tick, b->tick) / max(ddos_interval, 1) >= ddos_count) ||
+			(b->ddos && DIFF_TICK(tick, b->tick) >= ddos_autoreset) )
+		{
+			b->used = 0;
+			clear++;
 		}
-		connect_history[i] = root.next;
+		list++;
 	}
 	if( access_debug ){
 		ShowInfo("connect_check_clear: Cleared %d of %d from IP list.\n", clear, list);
@@ -977,6 +1934,23 @@ static int connect_check_clear(int tid, unsigned int tick, int id, intptr_t data
 	return list;
 }
 
+/// Timer function.
+/// Reports the connections that were rejected by the rate limit.
+static int connect_check_report(int tid, unsigned int tick, int id, intptr_t data)
+{
+	static unsigned int last_accepted = 0;
+	static unsigned int last_throttled = 0;
+	static unsigned int last_banned = 0;
+
+	if( connect_throttled != last_throttled || connect_banned != last_banned )
+		ShowInfo("connect_check: %u connections accepted, %u throttled, %u banned since the last report.\n",
+			connect_accepted - last_accepted, connect_throttled - last_throttled, connect_banned - last_banned);
+	last_accepted = connect_accepted;
+	last_throttled = connect_throttled;
+	last_banned = connect_banned;
+	return 0;
+}
+
 /// Parses the ip address and mask and puts it into acc.
 /// Returns 1 is successful, 0 otherwise.
 int access_ipmask(const char* str, AccessControl* acc)
@@ -1072,10 +2046,16 @@ int socket_config_read(const char* cfgName)
 			ddos_count = atoi(w2);
 		else if (!strcmpi(w1,"ddos_autoreset"))
 			ddos_autoreset = atoi(w2);
+		else if (!strcmpi(w1,"ddos_subnet")) {
+			int bits = atoi(w2);
+			ddos_mask = ( bits <= 0 ) ? 0 : ( bits >= 32 ) ? 0xFFFFFFFF : 0xFFFFFFFF << (32 - bits);
+		}
 		else if (!strcmpi(w1,"debug"))
 			access_debug = config_switch(w2);
 		else if (!strcmpi(w1,"socket_max_client_packet"))
 			socket_max_client_packet = strtoul(w2, NULL, 0);
+		else if (!strcmpi(w1,"socket_io_thread"))
+			socket_io_thread = config_switch(w2);
 		else if (!strcmpi(w1, "import"))
 			socket_config_read(w2);
 	}
@@ -1088,30 +2068,34 @@ int socket_config_read(const char* cfgName)
 void socket_final(void)
 {
 	int i;
-	ConnectHistory* hist;
-	ConnectHistory* next_hist;
-
-	for( i=0; i < 0x10000; ++i ){
-		hist = connect_history[i];
-		while( hist ){
-			next_hist = hist->next;
-			aFree(hist);
-			hist = next_hist;
-		}
-	}
+
 	if( access_allow )
 		aFree(access_allow);
 	if( access_deny )
 		aFree(access_deny);
 
 	for( i = 1; i < fd_max; i++ )
-		if(session[i])
+		if(session[i] && i != io_wake_main)
 			do_close(i);
+	io_final();
 
 	// session[0] ̃_~[f[^폜
-	aFree(session[0]->rdata);
-	aFree(session[0]->wdata);
+	fifo_free(session[0]->rdata, session[0]->max_rdata);
+	fifo_free(session[0]->wdata, session[0]->max_wdata);
 	aFree(session[0]);
+
+	// release the slabs and the session pool
+	for( i = 0; i < FIFO_CLASSES; ++i )
+	{
+		while( fifo_partial[i] )
+		{
+			struct fifo_slab* slab = fifo_partial[i];
+			fifo_slab_unlink(slab);
+			aFree(slab);
+		}
+	}
+	while( session_pool_count > 0 )
+		aFree(session_pool[--session_pool_count]);
 }
 
 /// Closes a socket.
@@ -1121,9 +2105,14 @@ void do_close(int fd)
 		return;// invalid
 
 	flush_fifo(fd); // Try to send what's left (although it might not succeed since it's a nonblocking socket)
-	sFD_CLR(fd, &readfds);// this needs to be done before closing the socket
-	sShutdown(fd, SHUT_RDWR); // Disallow further reads/writes
-	sClose(fd); // We don't really care if these closing functions return an error, we are just shutting down and not reusing this socket.
+	if( io_serial[fd] )
+		io_close(fd); // the I/O thread closes the socket after sending what's left
+	else
+	{
+		sFD_CLR(fd, &readfds);// this needs to be done before closing the socket
+		sShutdown(fd, SHUT_RDWR); // Disallow further reads/writes
+		sClose(fd); // We don't really care if these closing functions return an error, we are just shutting down and not reusing this socket.
+	}
 	if (session[fd]) delete_session(fd);
 }
 
@@ -1285,12 +2274,26 @@ void socket_init(void)
 	// session[0] is now currently used for disconnected sessions of the map server, and as such,
 	// should hold enough buffer (it is a vacuum so to speak) as it is never flushed. [Skotlex]
 	create_session(0, null_recv, null_send, null_parse);
+	session[0]->rdata = fifo_resize(session[0]->rdata, FIFO_MIN_SIZE, RFIFO_SIZE, 0);
+	session[0]->wdata = fifo_resize(session[0]->wdata, FIFO_MIN_SIZE, WFIFO_SIZE, 0);
+	session[0]->max_rdata = RFIFO_SIZE;
+	session[0]->max_wdata = WFIFO_SIZE;
+
+	// Report rejected connections every 5 minutes
+	memset(connect_table, 0, sizeof(connect_table));
+	add_timer_func_list(connect_check_report, "connect_check_report");
+	add_timer_interval(gettick()+5*60*1000, connect_check_report, 0, 0, 5*60*1000);
 
-	// Delete old connection history every 5 minutes
-	memset(connect_history, 0, sizeof(connect_history));
+	// Free the idle connection buckets every 5 minutes
 	add_timer_func_list(connect_check_clear, "connect_check_clear");
 	add_timer_interval(gettick()+1000, connect_check_clear, 0, 0, 5*60*1000);
 
+	// Shrink the buffers of idle sessions every 10 seconds
+	add_timer_func_list(socket_trim, "socket_trim");
+	add_timer_interval(gettick()+10*1000, socket_trim, 0, 0, 10*1000);
+	if( socket_io_thread )
+		io_init();
+
 	ShowInfo("Server supports up to '"CL_WHITE"%u"CL_RESET"' concurrent connections.\n", rlim_cur);
 }
 
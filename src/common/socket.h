@@ -122,6 +122,7 @@ extern bool session_isActive(int fd);
 
 int make_listen_bind(uint32 ip, uint16 port);
 int make_connection(uint32 ip, uint16 port);
+int make_connection_udp(uint32 ip, uint16 port);
 int realloc_fifo(int fd, unsigned int rfifo_size, unsigned int wfifo_size);
 int realloc_writefifo(int fd, size_t addition);
 int WFIFOSET(int fd, size_t len);
@@ -151,6 +152,16 @@ int socket_getips(uint32* ips, int max);
 extern uint32 addr_[16];   // ip addresses of local host (host byte order)
 extern int naddr_;   // # of ip addresses
 
+// connection admission counters (connections accepted, rejected by the rate limit, rejected while banned)
+extern unsigned int connect_accepted;
+extern unsigned int connect_throttled;
+extern unsigned int connect_banned;
+
+// fifo memory accounting (bytes of buffers held by sessions, bytes allocated for them)
+extern size_t fifo_bytes_used;
+extern size_t fifo_bytes_allocated;
+void socket_showusage(void);
+
 void set_eof(int fd);
 
 /// Use a shortlist of sockets instead of iterating all sessions for sockets 
@@ -0,0 +1,345 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "../common/cbasetypes.h"
+#include "../common/showmsg.h"
+#include "thread.h"
+#ifdef WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <unistd.h>
+#endif
+#include <stdlib.h>
+
+// Handles are allocated with the system allocator so any thread can use them.
+
+struct athread {
+	athread_func func;
+	void* param;
+	void* result;
+#ifdef WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+};
+
+struct amutex {
+#ifdef WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+// Windows condition variables need Vista, so they are built from an event:
+// a waiter only leaves when released by a signal or broadcast that came after it started waiting.
+struct acond {
+#ifdef WIN32
+	CRITICAL_SECTION lock; // protects the counters
+	HANDLE event; // manual-reset, set while there are released waiters
+	int waiters; // threads waiting
+	int release; // waiters released that didn't leave yet
+	unsigned int generation; // incremented by every signal or broadcast that releases waiters
+#else
+	pthread_cond_t cond;
+#endif
+};
+
+struct aring {
+	void** items;
+	unsigned int mask; // size-1
+	volatile unsigned int head; // next item to pop, written by the consumer
+	volatile unsigned int tail; // next slot to push, written by the producer
+};
+
+// Acquire loads and release stores of the ring positions.
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+	#define aring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define aring_store(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+	#define aring_load(p) __extension__({ unsigned int v_ = *(p); __sync_synchronize(); v_; })
+	#define aring_store(p,v) do{ __sync_synchronize(); *(p) = (v); }while(0)
+#else// WIN32
+	#define aring_load(p) ( MemoryBarrier(), *(p) )
+	#define aring_store(p,v) do{ MemoryBarrier(); *(p) = (v); }while(0)
+#endif
+
+
+#ifdef WIN32
+static DWORD WINAPI athread_main(LPVOID param)
+{
+	athread* thread = (athread*)param;
+	thread->result = thread->func(thread->param);
+	return 0;
+}
+#else
+static void* athread_main(void* param)
+{
+	athread* thread = (athread*)param;
+	thread->result = thread->func(thread->param);
+	return NULL;
+}
+#endif
+
+/// Starts a new thread that runs func(param).
+/// Returns NULL if the thread can't be created.
+athread* athread_create(athread_func func, void* param)
+{
+	athread* thread = (athread*)malloc(sizeof(athread));
+
+	if( thread == NULL )
+		return NULL;
+	thread->func = func;
+	thread->param = param;
+	thread->result = NULL;
+#ifdef WIN32
+	thread->handle = CreateThread(NULL, 0, athread_main, thread, 0, NULL);
+	if( thread->handle == NULL )
+#else
+	if( pthread_create(&thread->handle, NULL, athread_main, thread) != 0 )
+#endif
+	{
+		ShowError("athread_create: failed to create thread.\n");
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/// Waits for the thread to end, frees it and returns the value returned by its function.
+void* athread_join(athread* thread)
+{
+	void* result;
+
+	if( thread == NULL )
+		return NULL;
+#ifdef WIN32
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+	result = thread->result;
+	free(thread);
+	return result;
+}
+
+/// Returns the number of processors available, at least 1.
+int athread_cpu_count(void)
+{
+	int count;
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	count = (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	count = 1;
+#endif
+	return ( count > 0 ? count : 1 );
+}
+
+
+amutex* amutex_create(void)
+{
+	amutex* mutex = (amutex*)malloc(sizeof(amutex));
+
+	if( mutex == NULL )
+		return NULL;
+#ifdef WIN32
+	InitializeCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_init(&mutex->mutex, NULL);
+#endif
+	return mutex;
+}
+
+void amutex_destroy(amutex* mutex)
+{
+	if( mutex == NULL )
+		return;
+#ifdef WIN32
+	DeleteCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_destroy(&mutex->mutex);
+#endif
+	free(mutex);
+}
+
+void amutex_lock(amutex* mutex)
+{
+#ifdef WIN32
+	EnterCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+void amutex_unlock(amutex* mutex)
+{
+#ifdef WIN32
+	LeaveCriticalSection(&mutex->cs);
+#else
+	pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+
+acond* acond_create(void)
+{
+	acond* cond = (acond*)malloc(sizeof(acond));
+
+	if( cond == NULL )
+		return NULL;
+#ifdef WIN32
+	cond->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if( cond->event == NULL )
+	{
+		free(cond);
+		return NULL;
+	}
+	InitializeCriticalSection(&cond->lock);
+	cond->waiters = 0;
+	cond->release = 0;
+	cond->generation = 0;
+#else
+	pthread_cond_init(&cond->cond, NULL);
+#endif
+	return cond;
+}
+
+void acond_destroy(acond* cond)
+{
+	if( cond == NULL )
+		return;
+#ifdef WIN32
+	CloseHandle(cond->event);
+	DeleteCriticalSection(&cond->lock);
+#else
+	pthread_cond_destroy(&cond->cond);
+#endif
+	free(cond);
+}
+
+void acond_wait(acond* cond, amutex* mutex)
+{
+#ifdef WIN32
+	unsigned int generation;
+
+	EnterCriticalSection(&cond->lock);
+	++cond->waiters;
+	generation = cond->generation;
+	LeaveCriticalSection(&cond->lock);
+
+	LeaveCriticalSection(&mutex->cs);
+	for(;;)
+	{
+		bool released = false;
+
+		WaitForSingleObject(cond->event, INFINITE);
+		EnterCriticalSection(&cond->lock);
+		if( cond->release > 0 && cond->generation != generation )
+		{// take one of the releases
+			released = true;
+			--cond->waiters;
+			if( --cond->release == 0 )
+				ResetEvent(cond->event);
+		}
+		LeaveCriticalSection(&cond->lock);
+		if( released )
+			break;
+		Sleep(0);// the event is set for older waiters
+	}
+	EnterCriticalSection(&mutex->cs);
+#else
+	pthread_cond_wait(&cond->cond, &mutex->mutex);
+#endif
+}
+
+void acond_signal(acond* cond)
+{
+#ifdef WIN32
+	EnterCriticalSection(&cond->lock);
+	if( cond->waiters > cond->release )
+	{
+		SetEvent(cond->event);
+		++cond->release;
+		++cond->generation;
+	}
+	LeaveCriticalSection(&cond->lock);
+#else
+	pthread_cond_signal(&cond->cond);
+#endif
+}
+
+void acond_broadcast(acond* cond)
+{
+#ifdef WIN32
+	EnterCriticalSection(&cond->lock);
+	if( cond->waiters > 0 )
+	{
+		SetEvent(cond->event);
+		cond->release = cond->waiters;
+		++cond->generation;
+	}
+	LeaveCriticalSection(&cond->lock);
+#else
+	pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+
+aring* aring_create(int size)
+{
+	aring* ring = (aring*)malloc(sizeof(aring));
+	unsigned int n = 1;
+
+	if( ring == NULL )
+		return NULL;
+	while( n < (unsigned int)size )
+		n <<= 1;
+	ring->items = (void**)malloc(n*sizeof(void*));
+	if( ring->items == NULL )
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->mask = n - 1;
+	ring->head = ring->tail = 0;
+	return ring;
+}
+
+void aring_destroy(aring* ring)
+{
+	if( ring == NULL )
+		return;
+	free(ring->items);
+	free(ring);
+}
+
+bool aring_push(aring* ring, void* item)
+{
+	unsigned int tail = ring->tail;
+
+	if( tail - aring_load(&ring->head) > ring->mask )
+		return false;// full
+	ring->items[tail&ring->mask] = item;
+	aring_store(&ring->tail, tail + 1);
+	return true;
+}
+
+void* aring_pop(aring* ring)
+{
+	unsigned int head = ring->head;
+	void* item;
+
+	if( head == aring_load(&ring->tail) )
+		return NULL;// empty
+	item = ring->items[head&ring->mask];
+	aring_store(&ring->head, head + 1);
+	return item;
+}
@@ -0,0 +1,41 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#include "../common/cbasetypes.h"
+
+// Thin wrapper over the native threads (pthreads or win32).
+// Note: the memory manager (aMalloc and friends) is not thread-safe,
+// code that runs outside of the main thread must use the system allocator.
+
+typedef struct athread athread;
+typedef struct amutex amutex;
+typedef struct acond acond;
+typedef struct aring aring;
+
+typedef void* (*athread_func)(void* param);
+
+athread* athread_create(athread_func func, void* param);
+void* athread_join(athread* thread);// waits for the thread to end and frees it
+int athread_cpu_count(void);
+
+amutex* amutex_create(void);
+void amutex_destroy(amutex* mutex);
+void amutex_lock(amutex* mutex);
+void amutex_unlock(amutex* mutex);
+
+acond* acond_create(void);
+void acond_destroy(acond* cond);
+void acond_wait(acond* cond, amutex* mutex);// mutex must be locked
+void acond_signal(acond* cond);
+void acond_broadcast(acond* cond);
+
+// Lock-free ring of pointers between one producer thread and one consumer thread.
+aring* aring_create(int size);// size is rounded up to a power of 2
+void aring_destroy(aring* ring);
+bool aring_push(aring* ring, void* item);// producer only, false if the ring is full
+void* aring_pop(aring* ring);// consumer only, NULL if the ring is empty
+
+#endif /* _THREAD_H_ */
@@ -0,0 +1,510 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "../common/cbasetypes.h"
+#include "../common/db.h"
+#include "../common/malloc.h"
+#include "../common/showmsg.h"
+#include "../common/socket.h"
+#include "../common/strlib.h"
+#include "../common/timer.h"
+#include "dnsbl.h"
+#include "login.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// DNS blacklist lookups.
+// The A record queries go over one udp socket to the resolver, so a login
+// waiting for its lookups does not stop the server. Every blacklist server is
+// queried at the same time and a server that does not answer in time counts as
+// not listing the ip. Results are cached per ip for dnsbl_cache_time seconds.
+
+#define DNSBL_MAX_SERVERS 16
+#define DNSBL_PURGE_INTERVAL 60000 // ms between removals of expired results
+
+struct dnsbl_waiter {
+	int fd;
+	DnsblFunc func;
+};
+
+struct dnsbl_entry {
+	uint32 ip;
+	enum dnsbl_state state;
+	time_t expire; // when the result is looked up again
+	int pending; // queries without an answer
+	uint16 query[DNSBL_MAX_SERVERS]; // ids of the queries without an answer, 0 if answered
+	VECTOR_DECL(struct dnsbl_waiter) waiters;
+};
+
+struct dnsbl_query {
+	uint16 id;
+	uint32 ip;
+	int server;
+	int timer;
+};
+
+static char dnsbl_server[DNSBL_MAX_SERVERS][64];
+static int dnsbl_server_count = 0;
+static uint32 resolver_ip = 0;
+static uint16 resolver_port = 53;
+static int resolver_fd = -1;
+
+static DBMap* dnsbl_db = NULL; // uint32 ip -> struct dnsbl_entry*
+static DBMap* query_db = NULL; // uint16 id -> struct dnsbl_query*
+static int purge_timer_id = INVALID_TIMER;
+
+static int dnsbl_parse(int fd);
+static int dnsbl_timeout(int tid, unsigned int tick, int id, intptr_t data);
+
+
+/// Reads the resolver address from login_config.dnsbl_resolver or the system configuration.
+static void dnsbl_config_resolver(void)
+{
+	char host[64] = "";
+	char* port;
+
+	safestrncpy(host, login_config.dnsbl_resolver, sizeof(host));
+#ifndef WIN32
+	if( host[0] == '\0' )
+	{// first ipv4 nameserver of the system
+		FILE* fp = fopen("/etc/resolv.conf", "r");
+		if( fp != NULL )
+		{
+			char line[256];
+			char value[64];
+			while( host[0] == '\0' && fgets(line, sizeof(line), fp) )
+				if( sscanf(line, "nameserver %63s", value) == 1 && str2ip(value) != 0 && strchr(value, ':') == NULL )
+					safestrncpy(host, value, sizeof(host));
+			fclose(fp);
+		}
+	}
+#endif
+	if( host[0] == '\0' )
+	{
+		ShowWarning("dnsbl: No resolver configured, using 127.0.0.1. Set 'dnsbl_resolver' in %s.\n", LOGIN_CONF_NAME);
+		safestrncpy(host, "127.0.0.1", sizeof(host));
+	}
+
+	port = strchr(host, ':');
+	if( port != NULL )
+	{
+		*port++ = '\0';
+		resolver_port = (uint16)strtoul(port, NULL, 10);
+	}
+	resolver_ip = host2ip(host);
+}
+
+/// Opens the resolver socket if it is not open.
+static bool dnsbl_connect(void)
+{
+	if( resolver_fd != -1 )
+		return true;
+
+	resolver_fd = make_connection_udp(resolver_ip, resolver_port);
+	if( resolver_fd == -1 )
+		return false;
+	session[resolver_fd]->func_parse = dnsbl_parse;
+	return true;
+}
+
+/// Writes the question for the A record of ip at a blacklist server (name as labels, type A, class IN).
+/// Returns its length or -1 if it does not fit in size bytes.
+static int dnsbl_question(uint32 ip, int server, uint8* buf, int size)
+{
+	char name[256];
+	char* label;
+	char* next;
+	int len = 0;
+
+	snprintf(name, sizeof(name), "%u.%u.%u.%u.%s", ip&0xFF, (ip>>8)&0xFF, (ip>>16)&0xFF, ip>>24, dnsbl_server[server]);
+
+	for( label = name; label != NULL && *label != '\0'; label = next )
+	{
+		int n;
+
+		next = strchr(label, '.');
+		n = ( next != NULL ) ? (int)(next++ - label) : (int)strlen(label);
+		if( n == 0 || n > 63 || len + n + 6 > size )
+			return -1;
+		buf[len++] = (uint8)n;
+		memcpy(buf + len, label, n);
+		len += n;
+	}
+	buf[len++] = 0;
+	buf[len++] = 0; buf[len++] = 1;
+	buf[len++] = 0; buf[len++] = 1;
+
+	return len;
+}
+
+/// Sends the A record query for ip to a blacklist server.
+static bool dnsbl_send(uint32 ip, int server, uint16 id)
+{
+	uint8 buf[512];
+	int len;
+
+	// header: id, recursion desired, one question
+	memset(buf, 0, 12);
+	buf[0] = (uint8)(id >> 8);
+	buf[1] = (uint8)id;
+	buf[2] = 0x01;
+	buf[5] = 1;
+
+	len = dnsbl_question(ip, server, buf + 12, sizeof(buf) - 12);
+	if( len < 0 )
+		return false;
+	len += 12;
+
+	if( !dnsbl_connect() )
+		return false;
+
+	WFIFOHEAD(resolver_fd, len);
+	memcpy(WFIFOP(resolver_fd,0), buf, len);
+	WFIFOSET(resolver_fd, len);
+	flush_fifo(resolver_fd);
+	if( session[resolver_fd]->wdata_size != 0 )
+	{// not sent, don't merge it with the next datagram
+		session[resolver_fd]->wdata_size = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/// Stores the result of the lookups of entry and continues the waiting logins.
+static void dnsbl_finish(struct dnsbl_entry* entry, enum dnsbl_state state)
+{
+	struct dnsbl_waiter* waiters;
+	int count;
+	int i;
+
+	entry->state = state;
+	entry->expire = time(NULL) + login_config.dnsbl_cache_time;
+
+	// the answers of the other servers are no longer needed
+	for( i = 0; i < dnsbl_server_count; ++i )
+	{
+		struct dnsbl_query* q;
+
+		if( entry->query[i] == 0 )
+			continue;
+		q = (struct dnsbl_query*)uidb_remove(query_db, entry->query[i]);
+		if( q != NULL )
+		{
+			delete_timer(q->timer, dnsbl_timeout);
+			aFree(q);
+		}
+		entry->query[i] = 0;
+	}
+	entry->pending = 0;
+
+	// detach the waiters, the callbacks may start new lookups
+	count = VECTOR_LENGTH(entry->waiters);
+	if( count == 0 )
+		return;
+	CREATE(waiters, struct dnsbl_waiter, count);
+	memcpy(waiters, VECTOR_DATA(entry->waiters), count*sizeof(struct dnsbl_waiter));
+	VECTOR_CLEAR(entry->waiters);
+
+	for( i = 0; i < count; ++i )
+		waiters[i].func(waiters[i].fd, (state == DNSBL_LISTED));
+	aFree(waiters);
+}
+
+/// Records the answer of query q and frees it.
+static void dnsbl_answer(struct dnsbl_query* q, bool listed)
+{
+	struct dnsbl_entry* entry = (struct dnsbl_entry*)uidb_get(dnsbl_db, q->ip);
+
+	uidb_remove(query_db, q->id);
+	if( entry != NULL && entry->state == DNSBL_PENDING && entry->query[q->server] == q->id )
+	{
+		entry->query[q->server] = 0;
+		entry->pending--;
+		if( listed )
+		{
+			ShowInfo("DNSBL: (%u.%u.%u.%u) listed by '%s'.\n", CONVIP(q->ip), dnsbl_server[q->server]);
+			dnsbl_finish(entry, DNSBL_LISTED);
+		}
+		else if( entry->pending == 0 )
+			dnsbl_finish(entry, DNSBL_CLEAN);
+	}
+	aFree(q);
+}
+
+/// Skips a name in a DNS message, returns the position after it or -1.
+static int dnsbl_skipname(const uint8* buf, int len, int pos)
+{
+	while( pos < len )
+	{
+		if( buf[pos] == 0 )
+			return pos + 1;
+		if( (buf[pos]&0xC0) == 0xC0 )
+			return pos + 2;// compressed
+		pos += buf[pos] + 1;
+	}
+	return -1;
+}
+
+/// Returns true if a DNS response echoes the question of query q.
+/// The id alone is only 16 bits, a forged reply would have to guess it and the name.
+static bool dnsbl_parse_question(const struct dnsbl_query* q, const uint8* buf, int len)
+{
+	uint8 question[512];
+	int qlen;
+	int i;
+
+	if( ((buf[4]<<8)|buf[5]) != 1 )
+		return false;// exactly one question was sent
+	qlen = dnsbl_question(q->ip, q->server, question, sizeof(question));
+	if( qlen < 0 || 12 + qlen > len )
+		return false;
+	for( i = 0; i < qlen; ++i )
+		if( TOLOWER(buf[12 + i]) != TOLOWER(question[i]) )
+			return false;// names are case insensitive
+	return true;
+}
+
+/// Returns true if a DNS response has an A record in the answer section.
+static bool dnsbl_parse_answer(const uint8* buf, int len)
+{
+	int qdcount, ancount;
+	int pos = 12;
+	int i;
+
+	if( (buf[3]&0x0F) != 0 )
+		return false;// NXDOMAIN or another error
+	qdcount = (buf[4]<<8)|buf[5];
+	ancount = (buf[6]<<8)|buf[7];
+
+	for( i = 0; i < qdcount && pos >= 0; ++i )
+	{
+		pos = dnsbl_skipname(buf, len, pos);
+		if( pos >= 0 )
+			pos += 4;
+	}
+	for( i = 0; i < ancount && pos >= 0 && pos + 10 <= len; ++i )
+	{
+		int type, rdlength;
+
+		pos = dnsbl_skipname(buf, len, pos);
+		if( pos < 0 || pos + 10 > len )
+			break;
+		type = (buf[pos]<<8)|buf[pos+1];
+		rdlength = (buf[pos+8]<<8)|buf[pos+9];
+		if( type == 1 && rdlength == 4 )
+			return true;
+		pos += 10 + rdlength;
+	}
+	return false;
+}
+
+/// Handles the datagrams from the resolver.
+static int dnsbl_parse(int fd)
+{
+	int len;
+
+	if( session[fd]->flag.eof )
+	{// the resolver is unreachable, the queries time out and the socket is opened again by the next lookup
+		ShowWarning("dnsbl: Connection to the resolver %u.%u.%u.%u:%u failed.\n", CONVIP(resolver_ip), resolver_port);
+		do_close(fd);
+		resolver_fd = -1;
+		return 0;
+	}
+
+	len = (int)RFIFOREST(fd);
+	if( len >= 12 && (RFIFOB(fd,2)&0x80) )
+	{// a response
+		uint8* buf = (uint8*)RFIFOP(fd,0);
+		struct dnsbl_query* q = (struct dnsbl_query*)uidb_get(query_db, (buf[0]<<8)|buf[1]);
+		if( q != NULL && dnsbl_parse_question(q, buf, len) )
+		{
+			delete_timer(q->timer, dnsbl_timeout);
+			dnsbl_answer(q, dnsbl_parse_answer(buf, len));
+		}
+	}
+	RFIFOSKIP(fd, len);
+
+	return 0;
+}
+
+/// A blacklist server did not answer in time, the ip is not listed there.
+static int dnsbl_timeout(int tid, unsigned int tick, int id, intptr_t data)
+{
+	struct dnsbl_query* q = (struct dnsbl_query*)uidb_get(query_db, id);
+
+	if( q == NULL || q->timer != tid )
+		return 0;
+	dnsbl_answer(q, false);
+
+	return 0;
+}
+
+/// Removes the expired results.
+static int dnsbl_purge(int tid, unsigned int tick, int id, intptr_t data)
+{
+	time_t now = time(NULL);
+	DBIterator* iter = db_iterator(dnsbl_db);
+	struct dnsbl_entry* entry;
+
+	for( entry = (struct dnsbl_entry*)dbi_first(iter); dbi_exists(iter); entry = (struct dnsbl_entry*)dbi_next(iter) )
+	{
+		if( entry->state == DNSBL_PENDING || entry->expire > now )
+			continue;
+		VECTOR_CLEAR(entry->waiters);
+		iter->remove(iter);
+		aFree(entry);
+	}
+	dbi_destroy(iter);
+
+	return 0;
+}
+
+enum dnsbl_state dnsbl_check(uint32 ip, int fd, DnsblFunc func)
+{
+	struct dnsbl_entry* entry;
+	struct dnsbl_waiter waiter;
+	int i;
+
+	if( dnsbl_server_count == 0 )
+		return DNSBL_CLEAN;
+
+	entry = (struct dnsbl_entry*)uidb_get(dnsbl_db, ip);
+	if( entry == NULL )
+	{
+		CREATE(entry, struct dnsbl_entry, 1);
+		entry->ip = ip;
+		VECTOR_INIT(entry->waiters);
+		uidb_put(dnsbl_db, ip, entry);
+	}
+	else if( entry->state != DNSBL_PENDING && entry->expire > time(NULL) )
+		return entry->state;// cached
+
+	if( entry->state != DNSBL_PENDING )
+	{// start the lookups
+		entry->state = DNSBL_PENDING;
+		for( i = 0; i < dnsbl_server_count; ++i )
+		{
+			struct dnsbl_query* q;
+			uint16 id;
+
+			// unpredictable id, RAND_MAX can be as low as 0x7FFF
+			do
+				id = (uint16)(rand() ^ (rand() << 8));
+			while( id == 0 || uidb_get(query_db, id) != NULL );
+
+			if( !dnsbl_send(ip, i, id) )
+				continue;// counts as not listed
+
+			CREATE(q, struct dnsbl_query, 1);
+			q->id = id;
+			q->ip = ip;
+			q->server = i;
+			q->timer = add_timer(gettick() + login_config.dnsbl_timeout, dnsbl_timeout, q->id, 0);
+			uidb_put(query_db, q->id, q);
+			entry->query[i] = q->id;
+			entry->pending++;
+		}
+		if( entry->pending == 0 )
+		{// nothing was sent
+			entry->state = DNSBL_CLEAN;
+			entry->expire = 0;
+			return DNSBL_CLEAN;
+		}
+	}
+
+	waiter.fd = fd;
+	waiter.func = func;
+	VECTOR_ENSURE(entry->waiters, 1, 1);
+	VECTOR_PUSH(entry->waiters, waiter);
+
+	return DNSBL_PENDING;
+}
+
+void dnsbl_cancel(int fd)
+{
+	DBIterator* iter = db_iterator(dnsbl_db);
+	struct dnsbl_entry* entry;
+
+	for( entry = (struct dnsbl_entry*)dbi_first(iter); dbi_exists(iter); entry = (struct dnsbl_entry*)dbi_next(iter) )
+	{
+		int i;
+
+		if( entry->state != DNSBL_PENDING )
+			continue;
+		ARR_FIND(0, VECTOR_LENGTH(entry->waiters), i, VECTOR_INDEX(entry->waiters, i).fd == fd);
+		if( i < VECTOR_LENGTH(entry->waiters) )
+			VECTOR_ERASE(entry->waiters, i);
+	}
+	dbi_destroy(iter);
+}
+
+void dnsbl_init(void)
+{
+	char servers[sizeof(login_config.dnsbl_servs)];
+	char* server;
+
+	dnsbl_db = uidb_alloc(DB_OPT_BASE);
+	query_db = uidb_alloc(DB_OPT_BASE);
+
+	if( !login_config.use_dnsbl )
+		return;
+
+	safestrncpy(servers, login_config.dnsbl_servs, sizeof(servers));
+	for( server = strtok(servers, ","); server != NULL; server = strtok(NULL, ",") )
+	{
+		trim(server);
+		if( server[0] == '\0' )
+			continue;
+		if( dnsbl_server_count == DNSBL_MAX_SERVERS )
+		{
+			ShowWarning("dnsbl: Too many servers in 'dnsbl_servers', only the first %d are used.\n", DNSBL_MAX_SERVERS);
+			break;
+		}
+		safestrncpy(dnsbl_server[dnsbl_server_count++], server, sizeof(dnsbl_server[0]));
+	}
+
+	dnsbl_config_resolver();
+
+	add_timer_func_list(dnsbl_timeout, "dnsbl_timeout");
+	add_timer_func_list(dnsbl_purge, "dnsbl_purge");
+	purge_timer_id = add_timer_interval(gettick() + DNSBL_PURGE_INTERVAL, dnsbl_purge, 0, 0, DNSBL_PURGE_INTERVAL);
+
+	ShowStatus("DNSBL: %d blacklist servers, resolver %u.%u.%u.%u:%u.\n", dnsbl_server_count, CONVIP(resolver_ip), resolver_port);
+}
+
+static int dnsbl_db_final(DBKey key, void* data, va_list ap)
+{
+	struct dnsbl_entry* entry = (struct dnsbl_entry*)data;
+	VECTOR_CLEAR(entry->waiters);
+	aFree(entry);
+	return 0;
+}
+
+static int query_db_final(DBKey key, void* data, va_list ap)
+{
+	struct dnsbl_query* q = (struct dnsbl_query*)data;
+	delete_timer(q->timer, dnsbl_timeout);
+	aFree(q);
+	return 0;
+}
+
+void dnsbl_final(void)
+{
+	if( purge_timer_id != INVALID_TIMER )
+	{
+		delete_timer(purge_timer_id, dnsbl_purge);
+		purge_timer_id = INVALID_TIMER;
+	}
+	if( resolver_fd != -1 )
+	{
+		do_close(resolver_fd);
+		resolver_fd = -1;
+	}
+	query_db->destroy(query_db, query_db_final);
+	dnsbl_db->destroy(dnsbl_db, dnsbl_db_final);
+	query_db = NULL;
+	dnsbl_db = NULL;
+}
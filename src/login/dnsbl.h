@@ -0,0 +1,31 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef __DNSBL_H_INCLUDED__
+#define __DNSBL_H_INCLUDED__
+
+#include "../common/cbasetypes.h"
+
+enum dnsbl_state {
+	DNSBL_CLEAN,   // not listed by any server
+	DNSBL_LISTED,  // listed by at least one server
+	DNSBL_PENDING  // lookups are running, the callback gets the result
+};
+
+// called with the result of a lookup that was pending
+typedef void (*DnsblFunc)(int fd, bool listed);
+
+// initialize
+void dnsbl_init(void);
+
+// finalize
+void dnsbl_final(void);
+
+// checks ip against the dns blacklists, func is called later for fd if the result is DNSBL_PENDING
+enum dnsbl_state dnsbl_check(uint32 ip, int fd, DnsblFunc func);
+
+// drops the pending callbacks of fd
+void dnsbl_cancel(int fd);
+
+
+#endif // __DNSBL_H_INCLUDED__
@@ -12,8 +12,10 @@
 #include "login.h"
 #include "ipban.h"
 #include "loginlog.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // global sql settings
 static char   global_db_hostname[32] = "127.0.0.1";
@@ -34,9 +36,30 @@ static char   ipban_table[32] = "ipbanlist";
 // globals
 static Sql* sql_handle = NULL;
 static int cleanup_timer_id = INVALID_TIMER;
+static int sync_timer_id = INVALID_TIMER;
 static bool ipban_inited = false;
 
+// Active bans, one table per prefix length (a.*.*.*, a.b.*.*, a.b.c.*, a.b.c.d).
+// Keys are the masked ip, values the expiration time.
+// This is a prefix trie over the octets with each level flattened into a hash table,
+// so a check costs at most four lookups.
+#define IPBAN_LEVELS 4
+static DBMap* ipban_db[IPBAN_LEVELS];
+static const uint32 ipban_mask[IPBAN_LEVELS] = { 0xFF000000, 0xFFFF0000, 0xFFFFFF00, 0xFFFFFFFF };
+static time_t ipban_lastbtime = 0; // newest `btime` seen in the table (database clock)
+
+// Failed login attempts per ip, counted over a sliding window of
+// dynamic_pass_failure_ban_interval minutes split into IPBAN_FAILURE_SLOTS slots.
+#define IPBAN_FAILURE_SLOTS 10
+struct ipban_failures {
+	unsigned int slot; // slot number of the latest failure
+	unsigned short count[IPBAN_FAILURE_SLOTS];
+};
+static DBMap* ipban_failures_db = NULL; // ip -> struct ipban_failures*
+
 int ipban_cleanup(int tid, unsigned int tick, int id, intptr_t data);
+int ipban_sync(int tid, unsigned int tick, int id, intptr_t data);
+static void ipban_reload(bool full);
 
 
 // initialize
@@ -48,6 +71,7 @@ void ipban_init(void)
 	uint16      port;
 	const char* database;
 	const char* codepage;
+	int i;
 
 	ipban_inited = true;
 
@@ -87,26 +111,47 @@ void ipban_init(void)
 	ShowStatus("Connected to ipban database '%s'.\n", database);
 	Sql_PrintExtendedInfo(sql_handle);
 
+	for( i = 0; i < IPBAN_LEVELS; ++i )
+		ipban_db[i] = uidb_alloc(DB_OPT_BASE);
+	ipban_failures_db = uidb_alloc(DB_OPT_RELEASE_DATA);
+
 	if( login_config.ipban_cleanup_interval > 0 )
 	{ // set up periodic cleanup of connection history and active bans
 		add_timer_func_list(ipban_cleanup, "ipban_cleanup");
 		cleanup_timer_id = add_timer_interval(gettick()+10, ipban_cleanup, 0, 0, login_config.ipban_cleanup_interval*1000);
 	} else // make sure it gets cleaned up on login-server start regardless of interval-based cleanups
 		ipban_cleanup(0,0,0,0);
+
+	// the cleanup above does not load the bans when it runs from a timer
+	ipban_reload(true);
+
+	add_timer_func_list(ipban_sync, "ipban_sync");
+	sync_timer_id = add_timer_interval(gettick()+login_config.ipban_sync_interval*1000, ipban_sync, 0, 0, login_config.ipban_sync_interval*1000);
 }
 
 // finalize
 void ipban_final(void)
 {
+	int i;
+
 	if( !login_config.ipban )
 		return;// ipban disabled
 
 	if( login_config.ipban_cleanup_interval > 0 )
 		// release data
 		delete_timer(cleanup_timer_id, ipban_cleanup);
+	delete_timer(sync_timer_id, ipban_sync);
 	
 	ipban_cleanup(0,0,0,0); // always clean up on login-server stop
 
+	for( i = 0; i < IPBAN_LEVELS; ++i )
+	{
+		db_destroy(ipban_db[i]);
+		ipban_db[i] = NULL;
+	}
+	db_destroy(ipban_failures_db);
+	ipban_failures_db = NULL;
+
 	// close connections
 	Sql_Free(sql_handle);
 	sql_handle = NULL;
@@ -193,6 +238,9 @@ bool ipban_config_read(const char* key, const char* value)
 		else
 		if( strcmpi(key, "dynamic_pass_failure_ban_duration") == 0 )
 			login_config.dynamic_pass_failure_ban_duration = atoi(value);
+		else
+		if( strcmpi(key, "sync_interval") == 0 )
+			login_config.ipban_sync_interval = max(atoi(value), 1);
 		else
 			return false;// not found
 		return true;
@@ -201,48 +249,173 @@ bool ipban_config_read(const char* key, const char* value)
 	return false;// not found
 }
 
+/// Parses a `list` entry of the form 'a.*.*.*', 'a.b.*.*', 'a.b.c.*' or 'a.b.c.d'.
+/// Returns the prefix level of the entry, or -1 if it has another form.
+static int ipban_parse(const char* list, uint32* ip)
+{
+	const char* p = list;
+	char* end;
+	int level;
+	int i;
+
+	*ip = 0;
+	for( level = 0; level < IPBAN_LEVELS; ++level )
+	{
+		unsigned long octet;
+
+		if( level > 0 && *p++ != '.' )
+			return -1;
+		if( !ISDIGIT(*p) )
+			break;
+		octet = strtoul(p, &end, 10);
+		if( octet > 255 )
+			return -1;
+		*ip |= (uint32)octet << (24 - 8*level);
+		p = end;
+	}
+
+	if( level == 0 )
+		return -1;// '*.*.*.*' never matched anything
+	for( i = level; i < IPBAN_LEVELS; ++i )
+	{
+		if( i > level && *p++ != '.' )
+			return -1;
+		if( *p++ != '*' )
+			return -1;
+	}
+	if( *p != '\0' )
+		return -1;
+
+	return level - 1;
+}
+
+/// Adds a ban to the in-memory table, keeping the later expiration time if it already exists.
+static void ipban_add(int level, uint32 ip, time_t rtime)
+{
+	uint32 key = ip & ipban_mask[level];
+	time_t old = (time_t)(intptr_t)uidb_get(ipban_db[level], key);
+
+	if( rtime > old )
+		uidb_put(ipban_db[level], key, (void*)(intptr_t)rtime);
+}
+
+/// Loads active bans from the database.
+/// A full reload replaces the table, otherwise only entries created since the last load are read.
+static void ipban_reload(bool full)
+{
+	int count = 0;
+	int i;
+
+	if( full )
+	{
+		if( SQL_ERROR == Sql_Query(sql_handle, "SELECT `list`, UNIX_TIMESTAMP(`btime`), UNIX_TIMESTAMP(`rtime`) FROM `%s` WHERE `rtime` > NOW()", ipban_table) )
+		{
+			Sql_ShowDebug(sql_handle);
+			return;// keep the current table
+		}
+		for( i = 0; i < IPBAN_LEVELS; ++i )
+			db_clear(ipban_db[i]);
+	}
+	else
+	if( SQL_ERROR == Sql_Query(sql_handle, "SELECT `list`, UNIX_TIMESTAMP(`btime`), UNIX_TIMESTAMP(`rtime`) FROM `%s` WHERE `rtime` > NOW() AND `btime` >= FROM_UNIXTIME(%lu)", ipban_table, (unsigned long)ipban_lastbtime) )
+	{
+		Sql_ShowDebug(sql_handle);
+		return;
+	}
+
+	while( SQL_SUCCESS == Sql_NextRow(sql_handle) )
+	{
+		char* data;
+		time_t btime;
+		time_t rtime;
+		uint32 ip;
+		int level;
+
+		Sql_GetData(sql_handle, 0, &data, NULL); level = ipban_parse(data, &ip);
+		Sql_GetData(sql_handle, 1, &data, NULL); btime = (time_t)strtoul(data, NULL, 10);
+		Sql_GetData(sql_handle, 2, &data, NULL); rtime = (time_t)strtoul(data, NULL, 10);
+
+		if( btime > ipban_lastbtime )
+			ipban_lastbtime = btime;
+		if( level < 0 )
+			continue;// not a supported pattern
+		ipban_add(level, ip, rtime);
+		++count;
+	}
+	Sql_FreeResult(sql_handle);
+
+	if( full )
+		ShowInfo("Loaded '"CL_WHITE"%d"CL_RESET"' active ip bans.\n", count);
+}
+
 // check ip against active bans list
 bool ipban_check(uint32 ip)
 {
-	uint8* p = (uint8*)&ip;
-	char* data = NULL;
-	int matches;
+	time_t now = time(NULL);
+	int i;
 
 	if( !login_config.ipban )
 		return false;// ipban disabled
 
-	if( SQL_ERROR == Sql_Query(sql_handle, "SELECT count(*) FROM `%s` WHERE `rtime` > NOW() AND (`list` = '%u.*.*.*' OR `list` = '%u.%u.*.*' OR `list` = '%u.%u.%u.*' OR `list` = '%u.%u.%u.%u')",
-		ipban_table, p[3], p[3], p[2], p[3], p[2], p[1], p[3], p[2], p[1], p[0]) )
+	for( i = 0; i < IPBAN_LEVELS; ++i )
+		if( (time_t)(intptr_t)uidb_get(ipban_db[i], ip & ipban_mask[i]) > now )
+			return true;
+
+	return false;
+}
+
+/// Records a failure and returns the number of failures in the sliding window.
+static unsigned int ipban_countfailure(uint32 ip)
+{
+	struct ipban_failures* f;
+	unsigned int width = max(login_config.dynamic_pass_failure_ban_interval*60/IPBAN_FAILURE_SLOTS, 1);
+	unsigned int slot = (unsigned int)(time(NULL) / width);
+	unsigned int total = 0;
+	int i;
+
+	f = (struct ipban_failures*)uidb_get(ipban_failures_db, ip);
+	if( f == NULL )
 	{
-		Sql_ShowDebug(sql_handle);
-		// close connection because we can't verify their connectivity.
-		return true;
+		CREATE(f, struct ipban_failures, 1);
+		f->slot = slot;
+		uidb_put(ipban_failures_db, ip, f);
 	}
+	else
+	if( slot - f->slot >= IPBAN_FAILURE_SLOTS )
+		memset(f->count, 0, sizeof(f->count));// whole window expired
+	else
+	{// expire the slots between the last failure and now
+		while( f->slot != slot )
+			f->count[++f->slot%IPBAN_FAILURE_SLOTS] = 0;
+	}
+	f->slot = slot;
 
-	if( SQL_ERROR == Sql_NextRow(sql_handle) )
-		return true;// Shouldn't happen, but just in case...
-
-	Sql_GetData(sql_handle, 0, &data, NULL);
-	matches = atoi(data);
-	Sql_FreeResult(sql_handle);
+	if( f->count[slot%IPBAN_FAILURE_SLOTS] < USHRT_MAX )
+		f->count[slot%IPBAN_FAILURE_SLOTS]++;
+	for( i = 0; i < IPBAN_FAILURE_SLOTS; ++i )
+		total += f->count[i];
 
-	return( matches > 0 );
+	return total;
 }
 
 // log failed attempt
 void ipban_log(uint32 ip)
 {
-	unsigned long failures;
+	unsigned int failures;
 
 	if( !login_config.ipban )
 		return;// ipban disabled
 
-	failures = loginlog_failedattempts(ip, login_config.dynamic_pass_failure_ban_interval);// how many times failed account? in one ip.
+	failures = ipban_countfailure(ip);// how many times failed account? in one ip.
 
 	// if over the limit, add a temporary ban entry
 	if( failures >= login_config.dynamic_pass_failure_ban_limit )
 	{
 		uint8* p = (uint8*)&ip;
+
+		ipban_add(2, ip, time(NULL) + login_config.dynamic_pass_failure_ban_duration*60);
+		uidb_remove(ipban_failures_db, ip);
+
 		if( SQL_ERROR == Sql_Query(sql_handle, "INSERT INTO `%s`(`list`,`btime`,`rtime`,`reason`) VALUES ('%u.%u.%u.*', NOW() , NOW() +  INTERVAL %d MINUTE ,'Password error ban')",
 			ipban_table, p[3], p[2], p[1], login_config.dynamic_pass_failure_ban_duration) )
 			Sql_ShowDebug(sql_handle);
@@ -258,5 +431,28 @@ int ipban_cleanup(int tid, unsigned int tick, int id, intptr_t data)
 	if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `ipbanlist` WHERE `rtime` <= NOW()") )
 		Sql_ShowDebug(sql_handle);
 
+	// picks up bans that were edited or removed in the database
+	if( tid != 0 )
+		ipban_reload(true);
+
+	return 0;
+}
+
+// load new bans and forget failure counters that left the window
+int ipban_sync(int tid, unsigned int tick, int id, intptr_t data)
+{
+	unsigned int width = max(login_config.dynamic_pass_failure_ban_interval*60/IPBAN_FAILURE_SLOTS, 1);
+	unsigned int slot = (unsigned int)(time(NULL) / width);
+	DBIterator* iter;
+	struct ipban_failures* f;
+
+	ipban_reload(false);
+
+	iter = db_iterator(ipban_failures_db);
+	for( f = (struct ipban_failures*)dbi_first(iter); dbi_exists(iter); f = (struct ipban_failures*)dbi_next(iter) )
+		if( slot - f->slot >= IPBAN_FAILURE_SLOTS )
+			iter->remove(iter);
+	dbi_destroy(iter);
+
 	return 0;
 }
@@ -11,6 +11,7 @@
 #include "../common/timer.h"
 #include "../common/version.h"
 #include "account.h"
+#include "dnsbl.h"
 #include "ipban.h"
 #include "login.h"
 #include "loginlog.h"
@@ -366,13 +367,19 @@ int parse_console(const char* command)
 	if( strcmpi("shutdown", command) == 0 || strcmpi("exit", command) == 0 || strcmpi("quit", command) == 0 || strcmpi("end", command) == 0 )
 		runflag = SERVER_STATE_STOP;
 	else if( strcmpi("alive", command) == 0 || strcmpi("status", command) == 0 )
+	{
 		ShowInfo(CL_CYAN"Console: "CL_BOLD"I'm Alive."CL_RESET"\n");
+		if( strcmpi("status", command) == 0 )
+			socket_showusage();
+	}
 	else if( strcmpi("help", command) == 0 )
 	{
 		ShowInfo("To shutdown the server:\n");
 		ShowInfo("  'shutdown|exit|quit|end'\n");
 		ShowInfo("To know if server is alive:\n");
 		ShowInfo("  'alive|status'\n");
+		ShowInfo("To show the sessions and their buffer memory:\n");
+		ShowInfo("  'status'\n");
 		ShowInfo("To create a new account:\n");
 		ShowInfo("  'create'\n");
 	}
@@ -979,31 +986,6 @@ int mmo_auth(struct login_session_data* sd)
 	char ip[16];
 	ip2str(session[sd->fd]->client_addr, ip);
 
-	// DNS Blacklist check
-	if( login_config.use_dnsbl )
-	{
-		char r_ip[16];
-		char ip_dnsbl[256];
-		char* dnsbl_serv;
-		bool matched = false;
-		uint8* sin_addr = (uint8*)&session[sd->fd]->client_addr;
-
-		sprintf(r_ip, "%u.%u.%u.%u", sin_addr[0], sin_addr[1], sin_addr[2], sin_addr[3]);
-
-		for( dnsbl_serv = strtok(login_config.dnsbl_servs,","); !matched && dnsbl_serv != NULL; dnsbl_serv = strtok(NULL,",") )
-		{
-			sprintf(ip_dnsbl, "%s.%s", r_ip, dnsbl_serv);
-			if( host2ip(ip_dnsbl) )
-				matched = true;
-		}
-
-		if( matched )
-		{
-			ShowInfo("DNSBL: (%s) Blacklisted. User Kicked.\n", r_ip);
-			return 3;
-		}
-	}
-
 	//Client Version check
 	if( login_config.check_client_version && sd->version != login_config.client_version_to_connect )
 		return 5;
@@ -1275,6 +1257,27 @@ void login_auth_failed(struct login_session_data* sd, int result)
 //----------------------------------------------------------------------------------------
 // Default packet parsing (normal players or char-server connection requests)
 //----------------------------------------------------------------------------------------
+/// Continues a client login request after the dns blacklist lookups.
+static void login_dnsbl_result(int fd, bool listed)
+{
+	struct login_session_data* sd = (struct login_session_data*)session[fd]->session_data;
+	int result;
+
+	sd->dnsbl_pending = false;
+	if( listed )
+	{
+		ShowInfo("DNSBL: (%s) Blacklisted. User Kicked.\n", ip2str(session[fd]->client_addr, NULL));
+		result = 3;
+	}
+	else
+		result = mmo_auth(sd);
+
+	if( result == -1 )
+		login_auth_ok(sd);
+	else
+		login_auth_failed(sd, result);
+}
+
 int parse_login(int fd)
 {
 	struct login_session_data* sd = (struct login_session_data*)session[fd]->session_data;
@@ -1287,6 +1290,8 @@ int parse_login(int fd)
 	if( session[fd]->flag.eof )
 	{
 		ShowInfo("Closed connection from '"CL_WHITE"%s"CL_RESET"'.\n", ip);
+		if( sd != NULL && sd->dnsbl_pending )
+			dnsbl_cancel(fd);
 		do_close(fd);
 		return 0;
 	}
@@ -1312,6 +1317,9 @@ int parse_login(int fd)
 		sd->fd = fd;
 	}
 
+	if( sd->dnsbl_pending )
+		return 0;// the login request waits for the dns blacklist lookups
+
 	while( RFIFOREST(fd) >= 2 )
 	{
 		uint16 command = RFIFOW(fd,0);
@@ -1422,6 +1430,23 @@ int parse_login(int fd)
 				return 0;
 			}
 
+			// DNS Blacklist check
+			if( login_config.use_dnsbl )
+			{
+				enum dnsbl_state state = dnsbl_check(ipl, fd, login_dnsbl_result);
+				if( state == DNSBL_PENDING )
+				{// continued in login_dnsbl_result
+					sd->dnsbl_pending = true;
+					return 0;
+				}
+				if( state == DNSBL_LISTED )
+				{
+					ShowInfo("DNSBL: (%s) Blacklisted. User Kicked.\n", ip);
+					login_auth_failed(sd, 3);
+					return 0;
+				}
+			}
+
 			result = mmo_auth(sd);
 
 			if( result == -1 )
@@ -1542,8 +1567,12 @@ void login_set_defaults()
 	login_config.dynamic_pass_failure_ban_interval = 5;
 	login_config.dynamic_pass_failure_ban_limit = 7;
 	login_config.dynamic_pass_failure_ban_duration = 5;
+	login_config.ipban_sync_interval = 10;
 	login_config.use_dnsbl = false;
 	safestrncpy(login_config.dnsbl_servs, "", sizeof(login_config.dnsbl_servs));
+	safestrncpy(login_config.dnsbl_resolver, "", sizeof(login_config.dnsbl_resolver));
+	login_config.dnsbl_timeout = 2000;
+	login_config.dnsbl_cache_time = 600;
 	safestrncpy(login_config.account_engine, "auto", sizeof(login_config.account_engine));
 }
 
@@ -1612,6 +1641,12 @@ int login_config_read(const char* cfgName)
 			login_config.use_dnsbl = (bool)config_switch(w2);
 		else if(!strcmpi(w1, "dnsbl_servers"))
 			safestrncpy(login_config.dnsbl_servs, w2, sizeof(login_config.dnsbl_servs));
+		else if(!strcmpi(w1, "dnsbl_resolver"))
+			safestrncpy(login_config.dnsbl_resolver, w2, sizeof(login_config.dnsbl_resolver));
+		else if(!strcmpi(w1, "dnsbl_timeout"))
+			login_config.dnsbl_timeout = (unsigned int)atoi(w2);
+		else if(!strcmpi(w1, "dnsbl_cache_time"))
+			login_config.dnsbl_cache_time = (unsigned int)atoi(w2);
 		else if(!strcmpi(w1, "ipban_cleanup_interval"))
 			login_config.ipban_cleanup_interval = (unsigned int)atoi(w2);
 		else if(!strcmpi(w1, "ip_sync_interval"))
@@ -1676,6 +1711,7 @@ void do_final(void)
 		loginlog_final();
 
 	ipban_final();
+	dnsbl_final();
 
 	for( i = 0; account_engines[i].constructor; ++i )
 	{// destroy all account engines
@@ -1760,6 +1796,7 @@ int do_init(int argc, char** argv)
 
 	// initialize static and dynamic ipban system
 	ipban_init();
+	dnsbl_init();
 
 	// Online user database init
 	online_db = idb_alloc(DB_OPT_RELEASE_DATA);
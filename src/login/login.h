@@ -32,6 +32,7 @@ struct login_session_data {
 	uint32 version;
 
 	int fd;
+	bool dnsbl_pending; // the login request waits for the dns blacklist lookups
 };
 
 struct mmo_char_server {
@@ -66,8 +67,12 @@ struct Login_Config {
 	unsigned int dynamic_pass_failure_ban_interval; // how far to scan the loginlog for password failures
 	unsigned int dynamic_pass_failure_ban_limit;    // number of failures needed to trigger the ipban
 	unsigned int dynamic_pass_failure_ban_duration; // duration of the ipban
+	unsigned int ipban_sync_interval;               // interval (in seconds) to load bans added to `ipbanlist` by other tools
 	bool use_dnsbl;                                 // dns blacklist blocking ?
 	char dnsbl_servs[1024];                         // comma-separated list of dnsbl servers
+	char dnsbl_resolver[64];                        // resolver for the dnsbl lookups (ip[:port], empty for the system resolver)
+	unsigned int dnsbl_timeout;                     // time (in milliseconds) to wait for the answer of a dnsbl server
+	unsigned int dnsbl_cache_time;                  // time (in seconds) the result of the dnsbl lookups is kept for an ip
 
 	char account_engine[256];                       // name of the engine to use (defaults to auto, for the first available engine)
 };
@@ -7,8 +7,10 @@
 #include "../common/socket.h"
 #include "../common/sql.h"
 #include "../common/strlib.h"
+#include "../common/timer.h"
 #include <string.h>
 #include <stdlib.h> // exit
+#include <time.h>
 
 // global sql settings (in ipban_sql.c)
 static char   global_db_hostname[32] = "127.0.0.1";
@@ -29,27 +31,31 @@ static char   loginlog_table[256] = "loginlog";
 static Sql* sql_handle = NULL;
 static bool enabled = false;
 
+// log entries are queued and written with one multi-row insert
+#define LOGINLOG_FLUSH_INTERVAL 1000 // ms between writes of the queued entries
+#define LOGINLOG_FLUSH_ROWS 100 // queued entries that trigger an immediate write
+static StringBuf loginlog_queue; // values of the pending insert
+static int loginlog_queued = 0;
+static int flush_timer_id = INVALID_TIMER;
 
-// Returns the number of failed login attemps by the ip in the last minutes.
-unsigned long loginlog_failedattempts(uint32 ip, unsigned int minutes)
-{
-	unsigned long failures = 0;
 
-	if( !enabled )
-		return 0;
+/// Writes the queued log entries to the database.
+static void loginlog_flush(void)
+{
+	if( loginlog_queued == 0 )
+		return;
 
-	if( SQL_ERROR == Sql_Query(sql_handle, "SELECT count(*) FROM `%s` WHERE `ip` = '%s' AND `rcode` = '1' AND `time` > NOW() - INTERVAL %d MINUTE",
-		loginlog_table, ip2str(ip,NULL), minutes) )// how many times failed account? in one ip.
+	if( SQL_ERROR == Sql_Query(sql_handle, "INSERT INTO `%s`(`time`,`ip`,`user`,`rcode`,`log`) VALUES %s", loginlog_table, StringBuf_Value(&loginlog_queue)) )
 		Sql_ShowDebug(sql_handle);
 
-	if( SQL_SUCCESS == Sql_NextRow(sql_handle) )
-	{
-		char* data;
-		Sql_GetData(sql_handle, 0, &data, NULL);
-		failures = strtoul(data, NULL, 10);
-		Sql_FreeResult(sql_handle);
-	}
-	return failures;
+	StringBuf_Clear(&loginlog_queue);
+	loginlog_queued = 0;
+}
+
+static int loginlog_flush_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	loginlog_flush();
+	return 0;
 }
 
 
@@ -60,7 +66,6 @@ void login_log(uint32 ip, const char* username, int rcode, const char* message)
 {
 	char esc_username[NAME_LENGTH*2+1];
 	char esc_message[255*2+1];
-	int retcode;
 
 	if( !enabled )
 		return;
@@ -68,12 +73,13 @@ void login_log(uint32 ip, const char* username, int rcode, const char* message)
 	Sql_EscapeStringLen(sql_handle, esc_username, username, strnlen(username, NAME_LENGTH));
 	Sql_EscapeStringLen(sql_handle, esc_message, message, strnlen(message, 255));
 
-	retcode = Sql_Query(sql_handle,
-		"INSERT INTO `%s`(`time`,`ip`,`user`,`rcode`,`log`) VALUES (NOW(), '%s', '%s', '%d', '%s')",
-		loginlog_table, ip2str(ip,NULL), esc_username, rcode, message);
+	if( loginlog_queued > 0 )
+		StringBuf_AppendStr(&loginlog_queue, ",");
+	StringBuf_Printf(&loginlog_queue, "(FROM_UNIXTIME(%lu), '%s', '%s', '%d', '%s')",
+		(unsigned long)time(NULL), ip2str(ip,NULL), esc_username, rcode, esc_message);
 
-	if( retcode != SQL_SUCCESS )
-		Sql_ShowDebug(sql_handle);
+	if( ++loginlog_queued >= LOGINLOG_FLUSH_ROWS )
+		loginlog_flush();
 }
 
 bool loginlog_init(void)
@@ -119,6 +125,10 @@ bool loginlog_init(void)
 	ShowStatus("Connected to loginlog database '%s'.\n", database);
 	Sql_PrintExtendedInfo(sql_handle);
 
+	StringBuf_Init(&loginlog_queue);
+	add_timer_func_list(loginlog_flush_timer, "loginlog_flush_timer");
+	flush_timer_id = add_timer_interval(gettick()+LOGINLOG_FLUSH_INTERVAL, loginlog_flush_timer, 0, 0, LOGINLOG_FLUSH_INTERVAL);
+
 	enabled = true;
 
 	return true;
@@ -126,6 +136,11 @@ bool loginlog_init(void)
 
 bool loginlog_final(void)
 {
+	loginlog_flush();
+	delete_timer(flush_timer_id, loginlog_flush_timer);
+	StringBuf_Destroy(&loginlog_queue);
+	enabled = false;
+
 	Sql_Free(sql_handle);
 	sql_handle = NULL;
 	return true;
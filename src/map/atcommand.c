@@ -4811,6 +4811,7 @@ ACMD_FUNC(loadnpc)
 	// add to list of script sources and run it
 	npc_addsrcfile(message);
 	npc_parsesrcfile(message);
+	script_cache_save(false);
 	npc_read_event_script();
 
 	clif_displaymessage(fd, msg_txt(262));
@@ -0,0 +1,386 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "../common/cbasetypes.h"
+#include "../common/malloc.h"
+#include "../common/random.h"
+#include "../common/showmsg.h"
+#include "../common/strlib.h"
+#include "../common/timer.h"
+#include "../common/utils.h"
+#include "battle.h"
+#include "battle_bench.h"
+#include "itemdb.h"
+#include "map.h"
+#include "mob.h"
+#include "pc.h"
+#include "skill.h"
+#include "status.h"
+#include "unit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/// Deterministic replay of the battle formulas.
+/// Builds are read from a corpus file, turned into fake players standing
+/// next to a monster, and each attack is calculated over and over with a
+/// fixed random seed. The checksums only change if the results do.
+
+#define BATTLE_BENCH_MAX_BUILDS 256
+#define BATTLE_BENCH_SEED 20101019
+
+enum e_bench_equip
+{
+	BENCH_WEAPON,
+	BENCH_SHIELD,
+	BENCH_ARMOR,
+	BENCH_HEAD,
+	BENCH_GARMENT,
+	BENCH_SHOES,
+	BENCH_ACC_L,
+	BENCH_ACC_R,
+	BENCH_EQUIP_MAX
+};
+
+struct s_bench_build
+{
+	short class_;
+	short base_level, job_level;
+	short str, agi, vit, int_, dex, luk;
+	short equip[BENCH_EQUIP_MAX];
+	char refine; // weapon refine
+	short card[MAX_SLOTS]; // weapon cards
+	short skill_id, skill_lv; // 0 for normal attacks
+	short mob_id; // target
+};
+
+char battle_bench_file[256] = "";
+int battle_bench_count = 100000;
+
+static struct s_bench_build bench_build[BATTLE_BENCH_MAX_BUILDS];
+static int bench_build_count = 0;
+
+
+/// Class,BaseLv,JobLv,Str,Agi,Vit,Int,Dex,Luk,Weapon,Refine,Card1,Card2,Card3,Card4,Shield,Armor,Head,Garment,Shoes,Accessory1,Accessory2,Skill,SkillLv,TargetMob
+static bool battle_bench_parse_row(char* split[], int columns, int current)
+{
+	struct s_bench_build* b = &bench_build[bench_build_count];
+	int i;
+
+	memset(b, 0, sizeof(*b));
+	b->class_ = atoi(split[0]);
+	b->base_level = cap_value(atoi(split[1]), 1, MAX_LEVEL);
+	b->job_level = max(atoi(split[2]), 1);
+	b->str = atoi(split[3]);
+	b->agi = atoi(split[4]);
+	b->vit = atoi(split[5]);
+	b->int_ = atoi(split[6]);
+	b->dex = atoi(split[7]);
+	b->luk = atoi(split[8]);
+	b->equip[BENCH_WEAPON] = atoi(split[9]);
+	b->refine = cap_value(atoi(split[10]), 0, MAX_REFINE);
+	for( i = 0; i < MAX_SLOTS; i++ )
+		b->card[i] = atoi(split[11+i]);
+	for( i = BENCH_SHIELD; i < BENCH_EQUIP_MAX; i++ )
+		b->equip[i] = atoi(split[15+i-BENCH_SHIELD]);
+	b->skill_id = atoi(split[22]);
+	b->skill_lv = atoi(split[23]);
+	b->mob_id = atoi(split[24]);
+
+	if( !pcdb_checkid(b->class_) )
+	{
+		ShowWarning("battle_bench_parse_row: Invalid class %d, skipping.\n", b->class_);
+		return false;
+	}
+	if( !mobdb_checkid(b->mob_id) )
+	{
+		ShowWarning("battle_bench_parse_row: Invalid monster %d, skipping.\n", b->mob_id);
+		return false;
+	}
+	if( b->skill_id && ( skill_get_index(b->skill_id) == 0 || !skill_get_type(b->skill_id) ) )
+	{
+		ShowWarning("battle_bench_parse_row: Skill %d is not an attack skill, skipping.\n", b->skill_id);
+		return false;
+	}
+	for( i = 0; i < BENCH_EQUIP_MAX; i++ )
+	{
+		if( b->equip[i] && !itemdb_exists(b->equip[i]) )
+		{
+			ShowWarning("battle_bench_parse_row: Unknown item %d, ignoring.\n", b->equip[i]);
+			b->equip[i] = 0;
+		}
+	}
+	for( i = 0; i < MAX_SLOTS; i++ )
+	{
+		if( b->card[i] && !itemdb_exists(b->card[i]) )
+		{
+			ShowWarning("battle_bench_parse_row: Unknown card %d, ignoring.\n", b->card[i]);
+			b->card[i] = 0;
+		}
+	}
+
+	bench_build_count++;
+	return true;
+}
+
+
+/// Creates a player with the given build, the same way pc_authok does but without a session.
+static struct map_session_data* battle_bench_create_pc(const struct s_bench_build* b, int id, int m, int x, int y)
+{
+	struct map_session_data* sd;
+	int i, n, skill_id;
+
+	CREATE(sd, struct map_session_data, 1);
+	sd->fd = 0; // packets go to the null session
+	sd->bl.id = id;
+	sd->bl.type = BL_PC;
+	sd->bl.m = m;
+	sd->bl.x = x;
+	sd->bl.y = y;
+	sd->status.account_id = id;
+	sd->status.char_id = id;
+	safestrncpy(sd->status.name, "battle_bench", NAME_LENGTH);
+	sd->status.class_ = b->class_;
+	sd->class_ = pc_jobid2mapid(b->class_);
+	sd->status.base_level = b->base_level;
+	sd->status.job_level = b->job_level;
+	sd->status.str = b->str;
+	sd->status.agi = b->agi;
+	sd->status.vit = b->vit;
+	sd->status.int_ = b->int_;
+	sd->status.dex = b->dex;
+	sd->status.luk = b->luk;
+	sd->status.hp = sd->status.sp = 1;
+
+	sd->followtimer = INVALID_TIMER;
+	sd->invincible_timer = INVALID_TIMER;
+	sd->npc_timer_id = INVALID_TIMER;
+	sd->pvp_timer = INVALID_TIMER;
+	sd->rental_timer = INVALID_TIMER;
+	for( i = 0; i < MAX_SKILL_LEVEL; i++ )
+		sd->spirit_timer[i] = INVALID_TIMER;
+	for( i = 0; i < ARRAYLENGTH(sd->autobonus); i++ )
+		sd->autobonus[i].active = INVALID_TIMER;
+	for( i = 0; i < ARRAYLENGTH(sd->autobonus2); i++ )
+		sd->autobonus2[i].active = INVALID_TIMER;
+	for( i = 0; i < ARRAYLENGTH(sd->autobonus3); i++ )
+		sd->autobonus3[i].active = INVALID_TIMER;
+	for( i = 0; i < MAX_EVENTTIMER; i++ )
+		sd->eventtimer[i] = INVALID_TIMER;
+
+	// every skill of the job at its max level
+	for( i = 0; i < MAX_SKILL_TREE && (skill_id = skill_tree[pc_class2idx(sd->status.class_)][i].id) > 0; i++ )
+	{
+		if( skill_get_inf2(skill_id)&(INF2_QUEST_SKILL|INF2_WEDDING_SKILL|INF2_SPIRIT_SKILL) || skill_id == SG_DEVIL )
+			continue;
+		sd->status.skill[skill_id].id = skill_id;
+		sd->status.skill[skill_id].lv = skill_tree_get_max(skill_id, sd->status.class_);
+	}
+
+	// equipment, one inventory slot each
+	for( i = n = 0; i < BENCH_EQUIP_MAX; i++ )
+	{
+		if( !b->equip[i] )
+			continue;
+		sd->status.inventory[n].nameid = b->equip[i];
+		sd->status.inventory[n].amount = 1;
+		sd->status.inventory[n].identify = 1;
+		if( i == BENCH_WEAPON )
+		{
+			sd->status.inventory[n].refine = b->refine;
+			memcpy(sd->status.inventory[n].card, b->card, sizeof(b->card));
+		}
+		n++;
+	}
+	pc_setinventorydata(sd);
+	for( i = n = 0; i < BENCH_EQUIP_MAX; i++ )
+	{
+		int pos, used = 0, j;
+
+		if( !b->equip[i] )
+			continue;
+		pos = pc_equippoint(sd, n);
+		if( i == BENCH_ACC_L || i == BENCH_ACC_R )
+			pos &= ( i == BENCH_ACC_L ? EQP_ACC_L : EQP_ACC_R );
+		for( j = 0; j < n; j++ )
+			used |= sd->status.inventory[j].equip;
+		if( pos&used )
+			pos = 0; // slot taken by an earlier item (two-handed weapon and a shield)
+		sd->status.inventory[n].equip = pos;
+		n++;
+	}
+	pc_setequipindex(sd);
+
+	status_change_init(&sd->bl);
+	status_set_viewdata(&sd->bl, sd->status.class_);
+	unit_dataset(&sd->bl);
+	map_addiddb(&sd->bl); // equip scripts look the player up by id
+	status_calc_pc(sd,1);
+	sd->battle_status.hp = sd->battle_status.max_hp;
+	sd->battle_status.sp = sd->battle_status.max_sp;
+
+	return sd;
+}
+
+static void battle_bench_free_pc(struct map_session_data* sd)
+{
+	status_change_clear(&sd->bl, 1);
+	pc_delautobonus(sd, sd->autobonus, ARRAYLENGTH(sd->autobonus), false);
+	pc_delautobonus(sd, sd->autobonus2, ARRAYLENGTH(sd->autobonus2), false);
+	pc_delautobonus(sd, sd->autobonus3, ARRAYLENGTH(sd->autobonus3), false);
+	map_deliddb(&sd->bl);
+	aFree(sd);
+}
+
+static struct mob_data* battle_bench_create_mob(int mob_id, int m, int x, int y)
+{
+	struct spawn_data data;
+	struct mob_data* md;
+
+	memset(&data, 0, sizeof(data));
+	data.m = m;
+	data.x = x;
+	data.y = y;
+	data.class_ = mob_id;
+	data.num = 1;
+	safestrncpy(data.name, "--ja--", sizeof(data.name));
+	if( !mob_parse_dataset(&data) )
+		return NULL;
+
+	md = mob_spawn_dataset(&data);
+	status_calc_mob(md, 1);
+	return md;
+}
+
+
+/// FNV-1a
+static unsigned int battle_bench_hash(unsigned int hash, int value)
+{
+	int i;
+	for( i = 0; i < 4; i++ )
+	{
+		hash ^= (unsigned char)(value>>(i*8));
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static unsigned int battle_bench_hash_damage(unsigned int hash, const struct Damage* d)
+{
+	hash = battle_bench_hash(hash, d->damage);
+	hash = battle_bench_hash(hash, d->damage2);
+	hash = battle_bench_hash(hash, d->type);
+	hash = battle_bench_hash(hash, d->div_);
+	hash = battle_bench_hash(hash, d->amotion);
+	hash = battle_bench_hash(hash, d->dmotion);
+	hash = battle_bench_hash(hash, d->blewcount);
+	hash = battle_bench_hash(hash, d->flag);
+	hash = battle_bench_hash(hash, d->dmg_lv);
+	return hash;
+}
+
+static unsigned int battle_bench_hash_status(unsigned int hash, const struct status_data* status)
+{
+	hash = battle_bench_hash(hash, status->max_hp);
+	hash = battle_bench_hash(hash, status->max_sp);
+	hash = battle_bench_hash(hash, status->batk);
+	hash = battle_bench_hash(hash, status->rhw.atk);
+	hash = battle_bench_hash(hash, status->rhw.atk2);
+	hash = battle_bench_hash(hash, status->lhw.atk);
+	hash = battle_bench_hash(hash, status->matk_min);
+	hash = battle_bench_hash(hash, status->matk_max);
+	hash = battle_bench_hash(hash, status->hit);
+	hash = battle_bench_hash(hash, status->flee);
+	hash = battle_bench_hash(hash, status->flee2);
+	hash = battle_bench_hash(hash, status->cri);
+	hash = battle_bench_hash(hash, status->def);
+	hash = battle_bench_hash(hash, status->def2);
+	hash = battle_bench_hash(hash, status->mdef);
+	hash = battle_bench_hash(hash, status->mdef2);
+	hash = battle_bench_hash(hash, status->amotion);
+	hash = battle_bench_hash(hash, status->speed);
+	return hash;
+}
+
+
+/// Replays every build of the corpus 'filename' (in db_path).
+/// Each build attacks its target 'count' times and is attacked back 'count' times,
+/// and its status is recalculated count/10 times.
+bool battle_bench_run(const char* filename, int count)
+{
+	unsigned int total_hash = 2166136261U;
+	unsigned int attack_ms = 0, status_ms = 0;
+	int attack_calcs = 0, status_calcs = 0;
+	int m, x = 150, y = 150;
+	int i, k;
+
+	bench_build_count = 0;
+	if( !sv_readdb(db_path, filename, ',', 25, 25, BATTLE_BENCH_MAX_BUILDS, &battle_bench_parse_row) || bench_build_count == 0 )
+	{
+		ShowError("battle_bench_run: No builds to replay in '"CL_WHITE"%s/%s"CL_RESET"'.\n", db_path, filename);
+		return false;
+	}
+
+	if( (m = map_mapname2mapid(MAP_PRONTERA)) < 0 )
+		m = 0;
+	if( x >= map[m].xs || y >= map[m].ys )
+		x = y = 1;
+
+	ShowStatus("Replaying '"CL_WHITE"%d"CL_RESET"' builds, '"CL_WHITE"%d"CL_RESET"' calculations each...\n", bench_build_count, count);
+	for( i = 0; i < bench_build_count; i++ )
+	{
+		const struct s_bench_build* b = &bench_build[i];
+		struct map_session_data* sd;
+		struct mob_data* md;
+		unsigned int attack_hash = 2166136261U, defend_hash = 2166136261U, status_hash = 2166136261U;
+		unsigned int tick;
+		int type = ( b->skill_id ? skill_get_type(b->skill_id) : BF_WEAPON );
+
+		if( (md = battle_bench_create_mob(b->mob_id, m, x+1, y)) == NULL )
+			continue;
+		sd = battle_bench_create_pc(b, START_ACCOUNT_NUM+i, m, x, y);
+
+		srand(BATTLE_BENCH_SEED+i);
+		rnd_seed(BATTLE_BENCH_SEED+i);
+
+		tick = gettick_nocache();
+		for( k = 0; k < count; k++ )
+		{
+			struct Damage d = battle_calc_attack(type, &sd->bl, &md->bl, b->skill_id, b->skill_lv, 0);
+			attack_hash = battle_bench_hash_damage(attack_hash, &d);
+		}
+		for( k = 0; k < count; k++ )
+		{
+			struct Damage d = battle_calc_attack(BF_WEAPON, &md->bl, &sd->bl, 0, 0, 0);
+			defend_hash = battle_bench_hash_damage(defend_hash, &d);
+		}
+		attack_ms += DIFF_TICK(gettick_nocache(), tick);
+		attack_calcs += 2*count;
+
+		tick = gettick_nocache();
+		for( k = 0; k < count/10; k++ )
+		{
+			status_calc_pc(sd,0);
+			status_hash = battle_bench_hash_status(status_hash, &sd->battle_status);
+		}
+		status_ms += DIFF_TICK(gettick_nocache(), tick);
+		status_calcs += count/10;
+
+		ShowInfo("Build %d (class %d, skill %d/%d vs '%s'): attack %08x, defend %08x, status %08x\n",
+			i+1, b->class_, b->skill_id, b->skill_lv, md->db->sprite, attack_hash, defend_hash, status_hash);
+		total_hash = battle_bench_hash(total_hash, attack_hash);
+		total_hash = battle_bench_hash(total_hash, defend_hash);
+		total_hash = battle_bench_hash(total_hash, status_hash);
+
+		battle_bench_free_pc(sd);
+		unit_free(&md->bl, CLR_OUTSIGHT);
+	}
+
+	ShowStatus("Battle calculations: '"CL_WHITE"%d"CL_RESET"' in '"CL_WHITE"%u"CL_RESET"' ms ('"CL_WHITE"%.0f"CL_RESET"'/s).\n",
+		attack_calcs, attack_ms, attack_ms ? attack_calcs*1000./attack_ms : 0.);
+	ShowStatus("Status calculations: '"CL_WHITE"%d"CL_RESET"' in '"CL_WHITE"%u"CL_RESET"' ms ('"CL_WHITE"%.0f"CL_RESET"'/s).\n",
+		status_calcs, status_ms, status_ms ? status_calcs*1000./status_ms : 0.);
+	ShowStatus("Battle bench checksum: '"CL_WHITE"%08x"CL_RESET"'.\n", total_hash);
+	return true;
+}
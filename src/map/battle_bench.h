@@ -0,0 +1,14 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _BATTLE_BENCH_H_
+#define _BATTLE_BENCH_H_
+
+#include "../common/cbasetypes.h"
+
+extern char battle_bench_file[256]; // corpus file in db_path, empty if the benchmark is disabled
+extern int battle_bench_count; // attack calculations per build and direction
+
+bool battle_bench_run(const char* filename, int count);
+
+#endif /* _BATTLE_BENCH_H_ */
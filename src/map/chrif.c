@@ -1169,7 +1169,6 @@ int chrif_save_scdata(struct map_session_data *sd)
 	unsigned int tick;
 	struct status_change_data data;
 	struct status_change *sc = &sd->sc;
-	const struct TimerData *timer;
 
 	chrif_check(-1);
 	tick = gettick();
@@ -1184,10 +1183,10 @@ int chrif_save_scdata(struct map_session_data *sd)
 			continue;
 		if (sc->data[i]->timer != INVALID_TIMER)
 		{
-			timer = get_timer(sc->data[i]->timer);
-			if (timer == NULL || timer->func != status_change_timer || DIFF_TICK(timer->tick,tick) < 0)
+			const unsigned int* timer = sc_timer_gettick(sc->data[i]->timer);
+			if (timer == NULL || DIFF_TICK(*timer,tick) < 0)
 				continue;
-			data.tick = DIFF_TICK(timer->tick,tick); //Duration that is left before ending.
+			data.tick = DIFF_TICK(*timer,tick); //Duration that is left before ending.
 		} else
 			data.tick = -1; //Infinite duration
 		data.type = i;
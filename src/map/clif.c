@@ -282,33 +282,25 @@ static inline unsigned char clif_bl_type(struct block_list *bl) {
 /*==========================================
  * clif_sendAREA*w莞p
  *------------------------------------------*/
-static int clif_send_sub(struct block_list *bl, va_list ap)
+static int clif_send_sub(struct map_session_data *sd, const uint8* buf, int len, struct block_list* src_bl, int type)
 {
-	struct block_list *src_bl;
-	struct map_session_data *sd;
-	unsigned char *buf;
-	int len, type, fd;
+	int fd;
 
-	nullpo_ret(bl);
-	nullpo_ret(sd = (struct map_session_data *)bl);
+	nullpo_ret(sd);
+	nullpo_ret(src_bl);
 
 	fd = sd->fd;
 	if (!fd) //Don't send to disconnected clients.
 		return 0;
 
-	buf = va_arg(ap,unsigned char*);
-	len = va_arg(ap,int);
-	nullpo_ret(src_bl = va_arg(ap,struct block_list*));
-	type = va_arg(ap,int);
-
 	switch(type)
 	{
 	case AREA_WOS:
-		if (bl == src_bl)
+		if (&sd->bl == src_bl)
 			return 0;
 	break;
 	case AREA_WOC:
-		if (sd->chatID || bl == src_bl)
+		if (sd->chatID || &sd->bl == src_bl)
 			return 0;
 	break;
 	case AREA_WOSC:
@@ -354,6 +346,8 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 	struct battleground_data *bg = NULL;
 	int x0 = 0, x1 = 0, y0 = 0, y1 = 0, fd;
 	struct s_mapiterator* iter;
+	struct s_mapquery q;
+	struct block_list* tbl;
 
 	if( type != ALL_CLIENT && type != CHAT_MAINCHAT )
 		nullpo_ret(bl);
@@ -396,12 +390,16 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 			clif_send (buf, len, bl, SELF);
 	case AREA_WOC:
 	case AREA_WOS:
-		map_foreachinarea(clif_send_sub, bl->m, bl->x-AREA_SIZE, bl->y-AREA_SIZE, bl->x+AREA_SIZE, bl->y+AREA_SIZE,
-			BL_PC, buf, len, bl, type);
+		map_query_inarea(&q, bl->m, bl->x-AREA_SIZE, bl->y-AREA_SIZE, bl->x+AREA_SIZE, bl->y+AREA_SIZE, BL_PC);
+		map_query_foreach(&q, tbl)
+			clif_send_sub((TBL_PC*)tbl, buf, len, bl, type);
+		map_query_end(&q);
 		break;
 	case AREA_CHAT_WOC:
-		map_foreachinarea(clif_send_sub, bl->m, bl->x-(AREA_SIZE-5), bl->y-(AREA_SIZE-5),
-			bl->x+(AREA_SIZE-5), bl->y+(AREA_SIZE-5), BL_PC, buf, len, bl, AREA_WOC);
+		map_query_inarea(&q, bl->m, bl->x-(AREA_SIZE-5), bl->y-(AREA_SIZE-5), bl->x+(AREA_SIZE-5), bl->y+(AREA_SIZE-5), BL_PC);
+		map_query_foreach(&q, tbl)
+			clif_send_sub((TBL_PC*)tbl, buf, len, bl, AREA_WOC);
+		map_query_end(&q);
 		break;
 
 	case CHAT:
@@ -9013,6 +9011,8 @@ void clif_parse_LoadEndAck(int fd,struct map_session_data *sd)
 		party_send_movemap(sd);
 		clif_party_hp(sd); // Show hp after displacement [LuzZza]
 	}
+	party_send_xy_mark(sd);
+	guild_send_xy_mark(sd);
 
 	if( sd->bg_id ) clif_bg_hp(sd); // BattleGround System
 
@@ -15651,14 +15651,14 @@ void clif_search_store_info_ack(struct map_session_data* sd)
 		struct s_search_store_info_item* ssitem = &sd->searchstore.items[i];
 		struct item it;
 
-		WFIFOL(fd,i*blocksize+ 7) = ssitem->store_id;
-		WFIFOL(fd,i*blocksize+11) = ssitem->account_id;
-		memcpy(WFIFOP(fd,i*blocksize+15), ssitem->store_name, MESSAGE_SIZE);
-		WFIFOW(fd,i*blocksize+15+MESSAGE_SIZE) = ssitem->nameid;
-		WFIFOB(fd,i*blocksize+17+MESSAGE_SIZE) = itemtype(itemdb_type(ssitem->nameid));
-		WFIFOL(fd,i*blocksize+18+MESSAGE_SIZE) = ssitem->price;
-		WFIFOW(fd,i*blocksize+22+MESSAGE_SIZE) = ssitem->amount;
-		WFIFOB(fd,i*blocksize+24+MESSAGE_SIZE) = ssitem->refine;
+		WFIFOL(fd,(i-start)*blocksize+ 7) = ssitem->store_id;
+		WFIFOL(fd,(i-start)*blocksize+11) = ssitem->account_id;
+		memcpy(WFIFOP(fd,(i-start)*blocksize+15), ssitem->store_name, MESSAGE_SIZE);
+		WFIFOW(fd,(i-start)*blocksize+15+MESSAGE_SIZE) = ssitem->nameid;
+		WFIFOB(fd,(i-start)*blocksize+17+MESSAGE_SIZE) = itemtype(itemdb_type(ssitem->nameid));
+		WFIFOL(fd,(i-start)*blocksize+18+MESSAGE_SIZE) = ssitem->price;
+		WFIFOW(fd,(i-start)*blocksize+22+MESSAGE_SIZE) = ssitem->amount;
+		WFIFOB(fd,(i-start)*blocksize+24+MESSAGE_SIZE) = ssitem->refine;
 
 		// make-up an item for clif_addcards
 		memset(&it, 0, sizeof(it));
@@ -15666,7 +15666,7 @@ void clif_search_store_info_ack(struct map_session_data* sd)
 		it.nameid = ssitem->nameid;
 		it.amount = ssitem->amount;
 
-		clif_addcards(WFIFOP(fd,i*blocksize+25+MESSAGE_SIZE), &it);
+		clif_addcards(WFIFOP(fd,(i-start)*blocksize+25+MESSAGE_SIZE), &it);
 	}
 
 	WFIFOSET(fd,WFIFOW(fd,2));
@@ -42,6 +42,10 @@ struct eventlist {
 
 #define GUILD_SEND_XY_INVERVAL	5000
 
+static int* guild_xy_queue = NULL; // ids of the members with a pending position update
+static int guild_xy_count = 0;
+static int guild_xy_max = 0;
+static unsigned int guild_xy_round = 1; // current guild_send_xy_timer interval
 
 #define MAX_GUILD_SKILL_REQUIRE 5
 struct{
@@ -227,31 +231,43 @@ void guild_makemember(struct guild_member *m,struct map_session_data *sd)
 
 
 
-//Taken from party_send_xy_timer_sub. [Skotlex]
-int guild_send_xy_timer_sub(DBKey key,void *data,va_list ap)
+/// Queues a position update of this guild member for the next guild_send_xy_timer.
+/// Called whenever the member moves.
+void guild_send_xy_mark(struct map_session_data* sd)
 {
-	struct guild *g=(struct guild *)data;
-	int i;
+	nullpo_retv(sd);
 
-	nullpo_ret(g);
+	if( sd->status.guild_id == 0 || sd->guild_xy_round == guild_xy_round )
+		return;// not in a guild or already queued
+	sd->guild_xy_round = guild_xy_round;
 
-	for(i=0;i<g->max_member;i++){
-		//struct map_session_data* sd = g->member[i].sd;
-		struct map_session_data* sd = map_charid2sd(g->member[i].char_id); // temporary crashfix
-		if( sd != NULL && (sd->guild_x != sd->bl.x || sd->guild_y != sd->bl.y) && !sd->bg_id )
+	if( guild_xy_count == guild_xy_max )
+	{
+		guild_xy_max += 256;
+		RECREATE(guild_xy_queue, int, guild_xy_max);
+	}
+	guild_xy_queue[guild_xy_count++] = sd->bl.id;
+}
+
+//Code from party_send_xy_timer [Skotlex]
+static int guild_send_xy_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	int n;
+
+	// for each member that moved,
+	for( n = 0; n < guild_xy_count; n++ )
+	{
+		struct map_session_data* sd = map_id2sd(guild_xy_queue[n]);
+		if( sd != NULL && (sd->guild_x != sd->bl.x || sd->guild_y != sd->bl.y) && !sd->bg_id && guild_search(sd->status.guild_id) != NULL )
 		{
 			clif_guild_xy(sd);
 			sd->guild_x = sd->bl.x;
 			sd->guild_y = sd->bl.y;
 		}
 	}
-	return 0;
-}
+	guild_xy_count = 0;
+	guild_xy_round++;
 
-//Code from party_send_xy_timer [Skotlex]
-static int guild_send_xy_timer(int tid, unsigned int tick, int id, intptr_t data)
-{
-	guild_db->foreach(guild_db,guild_send_xy_timer_sub,tick);
 	return 0;
 }
 
@@ -458,6 +474,8 @@ int guild_recv_info(struct guild *sg)
 			clif_guild_belonginfo(sd,g);
 			clif_guild_notice(sd,g);
 			sd->guild_emblem_id=g->emblem_id;
+			sd->guild_x = -1;// show the new member on the minimap even if they stand still
+			guild_send_xy_mark(sd);
 		}
 	}
 
@@ -643,6 +661,8 @@ int guild_member_added(int guild_id,int account_id,int char_id,int flag)
 	//Packets which were sent in the previous 'guild_sent' implementation.
 	clif_guild_belonginfo(sd,g);
 	clif_guild_notice(sd,g);
+	sd->guild_x = -1;// show the new member on the minimap even if they stand still
+	guild_send_xy_mark(sd);
 
 	//TODO: send new emblem info to others
 
@@ -1610,4 +1630,8 @@ void do_final_guild(void)
 
 	do_final_guild_castle();
 	do_final_guild_expcache();
+
+	aFree(guild_xy_queue);
+	guild_xy_queue = NULL;
+	guild_xy_count = guild_xy_max = 0;
 }
@@ -101,7 +101,7 @@ int instance_create(int party_id, const char *name)
 int instance_add_map(const char *name, int instance_id, bool usebasename)
 {
 	int m = map_mapname2mapid(name), i, im = -1;
-	size_t num_cell, size;
+	size_t size;
 
 	if( m < 0 )
 		return -1; // source map not found
@@ -143,13 +143,12 @@ int instance_add_map(const char *name, int instance_id, bool usebasename)
 	}	
 
 	// Reallocate cells
-	num_cell = map[im].xs * map[im].ys;
-	CREATE( map[im].cell, struct mapcell, num_cell );
-	memcpy( map[im].cell, map[m].cell, num_cell * sizeof(struct mapcell) );
+	map_alloccells(&map[im]);
+	memcpy( map[im].cell, map[m].cell, CELLPLANE_SKILLUNIT * map[im].cell_planesize * sizeof(uint32) ); // no skill units yet
 
-	size = map[im].bxs * map[im].bys * sizeof(struct block_list*);
-	map[im].block = (struct block_list**)aCalloc(size, 1);
-	map[im].block_mob = (struct block_list**)aCalloc(size, 1);
+	size = map[im].bxs * map[im].bys * sizeof(struct map_block);
+	map[im].block = (struct map_block*)aCalloc(size, 1);
+	map[im].block_mob = (struct map_block*)aCalloc(size, 1);
 
 	memset(map[im].npc, 0x00, sizeof(map[i].npc));
 	map[im].npc_num = 0;
@@ -277,9 +276,8 @@ void instance_del_map(int m)
 	mapindex_removemap( map[m].index );
 
 	// Free memory
-	aFree(map[m].cell);
-	aFree(map[m].block);
-	aFree(map[m].block_mob);
+	map_freecells(&map[m]);
+	map_freemapblocks(m);
 
 	// Remove from instance
 	for( i = 0; i < instance[map[m].instance_id].num_map; i++ )
@@ -10,6 +10,7 @@
 #include "battle.h" // struct battle_config
 #include "script.h" // item script processing
 #include "pc.h"     // W_MUSICAL, W_WHIP
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,72 +28,117 @@ static struct item_group itemgroup_db[MAX_ITEMGROUP];
 
 struct item_data dummy_item; //This is the default dummy item used for non-existant items. [Skotlex]
 
-/*==========================================
- * OŌp
- *------------------------------------------*/
-// name = item alias, so we should find items aliases first. if not found then look for "jname" (full name)
-static int itemdb_searchname_sub(DBKey key,void *data,va_list ap)
+// Item name search index, rebuilt every time the item database is (re)loaded.
+static DBMap* itemdb_name;    // const char* name -> struct item_data* (case-insensitive)
+static DBMap* itemdb_jname;   // const char* jname -> struct item_data* (case-insensitive)
+static DBMap* itemdb_trigram; // int trigram -> struct itemdb_trigram*
+static struct item_data** itemdb_list; // all items, in search order
+static int itemdb_list_count;
+
+/// Sorted list of itemdb_list positions whose name or jname contain a trigram.
+struct itemdb_trigram {
+	int count;
+	int max;
+	int* index;
+};
+
+/// Upper-cased 3-byte sequence used as trigram key (same folding as stristr).
+#define itemdb_trigram_key(s) ( (TOUPPER((s)[0])<<16) | (TOUPPER((s)[1])<<8) | TOUPPER((s)[2]) )
+
+static void itemdb_trigram_add(const char* str, int index)
+{
+	size_t i, len = strlen(str);
+
+	for( i = 0; i + 3 <= len; ++i )
+	{
+		int key = itemdb_trigram_key(str+i);
+		struct itemdb_trigram* tg = (struct itemdb_trigram*)idb_get(itemdb_trigram, key);
+
+		if( tg == NULL )
+		{
+			CREATE(tg, struct itemdb_trigram, 1);
+			idb_put(itemdb_trigram, key, tg);
+		}
+		else if( tg->index[tg->count-1] == index )
+			continue;// already listed for this item
+
+		if( tg->count == tg->max )
+		{
+			tg->max = ( tg->max ? tg->max*2 : 8 );
+			RECREATE(tg->index, int, tg->max);
+		}
+		tg->index[tg->count++] = index;
+	}
+}
+
+static int itemdb_trigram_free(DBKey key, void* data, va_list ap)
 {
-	struct item_data *item=(struct item_data *)data,**dst,**dst2;
-	char *str;
-	str=va_arg(ap,char *);
-	dst=va_arg(ap,struct item_data **);
-	dst2=va_arg(ap,struct item_data **);
-	if(item == &dummy_item) return 0;
-
-	//Absolute priority to Aegis code name.
-	if (*dst != NULL) return 0;
-	if( strcmpi(item->name,str)==0 )
-		*dst=item;
-
-	//Second priority to Client displayed name.
-	if (*dst2 != NULL) return 0;
-	if( strcmpi(item->jname,str)==0 )
-		*dst2=item;
+	struct itemdb_trigram* tg = (struct itemdb_trigram*)data;
+	aFree(tg->index);
+	aFree(tg);
 	return 0;
 }
 
-/*==========================================
- * OŌ
- *------------------------------------------*/
-struct item_data* itemdb_searchname(const char *str)
+/// Indexes one item for name searches.
+static void itemdb_nameindex_add(struct item_data* item)
 {
-	struct item_data* item;
-	struct item_data* item2=NULL;
-	int i;
+	// Absolute priority to Aegis code name, lowest item id wins.
+	if( strdb_get(itemdb_name, item->name) == NULL )
+		strdb_put(itemdb_name, item->name, item);
 
-	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
-	{
-		item = itemdb_array[i];
-		if( item == NULL )
-			continue;
+	// Second priority to Client displayed name, highest item id in itemdb_array wins.
+	if( item->nameid < MAX_ITEMDB || strdb_get(itemdb_jname, item->jname) == NULL )
+		strdb_put(itemdb_jname, item->jname, item);
 
-		// Absolute priority to Aegis code name.
-		if( strcasecmp(item->name,str) == 0 )
-			return item;
+	itemdb_trigram_add(item->name, itemdb_list_count);
+	itemdb_trigram_add(item->jname, itemdb_list_count);
+	itemdb_list[itemdb_list_count++] = item;
+}
 
-		//Second priority to Client displayed name.
-		if( strcasecmp(item->jname,str) == 0 )
-			item2 = item;
-	}
+/// Clears the name search index.
+static void itemdb_nameindex_clear(void)
+{
+	db_clear(itemdb_name);
+	db_clear(itemdb_jname);
+	itemdb_trigram->clear(itemdb_trigram, itemdb_trigram_free);
+	aFree(itemdb_list);
+	itemdb_list = NULL;
+	itemdb_list_count = 0;
+}
+
+/// (Re)builds the name search index from the loaded items.
+/// Items are indexed in the order the old linear search visited them.
+static void itemdb_nameindex_build(void)
+{
+	DBIterator* iter;
+	struct item_data* item;
+	int i;
+
+	itemdb_nameindex_clear();
+	CREATE(itemdb_list, struct item_data*, MAX_ITEMDB + itemdb_other->size(itemdb_other));
 
-	item = NULL;
-	itemdb_other->foreach(itemdb_other,itemdb_searchname_sub,str,&item,&item2);
-	return item?item:item2;
+	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+		if( itemdb_array[i] != NULL )
+			itemdb_nameindex_add(itemdb_array[i]);
+
+	iter = db_iterator(itemdb_other);
+	for( item = (struct item_data*)dbi_first(iter); dbi_exists(iter); item = (struct item_data*)dbi_next(iter) )
+		if( item != &dummy_item )
+			itemdb_nameindex_add(item);
+	dbi_destroy(iter);
 }
 
-static int itemdb_searchname_array_sub(DBKey key,void * data,va_list ap)
+/*==========================================
+ * OŌ
+ *------------------------------------------*/
+// name = item alias, so we should find items aliases first. if not found then look for "jname" (full name)
+struct item_data* itemdb_searchname(const char *str)
 {
-	struct item_data *item=(struct item_data *)data;
-	char *str;
-	str=va_arg(ap,char *);
-	if (item == &dummy_item)
-		return 1; //Invalid item.
-	if(stristr(item->jname,str))
-		return 0;
-	if(stristr(item->name,str))
-		return 0;
-	return strcmpi(item->jname,str);
+	struct item_data* item;
+
+	if( (item = (struct item_data*)strdb_get(itemdb_name, str)) != NULL )
+		return item;
+	return (struct item_data*)strdb_get(itemdb_jname, str);
 }
 
 /*==========================================
@@ -100,17 +146,38 @@ static int itemdb_searchname_array_sub(DBKey key,void * data,va_list ap)
  *------------------------------------------*/
 int itemdb_searchname_array(struct item_data** data, int size, const char *str)
 {
-	struct item_data* item;
-	int i;
-	int count=0;
+	struct itemdb_trigram* tg = NULL;
+	size_t i, len = strlen(str);
+	int count = 0;
 
-	// Search in the array
-	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+	// candidates are the items listed for the rarest trigram of str
+	for( i = 0; i + 3 <= len; ++i )
 	{
-		item = itemdb_array[i];
-		if( item == NULL )
-			continue;
+		struct itemdb_trigram* tmp = (struct itemdb_trigram*)idb_get(itemdb_trigram, itemdb_trigram_key(str+i));
+		if( tmp == NULL )
+			return 0;// no item contains this part of str
+		if( tg == NULL || tmp->count < tg->count )
+			tg = tmp;
+	}
+
+	if( tg == NULL )
+	{// too short for the trigram index
+		for( i = 0; i < (size_t)itemdb_list_count; ++i )
+		{
+			struct item_data* item = itemdb_list[i];
+			if( stristr(item->jname,str) || stristr(item->name,str) )
+			{
+				if( count < size )
+					data[count] = item;
+				++count;
+			}
+		}
+		return count;
+	}
 
+	for( i = 0; i < (size_t)tg->count; ++i )
+	{
+		struct item_data* item = itemdb_list[tg->index[i]];
 		if( stristr(item->jname,str) || stristr(item->name,str) )
 		{
 			if( count < size )
@@ -118,19 +185,7 @@ int itemdb_searchname_array(struct item_data** data, int size, const char *str)
 			++count;
 		}
 	}
-
-	// search in the db
-	if( count >= size )
-	{
-		data = NULL;
-		size = 0;
-	}
-	else
-	{
-		data -= count;
-		size -= count;
-	}
-	return count + itemdb_other->getall(itemdb_other,(void**)data,size,itemdb_searchname_array_sub,str);
+	return count;
 }
 
 
@@ -511,6 +566,7 @@ static void itemdb_read_itemgroup_sub(const char* filename)
 	char *str[3],*p;
 	char w1[1024], w2[1024];
 	
+	snapshot_addsource(filename);
 	if( (fp=fopen(filename,"r"))==NULL ){
 		ShowError("can't read %s\n", filename);
 		return;
@@ -847,6 +903,7 @@ static int itemdb_readdb(void)
 		FILE* fp;
 
 		sprintf(path, "%s/%s", db_path, filename[fi]);
+		snapshot_addsource(path);
 		fp = fopen(path, "r");
 		if( fp == NULL )
 		{
@@ -989,24 +1046,280 @@ static int itemdb_read_sqldb(void)
 }
 #endif /* not TXT_ONLY */
 
+/// Returns the number of loaded items.
+static int itemdb_count(void)
+{
+	DBIterator* iter;
+	struct item_data* id;
+	int count = 0, i;
+
+	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+		if( itemdb_array[i] != NULL )
+			++count;
+	iter = db_iterator(itemdb_other);
+	for( id = (struct item_data*)dbi_first(iter); dbi_exists(iter); id = (struct item_data*)dbi_next(iter) )
+		if( id != &dummy_item )
+			++count;
+	dbi_destroy(iter);
+
+	return count;
+}
+
+static const struct snapshot_field itemdb_snapshot_fields[] = {
+	SNAPSHOT_FIELD(struct item_data, nameid),
+	SNAPSHOT_FIELD(struct item_data, name),
+	SNAPSHOT_FIELD(struct item_data, jname),
+	SNAPSHOT_FIELD(struct item_data, value_buy),
+	SNAPSHOT_FIELD(struct item_data, value_sell),
+	SNAPSHOT_FIELD(struct item_data, type),
+	SNAPSHOT_FIELD(struct item_data, maxchance),
+	SNAPSHOT_FIELD(struct item_data, sex),
+	SNAPSHOT_FIELD(struct item_data, equip),
+	SNAPSHOT_FIELD(struct item_data, weight),
+	SNAPSHOT_FIELD(struct item_data, atk),
+	SNAPSHOT_FIELD(struct item_data, def),
+	SNAPSHOT_FIELD(struct item_data, range),
+	SNAPSHOT_FIELD(struct item_data, slot),
+	SNAPSHOT_FIELD(struct item_data, look),
+	SNAPSHOT_FIELD(struct item_data, elv),
+	SNAPSHOT_FIELD(struct item_data, wlv),
+	SNAPSHOT_FIELD(struct item_data, view_id),
+	SNAPSHOT_FIELD(struct item_data, delay),
+	SNAPSHOT_FIELD(struct item_data, class_base),
+	SNAPSHOT_FIELD(struct item_data, mob),
+	SNAPSHOT_FIELD(struct item_data, flag),
+	SNAPSHOT_FIELD(struct item_data, gm_lv_trade_override),
+};
+
+/// Stores one item of the db snapshot, scripts are stored separately.
+static void itemdb_snapshot_item(struct snapshot* s, struct item_data* id)
+{
+	struct item_data tmp;
+	char label[32];
+	int class_upper;
+
+	snprintf(label, sizeof(label), "item_db[%d]", id->nameid);
+	memcpy(&tmp, id, sizeof(tmp));
+	tmp.script = tmp.equip_script = tmp.unequip_script = NULL;
+	class_upper = id->class_upper;
+
+	snapshot_structs(s, label, &tmp, sizeof(tmp), 1, itemdb_snapshot_fields, ARRAYLENGTH(itemdb_snapshot_fields));
+	snprintf(label, sizeof(label), "item_db[%d].class_upper", id->nameid);
+	snapshot_int(s, label, &class_upper);
+
+	if( s->op == SNAPSHOT_READ )
+	{
+		tmp.class_upper = class_upper;
+		memcpy(id, &tmp, sizeof(tmp));
+	}
+	snapshot_script(s, "item script", id->nameid, &id->script);
+	snapshot_script(s, "item equip script", id->nameid, &id->equip_script);
+	snapshot_script(s, "item unequip script", id->nameid, &id->unequip_script);
+}
+
+/// Reads, writes or checks the items in the db snapshot.
+static void itemdb_snapshot(struct snapshot* s)
+{
+	struct item_data* id;
+	int count = 0, i;
+
+	if( s->op != SNAPSHOT_READ )
+		count = itemdb_count();
+
+	i = snapshot_key(s, "count", count);
+	if( s->op == SNAPSHOT_CHECK && i != count )
+		snapshot_mismatch(s, "item count: snapshot %d, text %d", i, count);
+
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		DBIterator* iter;
+
+		for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+		{
+			if( itemdb_array[i] == NULL )
+				continue;
+			snapshot_key(s, "nameid", i);
+			itemdb_snapshot_item(s, itemdb_array[i]);
+		}
+		iter = db_iterator(itemdb_other);
+		for( id = (struct item_data*)dbi_first(iter); dbi_exists(iter); id = (struct item_data*)dbi_next(iter) )
+		{
+			if( id == &dummy_item )
+				continue;
+			snapshot_key(s, "nameid", id->nameid);
+			itemdb_snapshot_item(s, id);
+		}
+		dbi_destroy(iter);
+	}
+	else
+	{
+		for( count = i, i = 0; i < count && !s->failed; ++i )
+		{
+			int nameid = snapshot_key(s, "nameid", 0);
+
+			if( s->op == SNAPSHOT_READ )
+				id = itemdb_load(nameid);
+			else if( (id = itemdb_exists(nameid)) == NULL )
+			{
+				static struct item_data missing;
+
+				snapshot_mismatch(s, "item %d is not in the text files", nameid);
+				memset(&missing, 0, sizeof(missing));
+				missing.nameid = nameid;
+				id = &missing;
+			}
+			itemdb_snapshot_item(s, id);
+		}
+	}
+
+	snapshot_structs(s, "item_group", itemgroup_db, sizeof(itemgroup_db[0]), ARRAYLENGTH(itemgroup_db), NULL, 0);
+}
+
+/// Stores the monster drop information of one item.
+static void itemdb_snapshot_item_drops(struct snapshot* s, struct item_data* id)
+{
+	char label[32];
+
+	snprintf(label, sizeof(label), "item_db[%d].maxchance", id->nameid);
+	snapshot_int(s, label, &id->maxchance);
+	snprintf(label, sizeof(label), "item_db[%d].mob", id->nameid);
+	snapshot_array(s, label, id->mob, sizeof(id->mob[0]), ARRAYLENGTH(id->mob));
+}
+
+/// Reads, writes or checks the monster drop information of the items in the db snapshot.
+/// Set while loading the mob db, so it's stored with it.
+void itemdb_snapshot_drops(struct snapshot* s)
+{
+	int count = 0, i;
+
+	if( s->op != SNAPSHOT_READ )
+		count = itemdb_count();
+
+	i = snapshot_key(s, "count", count);
+	if( s->op == SNAPSHOT_CHECK && i != count )
+		snapshot_mismatch(s, "item count: snapshot %d, text %d", i, count);
+
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		DBIterator* iter;
+		struct item_data* id;
+
+		for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+		{
+			if( (id = itemdb_array[i]) == NULL )
+				continue;
+			snapshot_key(s, "nameid", id->nameid);
+			itemdb_snapshot_item_drops(s, id);
+		}
+		iter = db_iterator(itemdb_other);
+		for( id = (struct item_data*)dbi_first(iter); dbi_exists(iter); id = (struct item_data*)dbi_next(iter) )
+		{
+			if( id == &dummy_item )
+				continue;
+			snapshot_key(s, "nameid", id->nameid);
+			itemdb_snapshot_item_drops(s, id);
+		}
+		dbi_destroy(iter);
+	}
+	else
+	{
+		for( count = i, i = 0; i < count && !s->failed; ++i )
+		{
+			int nameid = snapshot_key(s, "nameid", 0);
+			struct item_data* id = itemdb_exists(nameid);
+
+			if( id == NULL )
+			{
+				static struct item_data missing;
+
+				if( s->op == SNAPSHOT_READ )
+				{
+					s->failed = true;
+					break;
+				}
+				snapshot_mismatch(s, "item %d is not in the text files", nameid);
+				memset(&missing, 0, sizeof(missing));
+				missing.nameid = nameid;
+				id = &missing;
+			}
+			itemdb_snapshot_item_drops(s, id);
+		}
+	}
+
+	// the dummy item gets the drops of unknown items
+	snapshot_int(s, "dummy_item.nameid", &dummy_item.nameid);
+	snapshot_int(s, "dummy_item.maxchance", &dummy_item.maxchance);
+	snapshot_array(s, "dummy_item.mob", dummy_item.mob, sizeof(dummy_item.mob[0]), ARRAYLENGTH(dummy_item.mob));
+}
+
+/// Clears the monster drop information of all items.
+void itemdb_clear_drops(void)
+{
+	DBIterator* iter;
+	struct item_data* id;
+	int i;
+
+	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
+	{
+		if( (id = itemdb_array[i]) == NULL )
+			continue;
+		id->maxchance = 0;
+		memset(id->mob, 0, sizeof(id->mob));
+	}
+	iter = db_iterator(itemdb_other);
+	for( id = (struct item_data*)dbi_first(iter); dbi_exists(iter); id = (struct item_data*)dbi_next(iter) )
+	{
+		id->maxchance = 0;
+		memset(id->mob, 0, sizeof(id->mob));
+	}
+	dbi_destroy(iter);
+	dummy_item.maxchance = 0;
+	memset(dummy_item.mob, 0, sizeof(dummy_item.mob));
+}
+
+static void itemdb_clear(void);
+
 /*====================================
  * read all item-related databases
  *------------------------------------*/
 static void itemdb_read(void)
 {
+	struct snapshot* s = NULL;
+
 #ifndef TXT_ONLY
 	if (db_use_sqldbs)
 		itemdb_read_sqldb();
 	else
 #endif
+	{
+		if( (s = snapshot_open(SNAPSHOT_ITEMDB)) != NULL )
+		{
+			itemdb_snapshot(s);
+			if( snapshot_close(s) )
+			{
+				itemdb_nameindex_build();
+				return;
+			}
+			itemdb_clear();
+		}
+		s = snapshot_create(SNAPSHOT_ITEMDB);
 		itemdb_readdb();
+	}
 
 	itemdb_read_itemgroup();
-	sv_readdb(db_path, "item_avail.txt",   ',', 2, 2, -1,             &itemdb_read_itemavail);
-	sv_readdb(db_path, "item_noequip.txt", ',', 2, 2, -1,             &itemdb_read_noequip);
-	sv_readdb(db_path, "item_trade.txt",   ',', 3, 3, -1,             &itemdb_read_itemtrade);
-	sv_readdb(db_path, "item_delay.txt",   ',', 2, 2, MAX_ITEMDELAYS, &itemdb_read_itemdelay);
-	sv_readdb(db_path, "item_buyingstore.txt", ',', 1, 1, -1,         &itemdb_read_buyingstore);
+	snapshot_readdb(db_path, "item_avail.txt",   ',', 2, 2, -1,             &itemdb_read_itemavail);
+	snapshot_readdb(db_path, "item_noequip.txt", ',', 2, 2, -1,             &itemdb_read_noequip);
+	snapshot_readdb(db_path, "item_trade.txt",   ',', 3, 3, -1,             &itemdb_read_itemtrade);
+	snapshot_readdb(db_path, "item_delay.txt",   ',', 2, 2, MAX_ITEMDELAYS, &itemdb_read_itemdelay);
+	snapshot_readdb(db_path, "item_buyingstore.txt", ',', 1, 1, -1,         &itemdb_read_buyingstore);
+
+	if( s != NULL )
+	{
+		itemdb_snapshot(s);
+		snapshot_close(s);
+	}
+
+	itemdb_nameindex_build();
 }
 
 /*==========================================
@@ -1044,14 +1357,12 @@ static int itemdb_final_sub(DBKey key,void *data,va_list ap)
 	return 0;
 }
 
-void itemdb_reload(void)
+/// Removes all items.
+static void itemdb_clear(void)
 {
-	struct s_mapiterator* iter;
-	struct map_session_data* sd;
-
 	int i;
 
-	// clear the previous itemdb data
+	itemdb_nameindex_clear();
 	for( i = 0; i < ARRAYLENGTH(itemdb_array); ++i )
 		if( itemdb_array[i] )
 			destroy_item_data(itemdb_array[i], 1);
@@ -1059,6 +1370,15 @@ void itemdb_reload(void)
 	itemdb_other->clear(itemdb_other, itemdb_final_sub);
 
 	memset(itemdb_array, 0, sizeof(itemdb_array));
+}
+
+void itemdb_reload(void)
+{
+	struct s_mapiterator* iter;
+	struct map_session_data* sd;
+
+	// clear the previous itemdb data
+	itemdb_clear();
 
 	// read new data
 	itemdb_read();
@@ -1081,6 +1401,11 @@ void do_final_itemdb(void)
 		if( itemdb_array[i] )
 			destroy_item_data(itemdb_array[i], 1);
 
+	itemdb_nameindex_clear();
+	db_destroy(itemdb_name);
+	db_destroy(itemdb_jname);
+	db_destroy(itemdb_trigram);
+
 	itemdb_other->destroy(itemdb_other, itemdb_final_sub);
 	destroy_item_data(&dummy_item, 0);
 }
@@ -1089,6 +1414,9 @@ int do_init_itemdb(void)
 {
 	memset(itemdb_array, 0, sizeof(itemdb_array));
 	itemdb_other = idb_alloc(DB_OPT_BASE); 
+	itemdb_name = stridb_alloc(DB_OPT_BASE, 0);
+	itemdb_jname = stridb_alloc(DB_OPT_BASE, 0);
+	itemdb_trigram = idb_alloc(DB_OPT_BASE);
 	create_dummy_data(); //Dummy data item.
 	itemdb_read();
 
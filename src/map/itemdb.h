@@ -144,6 +144,10 @@ int itemdb_isidentified(int);
 int itemdb_isstackable(int);
 int itemdb_isstackable2(struct item_data *);
 
+struct snapshot;
+void itemdb_snapshot_drops(struct snapshot* s);
+void itemdb_clear_drops(void);
+
 void itemdb_reload(void);
 
 void do_final_itemdb(void);
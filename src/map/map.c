@@ -32,6 +32,8 @@
 #include "party.h"
 #include "unit.h"
 #include "battle.h"
+#include "battle_bench.h"
+#include "shard.h"
 #include "battleground.h"
 #include "quest.h"
 #include "script.h"
@@ -43,6 +45,8 @@
 #include "mercenary.h"
 #include "atcommand.h"
 #include "log.h"
+#include "searchstore.h"
+#include "snapshot.h"
 #ifndef TXT_ONLY
 #include "mail.h"
 #endif
@@ -102,7 +106,7 @@ static DBMap* bossid_db=NULL; // int id -> struct mob_data* (MVP db)
 static DBMap* map_db=NULL; // unsigned int mapindex -> struct map_data*
 static DBMap* nick_db=NULL; // int char_id -> struct charid2nick* (requested names of offline characters)
 static DBMap* charid_db=NULL; // int char_id -> struct map_session_data*
-static DBMap* regen_db=NULL; // int id -> struct block_list* (status_natural_heal processing)
+static DBMap* regen_db=NULL; // int id -> position+1 in regen_list
 
 static int map_users=0;
 
@@ -110,9 +114,11 @@ static int map_users=0;
 struct block_list *block_free[block_free_max];
 static int block_free_count = 0, block_free_lock = 0;
 
-#define BL_LIST_MAX 1048576
-static struct block_list *bl_list[BL_LIST_MAX];
-static int bl_list_count = 0;
+static struct block_list** bl_list = NULL; // matches of the area queries in progress (see map_query_*)
+static int bl_list_count = 0, bl_list_max = 0;
+
+static struct block_list** regen_list = NULL; // units with natural regen, packed (status_natural_heal processing)
+static int regen_count = 0, regen_max = 0;
 
 struct map_data map[MAX_MAP_PER_SERVER];
 int map_num = 0;
@@ -269,7 +275,7 @@ static void map_addblcell(struct block_list *bl)
 {
 	if( bl->m<0 || bl->x<0 || bl->x>=map[bl->m].xs || bl->y<0 || bl->y>=map[bl->m].ys || !(bl->type&BL_CHAR) )
 		return;
-	map[bl->m].cell[bl->x+bl->y*map[bl->m].xs].cell_bl++;
+	map[bl->m].cell_bl[bl->x+bl->y*map[bl->m].xs]++;
 	return;
 }
 
@@ -277,17 +283,57 @@ static void map_delblcell(struct block_list *bl)
 {
 	if( bl->m <0 || bl->x<0 || bl->x>=map[bl->m].xs || bl->y<0 || bl->y>=map[bl->m].ys || !(bl->type&BL_CHAR) )
 		return;
-	map[bl->m].cell[bl->x+bl->y*map[bl->m].xs].cell_bl--;
+	map[bl->m].cell_bl[bl->x+bl->y*map[bl->m].xs]--;
 }
 #endif
 
+/// Iterates over the entries of a map block.
+#define map_block_foreach(e,b) for( (e) = (b)->entry; (e) < (b)->entry + (b)->count; ++(e) )
+
+/// Returns the map block that holds (or would hold) the object.
+static struct map_block* map_getblock(struct block_list* bl)
+{
+	int pos = bl->x/BLOCK_SIZE+(bl->y/BLOCK_SIZE)*map[bl->m].bxs;
+
+	if( bl->type == BL_MOB )
+		return &map[bl->m].block_mob[pos];
+	else
+		return &map[bl->m].block[pos];
+}
+
+/*==========================================
+ * Keep the skill unit plane up to date, so cell queries
+ * can skip the map block when there are no skill units on the cell.
+ *------------------------------------------*/
+static void map_addskillcell(struct block_list* bl)
+{
+	if( bl->type != BL_SKILL )
+		return;
+	*map_cellword(&map[bl->m], CELLPLANE_SKILLUNIT, bl->x, bl->y) |= 1u<<(bl->x&31);
+}
+
+/// Must be called before the entry of the unit is removed from the block or moved.
+static void map_delskillcell(struct block_list* bl)
+{
+	struct block_entry* e;
+
+	if( bl->type != BL_SKILL )
+		return;
+	map_block_foreach( e, map_getblock(bl) )
+		if( e->type == BL_SKILL && e->bl != bl && e->x == bl->x && e->y == bl->y )
+			return;// another unit on the same cell
+	*map_cellword(&map[bl->m], CELLPLANE_SKILLUNIT, bl->x, bl->y) &= ~(1u<<(bl->x&31));
+}
+
 /*==========================================
  * Adds a block to the map.
  * Returns 0 on success, 1 on failure (illegal coordinates).
  *------------------------------------------*/
 int map_addblock(struct block_list* bl)
 {
-	int m, x, y, pos;
+	int m, x, y;
+	struct map_block* b;
+	struct block_entry* e;
 
 	nullpo_ret(bl);
 
@@ -310,20 +356,24 @@ int map_addblock(struct block_list* bl)
 		return 1;
 	}
 
-	pos = x/BLOCK_SIZE+(y/BLOCK_SIZE)*map[m].bxs;
-
-	if (bl->type == BL_MOB) {
-		bl->next = map[m].block_mob[pos];
-		bl->prev = &bl_head;
-		if (bl->next) bl->next->prev = bl;
-		map[m].block_mob[pos] = bl;
-	} else {
-		bl->next = map[m].block[pos];
-		bl->prev = &bl_head;
-		if (bl->next) bl->next->prev = bl;
-		map[m].block[pos] = bl;
+	b = map_getblock(bl);
+	if( b->count == b->max )
+	{
+		b->max = ( b->max ? 2*b->max : 4 );
+		RECREATE(b->entry, struct block_entry, b->max);
 	}
 
+	e = &b->entry[b->count];
+	e->bl = bl;
+	e->id = bl->id;
+	e->x = x;
+	e->y = y;
+	e->type = bl->type;
+
+	bl->blockidx = b->count++;
+	bl->prev = &bl_head;
+
+	map_addskillcell(bl);
 #ifdef CELL_NOSTACK
 	map_addblcell(bl);
 #endif
@@ -336,37 +386,38 @@ int map_addblock(struct block_list* bl)
  *------------------------------------------*/
 int map_delblock(struct block_list* bl)
 {
-	int pos;
+	struct map_block* b;
+	int i;
 	nullpo_ret(bl);
 
-	// ?blocklist?Ă
-	if (bl->prev == NULL) {
-		if (bl->next != NULL) {
-			// prevNULLnextNULLłȂ̂͗LĂ͂ȂȂ
-			ShowError("map_delblock error : bl->next!=NULL\n");
-		}
+	// not on a map
+	if (bl->prev == NULL)
 		return 0;
-	}
 
+	map_delskillcell(bl);
 #ifdef CELL_NOSTACK
 	map_delblcell(bl);
 #endif
 	
-	pos = bl->x/BLOCK_SIZE+(bl->y/BLOCK_SIZE)*map[bl->m].bxs;
-
-	if (bl->next)
-		bl->next->prev = bl->prev;
-	if (bl->prev == &bl_head) {
-		// Xg̓Ȃ̂ŁAmap[]block_listXV
-		if (bl->type == BL_MOB) {
-			map[bl->m].block_mob[pos] = bl->next;
-		} else {
-			map[bl->m].block[pos] = bl->next;
+	b = map_getblock(bl);
+	i = bl->blockidx;
+	if( i < 0 || i >= b->count || b->entry[i].bl != bl )
+	{
+		ShowError("map_delblock: object %d is not in its map block (\"%s\",%d,%d)\n", bl->id, map[bl->m].name, bl->x, bl->y);
+		ARR_FIND(0, b->count, i, b->entry[i].bl == bl);
+		if( i == b->count )
+		{
+			bl->prev = NULL;
+			return 0;
 		}
-	} else {
-		bl->prev->next = bl->next;
 	}
-	bl->next = NULL;
+
+	// swap the last entry into the freed slot
+	if( i != --b->count )
+	{
+		b->entry[i] = b->entry[b->count];
+		b->entry[i].bl->blockidx = i;
+	}
 	bl->prev = NULL;
 
 	return 0;
@@ -403,15 +454,31 @@ int map_moveblock(struct block_list *bl, int x1, int y1, unsigned int tick)
 		npc_unsetcells((TBL_NPC*)bl);
 
 	if (moveblock) map_delblock(bl);
+	else
+	{
+		map_delskillcell(bl);
 #ifdef CELL_NOSTACK
-	else map_delblcell(bl);
+		map_delblcell(bl);
 #endif
+	}
 	bl->x = x1;
 	bl->y = y1;
 	if (moveblock) map_addblock(bl);
+	else
+	{	// same block, only the cached coordinates change
+		struct block_entry* e = &map_getblock(bl)->entry[bl->blockidx];
+		e->x = x1;
+		e->y = y1;
+		map_addskillcell(bl);
 #ifdef CELL_NOSTACK
-	else map_addblcell(bl);
+		map_addblcell(bl);
 #endif
+	}
+
+	if (bl->type == BL_PC) {// minimap positions
+		party_send_xy_mark((TBL_PC*)bl);
+		guild_send_xy_mark((TBL_PC*)bl);
+	}
 
 	if (bl->type&BL_CHAR) {
 		skill_unit_move(bl,tick,3);
@@ -432,6 +499,29 @@ int map_moveblock(struct block_list *bl, int x1, int y1, unsigned int tick)
 
 	return 0;
 }
+
+/*==========================================
+ * Frees the blocks of a map and the entries they hold.
+ *------------------------------------------*/
+void map_freemapblocks(int m)
+{
+	int i;
+
+	if( map[m].block )
+	{
+		for( i = 0; i < map[m].bxs*map[m].bys; i++ )
+			aFree(map[m].block[i].entry);
+		aFree(map[m].block);
+		map[m].block = NULL;
+	}
+	if( map[m].block_mob )
+	{
+		for( i = 0; i < map[m].bxs*map[m].bys; i++ )
+			aFree(map[m].block_mob[i].entry);
+		aFree(map[m].block_mob);
+		map[m].block_mob = NULL;
+	}
+}
 	
 /*==========================================
  * Counts specified number of objects on given cell.
@@ -439,7 +529,7 @@ int map_moveblock(struct block_list *bl, int x1, int y1, unsigned int tick)
 int map_count_oncell(int m, int x, int y, int type)
 {
 	int bx,by;
-	struct block_list *bl;
+	struct block_entry *e;
 	int count = 0;
 
 	if (x < 0 || y < 0 || (x >= map[m].xs) || (y >= map[m].ys))
@@ -449,13 +539,13 @@ int map_count_oncell(int m, int x, int y, int type)
 	by = y/BLOCK_SIZE;
 
 	if (type&~BL_MOB)
-		for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->x == x && bl->y == y && bl->type&type)
+		map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
+			if(e->x == x && e->y == y && e->type&type)
 				count++;
 	
 	if (type&BL_MOB)
-		for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->x == x && bl->y == y)
+		map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
+			if(e->x == x && e->y == y)
 				count++;
 
 	return count;
@@ -466,22 +556,24 @@ int map_count_oncell(int m, int x, int y, int type)
 struct skill_unit* map_find_skill_unit_oncell(struct block_list* target,int x,int y,int skill_id,struct skill_unit* out_unit)
 {
 	int m,bx,by;
-	struct block_list *bl;
+	struct block_entry *e;
 	struct skill_unit *unit;
 	m = target->m;
 
 	if (x < 0 || y < 0 || (x >= map[m].xs) || (y >= map[m].ys))
 		return NULL;
+	if( !map_cellbit(&map[m], CELLPLANE_SKILLUNIT, x, y) )
+		return NULL;
 
 	bx = x/BLOCK_SIZE;
 	by = y/BLOCK_SIZE;
 
-	for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+	map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 	{
-		if (bl->x != x || bl->y != y || bl->type != BL_SKILL)
+		if (e->x != x || e->y != y || e->type != BL_SKILL)
 			continue;
 
-		unit = (struct skill_unit *) bl;
+		unit = (struct skill_unit *) e->bl;
 		if( unit == out_unit || !unit->alive || !unit->group || unit->group->skill_id != skill_id )
 			continue;
 		if( battle_check_target(&unit->bl,target,unit->group->target_flag) > 0 )
@@ -490,17 +582,71 @@ struct skill_unit* map_find_skill_unit_oncell(struct block_list* target,int x,in
 	return NULL;
 }
 
+/*==========================================
+ * Area queries.
+ * Matches are collected on a shared stack, so queries can be nested
+ * as long as they are ended in reverse order. Objects that leave the
+ * map while the query is being iterated are skipped, and freeing
+ * blocks is deferred until the query ends.
+ *------------------------------------------*/
+
+/// Starts collecting the matches of a query.
+static void map_query_begin(struct s_mapquery* q)
+{
+	q->start = q->pos = q->end = bl_list_count;
+}
+
+/// Adds an object to the matches of the current query.
+static void map_query_push(struct block_list* bl)
+{
+	if( bl_list_count == bl_list_max )
+	{
+		bl_list_max = ( bl_list_max ? 2*bl_list_max : 1024 );
+		RECREATE(bl_list, struct block_list*, bl_list_max);
+	}
+	bl_list[bl_list_count++] = bl;
+}
+
+/// Finishes collecting the matches of a query.
+/// Returns the number of matches.
+static int map_query_done(struct s_mapquery* q)
+{
+	q->end = bl_list_count;
+	map_freeblock_lock();
+	return q->end - q->start;
+}
+
+/// Returns the next match that is still on the map, or NULL when there are no more.
+struct block_list* map_query_next(struct s_mapquery* q)
+{
+	while( q->pos < q->end )
+	{
+		struct block_list* bl = bl_list[q->pos++];
+		if( bl->prev )
+			return bl;
+	}
+	return NULL;
+}
+
+/// Ends a query and releases its matches.
+void map_query_end(struct s_mapquery* q)
+{
+	bl_list_count = q->start;
+	q->pos = q->end = q->start;
+	map_freeblock_unlock();
+}
+
 /*==========================================
  * Adapted from foreachinarea for an easier invocation. [Skotlex]
  *------------------------------------------*/
-int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int type, ...)
+int map_query_inrange(struct s_mapquery* q, struct block_list* center, int range, int type)
 {
 	int bx,by,m;
-	int returnCount =0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
 	int x0,x1,y0,y1;
 
+	map_query_begin(q);
+
 	m = center->m;
 	x0 = max(center->x-range, 0);
 	y0 = max(center->y-range, 0);
@@ -510,67 +656,50 @@ int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_lis
 	if (type&~BL_MOB)
 		for (by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++) {
 			for(bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++) {
-				for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 				{
-					if( bl->type&type
-						&& bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1
+					if( e->type&type
+						&& e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+						&& check_distance_bl(center, e, range)
 #endif
-					  	&& bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
+						)
+						map_query_push(e->bl);
 				}
 			}
 		}
 	if(type&BL_MOB)
 		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++){
 			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++){
-				for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
 				{
-					if( bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1
+					if( e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+						&& check_distance_bl(center, e, range)
 #endif
-						&& bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
+						)
+						map_query_push(e->bl);
 				}
 			}
 		}
 
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinrange: block count too many!\n");
-
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
-
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;	//[Skotlex]
+	return map_query_done(q);
 }
 
 /*==========================================
  * Same as foreachinrange, but there must be a shoot-able range between center and target to be counted in. [Skotlex]
  *------------------------------------------*/
-int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block_list* center, int range, int type,...)
+int map_query_inshootrange(struct s_mapquery* q, struct block_list* center, int range, int type)
 {
 	int bx,by,m;
-	int returnCount =0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
 	int x0,x1,y0,y1;
 
+	map_query_begin(q);
+
 	m = center->m;
 	if (m < 0)
-		return 0;
+		return map_query_done(q);
 
 	x0 = max(center->x-range, 0);
 	y0 = max(center->y-range, 0);
@@ -580,53 +709,34 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
 	if (type&~BL_MOB)
 		for(by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++) {
 			for(bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++) {
-				for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 				{
-					if( bl->type&type
-						&& bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1
+					if( e->type&type
+						&& e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+						&& check_distance_bl(center, e, range)
 #endif
-						&& path_search_long(NULL,center->m,center->x,center->y,bl->x,bl->y,CELL_CHKWALL)
-					  	&& bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
+						&& path_search_long(NULL,center->m,center->x,center->y,e->x,e->y,CELL_CHKWALL))
+						map_query_push(e->bl);
 				}
 			}
 		}
 	if(type&BL_MOB)
 		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++){
 			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++){
-				for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
 				{
-					if( bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1
+					if( e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1
 #ifdef CIRCULAR_AREA
-						&& check_distance_bl(center, bl, range)
+						&& check_distance_bl(center, e, range)
 #endif
-						&& path_search_long(NULL,center->m,center->x,center->y,bl->x,bl->y,CELL_CHKWALL)
-						&& bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
+						&& path_search_long(NULL,center->m,center->x,center->y,e->x,e->y,CELL_CHKWALL))
+						map_query_push(e->bl);
 				}
 			}
 		}
 
-	if(bl_list_count>=BL_LIST_MAX)
-			ShowWarning("map_foreachinrange: block count too many!\n");
-
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
-
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;	//[Skotlex]
+	return map_query_done(q);
 }
 
 /*==========================================
@@ -634,70 +744,15 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
  * funcĂ
  * type!=0 Ȃ炻̎ނ̂
  *------------------------------------------*/
-int map_foreachinarea(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int type, ...)
+int map_query_inarea(struct s_mapquery* q, int m, int x0, int y0, int x1, int y1, int type)
 {
 	int bx,by;
-	int returnCount =0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
 
-	if (m < 0)
-		return 0;
-	if (x1 < x0)
-	{	//Swap range
-		swap(x0, x1);
-	}
-	if (y1 < y0)
-	{
-		swap(y0, y1);
-	}
-	x0 = max(x0, 0);
-	y0 = max(y0, 0);
-	x1 = min(x1, map[m].xs-1);
-	y1 = min(y1, map[m].ys-1);
-	if (type&~BL_MOB)
-		for(by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++)
-			for(bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++)
-				for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-					if(bl->type&type && bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1 && bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
-
-	if(type&BL_MOB)
-		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++)
-			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++)
-				for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-					if(bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1 && bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
-
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinarea: block count too many!\n");
-
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
-
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;	//[Skotlex]
-}
-
-int map_forcountinarea(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int count, int type, ...)
-{
-	int bx,by;
-	int returnCount =0;	//total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	map_query_begin(q);
 
 	if (m < 0)
-		return 0;
+		return map_query_done(q);
 	if (x1 < x0)
 	{	//Swap range
 		swap(x0, x1);
@@ -710,41 +765,21 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int m, int x0, i
 	y0 = max(y0, 0);
 	x1 = min(x1, map[m].xs-1);
 	y1 = min(y1, map[m].ys-1);
-
 	if (type&~BL_MOB)
 		for(by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++)
 			for(bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++)
-				for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-					if(bl->type&type && bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1 && bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
+				map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
+					if(e->type&type && e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1)
+						map_query_push(e->bl);
 
 	if(type&BL_MOB)
 		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++)
 			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++)
-				for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-					if(bl->x>=x0 && bl->x<=x1 && bl->y>=y0 && bl->y<=y1 && bl_list_count<BL_LIST_MAX)
-						bl_list[bl_list_count++]=bl;
-
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinarea: block count too many!\n");
+				map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
+					if(e->x>=x0 && e->x<=x1 && e->y>=y0 && e->y<=y1)
+						map_query_push(e->bl);
 
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-			if( count && returnCount >= count )
-				break;
-		}
-
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;	//[Skotlex]
+	return map_query_done(q);
 }
 
 /*==========================================
@@ -754,16 +789,16 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int m, int x0, i
  *
  * dx,dy-1,0,1݂̂ƂiǂȒlłۂHj
  *------------------------------------------*/
-int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int dx, int dy, int type, ...)
+int map_query_inmovearea(struct s_mapquery* q, struct block_list* center, int range, int dx, int dy, int type)
 {
 	int bx,by,m;
-	int returnCount =0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
 	int x0, x1, y0, y1;
 
-	if (!range) return 0;
-	if (!dx && !dy) return 0; //No movement.
+	map_query_begin(q);
+
+	if (!range) return map_query_done(q);
+	if (!dx && !dy) return map_query_done(q); //No movement.
 	m = center->m;
 
 	x0 = center->x-range;
@@ -799,22 +834,20 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++){
 			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++){
 				if (type&~BL_MOB) {
-					for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+					map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 					{
-						if(bl->type&type &&
-							bl->x>=x0 && bl->x<=x1 &&
-							bl->y>=y0 && bl->y<=y1 &&
-							bl_list_count<BL_LIST_MAX)
-							bl_list[bl_list_count++]=bl;
+						if(e->type&type &&
+							e->x>=x0 && e->x<=x1 &&
+							e->y>=y0 && e->y<=y1)
+							map_query_push(e->bl);
 					}
 				}
 				if (type&BL_MOB) {
-					for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+					map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
 					{
-						if(bl->x>=x0 && bl->x<=x1 &&
-							bl->y>=y0 && bl->y<=y1 &&
-							bl_list_count<BL_LIST_MAX)
-							bl_list[bl_list_count++]=bl;
+						if(e->x>=x0 && e->x<=x1 &&
+							e->y>=y0 && e->y<=y1)
+							map_query_push(e->bl);
 					}
 				}
 			}
@@ -828,30 +861,28 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 		for(by=y0/BLOCK_SIZE;by<=y1/BLOCK_SIZE;by++){
 			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++){
 				if (type & ~BL_MOB) {
-					for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+					map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 					{
-						if( bl->type&type &&
-							bl->x>=x0 && bl->x<=x1 &&
-							bl->y>=y0 && bl->y<=y1 &&
-							bl_list_count<BL_LIST_MAX )
-						if((dx>0 && bl->x<x0+dx) ||
-							(dx<0 && bl->x>x1+dx) ||
-							(dy>0 && bl->y<y0+dy) ||
-							(dy<0 && bl->y>y1+dy))
-							bl_list[bl_list_count++]=bl;
+						if( e->type&type &&
+							e->x>=x0 && e->x<=x1 &&
+							e->y>=y0 && e->y<=y1)
+						if((dx>0 && e->x<x0+dx) ||
+							(dx<0 && e->x>x1+dx) ||
+							(dy>0 && e->y<y0+dy) ||
+							(dy<0 && e->y>y1+dy))
+							map_query_push(e->bl);
 					}
 				}
 				if (type & BL_MOB) {
-					for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+					map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
 					{
-						if( bl->x>=x0 && bl->x<=x1 &&
-							bl->y>=y0 && bl->y<=y1 &&
-							bl_list_count<BL_LIST_MAX)
-						if((dx>0 && bl->x<x0+dx) ||
-							(dx<0 && bl->x>x1+dx) ||
-							(dy>0 && bl->y<y0+dy) ||
-							(dy<0 && bl->y>y1+dy))
-							bl_list[bl_list_count++]=bl;
+						if( e->x>=x0 && e->x<=x1 &&
+							e->y>=y0 && e->y<=y1)
+						if((dx>0 && e->x<x0+dx) ||
+							(dx<0 && e->x>x1+dx) ||
+							(dy>0 && e->y<y0+dy) ||
+							(dy<0 && e->y>y1+dy))
+							map_query_push(e->bl);
 					}
 				}
 			}
@@ -859,78 +890,45 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 
 	}
 
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinmovearea: block count too many!\n");
-
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
-
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;
+	return map_query_done(q);
 }
 
 // -- moonsoul	(added map_foreachincell which is a rework of map_foreachinarea but
 //			 which only checks the exact single x/y passed to it rather than an
 //			 area radius - may be more useful in some instances)
 //
-int map_foreachincell(int (*func)(struct block_list*,va_list), int m, int x, int y, int type, ...)
+int map_query_incell(struct s_mapquery* q, int m, int x, int y, int type)
 {
 	int bx,by;
-	int returnCount =0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
+
+	map_query_begin(q);
 
-	if (x < 0 || y < 0 || x >= map[m].xs || y >= map[m].ys) return 0;
+	if (x < 0 || y < 0 || x >= map[m].xs || y >= map[m].ys) return map_query_done(q);
+	if( type&BL_SKILL && !map_cellbit(&map[m], CELLPLANE_SKILLUNIT, x, y) )
+		type &= ~BL_SKILL; // no skill units on this cell
 
 	by=y/BLOCK_SIZE;
 	bx=x/BLOCK_SIZE;
 
 	if(type&~BL_MOB)
-		for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->type&type && bl->x==x && bl->y==y && bl_list_count<BL_LIST_MAX)
-				bl_list[bl_list_count++]=bl;
+		map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
+			if(e->type&type && e->x==x && e->y==y)
+				map_query_push(e->bl);
 
 	if(type&BL_MOB)
-		for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-			if(bl->x==x && bl->y==y && bl_list_count<BL_LIST_MAX)
-				bl_list[bl_list_count++]=bl;
-
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachincell: block count too many!\n");
-
-	map_freeblock_lock();	// ̉֎~
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
+		map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
+			if(e->x==x && e->y==y)
+				map_query_push(e->bl);
 
-	map_freeblock_unlock();	// 
-
-	bl_list_count = blockcount;
-	return returnCount;
+	return map_query_done(q);
 }
 
 /*============================================================
 * For checking a path between two points (x0, y0) and (x1, y1)
 *------------------------------------------------------------*/
-int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y0,int x1,int y1,int range,int length, int type,...)
+int map_query_inpath(struct s_mapquery* q, int m,int x0,int y0,int x1,int y1,int range,int length, int type)
 {
-	int returnCount =0;  //total sum of returned values of func() [Skotlex]
 //////////////////////////////////////////////////////////////
 //
 // sharp shooting 3 [Skotlex]
@@ -965,8 +963,7 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y
 // kRO.
 
 	//Generic map_foreach* variables.
-	int i, blockcount = bl_list_count;
-	struct block_list *bl;
+	struct block_entry *e;
 	int bx, by;
 	//method specific variables
 	int magnitude2, len_limit; //The square of the magnitude
@@ -975,13 +972,15 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y
 	
 	//Avoid needless calculations by not getting the sqrt right away.
 	#define MAGNITUDE2(x0, y0, x1, y1) (((x1)-(x0))*((x1)-(x0)) + ((y1)-(y0))*((y1)-(y0)))
+
+	map_query_begin(q);
 	
 	if (m < 0)
-		return 0;
+		return map_query_done(q);
 
 	len_limit = magnitude2 = MAGNITUDE2(x0,y0, x1,y1);
 	if (magnitude2 < 1) //Same begin and ending point, can't trace path.
-		return 0;
+		return map_query_done(q);
 
 	if (length)
 	{	//Adjust final position to fit in the given area.
@@ -1029,12 +1028,12 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y
 	if (type & ~BL_MOB)
 		for (by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++) {
 			for(bx=mx0/BLOCK_SIZE;bx<=mx1/BLOCK_SIZE;bx++){
-				for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block[bx+by*map[m].bxs] )
 				{
-					if(bl->prev && bl->type&type && bl_list_count<BL_LIST_MAX)
+					if(e->type&type)
 					{
-						xi = bl->x;
-						yi = bl->y;
+						xi = e->x;
+						yi = e->y;
 					
 						k = (xi-x0)*(x1-x0) + (yi-y0)*(y1-y0);
 						if (k < 0 || k > len_limit) //Since more skills use this, check for ending point as well.
@@ -1056,7 +1055,7 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y
 						if (k > range)
 							continue;
 
-						bl_list[bl_list_count++]=bl;
+						map_query_push(e->bl);
 					}
 				}
 			}
@@ -1065,96 +1064,216 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int m,int x0,int y
 	if(type&BL_MOB)
 		for(by=my0/BLOCK_SIZE;by<=my1/BLOCK_SIZE;by++){
 			for(bx=mx0/BLOCK_SIZE;bx<=mx1/BLOCK_SIZE;bx++){
-				for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+				map_block_foreach( e, &map[m].block_mob[bx+by*map[m].bxs] )
 				{
-					if(bl->prev && bl_list_count<BL_LIST_MAX)
-					{
-						xi = bl->x;
-						yi = bl->y;
-						k = (xi-x0)*(x1-x0) + (yi-y0)*(y1-y0);
-						if (k < 0 || k > len_limit)
-							continue;
-				
-						if (k > magnitude2 && !path_search_long(NULL,m,x0,y0,xi,yi,CELL_CHKWALL))
-							continue; //Targets beyond the initial ending point need the wall check.
-	
-						k = (k<<4)/magnitude2; //k will be between 1~16 instead of 0~1
-						xi<<=4;
-						yi<<=4;
-						xu= (x0<<4) +k*(x1-x0);
-						yu= (y0<<4) +k*(y1-y0);
-						k = MAGNITUDE2(xi, yi, xu, yu);
-						
-						//If all dot coordinates were <<4 the square of the magnitude is <<8
-						if (k > range)
-							continue;
+					xi = e->x;
+					yi = e->y;
+					k = (xi-x0)*(x1-x0) + (yi-y0)*(y1-y0);
+					if (k < 0 || k > len_limit)
+						continue;
+			
+					if (k > magnitude2 && !path_search_long(NULL,m,x0,y0,xi,yi,CELL_CHKWALL))
+						continue; //Targets beyond the initial ending point need the wall check.
+
+					k = (k<<4)/magnitude2; //k will be between 1~16 instead of 0~1
+					xi<<=4;
+					yi<<=4;
+					xu= (x0<<4) +k*(x1-x0);
+					yu= (y0<<4) +k*(y1-y0);
+					k = MAGNITUDE2(xi, yi, xu, yu);
+					
+					//If all dot coordinates were <<4 the square of the magnitude is <<8
+					if (k > range)
+						continue;
 
-						bl_list[bl_list_count++]=bl;
-					}
+					map_query_push(e->bl);
 				}
 			}
 		}
 
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinpath: block count too many!\n");
-
-	map_freeblock_lock();
-
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	//This check is done in case some object gets killed due to further skill processing.
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
-
-	map_freeblock_unlock();
-
-	bl_list_count = blockcount;
-	return returnCount;	//[Skotlex]
-
+	return map_query_done(q);
 }
 
 // Copy of map_foreachincell, but applied to the whole map. [Skotlex]
-int map_foreachinmap(int (*func)(struct block_list*,va_list), int m, int type,...)
+int map_query_inmap(struct s_mapquery* q, int m, int type)
 {
 	int b, bsize;
-	int returnCount =0;  //total sum of returned values of func() [Skotlex]
-	struct block_list *bl;
-	int blockcount=bl_list_count,i;
+	struct block_entry *e;
+
+	map_query_begin(q);
 
 	bsize = map[m].bxs * map[m].bys;
 
 	if(type&~BL_MOB)
 		for(b=0;b<bsize;b++)
-			for( bl = map[m].block[b] ; bl != NULL ; bl = bl->next )
-				if(bl->type&type && bl_list_count<BL_LIST_MAX)
-					bl_list[bl_list_count++]=bl;
+			map_block_foreach( e, &map[m].block[b] )
+				if(e->type&type)
+					map_query_push(e->bl);
 
 	if(type&BL_MOB)
 		for(b=0;b<bsize;b++)
-			for( bl = map[m].block_mob[b] ; bl != NULL ; bl = bl->next )
-				if(bl_list_count<BL_LIST_MAX)
-					bl_list[bl_list_count++]=bl;
+			map_block_foreach( e, &map[m].block_mob[b] )
+				map_query_push(e->bl);
 
-	if(bl_list_count>=BL_LIST_MAX)
-		ShowWarning("map_foreachinmap: block count too many!\n");
+	return map_query_done(q);
+}
 
-	map_freeblock_lock();	// ̉֎~
+/*==========================================
+ * Callback versions of the area queries.
+ * func is called for each match, the sum of the returned values is returned.
+ *------------------------------------------*/
+int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
 
-	for(i=blockcount;i<bl_list_count;i++)
-		if(bl_list[i]->prev)	// L?ǂ`FbN
-		{
-			va_list ap;
-			va_start(ap, type);
-			returnCount += func(bl_list[i], ap);
-			va_end(ap);
-		}
+	map_query_inrange(&q, center, range, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+int map_foreachinshootrange(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inshootrange(&q, center, range, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
 
-	map_freeblock_unlock();	// 
+int map_foreachinarea(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inarea(&q, m, x0, y0, x1, y1, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+/// Same as map_foreachinarea, but stops once the returned values add up to count (0 = no limit).
+int map_forcountinarea(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int count, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inarea(&q, m, x0, y0, x1, y1, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+		if( count && returnCount >= count )
+			break;
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int dx, int dy, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inmovearea(&q, center, range, dx, dy, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+int map_foreachincell(int (*func)(struct block_list*,va_list), int m, int x, int y, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_incell(&q, m, x, y, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+int map_foreachinpath(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int range, int length, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inpath(&q, m, x0, y0, x1, y1, range, length, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
+
+	return returnCount;
+}
+
+int map_foreachinmap(int (*func)(struct block_list*,va_list), int m, int type, ...)
+{
+	struct s_mapquery q;
+	struct block_list* bl;
+	int returnCount = 0;
+
+	map_query_inmap(&q, m, type);
+	map_query_foreach(&q, bl)
+	{
+		va_list ap;
+		va_start(ap, type);
+		returnCount += func(bl, ap);
+		va_end(ap);
+	}
+	map_query_end(&q);
 
-	bl_list_count = blockcount;
 	return returnCount;
 }
 
@@ -1357,7 +1476,7 @@ int map_addflooritem(struct item *item_data,int amount,int m,int x,int y,int fir
 
 	CREATE(fitem, struct flooritem_data, 1);
 	fitem->bl.type=BL_ITEM;
-	fitem->bl.prev = fitem->bl.next = NULL;
+	fitem->bl.prev = NULL;
 	fitem->bl.m=m;
 	fitem->bl.x=x;
 	fitem->bl.y=y;
@@ -1474,6 +1593,42 @@ void map_reqnickdb(struct map_session_data * sd, int charid)
 	chrif_searchcharid(charid);
 }
 
+/// Adds a unit to the packed list of units with natural regen.
+static void map_addregen(struct block_list* bl)
+{
+	int i = (int)(intptr_t)idb_get(regen_db, bl->id);
+
+	if( i > 0 )
+	{// already listed
+		regen_list[i-1] = bl;
+		return;
+	}
+	if( regen_count == regen_max )
+	{
+		regen_max += 256;
+		RECREATE(regen_list, struct block_list*, regen_max);
+	}
+	regen_list[regen_count++] = bl;
+	idb_put(regen_db, bl->id, (void*)(intptr_t)regen_count);
+}
+
+/// Removes a unit from the list of units with natural regen.
+/// The last unit takes its place.
+static void map_delregen(struct block_list* bl)
+{
+	int i = (int)(intptr_t)idb_get(regen_db, bl->id);
+
+	if( i <= 0 )
+		return;// not listed
+	idb_remove(regen_db, bl->id);
+	if( i < regen_count )
+	{
+		regen_list[i-1] = regen_list[regen_count-1];
+		idb_put(regen_db, regen_list[i-1]->id, (void*)(intptr_t)i);
+	}
+	--regen_count;
+}
+
 /*==========================================
  * id_dbblǉ
  *------------------------------------------*/
@@ -1497,7 +1652,7 @@ void map_addiddb(struct block_list *bl)
 	}
 
 	if( bl->type & BL_REGEN )
-		idb_put(regen_db, bl->id, bl);
+		map_addregen(bl);
 
 	idb_put(id_db,bl->id,bl);
 }
@@ -1522,7 +1677,7 @@ void map_deliddb(struct block_list *bl)
 	}
 
 	if( bl->type & BL_REGEN )
-		idb_remove(regen_db,bl->id);
+		map_delregen(bl);
 
 	idb_remove(id_db,bl->id);
 }
@@ -1851,26 +2006,12 @@ void map_foreachnpc(int (*func)(struct npc_data* nd, va_list args), ...)
 	dbi_destroy(iter);
 }
 
-/// Applies func to everything in the db.
-/// Stops iteratin gif func returns -1.
-void map_foreachregen(int (*func)(struct block_list* bl, va_list args), ...)
+/// Returns the units with natural regen, packed in an array.
+/// The array changes when units are added or removed.
+struct block_list** map_getregenlist(int* count)
 {
-	DBIterator* iter;
-	struct block_list* bl;
-
-	iter = db_iterator(regen_db);
-	for( bl = (struct block_list*)dbi_first(iter); dbi_exists(iter); bl = (struct block_list*)dbi_next(iter) )
-	{
-		va_list args;
-		int ret;
-
-		va_start(args, func);
-		ret = func(bl, args);
-		va_end(args);
-		if( ret == -1 )
-			break;// stop iterating
-	}
-	dbi_destroy(iter);
+	*count = regen_count;
+	return regen_list;
 }
 
 /// Applies func to everything in the db.
@@ -2306,37 +2447,85 @@ int map_random_dir(struct block_list *bl, short *x, short *y)
 }
 
 // gatn
-inline static struct mapcell map_gat2cell(int gat)
+/// Sets or clears the bit of a cell in a plane.
+static inline void map_setcellbit(struct map_data* m, enum cell_plane plane, int x, int y, bool flag)
 {
-	struct mapcell cell = {0};
+	if( flag )
+		*map_cellword(m,plane,x,y) |= 1u<<(x&31);
+	else
+		*map_cellword(m,plane,x,y) &= ~(1u<<(x&31));
+}
+
+/// Sets the terrain flags of a cell from a gat type.
+static void map_setcellgat(struct map_data* m, int x, int y, int gat)
+{
+	bool walkable = false, shootable = false, water = false;
+
 	switch( gat )
 	{
-	case 0: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // walkable ground
-	case 1: cell.walkable = 0; cell.shootable = 0; cell.water = 0; break; // non-walkable ground
-	case 2: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
-	case 3: cell.walkable = 1; cell.shootable = 1; cell.water = 1; break; // walkable water
-	case 4: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
-	case 5: cell.walkable = 0; cell.shootable = 1; cell.water = 0; break; // gap (snipable)
-	case 6: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
+	case 0: walkable = true;  shootable = true;  water = false; break; // walkable ground
+	case 1: walkable = false; shootable = false; water = false; break; // non-walkable ground
+	case 2: walkable = true;  shootable = true;  water = false; break; // ???
+	case 3: walkable = true;  shootable = true;  water = true;  break; // walkable water
+	case 4: walkable = true;  shootable = true;  water = false; break; // ???
+	case 5: walkable = false; shootable = true;  water = false; break; // gap (snipable)
+	case 6: walkable = true;  shootable = true;  water = false; break; // ???
 	default:
-		ShowWarning("map_gat2cell: unrecognized gat type '%d'\n", gat);
+		ShowWarning("map_setcellgat: unrecognized gat type '%d'\n", gat);
 		break;
 	}
 
-	return cell;
+	map_setcellbit(m, CELLPLANE_WALKABLE, x, y, walkable);
+	map_setcellbit(m, CELLPLANE_SHOOTABLE, x, y, shootable);
+	map_setcellbit(m, CELLPLANE_WATER, x, y, water);
 }
 
-static int map_cell2gat(struct mapcell cell)
+/// Returns the gat type that matches the terrain flags of a cell.
+static int map_getcellgat(struct map_data* m, int x, int y)
 {
-	if( cell.walkable == 1 && cell.shootable == 1 && cell.water == 0 ) return 0;
-	if( cell.walkable == 0 && cell.shootable == 0 && cell.water == 0 ) return 1;
-	if( cell.walkable == 1 && cell.shootable == 1 && cell.water == 1 ) return 3;
-	if( cell.walkable == 0 && cell.shootable == 1 && cell.water == 0 ) return 5;
+	int walkable = map_cellbit(m,CELLPLANE_WALKABLE,x,y);
+	int shootable = map_cellbit(m,CELLPLANE_SHOOTABLE,x,y);
+	int water = map_cellbit(m,CELLPLANE_WATER,x,y);
 
-	ShowWarning("map_cell2gat: cell has no matching gat type\n");
+	if( walkable == 1 && shootable == 1 && water == 0 ) return 0;
+	if( walkable == 0 && shootable == 0 && water == 0 ) return 1;
+	if( walkable == 1 && shootable == 1 && water == 1 ) return 3;
+	if( walkable == 0 && shootable == 1 && water == 0 ) return 5;
+
+	ShowWarning("map_getcellgat: cell has no matching gat type\n");
 	return 1; // default to 'wall'
 }
 
+/// Allocates the cell planes of a map, with all flags cleared.
+void map_alloccells(struct map_data* m)
+{
+	m->cell_stride = (m->xs+31)/32;
+	m->cell_planesize = m->cell_stride*m->ys;
+	CREATE(m->cell, uint32, CELLPLANE_MAX*m->cell_planesize);
+	m->cell_label = NULL;
+#ifdef CELL_NOSTACK
+	CREATE(m->cell_bl, unsigned char, m->xs*m->ys);
+#endif
+}
+
+/// Frees the cell planes of a map.
+void map_freecells(struct map_data* m)
+{
+	if( m->cell )
+	{
+		aFree(m->cell);
+		m->cell = NULL;
+	}
+	path_freelabels(m);
+#ifdef CELL_NOSTACK
+	if( m->cell_bl )
+	{
+		aFree(m->cell_bl);
+		m->cell_bl = NULL;
+	}
+#endif
+}
+
 /*==========================================
  * (m,x,y)̏Ԃ𒲂ׂ
  *------------------------------------------*/
@@ -2347,63 +2536,56 @@ int map_getcell(int m,int x,int y,cell_chk cellchk)
 
 int map_getcellp(struct map_data* m,int x,int y,cell_chk cellchk)
 {
-	struct mapcell cell;
-
 	nullpo_ret(m);
 
 	//NOTE: this intentionally overrides the last row and column
 	if(x<0 || x>=m->xs-1 || y<0 || y>=m->ys-1)
 		return( cellchk == CELL_CHKNOPASS );
 
-	cell = m->cell[x + y*m->xs];
-
 	switch(cellchk)
 	{
 		// gat type retrieval
 		case CELL_GETTYPE:
-			return map_cell2gat(cell);
+			return map_getcellgat(m,x,y);
 
 		// base gat type checks
 		case CELL_CHKWALL:
-			return (!cell.walkable && !cell.shootable);
-			//return (map_cell2gat(cell) == 1);
+			return (!map_cellbit(m,CELLPLANE_WALKABLE,x,y) && !map_cellbit(m,CELLPLANE_SHOOTABLE,x,y));
 		case CELL_CHKWATER:
-			return (cell.water);
-			//return (map_cell2gat(cell) == 3);
+			return map_cellbit(m,CELLPLANE_WATER,x,y);
 		case CELL_CHKCLIFF:
-			return (!cell.walkable && cell.shootable);
-			//return (map_cell2gat(cell) == 5);
+			return (!map_cellbit(m,CELLPLANE_WALKABLE,x,y) && map_cellbit(m,CELLPLANE_SHOOTABLE,x,y));
 
 		// base cell type checks
 		case CELL_CHKNPC:
-			return (cell.npc);
+			return map_cellbit(m,CELLPLANE_NPC,x,y);
 		case CELL_CHKBASILICA:
-			return (cell.basilica);
+			return map_cellbit(m,CELLPLANE_BASILICA,x,y);
 		case CELL_CHKLANDPROTECTOR:
-			return (cell.landprotector);
+			return map_cellbit(m,CELLPLANE_LANDPROTECTOR,x,y);
 		case CELL_CHKNOVENDING:
-			return (cell.novending);
+			return map_cellbit(m,CELLPLANE_NOVENDING,x,y);
 		case CELL_CHKNOCHAT:
-			return (cell.nochat);
+			return map_cellbit(m,CELLPLANE_NOCHAT,x,y);
 
 		// special checks
 		case CELL_CHKPASS:
 #ifdef CELL_NOSTACK
-			if (cell.cell_bl >= battle_config.cell_stack_limit) return 0;
+			if (m->cell_bl[x + y*m->xs] >= battle_config.cell_stack_limit) return 0;
 #endif
 		case CELL_CHKREACH:
-			return (cell.walkable);
+			return map_cellbit(m,CELLPLANE_WALKABLE,x,y);
 
 		case CELL_CHKNOPASS:
 #ifdef CELL_NOSTACK
-			if (cell.cell_bl >= battle_config.cell_stack_limit) return 1;
+			if (m->cell_bl[x + y*m->xs] >= battle_config.cell_stack_limit) return 1;
 #endif
 		case CELL_CHKNOREACH:
-			return (!cell.walkable);
+			return !map_cellbit(m,CELLPLANE_WALKABLE,x,y);
 
 		case CELL_CHKSTACK:
 #ifdef CELL_NOSTACK
-			return (cell.cell_bl >= battle_config.cell_stack_limit);
+			return (m->cell_bl[x + y*m->xs] >= battle_config.cell_stack_limit);
 #else
 			return 0;
 #endif
@@ -2420,43 +2602,35 @@ int map_getcellp(struct map_data* m,int x,int y,cell_chk cellchk)
  *------------------------------------------*/
 void map_setcell(int m, int x, int y, cell_t cell, bool flag)
 {
-	int j;
-
 	if( m < 0 || m >= map_num || x < 0 || x >= map[m].xs || y < 0 || y >= map[m].ys )
 		return;
 
-	j = x + y*map[m].xs;
-
 	switch( cell ) {
-		case CELL_WALKABLE:      map[m].cell[j].walkable = flag;      break;
-		case CELL_SHOOTABLE:     map[m].cell[j].shootable = flag;     break;
-		case CELL_WATER:         map[m].cell[j].water = flag;         break;
-
-		case CELL_NPC:           map[m].cell[j].npc = flag;           break;
-		case CELL_BASILICA:      map[m].cell[j].basilica = flag;      break;
-		case CELL_LANDPROTECTOR: map[m].cell[j].landprotector = flag; break;
-		case CELL_NOVENDING:     map[m].cell[j].novending = flag;     break;
-		case CELL_NOCHAT:        map[m].cell[j].nochat = flag;        break;
+		case CELL_WALKABLE:      map_setcellbit(&map[m], CELLPLANE_WALKABLE, x, y, flag);      break;
+		case CELL_SHOOTABLE:     map_setcellbit(&map[m], CELLPLANE_SHOOTABLE, x, y, flag);     break;
+		case CELL_WATER:         map_setcellbit(&map[m], CELLPLANE_WATER, x, y, flag);         break;
+
+		case CELL_NPC:           map_setcellbit(&map[m], CELLPLANE_NPC, x, y, flag);           break;
+		case CELL_BASILICA:      map_setcellbit(&map[m], CELLPLANE_BASILICA, x, y, flag);      break;
+		case CELL_LANDPROTECTOR: map_setcellbit(&map[m], CELLPLANE_LANDPROTECTOR, x, y, flag); break;
+		case CELL_NOVENDING:     map_setcellbit(&map[m], CELLPLANE_NOVENDING, x, y, flag);     break;
+		case CELL_NOCHAT:        map_setcellbit(&map[m], CELLPLANE_NOCHAT, x, y, flag);        break;
 		default:
 			ShowWarning("map_setcell: invalid cell type '%d'\n", (int)cell);
 			break;
 	}
+
+	if( cell == CELL_WALKABLE )
+		path_cellchanged(&map[m], x, y);
 }
 
 void map_setgatcell(int m, int x, int y, int gat)
 {
-	int j;
-	struct mapcell cell;
-
 	if( m < 0 || m >= map_num || x < 0 || x >= map[m].xs || y < 0 || y >= map[m].ys )
 		return;
 
-	j = x + y*map[m].xs;
-
-	cell = map_gat2cell(gat);
-	map[m].cell[j].walkable = cell.walkable;
-	map[m].cell[j].shootable = cell.shootable;
-	map[m].cell[j].water = cell.water;
+	map_setcellgat(&map[m], x, y, gat);
+	path_cellchanged(&map[m], x, y);
 }
 
 /*==========================================
@@ -2710,11 +2884,9 @@ int map_readfromcache(struct map_data *m, char *buffer, char *decode_buffer)
 		// TO-DO: Maybe handle the scenario, if the decoded buffer isn't the same size as expected? [Shinryo]
 		decode_zip(decode_buffer, &size, p+sizeof(struct map_cache_map_info), info->len);
 
-		CREATE(m->cell, struct mapcell, size);
-
-
+		map_alloccells(m);
 		for( xy = 0; xy < size; ++xy )
-			m->cell[xy] = map_gat2cell(decode_buffer[xy]);
+			map_setcellgat(m, xy%m->xs, xy/m->xs, decode_buffer[xy]);
 
 		return 1;
 	}
@@ -2842,7 +3014,7 @@ int map_readgat (struct map_data* m)
 	m->xs = *(int32*)(gat+6);
 	m->ys = *(int32*)(gat+10);
 	num_cells = m->xs * m->ys;
-	CREATE(m->cell, struct mapcell, num_cells);
+	map_alloccells(m);
 
 	water_height = map_waterheight(m->name);
 
@@ -2858,7 +3030,7 @@ int map_readgat (struct map_data* m)
 		if( type == 0 && water_height != NO_WATER && height > water_height )
 			type = 3; // Cell is 0 (walkable) but under water level, set to 3 (walkable water)
 
-		m->cell[xy] = map_gat2cell(type);
+		map_setcellgat(m, xy%m->xs, xy/m->xs, type);
 	}
 	
 	aFree(gat);
@@ -2938,10 +3110,7 @@ int map_readallmaps (void)
 		if (uidb_get(map_db,(unsigned int)map[i].index) != NULL)
 		{
 			ShowWarning("Map %s already loaded!"CL_CLL"\n", map[i].name);
-			if (map[i].cell) {
-				aFree(map[i].cell);
-				map[i].cell = NULL;	
-			}
+			map_freecells(&map[i]);
 			map_delmapid(i);
 			maps_removed++;
 			i--;
@@ -2957,9 +3126,9 @@ int map_readallmaps (void)
 		map[i].bxs = (map[i].xs + BLOCK_SIZE - 1) / BLOCK_SIZE;
 		map[i].bys = (map[i].ys + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-		size = map[i].bxs * map[i].bys * sizeof(struct block_list*);
-		map[i].block = (struct block_list**)aCalloc(size, 1);
-		map[i].block_mob = (struct block_list**)aCalloc(size, 1);
+		size = map[i].bxs * map[i].bys * sizeof(struct map_block);
+		map[i].block = (struct map_block*)aCalloc(size, 1);
+		map[i].block_mob = (struct map_block*)aCalloc(size, 1);
 	}
 
 	// intialization and configuration-dependent adjustments of mapflags
@@ -3048,6 +3217,10 @@ int parse_console(const char* buf)
 		{
 			runflag = SERVER_STATE_STOP;
 		}
+		else if( strcmpi("status", command) == 0 )
+		{
+			socket_showusage();
+		}
 	}
 	else if( strcmpi("help", type) == 0 )
 	{
@@ -3059,6 +3232,8 @@ int parse_console(const char* buf)
 		ShowInfo("IE: @spawn\n");
 		ShowInfo("To shutdown the server:\n");
 		ShowInfo("  server:shutdown\n");
+		ShowInfo("To show the sessions and their buffer memory:\n");
+		ShowInfo("  server:status\n");
 	}
 
 	return 0;
@@ -3139,6 +3314,12 @@ int map_config_read(char *cfgName)
 		else
 		if (strcmpi(w1, "delnpc") == 0)
 			npc_delsrcfile(w2);
+		else
+		if (strcmpi(w1, "npc_parse_threads") == 0)
+			npc_parse_threads = atoi(w2);
+		else
+		if (strcmpi(w1, "map_shards") == 0)
+			map_shards = atoi(w2);
 		else if (strcmpi(w1, "autosave_time") == 0) {
 			autosave_interval = atoi(w2);
 			if (autosave_interval < 1) //Revert to default saving.
@@ -3172,6 +3353,9 @@ int map_config_read(char *cfgName)
 		if(strcmpi(w1,"db_path") == 0)
 			strncpy(db_path,w2,255);
 		else
+		if(strcmpi(w1,"db_snapshot_file") == 0)
+			safestrncpy(db_snapshot_file, w2, sizeof(db_snapshot_file));
+		else
 		if (strcmpi(w1, "console") == 0) {
 			console = config_switch(w2);
 			if (console)
@@ -3443,15 +3627,16 @@ void do_final(void)
 	do_final_skill();
 	do_final_status();
 	do_final_unit();
+	do_final_shard();
 	do_final_battleground();
 	do_final_duel();
+	do_final_searchstore();
 	
 	map_db->destroy(map_db, map_db_final);
 	
 	for (i=0; i<map_num; i++) {
-		if(map[i].cell) aFree(map[i].cell);
-		if(map[i].block) aFree(map[i].block);
-		if(map[i].block_mob) aFree(map[i].block_mob);
+		map_freecells(&map[i]);
+		map_freemapblocks(i);
 		if(battle_config.dynamic_mobs) { //Dynamic mobs flag by [random]
 			for (j=0; j<MAX_MOB_LIST_PER_MAP; j++)
 				if (map[i].moblist[j]) aFree(map[i].moblist[j]);
@@ -3471,6 +3656,14 @@ void do_final(void)
 	iwall_db->destroy(iwall_db, NULL);
 	regen_db->destroy(regen_db, NULL);
 
+	aFree(bl_list);
+	bl_list = NULL;
+	bl_list_count = bl_list_max = 0;
+
+	aFree(regen_list);
+	regen_list = NULL;
+	regen_count = regen_max = 0;
+
 #ifndef TXT_ONLY
     map_sql_close();
 #endif /* not TXT_ONLY */
@@ -3527,6 +3720,10 @@ static void map_helpscreen(bool do_exit)
 	ShowInfo("  --grf-path <file>\t\tAlternative GRF path configuration.\n");
 	ShowInfo("  --inter-config <file>\t\tAlternative inter-server configuration.\n");
 	ShowInfo("  --log-config <file>\t\tAlternative logging configuration.\n");
+	ShowInfo("  --no-db-snapshot\t\tReads the static databases from the text files only.\n");
+	ShowInfo("  --check-db-snapshot\t\tCompares the db snapshot with the text files.\n");
+	ShowInfo("  --battle-bench <file>\t\tReplays the builds of a corpus in db_path through the battle formulas and exits.\n");
+	ShowInfo("  --battle-bench-count <n>\tAttack calculations per build for --battle-bench.\n");
 	if( do_exit )
 		exit(EXIT_SUCCESS);
 }
@@ -3667,6 +3864,28 @@ int do_init(int argc, char *argv[])
 				if( map_arg_next_value(arg, i, argc) )
 					LOG_CONF_NAME = argv[++i];
 			}
+			else if( strcmp(arg, "no-db-snapshot") == 0 )
+			{
+				db_snapshot = 0;
+			}
+			else if( strcmp(arg, "check-db-snapshot") == 0 )
+			{
+				db_snapshot = 2;
+			}
+			else if( strcmp(arg, "battle-bench") == 0 )
+			{
+				if( map_arg_next_value(arg, i, argc) )
+					safestrncpy(battle_bench_file, argv[++i], sizeof(battle_bench_file));
+			}
+			else if( strcmp(arg, "battle-bench-count") == 0 )
+			{
+				if( map_arg_next_value(arg, i, argc) )
+				{
+					battle_bench_count = atoi(argv[++i]);
+					if( battle_bench_count < 1 )
+						battle_bench_count = 1;
+				}
+			}
 			else if( strcmp(arg, "run-once") == 0 ) // close the map-server as soon as its done.. for testing [Celest]
 			{
 				runflag = SERVER_STATE_STOP;
@@ -3755,11 +3974,13 @@ int do_init(int argc, char *argv[])
 	do_init_chrif();
 	do_init_clif();
 	do_init_script();
+	snapshot_init();
 	do_init_itemdb();
 	do_init_skill();
 	do_init_mob();
 	do_init_pc();
 	do_init_status();
+	snapshot_final();
 	do_init_party();
 	do_init_guild();
 	do_init_storage();
@@ -3768,9 +3989,19 @@ int do_init(int argc, char *argv[])
 	do_init_mercenary();
 	do_init_quest();
 	do_init_npc();
+	do_init_shard();
 	do_init_unit();
 	do_init_battleground();
 	do_init_duel();
+	do_init_searchstore();
+
+	if( battle_bench_file[0] )
+	{// replay the battle formulas instead of starting the server
+		if( !battle_bench_run(battle_bench_file, battle_bench_count) )
+			exit(EXIT_FAILURE);
+		runflag = SERVER_STATE_STOP;
+		return 0;
+	}
 
 	npc_event_do_oninit();	// npcOnInitCxg?s
 
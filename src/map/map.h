@@ -247,7 +247,8 @@ enum auto_trigger_flag {
 };
 
 struct block_list {
-	struct block_list *next,*prev;
+	struct block_list *prev; // non-NULL while the object is in a map block
+	int blockidx; // position of the object's entry in its map block
 	int id;
 	short m,x,y;
 	enum bl_type type;
@@ -395,25 +396,43 @@ typedef enum {
 	CELL_CHKNOCHAT,
 } cell_chk;
 
-struct mapcell
+/// Bit planes of the cells of a map, each plane holds one flag of every cell.
+/// Rows are padded to whole 32-bit words, so a word covers 32 cells of a row.
+enum cell_plane
 {
 	// terrain flags
-	unsigned char
-		walkable : 1,
-		shootable : 1,
-		water : 1;
+	CELLPLANE_WALKABLE,
+	CELLPLANE_SHOOTABLE,
+	CELLPLANE_WATER,
 
 	// dynamic flags
-	unsigned char
-		npc : 1,
-		basilica : 1,
-		landprotector : 1,
-		novending : 1,
-		nochat : 1;
+	CELLPLANE_NPC,
+	CELLPLANE_BASILICA,
+	CELLPLANE_LANDPROTECTOR,
+	CELLPLANE_NOVENDING,
+	CELLPLANE_NOCHAT,
+	CELLPLANE_SKILLUNIT, // there is at least one skill unit on the cell
+
+	CELLPLANE_MAX
+};
 
-#ifdef CELL_NOSTACK
-	unsigned char cell_bl; //Holds amount of bls in this cell.
-#endif
+/// Word of a plane that holds the bit of cell (x,y).
+#define map_cellword(md,plane,x,y) ( (md)->cell + (plane)*(md)->cell_planesize + (y)*(md)->cell_stride + ((x)>>5) )
+/// Value (0 or 1) of the bit of cell (x,y) in a plane.
+#define map_cellbit(md,plane,x,y) ( (*map_cellword(md,plane,x,y)>>((x)&31))&1 )
+
+// Cached copy of an object's position, kept in the map block it is in.
+struct block_entry {
+	struct block_list* bl;
+	int id;
+	short x,y;
+	enum bl_type type;
+};
+
+// Objects in one BLOCK_SIZE x BLOCK_SIZE area of a map.
+struct map_block {
+	struct block_entry* entry;
+	int count, max;
 };
 
 struct iwall_data {
@@ -425,9 +444,15 @@ struct iwall_data {
 struct map_data {
 	char name[MAP_NAME_LENGTH];
 	unsigned short index; // The map index used by the mapindex* functions.
-	struct mapcell* cell; // Holds the information of each map cell (NULL if the map is not on this map-server).
-	struct block_list **block;
-	struct block_list **block_mob;
+	uint32* cell; // Holds the information of each map cell in bit planes, see enum cell_plane (NULL if the map is not on this map-server).
+	int cell_stride; // words per row of a cell plane
+	int cell_planesize; // words per cell plane
+	unsigned short* cell_label; // connected area of each reachable cell, 0 for the others (NULL until the first path search, see path.c)
+#ifdef CELL_NOSTACK
+	unsigned char* cell_bl; //Holds amount of bls in each cell.
+#endif
+	struct map_block* block;
+	struct map_block* block_mob;
 	int m;
 	short xs,ys; // map dimensions (in cells)
 	short bxs,bys; // map dimensions (in blocks)
@@ -510,7 +535,7 @@ struct map_data {
 struct map_data_other_server {
 	char name[MAP_NAME_LENGTH];
 	unsigned short index; //Index is the map index used by the mapindex* functions.
-	struct mapcell* cell; // If this is NULL, the map is not on this map-server
+	uint32* cell; // If this is NULL, the map is not on this map-server
 	uint32 ip;
 	uint16 port;
 };
@@ -518,6 +543,8 @@ struct map_data_other_server {
 int map_getcell(int,int,int,cell_chk);
 int map_getcellp(struct map_data*,int,int,cell_chk);
 void map_setcell(int m, int x, int y, cell_t cell, bool flag);
+void map_alloccells(struct map_data* m);
+void map_freecells(struct map_data* m);
 void map_setgatcell(int m, int x, int y, int gat);
 
 extern struct map_data map[];
@@ -551,6 +578,24 @@ int map_freeblock_unlock(void);
 int map_addblock(struct block_list* bl);
 int map_delblock(struct block_list* bl);
 int map_moveblock(struct block_list *, int, int, unsigned int);
+void map_freemapblocks(int m);
+// area queries
+struct s_mapquery {
+	int start; // first match on the shared match stack
+	int end;   // one past the last match
+	int pos;   // next match to return
+};
+int map_query_inrange(struct s_mapquery* q, struct block_list* center, int range, int type);
+int map_query_inshootrange(struct s_mapquery* q, struct block_list* center, int range, int type);
+int map_query_inarea(struct s_mapquery* q, int m, int x0, int y0, int x1, int y1, int type);
+int map_query_inmovearea(struct s_mapquery* q, struct block_list* center, int range, int dx, int dy, int type);
+int map_query_incell(struct s_mapquery* q, int m, int x, int y, int type);
+int map_query_inpath(struct s_mapquery* q, int m, int x0, int y0, int x1, int y1, int range, int length, int type);
+int map_query_inmap(struct s_mapquery* q, int m, int type);
+struct block_list* map_query_next(struct s_mapquery* q);
+void map_query_end(struct s_mapquery* q);
+#define map_query_foreach(q,bl) while( ((bl) = map_query_next(q)) != NULL )
+
 int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int type, ...);
 int map_foreachinshootrange(int (*func)(struct block_list*,va_list), struct block_list* center, int range, int type, ...);
 int map_foreachinarea(int (*func)(struct block_list*,va_list), int m, int x0, int y0, int x1, int y1, int type, ...);
@@ -603,7 +648,7 @@ void map_deliddb(struct block_list *bl);
 void map_foreachpc(int (*func)(struct map_session_data* sd, va_list args), ...);
 void map_foreachmob(int (*func)(struct mob_data* md, va_list args), ...);
 void map_foreachnpc(int (*func)(struct npc_data* nd, va_list args), ...);
-void map_foreachregen(int (*func)(struct block_list* bl, va_list args), ...);
+struct block_list** map_getregenlist(int* count);
 void map_foreachiddb(int (*func)(struct block_list* bl, va_list args), ...);
 struct map_session_data * map_nick2sd(const char*);
 struct mob_data * map_getmob_boss(int m);
@@ -34,6 +34,7 @@
 #include "atcommand.h"
 #include "date.h"
 #include "quest.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -957,17 +958,11 @@ int mob_target(struct mob_data *md,struct block_list *bl,int dist)
 /*==========================================
  * The ?? routine of an active monster
  *------------------------------------------*/
-static int mob_ai_sub_hard_activesearch(struct block_list *bl,va_list ap)
+static int mob_ai_sub_hard_activesearch(struct block_list *bl, struct mob_data *md, struct block_list **target, int mode)
 {
-	struct mob_data *md;
-	struct block_list **target;
-	int mode;
 	int dist;
 
 	nullpo_ret(bl);
-	md=va_arg(ap,struct mob_data *);
-	target= va_arg(ap,struct block_list**);
-	mode= va_arg(ap,int);
 
 	//If can't seek yet, not an enemy, or you can't attack it, skip.
 	if ((*target) == bl || !status_check_skilluse(&md->bl, bl, 0, 0))
@@ -1010,14 +1005,9 @@ static int mob_ai_sub_hard_activesearch(struct block_list *bl,va_list ap)
 /*==========================================
  * chase target-change routine.
  *------------------------------------------*/
-static int mob_ai_sub_hard_changechase(struct block_list *bl,va_list ap)
+static int mob_ai_sub_hard_changechase(struct block_list *bl, struct mob_data *md, struct block_list **target)
 {
-	struct mob_data *md;
-	struct block_list **target;
-
 	nullpo_ret(bl);
-	md=va_arg(ap,struct mob_data *);
-	target= va_arg(ap,struct block_list**);
 
 	//If can't seek yet, not an enemy, or you can't attack it, skip.
 	if ((*target) == bl ||
@@ -1038,15 +1028,10 @@ static int mob_ai_sub_hard_changechase(struct block_list *bl,va_list ap)
 /*==========================================
  * loot monster item search
  *------------------------------------------*/
-static int mob_ai_sub_hard_lootsearch(struct block_list *bl,va_list ap)
+static int mob_ai_sub_hard_lootsearch(struct block_list *bl, struct mob_data *md, struct block_list **target)
 {
-	struct mob_data* md;
-	struct block_list **target;
 	int dist;
 
-	md=va_arg(ap,struct mob_data *);
-	target= va_arg(ap,struct block_list**);
-
 	dist=distance_bl(&md->bl, bl);
 	if(mob_can_reach(md,bl,dist+1, MSS_LOOT) && 
 		((*target) == NULL || !check_distance_bl(&md->bl, *target, dist)) //New target closer than previous one.
@@ -1291,7 +1276,8 @@ int mob_warpchase(struct mob_data *md, struct block_list *target)
  *------------------------------------------*/
 static bool mob_ai_sub_hard(struct mob_data *md, unsigned int tick)
 {
-	struct block_list *tbl = NULL, *abl = NULL;
+	struct block_list *tbl = NULL, *abl = NULL, *bl;
+	struct s_mapquery q;
 	int dist;
 	int mode;
 	int search_size;
@@ -1420,18 +1406,27 @@ static bool mob_ai_sub_hard(struct mob_data *md, unsigned int tick)
 	if (!tbl && mode&MD_LOOTER && md->lootitem && DIFF_TICK(tick, md->ud.canact_tick) > 0 &&
 		(md->lootitem_count < LOOTITEM_SIZE || battle_config.monster_loot_type != 1))
 	{	// Scan area for items to loot, avoid trying to loot if the mob is full and can't consume the items.
-		map_foreachinrange (mob_ai_sub_hard_lootsearch, &md->bl, view_range, BL_ITEM, md, &tbl);
+		map_query_inrange(&q, &md->bl, view_range, BL_ITEM);
+		map_query_foreach(&q, bl)
+			mob_ai_sub_hard_lootsearch(bl, md, &tbl);
+		map_query_end(&q);
 	}
 
 	if ((!tbl && mode&MD_AGGRESSIVE) || md->state.skillstate == MSS_FOLLOW)
 	{
-		map_foreachinrange (mob_ai_sub_hard_activesearch, &md->bl, view_range, DEFAULT_ENEMY_TYPE(md), md, &tbl, mode);
+		map_query_inrange(&q, &md->bl, view_range, DEFAULT_ENEMY_TYPE(md));
+		map_query_foreach(&q, bl)
+			mob_ai_sub_hard_activesearch(bl, md, &tbl, mode);
+		map_query_end(&q);
 	}
 	else
 	if (mode&MD_CHANGECHASE && (md->state.skillstate == MSS_RUSH || md->state.skillstate == MSS_FOLLOW))
 	{
 		search_size = view_range<md->status.rhw.range ? view_range:md->status.rhw.range;
-		map_foreachinrange (mob_ai_sub_hard_changechase, &md->bl, search_size, DEFAULT_ENEMY_TYPE(md), md, &tbl);
+		map_query_inrange(&q, &md->bl, search_size, DEFAULT_ENEMY_TYPE(md));
+		map_query_foreach(&q, bl)
+			mob_ai_sub_hard_changechase(bl, md, &tbl);
+		map_query_end(&q);
 	}
 
 	if (!tbl) { //No targets available.
@@ -1540,17 +1535,14 @@ static bool mob_ai_sub_hard(struct mob_data *md, unsigned int tick)
 	return true;
 }
 
-static int mob_ai_sub_hard_timer(struct block_list *bl,va_list ap)
+static void mob_ai_hard_think(struct mob_data *md, unsigned int tick)
 {
-	struct mob_data *md = (struct mob_data*)bl;
-	unsigned int tick = va_arg(ap, unsigned int);
 	if (mob_ai_sub_hard(md, tick)) 
 	{	//Hard AI triggered.
 		if(!md->state.spotted)
 			md->state.spotted = 1;
 		md->last_pcneartime = tick;
 	}
-	return 0;
 }
 
 /*==========================================
@@ -1558,9 +1550,16 @@ static int mob_ai_sub_hard_timer(struct block_list *bl,va_list ap)
  *------------------------------------------*/
 static int mob_ai_sub_foreachclient(struct map_session_data *sd,va_list ap)
 {
+	struct s_mapquery q;
+	struct block_list* bl;
 	unsigned int tick;
 	tick=va_arg(ap,unsigned int);
-	map_foreachinrange(mob_ai_sub_hard_timer,&sd->bl, AREA_SIZE+ACTIVE_AI_RANGE, BL_MOB,tick);
+
+	// same matches and order as map_foreachinrange, without a va_list per mob
+	map_query_inrange(&q, &sd->bl, AREA_SIZE+ACTIVE_AI_RANGE, BL_MOB);
+	map_query_foreach(&q, bl)
+		mob_ai_hard_think((struct mob_data*)bl, tick);
+	map_query_end(&q);
 
 	return 0;
 }
@@ -3664,13 +3663,14 @@ static void mob_readdb(void)
 		if(fi > 0)
 		{
 			sprintf(path, "%s/%s", db_path, filename[fi]);
+			snapshot_addsource(path);
 			if(!exists(path))
 			{
 				continue;
 			}
 		}
 
-		sv_readdb(db_path, filename[fi], ',', 38+2*MAX_MOB_DROP, 38+2*MAX_MOB_DROP, -1, &mob_readdb_sub);
+		snapshot_readdb(db_path, filename[fi], ',', 38+2*MAX_MOB_DROP, 38+2*MAX_MOB_DROP, -1, &mob_readdb_sub);
 	}
 }
 
@@ -3794,6 +3794,7 @@ static int mob_read_randommonster(void)
 	{
 		mob_db_data[0]->summonper[i] = 1002;	// Default fallback value, in case the database does not provide one
 		sprintf(line, "%s/%s", db_path, mobfile[i]);
+		snapshot_addsource(line);
 		fp=fopen(line,"r");
 		if(fp==NULL){
 			ShowError("can't read %s\n",line);
@@ -3908,6 +3909,7 @@ static void mob_readchatdb(void)
 	int i, tmp=0;
 	FILE *fp;
 	sprintf(path, "%s/%s", db_path, arc); 
+	snapshot_addsource(path);
 	fp=fopen(path, "r");
 	if(fp == NULL)
 	{
@@ -4236,13 +4238,14 @@ static void mob_readskilldb(void)
 		if(fi > 0)
 		{
 			sprintf(path, "%s/%s", db_path, filename[fi]);
+			snapshot_addsource(path);
 			if(!exists(path))
 			{
 				continue;
 			}
 		}
 
-		sv_readdb(db_path, filename[fi], ',', 19, 19, -1, &mob_parse_row_mobskilldb);
+		snapshot_readdb(db_path, filename[fi], ',', 19, 19, -1, &mob_parse_row_mobskilldb);
 	}
 }
 /*==========================================
@@ -4273,20 +4276,204 @@ static bool mob_readdb_race2(char* fields[], int columns, int current)
 	return true;
 }
 
+static const struct snapshot_field mob_snapshot_fields[] = {
+	SNAPSHOT_FIELD(struct mob_db, sprite),
+	SNAPSHOT_FIELD(struct mob_db, name),
+	SNAPSHOT_FIELD(struct mob_db, jname),
+	SNAPSHOT_FIELD(struct mob_db, base_exp),
+	SNAPSHOT_FIELD(struct mob_db, job_exp),
+	SNAPSHOT_FIELD(struct mob_db, mexp),
+	SNAPSHOT_FIELD(struct mob_db, mexpper),
+	SNAPSHOT_FIELD(struct mob_db, range2),
+	SNAPSHOT_FIELD(struct mob_db, range3),
+	SNAPSHOT_FIELD(struct mob_db, race2),
+	SNAPSHOT_FIELD(struct mob_db, lv),
+	SNAPSHOT_FIELD(struct mob_db, dropitem),
+	SNAPSHOT_FIELD(struct mob_db, mvpitem),
+	SNAPSHOT_FIELD(struct mob_db, status),
+	SNAPSHOT_FIELD(struct mob_db, vd),
+	SNAPSHOT_FIELD(struct mob_db, option),
+	SNAPSHOT_FIELD(struct mob_db, summonper),
+	SNAPSHOT_FIELD(struct mob_db, maxskill),
+	SNAPSHOT_FIELD(struct mob_db, skill),
+};
+
+static const struct snapshot_field mob_chat_snapshot_fields[] = {
+	SNAPSHOT_FIELD(struct mob_chat, msg_id),
+	SNAPSHOT_FIELD(struct mob_chat, color),
+	SNAPSHOT_FIELD(struct mob_chat, msg),
+};
+
+/// Reads, writes or checks the mob databases in the db snapshot.
+static void mob_snapshot(struct snapshot* s)
+{
+	char label[32];
+	int count = 0, i, j;
+
+	// monsters, spawn data belongs to the npc scripts and is kept
+	if( s->op != SNAPSHOT_READ )
+		for( i = 0; i <= MAX_MOB_DB; i++ )
+			if( mob_db_data[i] != NULL )
+				count++;
+	j = snapshot_key(s, "mob count", count);
+	if( s->op == SNAPSHOT_CHECK && j != count )
+		snapshot_mismatch(s, "mob count: snapshot %d, text %d", j, count);
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		for( i = 0; i <= MAX_MOB_DB; i++ )
+		{
+			struct mob_db db;
+
+			if( mob_db_data[i] == NULL )
+				continue;
+			memcpy(&db, mob_db_data[i], sizeof(db));
+			memset(&db.spawn, 0, sizeof(db.spawn));
+			snapshot_key(s, "class", i);
+			snapshot_structs(s, "mob_db", &db, sizeof(db), 1, mob_snapshot_fields, ARRAYLENGTH(mob_snapshot_fields));
+		}
+	}
+	else
+	{
+		for( count = j, j = 0; j < count && !s->failed; j++ )
+		{
+			struct mob_db db;
+
+			i = snapshot_key(s, "class", 0);
+			if( i < 0 || i > MAX_MOB_DB )
+			{
+				s->failed = true;
+				break;
+			}
+			if( s->op == SNAPSHOT_READ )
+			{
+				if( mob_db_data[i] == NULL )
+					mob_db_data[i] = (struct mob_db*)aCalloc(1, sizeof(struct mob_db));
+				memcpy(&db.spawn, mob_db_data[i]->spawn, sizeof(db.spawn));
+				snapshot_structs(s, "mob_db", mob_db_data[i], sizeof(struct mob_db), 1, NULL, 0);
+				memcpy(mob_db_data[i]->spawn, &db.spawn, sizeof(db.spawn));
+				continue;
+			}
+			if( mob_db_data[i] == NULL )
+			{
+				snapshot_mismatch(s, "mob %d is not in the text files", i);
+				memset(&db, 0, sizeof(db));
+			}
+			else
+				memcpy(&db, mob_db_data[i], sizeof(db));
+			snprintf(label, sizeof(label), "mob_db[%d]", i);
+			snapshot_structs(s, label, &db, sizeof(db), 1, mob_snapshot_fields, ARRAYLENGTH(mob_snapshot_fields));
+		}
+	}
+
+	// chat messages
+	count = 0;
+	if( s->op != SNAPSHOT_READ )
+		for( i = 1; i <= MAX_MOB_CHAT; i++ )
+			if( mob_chat_db[i] != NULL )
+				count++;
+	j = snapshot_key(s, "chat count", count);
+	if( s->op == SNAPSHOT_CHECK && j != count )
+		snapshot_mismatch(s, "mob chat count: snapshot %d, text %d", j, count);
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		for( i = 1; i <= MAX_MOB_CHAT; i++ )
+		{
+			if( mob_chat_db[i] == NULL )
+				continue;
+			snapshot_key(s, "msg_id", i);
+			snapshot_structs(s, "mob_chat_db", mob_chat_db[i], sizeof(struct mob_chat), 1, mob_chat_snapshot_fields, ARRAYLENGTH(mob_chat_snapshot_fields));
+		}
+	}
+	else
+	{
+		for( count = j, j = 0; j < count && !s->failed; j++ )
+		{
+			static struct mob_chat missing;
+
+			i = snapshot_key(s, "msg_id", 0);
+			if( i <= 0 || i > MAX_MOB_CHAT )
+			{
+				s->failed = true;
+				break;
+			}
+			if( s->op == SNAPSHOT_READ && mob_chat_db[i] == NULL )
+				mob_chat_db[i] = (struct mob_chat*)aCalloc(1, sizeof(struct mob_chat));
+			snprintf(label, sizeof(label), "mob_chat_db[%d]", i);
+			if( mob_chat_db[i] == NULL )
+			{
+				snapshot_mismatch(s, "mob chat %d is not in the text files", i);
+				memset(&missing, 0, sizeof(missing));
+				snapshot_structs(s, label, &missing, sizeof(struct mob_chat), 1, mob_chat_snapshot_fields, ARRAYLENGTH(mob_chat_snapshot_fields));
+			}
+			else
+				snapshot_structs(s, label, mob_chat_db[i], sizeof(struct mob_chat), 1, mob_chat_snapshot_fields, ARRAYLENGTH(mob_chat_snapshot_fields));
+		}
+	}
+
+	snapshot_array(s, "summon", summon, sizeof(summon[0]), ARRAYLENGTH(summon));
+
+	// loading monsters sets the drop information of items
+	itemdb_snapshot_drops(s);
+}
+
+/// Removes the data loaded by mob_load.
+static void mob_clear(void)
+{
+	int i;
+
+	for( i = 1; i <= MAX_MOB_DB; i++ )
+	{
+		if( mob_db_data[i] != NULL )
+		{
+			aFree(mob_db_data[i]);
+			mob_db_data[i] = NULL;
+		}
+	}
+	memset(mob_db_data[0], 0, sizeof(struct mob_db));
+	for( i = 0; i <= MAX_MOB_CHAT; i++ )
+	{
+		if( mob_chat_db[i] != NULL )
+		{
+			aFree(mob_chat_db[i]);
+			mob_chat_db[i] = NULL;
+		}
+	}
+	memset(&summon, 0, sizeof(summon));
+	itemdb_clear_drops();
+}
+
 static void mob_load(void)
 {
+	struct snapshot* s = NULL;
+
 #ifndef TXT_ONLY
 	if(db_use_sqldbs)
 		mob_read_sqldb();
 	else
 #endif /* TXT_ONLY */
-	mob_readdb();
+	{
+		if( (s = snapshot_open(SNAPSHOT_MOBDB)) != NULL )
+		{
+			mob_snapshot(s);
+			if( snapshot_close(s) )
+				return;
+			mob_clear();
+		}
+		s = snapshot_create(SNAPSHOT_MOBDB);
+		mob_readdb();
+	}
 
-	sv_readdb(db_path, "mob_avail.txt", ',', 2, 12, -1, &mob_readdb_mobavail);
+	snapshot_readdb(db_path, "mob_avail.txt", ',', 2, 12, -1, &mob_readdb_mobavail);
 	mob_read_randommonster();
 	mob_readchatdb();
 	mob_readskilldb();
-	sv_readdb(db_path, "mob_race2_db.txt", ',', 2, 20, -1, &mob_readdb_race2);
+	snapshot_readdb(db_path, "mob_race2_db.txt", ',', 2, 20, -1, &mob_readdb_race2);
+
+	if( s != NULL )
+	{
+		mob_snapshot(s);
+		snapshot_close(s);
+	}
 }
 
 void mob_reload(void)
@@ -253,6 +253,7 @@ void mob_heal(struct mob_data *md,unsigned int heal);
 #define mob_is_battleground(md) ( map[(md)->bl.m].flag.battleground && ((md)->class_ == 1906 || ((md)->class_ >= 1909 && (md)->class_ <= 1915)) )
 
 void mob_clear_spawninfo();
+
 int do_init_mob(void);
 int do_final_mob(void);
 
@@ -11,6 +11,7 @@
 #include "../common/ers.h"
 #include "../common/db.h"
 #include "../common/socket.h"
+#include "../common/thread.h"
 #include "map.h"
 #include "log.h"
 #include "clif.h"
@@ -45,6 +46,28 @@ struct npc_src_list {
 };
 static struct npc_src_list* npc_src_files = NULL;
 
+int npc_parse_threads = 0; // number of loader threads (-1 = one per processor, 0 = disabled)
+
+// npc source file read and split into lines by a loader thread
+struct npc_src_line {
+	int offset; // start of the line in the buffer
+	int count; // result of sv_parse
+	int pos[9]; // positions returned by sv_parse
+	int script_start; // position of the left curly of the script, -1 if not a script
+	int script_end; // position after the matching right curly
+};
+struct npc_src_prescan {
+	const char* filepath;
+	char* buffer; // NULL if the file couldn't be read (system allocator)
+	size_t len;
+	struct npc_src_line* lines; // (system allocator)
+	int line_count;
+	bool done; // set by the loader thread when it's finished with the file
+};
+static struct npc_src_prescan* npc_prescan = NULL; // prescan of the file being parsed
+static const struct npc_src_line* npc_prescan_line = NULL; // prescan of the line being parsed
+static int npc_prescan_idx = 0; // next line of npc_prescan to check
+
 static int npc_id=START_NPC_NUM;
 static int npc_warp=0;
 static int npc_shop=0;
@@ -1793,7 +1816,7 @@ struct npc_data* npc_add_warp(short from_mapid, short from_x, short from_y, shor
 	CREATE(nd, struct npc_data, 1);
 	nd->bl.id = npc_get_new_npc_id();
 	map_addnpc(from_mapid, nd);
-	nd->bl.prev = nd->bl.next = NULL;
+	nd->bl.prev = NULL;
 	nd->bl.m = from_mapid;
 	nd->bl.x = from_x;
 	nd->bl.y = from_y;
@@ -1855,7 +1878,7 @@ static const char* npc_parse_warp(char* w1, char* w2, char* w3, char* w4, const
 
 	nd->bl.id = npc_get_new_npc_id();
 	map_addnpc(m, nd);
-	nd->bl.prev = nd->bl.next = NULL;
+	nd->bl.prev = NULL;
 	nd->bl.m = m;
 	nd->bl.x = x;
 	nd->bl.y = y;
@@ -1967,7 +1990,7 @@ static const char* npc_parse_shop(char* w1, char* w2, char* w3, char* w4, const
 	CREATE(nd->u.shop.shop_item, struct npc_item_list, i);
 	memcpy(nd->u.shop.shop_item, items, sizeof(struct npc_item_list)*i);
 	nd->u.shop.count = i;
-	nd->bl.prev = nd->bl.next = NULL;
+	nd->bl.prev = NULL;
 	nd->bl.m = m;
 	nd->bl.x = x;
 	nd->bl.y = y;
@@ -2044,33 +2067,24 @@ int npc_convertlabel_db(DBKey key, void* data, va_list ap)
 }
 
 // Skip the contents of a script.
-static const char* npc_skip_script(const char* start, const char* buffer, const char* filepath)
+/// Skips the script body that starts at the left curly in p.
+/// Returns 0 and sets out to after the matching right curly if successful,
+/// otherwise sets out to the error position and returns 1 (unexpected end of string),
+/// 2 (unexpected newline at string) or 3 (missing right curlys, curly_count is set to the number).
+static int npc_skip_curly(const char* p, const char** out, int* curly_count)
 {
-	const char* p;
-	int curly_count;
-
-	if( start == NULL )
-		return NULL;// nothing to skip
-
-	// initial bracket (assumes the previous part is ok)
-	p = strchr(start,'{');
-	if( p == NULL )
-	{
-		ShowError("npc_skip_script: Missing left curly in file '%s', line'%d'.", filepath, strline(buffer,start-buffer));
-		return NULL;// can't continue
-	}
+	int count;
 
-	// skip everything
-	for( curly_count = 1; curly_count > 0 ; )
+	for( count = 1; count > 0 ; )
 	{
 		p = skip_space(p+1) ;
 		if( *p == '}' )
 		{// right curly
-			--curly_count;
+			--count;
 		}
 		else if( *p == '{' )
 		{// left curly
-			++curly_count;
+			++count;
 		}
 		else if( *p == '"' )
 		{// string
@@ -2080,24 +2094,64 @@ static const char* npc_skip_script(const char* start, const char* buffer, const
 					++p;// escape sequence (not part of a multibyte character)
 				else if( *p == '\0' )
 				{
-					script_error(buffer, filepath, 0, "Unexpected end of string.", p);
-					return NULL;// can't continue
+					*out = p;
+					return 1;
 				}
 				else if( *p == '\n' )
 				{
-					script_error(buffer, filepath, 0, "Unexpected newline at string.", p);
-					return NULL;// can't continue
+					*out = p;
+					return 2;
 				}
 			}
 		}
 		else if( *p == '\0' )
 		{// end of buffer
-			ShowError("Missing %d right curlys at file '%s', line '%d'.\n", curly_count, filepath, strline(buffer,p-buffer));
-			return NULL;// can't continue
+			*out = p;
+			if( curly_count )
+				*curly_count = count;
+			return 3;
 		}
 	}
 
-	return p+1;// return after the last '}'
+	*out = p+1;// after the last '}'
+	return 0;
+}
+
+static const char* npc_skip_script(const char* start, const char* buffer, const char* filepath)
+{
+	const char* p;
+	int curly_count;
+
+	if( start == NULL )
+		return NULL;// nothing to skip
+
+	// initial bracket (assumes the previous part is ok)
+	p = strchr(start,'{');
+	if( p == NULL )
+	{
+		ShowError("npc_skip_script: Missing left curly in file '%s', line'%d'.", filepath, strline(buffer,start-buffer));
+		return NULL;// can't continue
+	}
+
+	// already skipped by the loader thread
+	if( npc_prescan_line && npc_prescan->buffer == buffer && npc_prescan_line->script_start == p-buffer )
+		return buffer + npc_prescan_line->script_end;
+
+	// skip everything
+	switch( npc_skip_curly(p, &p, &curly_count) )
+	{
+	case 1:
+		script_error(buffer, filepath, 0, "Unexpected end of string.", p);
+		return NULL;// can't continue
+	case 2:
+		script_error(buffer, filepath, 0, "Unexpected newline at string.", p);
+		return NULL;// can't continue
+	case 3:
+		ShowError("Missing %d right curlys at file '%s', line '%d'.\n", curly_count, filepath, strline(buffer,p-buffer));
+		return NULL;// can't continue
+	}
+
+	return p;// after the last '}'
 }
 
 /// Parses a npc script.
@@ -2147,7 +2201,7 @@ static const char* npc_parse_script(char* w1, char* w2, char* w3, char* w4, cons
 	if( end == NULL )
 		return NULL;// (simple) parse error, don't continue
 
-	script = parse_script(script_start, filepath, strline(buffer,script_start-buffer), SCRIPT_USE_LABEL_DB);
+	script = parse_script_cached(script_start, (int)(end-script_start), filepath, strline(buffer,script_start-buffer), SCRIPT_USE_LABEL_DB);
 	label_list = NULL;
 	label_list_num = 0;
 	if( script )
@@ -2171,7 +2225,7 @@ static const char* npc_parse_script(char* w1, char* w2, char* w3, char* w4, cons
 		nd->u.scr.ys = -1;
 	}
 
-	nd->bl.prev = nd->bl.next = NULL;
+	nd->bl.prev = NULL;
 	nd->bl.m = m;
 	nd->bl.x = x;
 	nd->bl.y = y;
@@ -2327,7 +2381,7 @@ const char* npc_parse_duplicate(char* w1, char* w2, char* w3, char* w4, const ch
 
 	CREATE(nd, struct npc_data, 1);
 
-	nd->bl.prev = nd->bl.next = NULL;
+	nd->bl.prev = NULL;
 	nd->bl.m = m;
 	nd->bl.x = x;
 	nd->bl.y = y;
@@ -2479,7 +2533,7 @@ int npc_duplicate4instance(struct npc_data *snd, int m)
 		CREATE(wnd, struct npc_data, 1);
 		wnd->bl.id = npc_get_new_npc_id();
 		map_addnpc(m, wnd);
-		wnd->bl.prev = wnd->bl.next = NULL;
+		wnd->bl.prev = NULL;
 		wnd->bl.m = m;
 		wnd->bl.x = snd->bl.x;
 		wnd->bl.y = snd->bl.y;
@@ -2659,7 +2713,7 @@ static const char* npc_parse_function(char* w1, char* w2, char* w3, char* w4, co
 	if( end == NULL )
 		return NULL;// (simple) parse error, don't continue
 
-	script = parse_script(script_start, filepath, strline(buffer,start-buffer), SCRIPT_RETURN_EMPTY_SCRIPT);
+	script = parse_script_cached(script_start, (int)(end-script_start), filepath, strline(buffer,start-buffer), SCRIPT_RETURN_EMPTY_SCRIPT);
 	if( script == NULL )// parse error, continue
 		return end;
 
@@ -3122,13 +3176,202 @@ static const char* npc_parse_mapflag(char* w1, char* w2, char* w3, char* w4, con
 	return strchr(start,'\n');// continue
 }
 
+static void npc_parsebuffer(const char* filepath, const char* buffer, size_t len);
+
+/// Returns the line split by the loader thread that starts at offset, or NULL if not available.
+static const struct npc_src_line* npc_prescan_find(int offset)
+{
+	if( npc_prescan == NULL )
+		return NULL;
+	while( npc_prescan_idx < npc_prescan->line_count && npc_prescan->lines[npc_prescan_idx].offset < offset )
+		++npc_prescan_idx;
+	if( npc_prescan_idx < npc_prescan->line_count && npc_prescan->lines[npc_prescan_idx].offset == offset )
+		return &npc_prescan->lines[npc_prescan_idx];
+	return NULL;
+}
+
+/// Reads a npc source file and splits it into lines, skipping script bodies.
+/// Runs in a loader thread, so it only uses the system allocator and doesn't report errors.
+/// Files that can't be read, or the rest of a file after a syntax error, are left to npc_parsebuffer.
+static void npc_prescan_file(struct npc_src_prescan* scan)
+{
+	FILE* fp;
+	const char* p;
+	char* buffer;
+	size_t len;
+	int max = 0;
+
+	fp = fopen(scan->filepath, "rb");
+	if( fp == NULL )
+		return;
+	len = filesize(fp);
+	buffer = (char*)malloc(len+1);
+	if( buffer == NULL )
+	{
+		fclose(fp);
+		return;
+	}
+	len = fread(buffer, sizeof(char), len, fp);
+	buffer[len] = '\0';
+	if( ferror(fp) )
+	{
+		free(buffer);
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	scan->buffer = buffer;
+	scan->len = len;
+
+	for( p = skip_space(buffer); p && *p ; p = skip_space(p) )
+	{
+		struct npc_src_line* line;
+
+		if( scan->line_count == max )
+		{
+			struct npc_src_line* lines = (struct npc_src_line*)realloc(scan->lines, (max ? max*2 : 256)*sizeof(struct npc_src_line));
+			if( lines == NULL )
+				break;
+			scan->lines = lines;
+			max = ( max ? max*2 : 256 );
+		}
+		line = &scan->lines[scan->line_count];
+		line->offset = (int)(p-buffer);
+		line->script_start = line->script_end = -1;
+		line->count = sv_parse(p, len+buffer-p, 0, '\t', line->pos, ARRAYLENGTH(line->pos), (e_svopt)(SV_TERMINATE_LF|SV_TERMINATE_CRLF));
+		if( line->count < 3 )
+			break;// syntax error
+
+		if( line->count > 3 && line->pos[5]-line->pos[4] == 6 && strncasecmp(p+line->pos[4], "script", 6) == 0 )
+		{// script or function, skip the body
+			const char* start = strchr(p, '{');
+			const char* end;
+			if( start == NULL || npc_skip_curly(start, &end, NULL) != 0 )
+				break;// syntax error
+			line->script_start = (int)(start-buffer);
+			line->script_end = (int)(end-buffer);
+			++scan->line_count;
+			p = end;
+			continue;
+		}
+		++scan->line_count;
+		p = strchr(p, '\n');// next line
+	}
+}
+
+struct npc_prescan_batch {
+	struct npc_src_prescan* files;
+	int count;
+	int next; // next file to be read
+	amutex* mutex;
+	acond* cond; // signaled when a file is done
+};
+
+/// Loader thread, reads and splits npc files in order until there are none left.
+static void* npc_prescan_worker(void* param)
+{
+	struct npc_prescan_batch* batch = (struct npc_prescan_batch*)param;
+
+	for(;;)
+	{
+		int i;
+
+		amutex_lock(batch->mutex);
+		i = batch->next++;
+		amutex_unlock(batch->mutex);
+		if( i >= batch->count )
+			break;
+
+		npc_prescan_file(&batch->files[i]);
+
+		amutex_lock(batch->mutex);
+		batch->files[i].done = true;
+		acond_broadcast(batch->cond);
+		amutex_unlock(batch->mutex);
+	}
+	return NULL;
+}
+
+/// Parses all npc source files in order.
+/// Loader threads read and split the files ahead of the main thread, which
+/// does everything that touches the server state, so the result is the same.
+static void npc_parsesrcfiles(void)
+{
+	struct npc_prescan_batch batch;
+	struct npc_src_list* file;
+	athread** threads;
+	int thread_count, i;
+
+	thread_count = ( npc_parse_threads < 0 ? athread_cpu_count() : npc_parse_threads );
+	memset(&batch, 0, sizeof(batch));
+	for( file = npc_src_files; file != NULL; file = file->next )
+		++batch.count;
+	thread_count = min(thread_count, batch.count);
+
+	if( thread_count < 1 || batch.count < 2 )
+	{// no loader threads
+		for( file = npc_src_files; file != NULL; file = file->next )
+		{
+			ShowStatus("Loading NPC file: %s"CL_CLL"\r", file->name);
+			npc_parsesrcfile(file->name);
+		}
+		return;
+	}
+
+	CREATE(batch.files, struct npc_src_prescan, batch.count);
+	for( i = 0, file = npc_src_files; file != NULL; file = file->next, ++i )
+		batch.files[i].filepath = file->name;
+	batch.mutex = amutex_create();
+	batch.cond = acond_create();
+
+	CREATE(threads, athread*, thread_count);
+	for( i = 0; i < thread_count; ++i )
+		threads[i] = athread_create(npc_prescan_worker, &batch);
+
+	for( i = 0; i < batch.count; ++i )
+	{
+		struct npc_src_prescan* scan = &batch.files[i];
+
+		ShowStatus("Loading NPC file: %s"CL_CLL"\r", scan->filepath);
+		amutex_lock(batch.mutex);
+		if( !scan->done && batch.next <= i )
+		{// not taken by a loader thread yet, do it here
+			batch.next = i+1;
+			amutex_unlock(batch.mutex);
+			npc_prescan_file(scan);
+			amutex_lock(batch.mutex);
+			scan->done = true;
+		}
+		while( !scan->done )
+			acond_wait(batch.cond, batch.mutex);
+		amutex_unlock(batch.mutex);
+
+		if( scan->buffer == NULL )
+			npc_parsesrcfile(scan->filepath);// report the error
+		else
+		{
+			npc_prescan = scan;
+			npc_prescan_idx = 0;
+			npc_parsebuffer(scan->filepath, scan->buffer, scan->len);
+			npc_prescan = NULL;
+		}
+		free(scan->buffer);
+		free(scan->lines);
+	}
+
+	for( i = 0; i < thread_count; ++i )
+		athread_join(threads[i]);
+	aFree(threads);
+	acond_destroy(batch.cond);
+	amutex_destroy(batch.mutex);
+	aFree(batch.files);
+}
+
 void npc_parsesrcfile(const char* filepath)
 {
-	int m, lines = 0;
 	FILE* fp;
 	size_t len;
 	char* buffer;
-	const char* p;
 
 	// read whole file to buffer
 	fp = fopen(filepath, "rb");
@@ -3150,6 +3393,17 @@ void npc_parsesrcfile(const char* filepath)
 	}
 	fclose(fp);
 
+	npc_parsebuffer(filepath, buffer, len);
+	aFree(buffer);
+}
+
+/// Parses the contents of a npc source file.
+/// Uses the lines split by the loader thread if npc_prescan is set.
+static void npc_parsebuffer(const char* filepath, const char* buffer, size_t len)
+{
+	int m, lines = 0;
+	const char* p;
+
 	// parse buffer
 	for( p = skip_space(buffer); p && *p ; p = skip_space(p) )
 	{
@@ -3159,7 +3413,14 @@ void npc_parsesrcfile(const char* filepath)
 		lines++;
 
 		// w1<TAB>w2<TAB>w3<TAB>w4
-		count = sv_parse(p, len+buffer-p, 0, '\t', pos, ARRAYLENGTH(pos), (e_svopt)(SV_TERMINATE_LF|SV_TERMINATE_CRLF));
+		npc_prescan_line = npc_prescan_find((int)(p-buffer));
+		if( npc_prescan_line )
+		{// already split by the loader thread
+			count = npc_prescan_line->count;
+			memcpy(pos, npc_prescan_line->pos, sizeof(pos));
+		}
+		else
+			count = sv_parse(p, len+buffer-p, 0, '\t', pos, ARRAYLENGTH(pos), (e_svopt)(SV_TERMINATE_LF|SV_TERMINATE_CRLF));
 		if( count < 0 )
 		{
 			ShowError("npc_parsesrcfile: Parse error in file '%s', line '%d'. Stopping...\n", filepath, strline(buffer,p-buffer));
@@ -3266,9 +3527,7 @@ void npc_parsesrcfile(const char* filepath)
 			p = strchr(p,'\n');// skip and continue
 		}
 	}
-	aFree(buffer);
-
-	return;
+	npc_prescan_line = NULL;
 }
 
 int npc_script_event(struct map_session_data* sd, enum npce_event type)
@@ -3344,7 +3603,6 @@ void npc_read_event_script(void)
 
 int npc_reload(void)
 {
-	struct npc_src_list *nsl;
 	int m, i;
 	int npc_new_min = npc_id;
 	struct s_mapiterator* iter;
@@ -3399,11 +3657,8 @@ int npc_reload(void)
 
 	//TODO: the following code is copy-pasted from do_init_npc(); clean it up
 	// Reloading npcs now
-	for (nsl = npc_src_files; nsl; nsl = nsl->next)
-	{
-		ShowStatus("Loading NPC file: %s"CL_CLL"\r", nsl->name);
-		npc_parsesrcfile(nsl->name);
-	}
+	npc_parsesrcfiles();
+	script_cache_save(true);
 
 	ShowInfo ("Done loading '"CL_WHITE"%d"CL_RESET"' NPCs:"CL_CLL"\n"
 		"\t-'"CL_WHITE"%d"CL_RESET"' Warps\n"
@@ -3496,7 +3751,6 @@ static void npc_debug_warps(void)
  *------------------------------------------*/
 int do_init_npc(void)
 {
-	struct npc_src_list *file;
 	int i;
 
 	//Stock view data for normal npcs.
@@ -3512,11 +3766,8 @@ int do_init_npc(void)
 
 	// process all npc files
 	ShowStatus("Loading NPCs...\r");
-	for( file = npc_src_files; file != NULL; file = file->next )
-	{
-		ShowStatus("Loading NPC file: %s"CL_CLL"\r", file->name);
-		npc_parsesrcfile(file->name);
-	}
+	npc_parsesrcfiles();
+	script_cache_save(true);
 
 	ShowInfo ("Done loading '"CL_WHITE"%d"CL_RESET"' NPCs:"CL_CLL"\n"
 		"\t-'"CL_WHITE"%d"CL_RESET"' Warps\n"
@@ -156,5 +156,6 @@ int npc_duplicate4instance(struct npc_data *snd, int m);
 int npc_cashshop_buy(struct map_session_data *sd, int nameid, int amount, int points);
 
 extern struct npc_data* fake_nd;
+extern int npc_parse_threads;
 
 #endif /* _NPC_H_ */
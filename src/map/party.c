@@ -32,6 +32,11 @@ static DBMap* party_db; // int party_id -> struct party_data* (releases data)
 static DBMap* party_booking_db; // int char_id -> struct party_booking_ad_info* (releases data) // Party Booking [Spiria]
 static unsigned long party_booking_nextid = 1;
 
+static int* party_xy_queue = NULL; // ids of the members with a pending position/hp update
+static int party_xy_count = 0;
+static int party_xy_max = 0;
+static unsigned int party_xy_round = 1; // current party_send_xy_timer interval
+
 int party_send_xy_timer(int tid, unsigned int tick, int id, intptr_t data);
 
 /*==========================================
@@ -121,6 +126,9 @@ void do_final_party(void)
 {
 	party_db->destroy(party_db,NULL);
 	party_booking_db->destroy(party_booking_db,NULL); // Party Booking [Spiria]
+	aFree(party_xy_queue);
+	party_xy_queue = NULL;
+	party_xy_count = party_xy_max = 0;
 }
 // 
 void do_init_party(void)
@@ -320,6 +328,8 @@ int party_recv_info(struct party* sp, int char_id)
 		if ( member->char_id == 0 )
 			continue;// empty
 		p->data[member_id].sd = party_sd_check(sp->party_id, member->account_id, member->char_id);
+		if( p->data[member_id].sd )
+			party_send_xy_mark(p->data[member_id].sd); // position/hp cache was reset
 	}
 	party_check_state(p);
 	while( added_count > 0 )// new in party
@@ -881,36 +891,54 @@ int party_skill_check(struct map_session_data *sd, int party_id, int skillid, in
 	return 0;
 }
 
+/// Queues a position/hp update of this party member for the next party_send_xy_timer.
+/// Called whenever the member moves or its hp changes.
+void party_send_xy_mark(struct map_session_data* sd)
+{
+	nullpo_retv(sd);
+
+	if( sd->status.party_id == 0 || sd->party_xy_round == party_xy_round )
+		return;// not in a party or already queued
+	sd->party_xy_round = party_xy_round;
+
+	if( party_xy_count == party_xy_max )
+	{
+		party_xy_max += 256;
+		RECREATE(party_xy_queue, int, party_xy_max);
+	}
+	party_xy_queue[party_xy_count++] = sd->bl.id;
+}
+
 int party_send_xy_timer(int tid, unsigned int tick, int id, intptr_t data)
 {
-	struct party_data* p;
+	int n;
 
-	DBIterator* iter = party_db->iterator(party_db);
-	// for each existing party,
-	for( p = (struct party_data*)iter->first(iter,NULL); iter->exists(iter); p = (struct party_data*)iter->next(iter,NULL) )
+	// for each member that moved or had its hp changed,
+	for( n = 0; n < party_xy_count; n++ )
 	{
+		struct map_session_data* sd = map_id2sd(party_xy_queue[n]);
+		struct party_data* p;
 		int i;
-		// for each member of this party,
-		for( i = 0; i < MAX_PARTY; i++ )
-		{
-			//struct map_session_data* sd = p->data[i].sd;
-			struct map_session_data* sd = map_charid2sd(p->party.member[i].char_id); //temporary crashfix
-			if( !sd ) continue;
-
-			if( p->data[i].x != sd->bl.x || p->data[i].y != sd->bl.y )
-			{// perform position update
-				clif_party_xy(sd);
-				p->data[i].x = sd->bl.x;
-				p->data[i].y = sd->bl.y;
-			}
-			if (battle_config.party_hp_mode && p->data[i].hp != sd->battle_status.hp)
-			{// perform hp update
-				clif_party_hp(sd);
-				p->data[i].hp = sd->battle_status.hp;
-			}
+
+		if( sd == NULL || (p = party_search(sd->status.party_id)) == NULL )
+			continue;
+		if( (i = party_getmemberid(p,sd)) == PARTY_MEMBER_NOTFOUND )
+			continue;
+
+		if( p->data[i].x != sd->bl.x || p->data[i].y != sd->bl.y )
+		{// perform position update
+			clif_party_xy(sd);
+			p->data[i].x = sd->bl.x;
+			p->data[i].y = sd->bl.y;
+		}
+		if (battle_config.party_hp_mode && p->data[i].hp != sd->battle_status.hp)
+		{// perform hp update
+			clif_party_hp(sd);
+			p->data[i].hp = sd->battle_status.hp;
 		}
 	}
-	iter->destroy(iter);
+	party_xy_count = 0;
+	party_xy_round++;
 
 	return 0;
 }
@@ -926,6 +954,7 @@ int party_send_xy_clear(struct party_data *p)
 		p->data[i].hp = 0;
 		p->data[i].x = 0;
 		p->data[i].y = 0;
+		party_send_xy_mark(p->data[i].sd);
 	}
 	return 0;
 }
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h> // USHRT_MAX
 
 
 #define MAX_HEAP 150
@@ -19,6 +20,22 @@
 struct tmp_path { short x,y,dist,before,cost,flag;};
 #define calc_index(x,y) (((x)+(y)*MAX_WALKPATH) & (MAX_WALKPATH*MAX_WALKPATH-1))
 
+/// Search state reused by every path_search call.
+/// A tp entry only holds data when its stamp matches the generation of the current search,
+/// so starting a search does not need to clear the table.
+struct path_workspace {
+	int heap[MAX_HEAP+1];
+	struct tmp_path tp[MAX_WALKPATH*MAX_WALKPATH];
+	unsigned int stamp[MAX_WALKPATH*MAX_WALKPATH];
+	unsigned int gen;
+};
+static struct path_workspace path_ws;
+
+/// Label of the cells that are not part of a connected area.
+#define PATH_NOLABEL 0
+/// Cells that can be part of a walk path, same as CELL_CHKNOREACH.
+#define path_isreachable(md,x,y) ( !map_getcellp((md),(x),(y),CELL_CHKNOREACH) )
+
 const char walk_choices [3][3] =
 {
 	{1,0,7},
@@ -108,13 +125,15 @@ static int calc_cost(struct tmp_path *p,int x1,int y1)
 /*==========================================
  * attach/adjust path if neccessary
  *------------------------------------------*/
-static int add_path(int *heap,struct tmp_path *tp,int x,int y,int dist,int before,int cost)
+static int add_path(struct path_workspace *ws,int x,int y,int dist,int before,int cost)
 {
+	int *heap = ws->heap;
+	struct tmp_path *tp = ws->tp;
 	int i;
 
 	i = calc_index(x,y);
 
-	if( tp[i].x == x && tp[i].y == y )
+	if( ws->stamp[i] == ws->gen && tp[i].x == x && tp[i].y == y )
 	{
 		if( tp[i].dist > dist )
 		{
@@ -130,9 +149,10 @@ static int add_path(int *heap,struct tmp_path *tp,int x,int y,int dist,int befor
 		return 0;
 	}
 
-	if( tp[i].x || tp[i].y )
+	if( ws->stamp[i] == ws->gen )
 		return 1;
 
+	ws->stamp[i] = ws->gen;
 	tp[i].x = x;
 	tp[i].y = y;
 	tp[i].dist = dist;
@@ -144,6 +164,120 @@ static int add_path(int *heap,struct tmp_path *tp,int x,int y,int dist,int befor
 	return 0;
 }
 
+/*==========================================
+ * Labels the 8-way connected areas of reachable cells.
+ * Every cell that a walk path can pass through gets the label of its area,
+ * so two cells with different labels can never be joined by a path.
+ * Areas after the 65534th share the last label, which keeps the check safe.
+ *------------------------------------------*/
+static void path_buildlabels(struct map_data* md)
+{
+	int* queue;
+	int xs = md->xs, ys = md->ys;
+	int i, head, tail;
+	unsigned short label = PATH_NOLABEL;
+
+	CREATE(md->cell_label, unsigned short, xs*ys);
+	CREATE(queue, int, xs*ys);
+
+	for( i = 0; i < xs*ys; ++i )
+	{
+		if( md->cell_label[i] != PATH_NOLABEL || !path_isreachable(md,i%xs,i/xs) )
+			continue;
+
+		if( label < USHRT_MAX )
+			label++;
+		md->cell_label[i] = label;
+		queue[0] = i;
+		head = 0;
+		tail = 1;
+
+		while( head < tail )
+		{
+			int x = queue[head]%xs, y = queue[head]/xs;
+			int dx, dy;
+			head++;
+
+			for( dy = -1; dy <= 1; ++dy )
+			for( dx = -1; dx <= 1; ++dx )
+			{
+				int nx = x+dx, ny = y+dy;
+
+				if( nx < 0 || nx >= xs || ny < 0 || ny >= ys )
+					continue;
+				if( md->cell_label[nx+ny*xs] != PATH_NOLABEL || !path_isreachable(md,nx,ny) )
+					continue;
+				md->cell_label[nx+ny*xs] = label;
+				queue[tail++] = nx+ny*xs;
+			}
+		}
+	}
+
+	aFree(queue);
+}
+
+/*==========================================
+ * Returns false if (x0,y0) and (x1,y1) are known to be in different areas.
+ * A start cell outside every area (ex: standing on a wall) is not checked.
+ *------------------------------------------*/
+static bool path_isconnected(struct map_data* md, int x0, int y0, int x1, int y1)
+{
+	unsigned short l0, l1;
+
+	if( md->cell_label == NULL )
+		path_buildlabels(md);
+
+	l0 = md->cell_label[x0+y0*md->xs];
+	l1 = md->cell_label[x1+y1*md->xs];
+	return ( l0 == PATH_NOLABEL || l1 == PATH_NOLABEL || l0 == l1 );
+}
+
+/*==========================================
+ * Updates the labels after the walkability of a cell changed.
+ * Cells that become blocked keep their label, the areas are only too large then.
+ * Cells that become reachable drop the labels unless all their reachable
+ * neighbours are already in the same area, they are rebuilt on the next search.
+ *------------------------------------------*/
+void path_cellchanged(struct map_data* md, int x, int y)
+{
+	unsigned short label;
+	int dx, dy;
+
+	if( md->cell_label == NULL || !path_isreachable(md,x,y) )
+		return;
+
+	label = md->cell_label[x+y*md->xs];
+	if( label == PATH_NOLABEL )
+	{
+		path_freelabels(md);
+		return;
+	}
+
+	for( dy = -1; dy <= 1; ++dy )
+	for( dx = -1; dx <= 1; ++dx )
+	{
+		int nx = x+dx, ny = y+dy;
+
+		if( nx < 0 || nx >= md->xs || ny < 0 || ny >= md->ys || !path_isreachable(md,nx,ny) )
+			continue;
+		if( md->cell_label[nx+ny*md->xs] != label )
+		{// joins two areas
+			path_freelabels(md);
+			return;
+		}
+	}
+}
+
+/// Frees the labels of a map.
+void path_freelabels(struct map_data* md)
+{
+	if( md->cell_label )
+	{
+		aFree(md->cell_label);
+		md->cell_label = NULL;
+	}
+}
+
 /*==========================================
  * Find the closest reachable cell, 'count' cells away from (x0,y0) in direction (dx,dy).
  * 
@@ -272,8 +406,9 @@ bool path_search_long(struct shootpath_data *spd,int m,int x0,int y0,int x1,int
  *------------------------------------------*/
 bool path_search(struct walkpath_data *wpd,int m,int x0,int y0,int x1,int y1,int flag,cell_chk cell)
 {
-	int heap[MAX_HEAP+1];
-	struct tmp_path tp[MAX_WALKPATH*MAX_WALKPATH];
+	struct path_workspace *ws = &path_ws;
+	int *heap = ws->heap;
+	struct tmp_path *tp = ws->tp;
 	register int i,j,len,x,y,dx,dy;
 	int rp,xs,ys;
 	struct map_data *md;
@@ -295,6 +430,8 @@ bool path_search(struct walkpath_data *wpd,int m,int x0,int y0,int x1,int y1,int
 		return false;
 	if( x1 < 0 || x1 >= md->xs || y1 < 0 || y1 >= md->ys || map_getcellp(md,x1,y1,cell) )
 		return false;
+	if( (cell == CELL_CHKNOPASS || cell == CELL_CHKNOREACH) && !path_isconnected(md,x0,y0,x1,y1) )
+		return false; // target is in another area
 
 	// calculate (sgn(x1-x0), sgn(y1-y0))
 	dx = ((dx = x1-x0)) ? ((dx<0) ? -1 : 1) : 0;
@@ -331,9 +468,14 @@ bool path_search(struct walkpath_data *wpd,int m,int x0,int y0,int x1,int y1,int
 	if( flag&1 )
 		return false;
 
-	memset(tp,0,sizeof(tp));
+	if( ++ws->gen == 0 )
+	{// generation wrapped around, stale stamps could match again
+		memset(ws->stamp,0,sizeof(ws->stamp));
+		ws->gen = 1;
+	}
 
 	i=calc_index(x0,y0);
+	ws->stamp[i]=ws->gen;
 	tp[i].x=x0;
 	tp[i].y=y0;
 	tp[i].dist=0;
@@ -367,28 +509,28 @@ bool path_search(struct walkpath_data *wpd,int m,int x0,int y0,int x1,int y1,int
 
 		if(y < ys && !map_getcellp(md,x  ,y+1,cell)) {
 			f |= 1; dc[0] = (y >= y1 ? 20 : 0);
-			e+=add_path(heap,tp,x  ,y+1,dist,rp,cost+dc[0]); // (x,   y+1)
+			e+=add_path(ws,x  ,y+1,dist,rp,cost+dc[0]); // (x,   y+1)
 		}
 		if(x > 0  && !map_getcellp(md,x-1,y  ,cell)) {
 			f |= 2; dc[1] = (x <= x1 ? 20 : 0);
-			e+=add_path(heap,tp,x-1,y  ,dist,rp,cost+dc[1]); // (x-1, y  )
+			e+=add_path(ws,x-1,y  ,dist,rp,cost+dc[1]); // (x-1, y  )
 		}
 		if(y > 0  && !map_getcellp(md,x  ,y-1,cell)) {
 			f |= 4; dc[2] = (y <= y1 ? 20 : 0);
-			e+=add_path(heap,tp,x  ,y-1,dist,rp,cost+dc[2]); // (x  , y-1)
+			e+=add_path(ws,x  ,y-1,dist,rp,cost+dc[2]); // (x  , y-1)
 		}
 		if(x < xs && !map_getcellp(md,x+1,y  ,cell)) {
 			f |= 8; dc[3] = (x >= x1 ? 20 : 0);
-			e+=add_path(heap,tp,x+1,y  ,dist,rp,cost+dc[3]); // (x+1, y  )
+			e+=add_path(ws,x+1,y  ,dist,rp,cost+dc[3]); // (x+1, y  )
 		}
 		if( (f & (2+1)) == (2+1) && !map_getcellp(md,x-1,y+1,cell))
-			e+=add_path(heap,tp,x-1,y+1,dist+4,rp,cost+dc[1]+dc[0]-6);		// (x-1, y+1)
+			e+=add_path(ws,x-1,y+1,dist+4,rp,cost+dc[1]+dc[0]-6);		// (x-1, y+1)
 		if( (f & (2+4)) == (2+4) && !map_getcellp(md,x-1,y-1,cell))
-			e+=add_path(heap,tp,x-1,y-1,dist+4,rp,cost+dc[1]+dc[2]-6);		// (x-1, y-1)
+			e+=add_path(ws,x-1,y-1,dist+4,rp,cost+dc[1]+dc[2]-6);		// (x-1, y-1)
 		if( (f & (8+4)) == (8+4) && !map_getcellp(md,x+1,y-1,cell))
-			e+=add_path(heap,tp,x+1,y-1,dist+4,rp,cost+dc[3]+dc[2]-6);		// (x+1, y-1)
+			e+=add_path(ws,x+1,y-1,dist+4,rp,cost+dc[3]+dc[2]-6);		// (x+1, y-1)
 		if( (f & (8+1)) == (8+1) && !map_getcellp(md,x+1,y+1,cell))
-			e+=add_path(heap,tp,x+1,y+1,dist+4,rp,cost+dc[3]+dc[0]-6);		// (x+1, y+1)
+			e+=add_path(ws,x+1,y+1,dist+4,rp,cost+dc[3]+dc[0]-6);		// (x+1, y+1)
 		tp[rp].flag=1;
 		if(e || heap[0]>=MAX_HEAP-5)
 			return false;
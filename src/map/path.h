@@ -28,6 +28,10 @@ bool path_search(struct walkpath_data *wpd,int m,int x0,int y0,int x1,int y1,int
 // tries to find a shootable path
 bool path_search_long(struct shootpath_data *spd,int m,int x0,int y0,int x1,int y1,cell_chk cell);
 
+// connected area labels
+void path_cellchanged(struct map_data* md, int x, int y);
+void path_freelabels(struct map_data* md);
+
 
 // distance related functions
 int check_distance(int dx, int dy, int distance);
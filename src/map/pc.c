@@ -394,6 +394,8 @@ void pc_onstatuschanged(struct map_session_data* sd, int type)
 			clif_hpmeter(sd);
 		if( !battle_config.party_hp_mode && sd->status.party_id )
 			clif_party_hp(sd);
+		else if( battle_config.party_hp_mode )
+			party_send_xy_mark(sd);
 		if( sd->bg_id )
 			clif_bg_hp(sd);
 	break;
@@ -4267,8 +4269,9 @@ int pc_setpos(struct map_session_data* sd, unsigned short mapindex, int x, int y
 			if (sd->sc.data[SC_KNOWLEDGE]) {
 				struct status_change_entry *sce = sd->sc.data[SC_KNOWLEDGE];
 				if (sce->timer != INVALID_TIMER)
-					delete_timer(sce->timer, status_change_timer);
-				sce->timer = add_timer(gettick() + skill_get_time(SG_KNOWLEDGE, sce->val1), status_change_timer, sd->bl.id, SC_KNOWLEDGE);
+					sc_timer_settick(sce->timer, gettick() + skill_get_time(SG_KNOWLEDGE, sce->val1));
+				else
+					sce->timer = sc_timer_add(gettick() + skill_get_time(SG_KNOWLEDGE, sce->val1), sd->bl.id, SC_KNOWLEDGE);
 			}
 		}
 		if (battle_config.clear_unit_onwarp&BL_PC)
@@ -6350,6 +6353,8 @@ int pc_setparam(struct map_session_data *sd,int type,int val)
 void pc_heal(struct map_session_data *sd,unsigned int hp,unsigned int sp, int type)
 {
 	if (type) {
+		if (hp && battle_config.party_hp_mode)
+			party_send_xy_mark(sd);
 		if (hp)
 			clif_heal(sd->fd,SP_HP,hp);
 		if (sp)
@@ -349,6 +349,7 @@ struct map_session_data {
 	int guild_invite,guild_invite_account;
 	int guild_emblem_id,guild_alliance,guild_alliance_account;
 	short guild_x,guild_y; // For guildmate position display. [Skotlex] should be short [zzo]
+	unsigned int party_xy_round, guild_xy_round; // interval in which the party/guild position update was queued
 	int guildspy; // [Syrus22]
 	int partyspy; // [Syrus22]
 
@@ -573,6 +574,7 @@ int pc_reg_received(struct map_session_data *sd);
 int pc_isequip(struct map_session_data *sd,int n);
 int pc_equippoint(struct map_session_data *sd,int n);
 int pc_setinventorydata(struct map_session_data *sd);
+int pc_setequipindex(struct map_session_data *sd);
 
 int pc_checkskill(struct map_session_data *sd,int skill_id);
 int pc_checkallowskill(struct map_session_data *sd);
@@ -195,7 +195,7 @@ static struct str_data_struct {
 	int label;
 	int (*func)(struct script_state *st);
 	int val;
-	int next;
+	unsigned int hash; // calc_hash() of the string
 } *str_data = NULL;
 static int str_data_size = 0; // size of the data
 static int str_num = LABEL_START; // next id to be assigned
@@ -206,9 +206,16 @@ static int str_size = 0; // size of the buffer
 static int str_pos = 0; // next position to be assigned
 
 
-// Using a prime number for SCRIPT_HASH_SIZE should give better distributions
-#define SCRIPT_HASH_SIZE 1021
-int str_hash[SCRIPT_HASH_SIZE];
+// str_hash indexes str_data by (case-insensitive) string, using open addressing
+// with linear probing. Each slot holds a string id (0 if unused) and a copy of its hash.
+// The table size is a power of two and doubles when it gets 3/4 full.
+#define SCRIPT_HASH_INITIAL_SIZE 4096
+static struct str_hash_slot {
+	unsigned int hash;
+	int id;
+} *str_hash = NULL;
+static int str_hash_size = 0; // number of slots
+static int str_hash_count = 0; // number of used slots
 // Specifies which string hashing method to use
 //#define SCRIPT_HASH_DJB2
 //#define SCRIPT_HASH_SDBM
@@ -238,6 +245,7 @@ struct Script_Config script_config = {
 	"OnPCJobLvUpEvent", //joblvup_event_name
 	"OnTouch_",	//ontouch_name (runs on first visible char to enter area, picks another char if the first char leaves)
 	"OnTouch",	//ontouch2_name (run whenever a char walks into the OnTouch area)
+	1, "db/script_cache.dat", // script_cache/script_cache_file
 };
 
 static jmp_buf     error_jump;
@@ -641,7 +649,7 @@ static unsigned int calc_hash(const char* p)
 		h = ( h << 1 ) + ( h >> 3 ) + ( h >> 5 ) + ( h >> 8 ) + (unsigned char)TOLOWER(*p++);
 #endif
 
-	return h % SCRIPT_HASH_SIZE;
+	return h;
 }
 
 
@@ -656,67 +664,99 @@ const char* get_str(int id)
 	return str_buf+str_data[id].str;
 }
 
+/// Returns the str_hash slot of the string, or the unused slot where it would be inserted.
+static int str_hash_find(const char* p, unsigned int h)
+{
+	unsigned int mask = str_hash_size-1;
+	unsigned int i;
+
+	for( i = h&mask; str_hash[i].id != 0; i = (i+1)&mask )
+		if( str_hash[i].hash == h && strcasecmp(get_str(str_hash[i].id),p) == 0 )
+			break;
+
+	return (int)i;
+}
+
+/// Resizes str_hash and reinserts all the strings.
+static void str_hash_resize(int size)
+{
+	unsigned int mask = size-1;
+	int i;
+
+	if( str_hash )
+		aFree(str_hash);
+	CREATE(str_hash, struct str_hash_slot, size);
+	str_hash_size = size;
+
+	for( i = LABEL_START; i < str_num; i++ )
+	{
+		unsigned int j;
+		for( j = str_data[i].hash&mask; str_hash[j].id != 0; j = (j+1)&mask )
+			;
+		str_hash[j].hash = str_data[i].hash;
+		str_hash[j].id = i;
+	}
+}
+
 /// Returns the uid of the string, or -1.
 static int search_str(const char* p)
 {
 	int i;
 
-	for( i = str_hash[calc_hash(p)]; i != 0; i = str_data[i].next )
-		if( strcasecmp(get_str(i),p) == 0 )
-			return i;
+	if( str_hash_size == 0 )
+		return -1;
+
+	i = str_hash_find(p, calc_hash(p));
+	if( str_hash[i].id == 0 )
+		return -1;
 
-	return -1;
+	return str_hash[i].id;
 }
 
 /// Stores a copy of the string and returns its id.
 /// If an identical string is already present, returns its id instead.
 int add_str(const char* p)
 {
-	int i, h;
+	unsigned int h;
+	int i;
 	int len;
 
-	h = calc_hash(p);
+	if( (str_hash_count+1)*4 > str_hash_size*3 )
+		str_hash_resize(str_hash_size ? 2*str_hash_size : SCRIPT_HASH_INITIAL_SIZE);
 
-	if( str_hash[h] == 0 )
-	{// empty bucket, add new node here
-		str_hash[h] = str_num;
-	}
-	else
-	{// scan for end of list, or occurence of identical string
-		for( i = str_hash[h]; ; i = str_data[i].next )
-		{
-			if( strcasecmp(get_str(i),p) == 0 )
-				return i; // string already in list
-			if( str_data[i].next == 0 )
-				break; // reached the end
-		}
+	h = calc_hash(p);
+	i = str_hash_find(p, h);
+	if( str_hash[i].id != 0 )
+		return str_hash[i].id; // string already in the table
 
-		// append node to end of list
-		str_data[i].next = str_num;
-	}
+	str_hash[i].hash = h;
+	str_hash[i].id = str_num;
+	str_hash_count++;
 
 	// grow list if neccessary
 	if( str_num >= str_data_size )
 	{
-		str_data_size += 128;
+		int old_size = str_data_size;
+		str_data_size = max(2*str_data_size, 128);
 		RECREATE(str_data,struct str_data_struct,str_data_size);
-		memset(str_data + (str_data_size - 128), '\0', 128);
+		memset(str_data + old_size, '\0', (str_data_size - old_size)*sizeof(struct str_data_struct));
 	}
 
 	len=(int)strlen(p);
 
 	// grow string buffer if neccessary
-	while( str_pos+len+1 >= str_size )
+	if( str_pos+len+1 >= str_size )
 	{
-		str_size += 256;
+		int old_size = str_size;
+		str_size = max(2*str_size, str_pos+len+1+256);
 		RECREATE(str_buf,char,str_size);
-		memset(str_buf + (str_size - 256), '\0', 256);
+		memset(str_buf + old_size, '\0', str_size - old_size);
 	}
 
 	safestrncpy(str_buf+str_pos, p, len+1);
 	str_data[str_num].type = C_NOP;
 	str_data[str_num].str = str_pos;
-	str_data[str_num].next = 0;
+	str_data[str_num].hash = h;
 	str_data[str_num].func = NULL;
 	str_data[str_num].backpatch = -1;
 	str_data[str_num].label = -1;
@@ -2070,12 +2110,24 @@ void script_error(const char* src, const char* file, int start_line, const char*
 /*==========================================
  * XNvg̉
  *------------------------------------------*/
+/// Registers the built-in functions and constants before the first script is parsed.
+static void parse_script_init(void)
+{
+	static bool first = true;
+
+	if( first )
+	{
+		add_buildin_func();
+		read_constdb();
+		first = false;
+	}
+}
+
 struct script_code* parse_script(const char *src,const char *file,int line,int options)
 {
 	const char *p,*tmpp;
 	int i;
 	struct script_code* code = NULL;
-	static int first=1;
 	char end;
 	bool unresolved_names = false;
 
@@ -2083,11 +2135,7 @@ struct script_code* parse_script(const char *src,const char *file,int line,int o
 		return NULL;// empty script
 
 	memset(&syntax,0,sizeof(syntax));
-	if(first){
-		add_buildin_func();
-		read_constdb();
-		first=0;
-	}
+	parse_script_init();
 
 	script_buf=(unsigned char *)aMalloc(SCRIPT_BLOCK_SIZE*sizeof(unsigned char));
 	script_pos=0;
@@ -2260,6 +2308,635 @@ struct script_code* parse_script(const char *src,const char *file,int line,int o
 	return code;
 }
 
+/*==========================================
+ * Compiled script cache.
+ * Scripts are looked up by the MD5 digest of their source text. Name references
+ * in the cached bytecode are stored as indexes into a per-script name table
+ * and remapped to str_data ids when the script is loaded.
+ *------------------------------------------*/
+#define SCRIPT_CACHE_MAGIC "eASC"
+#define SCRIPT_CACHE_VERSION 2
+
+/// Label (or internal jump target) defined by a cached script.
+struct script_cache_label {
+	char* name;
+	int type; // C_POS or C_USERFUNC_POS
+	int pos;
+	bool in_label_db; // if it was recorded in scriptlabel_db
+};
+
+struct script_cache_entry {
+	struct script_cache_entry* next; // next entry with the same hash
+	uint8 digest[16]; // MD5 of the source (its first bytes are the db key)
+	int len; // length of the source
+	int options; // parse_script options
+	int script_size;
+	unsigned char* script_buf; // C_NAME references hold indexes into names
+	int name_count;
+	char** names;
+	int label_count;
+	struct script_cache_label* labels;
+	bool used; // looked up or added since the cache was loaded
+};
+
+static DBMap* script_cache_db = NULL; // unsigned int key -> struct script_cache_entry*
+static unsigned int script_cache_fingerprint = 0;
+static bool script_cache_dirty = false;
+
+/// Returns the db key of a source digest.
+static unsigned int script_cache_key(const uint8* digest)
+{
+	return (unsigned int)(digest[0] | (digest[1]<<8) | (digest[2]<<16) | ((unsigned int)digest[3]<<24));
+}
+
+/// Hashes everything outside of the source that affects the compiled code:
+/// built-in functions, constants, parameters and parser options.
+static unsigned int script_cache_calc_fingerprint(void)
+{
+	unsigned int h = SCRIPT_CACHE_VERSION;
+	int i;
+
+	for( i = LABEL_START; i < str_num; ++i )
+	{
+		const char* p;
+
+		if( str_data[i].type != C_FUNC && str_data[i].type != C_INT && str_data[i].type != C_PARAM )
+			continue;
+		h = h*31 + str_data[i].type;
+		h = h*31 + str_data[i].val;
+		for( p = get_str(i); *p; ++p )
+			h = h*31 + (unsigned char)TOLOWER(*p);
+		if( str_data[i].type == C_FUNC )
+			for( p = buildin_func[str_data[i].val].arg; *p; ++p )
+				h = h*31 + (unsigned char)*p;
+	}
+	h = h*31 + script_config.warn_func_mismatch_paramnum;
+
+	return h;
+}
+
+static void script_cache_entry_free(struct script_cache_entry* e)
+{
+	int i;
+
+	while( e )
+	{
+		struct script_cache_entry* next = e->next;
+
+		for( i = 0; i < e->name_count; ++i )
+			aFree(e->names[i]);
+		for( i = 0; i < e->label_count; ++i )
+			aFree(e->labels[i].name);
+		aFree(e->names);
+		aFree(e->labels);
+		aFree(e->script_buf);
+		aFree(e);
+		e = next;
+	}
+}
+
+static int script_cache_db_final(DBKey key, void* data, va_list ap)
+{
+	script_cache_entry_free((struct script_cache_entry*)data);
+	return 0;
+}
+
+/// Calls func for every C_NAME reference in the bytecode, replacing it by the returned value.
+static void script_cache_remap(unsigned char* buf, int size, int (*func)(int id, void* data), void* data)
+{
+	int pos = 0;
+
+	while( pos < size )
+	{
+		switch( get_com(buf, &pos) )
+		{
+		case C_INT:
+			get_num(buf, &pos);
+			break;
+		case C_POS:
+			pos += 3;
+			break;
+		case C_NAME:
+			if( GETVALUE(buf, pos) != 0xffffff )
+				SETVALUE(buf, pos, func(GETVALUE(buf, pos), data));
+			pos += 3;
+			break;
+		case C_STR:
+			pos += (int)strlen((char*)buf + pos) + 1;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/// script_cache_remap callback, turns a str_data id into an index of the entry's name table.
+static int script_cache_remap_store(int id, void* data)
+{
+	struct script_cache_entry* e = (struct script_cache_entry*)data;
+	int i;
+
+	ARR_FIND(0, e->name_count, i, strcmp(e->names[i], get_str(id)) == 0);
+	if( i == e->name_count )
+	{
+		RECREATE(e->names, char*, e->name_count+1);
+		e->names[e->name_count++] = aStrdup(get_str(id));
+	}
+	return i;
+}
+
+/// script_cache_remap callback, turns an index of the entry's name table into a str_data id.
+static int script_cache_remap_load(int idx, void* data)
+{
+	return ((int*)data)[idx];
+}
+
+/// Builds a cache entry from freshly compiled code.
+/// Must be called right after parse_script, while str_data and scriptlabel_db still describe the script.
+static struct script_cache_entry* script_cache_create(const struct script_code* code, int len, const uint8* digest, int options)
+{
+	struct script_cache_entry* e;
+	int i;
+
+	CREATE(e, struct script_cache_entry, 1);
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->len = len;
+	e->options = options;
+	e->used = true;
+	e->script_size = code->script_size;
+	e->script_buf = (unsigned char*)aMalloc(max(code->script_size,1));
+	memcpy(e->script_buf, code->script_buf, code->script_size);
+	script_cache_remap(e->script_buf, e->script_size, script_cache_remap_store, e);
+
+	for( i = LABEL_START; i < str_num; ++i )
+	{
+		struct script_cache_label* l;
+
+		if( str_data[i].type != C_POS && str_data[i].type != C_USERFUNC_POS )
+			continue;
+		RECREATE(e->labels, struct script_cache_label, e->label_count+1);
+		l = &e->labels[e->label_count++];
+		l->name = aStrdup(get_str(i));
+		l->type = str_data[i].type;
+		l->pos = str_data[i].label;
+		l->in_label_db = ( options&SCRIPT_USE_LABEL_DB && strdb_exists(scriptlabel_db, get_str(i)) );
+	}
+
+	return e;
+}
+
+/// Returns true if two cache entries hold the same compiled script.
+static bool script_cache_compare(const struct script_cache_entry* a, const struct script_cache_entry* b)
+{
+	int i, j;
+
+	if( a->script_size != b->script_size || a->name_count != b->name_count || a->label_count != b->label_count )
+		return false;
+	if( memcmp(a->script_buf, b->script_buf, a->script_size) != 0 )
+		return false;
+	for( i = 0; i < a->name_count; ++i )
+		if( strcmp(a->names[i], b->names[i]) != 0 )
+			return false;
+	for( i = 0; i < a->label_count; ++i )
+	{
+		ARR_FIND(0, b->label_count, j, strcmp(a->labels[i].name, b->labels[j].name) == 0);
+		if( j == b->label_count || a->labels[i].type != b->labels[j].type || a->labels[i].pos != b->labels[j].pos || a->labels[i].in_label_db != b->labels[j].in_label_db )
+			return false;
+	}
+	return true;
+}
+
+/// Rebuilds the compiled script from a cache entry, leaving str_data and
+/// scriptlabel_db in the same state as parse_script would.
+static struct script_code* script_cache_instantiate(const struct script_cache_entry* e)
+{
+	struct script_code* code;
+	int* ids;
+	int i;
+
+	// same as the start of parse_script
+	if( e->options&SCRIPT_USE_LABEL_DB )
+		scriptlabel_db->clear(scriptlabel_db, NULL);
+	for( i = LABEL_START; i < str_num; ++i )
+	{
+		if( str_data[i].type == C_POS || str_data[i].type == C_NAME ||
+			str_data[i].type == C_USERFUNC || str_data[i].type == C_USERFUNC_POS )
+		{
+			str_data[i].type = C_NOP;
+			str_data[i].backpatch = -1;
+			str_data[i].label = -1;
+		}
+	}
+
+	CREATE(ids, int, max(e->name_count,1));
+	for( i = 0; i < e->name_count; ++i )
+		ids[i] = add_str(e->names[i]);
+	for( i = 0; i < e->label_count; ++i )
+	{
+		int l = add_str(e->labels[i].name);
+		str_data[l].type = e->labels[i].type;
+		str_data[l].label = e->labels[i].pos;
+		if( e->labels[i].in_label_db )
+			strdb_put(scriptlabel_db, get_str(l), (void*)(intptr_t)e->labels[i].pos);
+	}
+
+	// same as the end of parse_script
+	for( i = LABEL_START; i < str_num; ++i )
+	{
+		if( str_data[i].type == C_NOP )
+		{
+			str_data[i].type = C_NAME;
+			str_data[i].label = i;
+		}
+	}
+
+	CREATE(code, struct script_code, 1);
+	code->script_buf = (unsigned char*)aMalloc(max(e->script_size,1));
+	code->script_size = e->script_size;
+	code->script_vars = NULL;
+	memcpy(code->script_buf, e->script_buf, e->script_size);
+	script_cache_remap(code->script_buf, code->script_size, script_cache_remap_load, ids);
+	aFree(ids);
+
+	return code;
+}
+
+/// Reads a 32-bit value from the cache file.
+static bool script_cache_read_int(FILE* fp, int* value)
+{
+	unsigned char buf[4];
+
+	if( fread(buf, 1, 4, fp) != 4 )
+		return false;
+	*value = (int)(buf[0] | (buf[1]<<8) | (buf[2]<<16) | ((unsigned int)buf[3]<<24));
+	return true;
+}
+
+/// Writes a 32-bit value to the cache file.
+static void script_cache_write_int(FILE* fp, int value)
+{
+	unsigned char buf[4];
+
+	buf[0] = (unsigned char)(value);
+	buf[1] = (unsigned char)(value>>8);
+	buf[2] = (unsigned char)(value>>16);
+	buf[3] = (unsigned char)(value>>24);
+	fwrite(buf, 1, 4, fp);
+}
+
+/// Reads a NUL-terminated string from the cache file.
+static char* script_cache_read_str(FILE* fp)
+{
+	char* str;
+	int c, len = 0, size = 32;
+
+	CREATE(str, char, size);
+	while( (c = fgetc(fp)) != EOF && c != '\0' )
+	{
+		if( len+1 >= size )
+		{
+			size *= 2;
+			RECREATE(str, char, size);
+		}
+		str[len++] = (char)c;
+	}
+	str[len] = '\0';
+	if( c == EOF )
+	{
+		aFree(str);
+		return NULL;
+	}
+	return str;
+}
+
+/// Reads one entry from the cache file.
+static struct script_cache_entry* script_cache_read_entry(FILE* fp)
+{
+	struct script_cache_entry* e;
+	int i, value;
+
+	CREATE(e, struct script_cache_entry, 1);
+	if( fread(e->digest, 1, sizeof(e->digest), fp) != sizeof(e->digest) ) { aFree(e); return NULL; }
+	if( !script_cache_read_int(fp, &e->len)
+	||  !script_cache_read_int(fp, &e->options)
+	||  !script_cache_read_int(fp, &e->script_size)
+	||  !script_cache_read_int(fp, &e->name_count)
+	||  !script_cache_read_int(fp, &e->label_count)
+	||  e->script_size < 0 || e->name_count < 0 || e->label_count < 0 )
+	{
+		aFree(e);
+		return NULL;
+	}
+
+	e->script_buf = (unsigned char*)aMalloc(max(e->script_size,1));
+	CREATE(e->names, char*, max(e->name_count,1));
+	CREATE(e->labels, struct script_cache_label, max(e->label_count,1));
+	if( fread(e->script_buf, 1, e->script_size, fp) != (size_t)e->script_size )
+		e->name_count = e->label_count = 0;
+	for( i = 0; i < e->name_count; ++i )
+	{
+		if( (e->names[i] = script_cache_read_str(fp)) == NULL )
+		{
+			e->name_count = i;
+			e->label_count = 0;
+			break;
+		}
+	}
+	for( i = 0; i < e->label_count; ++i )
+	{
+		struct script_cache_label* l = &e->labels[i];
+
+		if( (l->name = script_cache_read_str(fp)) == NULL )
+		{
+			e->label_count = i;
+			break;
+		}
+		if( !script_cache_read_int(fp, &l->type) || !script_cache_read_int(fp, &l->pos) || !script_cache_read_int(fp, &value) )
+		{
+			e->label_count = i+1;
+			script_cache_entry_free(e);
+			return NULL;
+		}
+		l->in_label_db = ( value != 0 );
+	}
+	if( feof(fp) || ferror(fp) )
+	{
+		script_cache_entry_free(e);
+		return NULL;
+	}
+	return e;
+}
+
+/// Loads the compiled script cache from disk.
+static void script_cache_load(void)
+{
+	char magic[4];
+	FILE* fp;
+	int version, fingerprint, count, i;
+
+	script_cache_db = idb_alloc(DB_OPT_BASE);
+	script_cache_fingerprint = script_cache_calc_fingerprint();
+	script_cache_dirty = false;
+
+	if( (fp = fopen(script_config.script_cache_file, "rb")) == NULL )
+		return;
+
+	if( fread(magic, 1, 4, fp) != 4 || memcmp(magic, SCRIPT_CACHE_MAGIC, 4) != 0 ||
+		!script_cache_read_int(fp, &version) || version != SCRIPT_CACHE_VERSION ||
+		!script_cache_read_int(fp, &fingerprint) || (unsigned int)fingerprint != script_cache_fingerprint ||
+		!script_cache_read_int(fp, &count) )
+	{// outdated cache, rebuild it
+		ShowInfo("Script cache '"CL_WHITE"%s"CL_RESET"' is outdated, rebuilding it.\n", script_config.script_cache_file);
+		fclose(fp);
+		script_cache_dirty = true;
+		return;
+	}
+
+	for( i = 0; i < count; ++i )
+	{
+		unsigned int key;
+		struct script_cache_entry* e = script_cache_read_entry(fp);
+
+		if( e == NULL )
+		{
+			ShowWarning("script_cache_load: cache file '%s' is truncated, rebuilding it.\n", script_config.script_cache_file);
+			script_cache_dirty = true;
+			break;
+		}
+		key = script_cache_key(e->digest);
+		e->next = (struct script_cache_entry*)idb_get(script_cache_db, key);
+		idb_put(script_cache_db, key, e);
+	}
+	fclose(fp);
+
+	ShowStatus("Loaded '"CL_WHITE"%d"CL_RESET"' entries from the script cache '"CL_WHITE"%s"CL_RESET"'.\n", i, script_config.script_cache_file);
+}
+
+/// Writes the cache to disk if it changed and frees it.
+/// With prune, only the entries that were used since the cache was loaded are kept
+/// (all the scripts were loaded); otherwise all of them are.
+void script_cache_save(bool prune)
+{
+	DBIterator* iter;
+	struct script_cache_entry* e;
+	FILE* fp;
+	int count = 0, unused = 0;
+
+	if( script_cache_db == NULL )
+		return;
+
+	iter = script_cache_db->iterator(script_cache_db);
+	for( e = (struct script_cache_entry*)iter->first(iter,NULL); iter->exists(iter); e = (struct script_cache_entry*)iter->next(iter,NULL) )
+		for( ; e; e = e->next )
+			if( e->used || !prune ) ++count; else ++unused;
+
+	if( script_cache_dirty || unused > 0 )
+	{
+		if( (fp = fopen(script_config.script_cache_file, "wb")) == NULL )
+			ShowError("script_cache_save: can't write to '%s'.\n", script_config.script_cache_file);
+		else
+		{
+			fwrite(SCRIPT_CACHE_MAGIC, 1, 4, fp);
+			script_cache_write_int(fp, SCRIPT_CACHE_VERSION);
+			script_cache_write_int(fp, (int)script_cache_fingerprint);
+			script_cache_write_int(fp, count);
+			for( e = (struct script_cache_entry*)iter->first(iter,NULL); iter->exists(iter); e = (struct script_cache_entry*)iter->next(iter,NULL) )
+			{
+				for( ; e; e = e->next )
+				{
+					int i;
+
+					if( !e->used && prune )
+						continue;
+					fwrite(e->digest, 1, sizeof(e->digest), fp);
+					script_cache_write_int(fp, e->len);
+					script_cache_write_int(fp, e->options);
+					script_cache_write_int(fp, e->script_size);
+					script_cache_write_int(fp, e->name_count);
+					script_cache_write_int(fp, e->label_count);
+					fwrite(e->script_buf, 1, e->script_size, fp);
+					for( i = 0; i < e->name_count; ++i )
+						fwrite(e->names[i], 1, strlen(e->names[i])+1, fp);
+					for( i = 0; i < e->label_count; ++i )
+					{
+						fwrite(e->labels[i].name, 1, strlen(e->labels[i].name)+1, fp);
+						script_cache_write_int(fp, e->labels[i].type);
+						script_cache_write_int(fp, e->labels[i].pos);
+						script_cache_write_int(fp, e->labels[i].in_label_db ? 1 : 0);
+					}
+				}
+			}
+			fclose(fp);
+			ShowStatus("Saved '"CL_WHITE"%d"CL_RESET"' entries to the script cache '"CL_WHITE"%s"CL_RESET"'.\n", count, script_config.script_cache_file);
+		}
+	}
+	iter->destroy(iter);
+
+	script_cache_db->destroy(script_cache_db, script_cache_db_final);
+	script_cache_db = NULL;
+}
+
+/// Same as parse_script, but reuses the compiled code from the script cache
+/// when the source didn't change since it was last compiled.
+struct script_code* parse_script_cached(const char* src, int len, const char* file, int line, int options)
+{
+	struct script_cache_entry* e = NULL;
+	struct script_code* code;
+	uint8 digest[16];
+	unsigned int key = 0;
+	char* buf;
+
+	buf = (char*)aMalloc(len+1);
+	memcpy(buf, src, len);
+	buf[len] = '\0';
+
+	if( script_config.script_cache )
+	{
+		parse_script_init();
+		if( script_cache_db == NULL )
+			script_cache_load();
+
+		MD5_Binary(buf, digest);
+		key = script_cache_key(digest);
+		for( e = (struct script_cache_entry*)idb_get(script_cache_db, key); e; e = e->next )
+			if( memcmp(e->digest, digest, sizeof(digest)) == 0 && e->len == len && e->options == options )
+				break;
+
+		if( e && script_config.script_cache == 1 )
+		{// cache hit
+			e->used = true;
+			aFree(buf);
+			return script_cache_instantiate(e);
+		}
+	}
+
+	// compile it
+	code = parse_script(buf, file, line, options);
+	aFree(buf);
+	if( code == NULL || !script_config.script_cache )
+		return code;
+
+	if( e )
+	{// verify mode, check that the cached code matches
+		struct script_cache_entry* fresh = script_cache_create(code, len, digest, options);
+		if( !script_cache_compare(e, fresh) )
+		{
+			struct script_cache_entry tmp;
+			ShowWarning("parse_script_cached: cached code of the script in file '%s' line %d doesn't match the compiled code, replacing it.\n", file, line);
+			fresh->next = e->next;
+			tmp = *e; *e = *fresh; *fresh = tmp;
+			fresh->next = NULL;
+			script_cache_dirty = true;
+		}
+		e->used = true;
+		script_cache_entry_free(fresh);
+	}
+	else
+	{
+		e = script_cache_create(code, len, digest, options);
+		e->next = (struct script_cache_entry*)idb_get(script_cache_db, key);
+		idb_put(script_cache_db, key, e);
+		script_cache_dirty = true;
+	}
+	return code;
+}
+
+/// Returns a hash of everything outside of the source that affects compiled scripts.
+unsigned int script_get_fingerprint(void)
+{
+	parse_script_init();
+	return script_cache_calc_fingerprint();
+}
+
+/// Converts compiled code to a form that doesn't depend on str_data ids.
+/// Returns a buffer allocated with aMalloc and sets size to its length.
+unsigned char* script_code_export(const struct script_code* code, int* size)
+{
+	struct script_cache_entry e;
+	unsigned char* buf;
+	int i, len, pos;
+
+	memset(&e, 0, sizeof(e));
+	e.script_size = code->script_size;
+	e.script_buf = (unsigned char*)aMalloc(max(code->script_size,1));
+	memcpy(e.script_buf, code->script_buf, code->script_size);
+	script_cache_remap(e.script_buf, e.script_size, script_cache_remap_store, &e);
+
+	len = 8 + e.script_size;
+	for( i = 0; i < e.name_count; ++i )
+		len += (int)strlen(e.names[i]) + 1;
+
+	buf = (unsigned char*)aMalloc(len);
+	memcpy(buf, &e.script_size, 4);
+	memcpy(buf+4, &e.name_count, 4);
+	pos = 8;
+	for( i = 0; i < e.name_count; ++i )
+	{
+		int n = (int)strlen(e.names[i]) + 1;
+		memcpy(buf+pos, e.names[i], n);
+		pos += n;
+		aFree(e.names[i]);
+	}
+	memcpy(buf+pos, e.script_buf, e.script_size);
+	aFree(e.names);
+	aFree(e.script_buf);
+
+	*size = len;
+	return buf;
+}
+
+/// Rebuilds compiled code from the output of script_code_export.
+/// Returns NULL if the data is invalid.
+struct script_code* script_code_import(const unsigned char* buf, int size)
+{
+	struct script_code* code;
+	int* ids;
+	int i, pos, script_size, name_count;
+
+	if( size < 8 )
+		return NULL;
+	memcpy(&script_size, buf, 4);
+	memcpy(&name_count, buf+4, 4);
+	if( script_size < 0 || name_count < 0 || name_count > size )
+		return NULL;
+
+	parse_script_init();
+	CREATE(ids, int, max(name_count,1));
+	for( i = 0, pos = 8; i < name_count; ++i )
+	{
+		const char* name = (const char*)buf+pos;
+		int n = (int)strnlen(name, size-pos);
+
+		if( pos + n >= size )
+		{
+			aFree(ids);
+			return NULL;
+		}
+		ids[i] = add_str(name);
+		if( str_data[ids[i]].type == C_NOP )
+		{// new name, same as the end of parse_script
+			str_data[ids[i]].type = C_NAME;
+			str_data[ids[i]].label = ids[i];
+		}
+		pos += n + 1;
+	}
+	if( pos + script_size != size )
+	{
+		aFree(ids);
+		return NULL;
+	}
+
+	CREATE(code, struct script_code, 1);
+	code->script_buf = (unsigned char*)aMalloc(max(script_size,1));
+	code->script_size = script_size;
+	code->script_vars = NULL;
+	memcpy(code->script_buf, buf+pos, script_size);
+	script_cache_remap(code->script_buf, code->script_size, script_cache_remap_load, ids);
+	aFree(ids);
+
+	return code;
+}
+
 /// Returns the player attached to this script, identified by the rid.
 /// If there is no player attached, the script is terminated.
 TBL_PC *script_rid2sd(struct script_state *st)
@@ -3603,6 +4280,12 @@ int script_config_read(char *cfgName)
 		else if(strcmpi(w1,"warn_func_mismatch_argtypes")==0) {
 			script_config.warn_func_mismatch_argtypes = config_switch(w2);
 		}
+		else if(strcmpi(w1,"script_cache")==0) {
+			script_config.script_cache = config_switch(w2);
+		}
+		else if(strcmpi(w1,"script_cache_file")==0) {
+			safestrncpy(script_config.script_cache_file, w2, sizeof(script_config.script_cache_file));
+		}
 		else if(strcmpi(w1,"import")==0){
 			script_config_read(w2);
 		}
@@ -3733,51 +4416,29 @@ int do_final_script()
 	{
 		FILE *fp = fopen("hash_dump.txt","wt");
 		if(fp) {
-			int i,count[SCRIPT_HASH_SIZE];
-			int count2[SCRIPT_HASH_SIZE]; // number of buckets with a certain number of items
-			int n=0;
-			int min=INT_MAX,max=0,zero=0;
+			unsigned int mask = str_hash_size-1;
+			int i,dist,min=INT_MAX,max=0;
 			double mean=0.0f;
-			double median=0.0f;
 
 			ShowNotice("Dumping script str hash information to hash_dump.txt\n");
-			memset(count, 0, sizeof(count));
-			fprintf(fp,"num : hash : data_name\n");
+			fprintf(fp,"num : hash : probes : data_name\n");
 			fprintf(fp,"---------------------------------------------------------------\n");
 			for(i=LABEL_START; i<str_num; i++) {
-				unsigned int h = calc_hash(get_str(i));
-				fprintf(fp,"%04d : %4u : %s\n",i,h, get_str(i));
-				++count[h];
+				unsigned int h = str_data[i].hash;
+				unsigned int j = (unsigned int)str_hash_find(get_str(i), h);
+				dist = (int)((j - (h&mask))&mask) + 1; // number of slots checked to find the string
+				fprintf(fp,"%04d : %08x : %4d : %s\n",i,h,dist,get_str(i));
+				if(min > dist)
+					min = dist;
+				if(max < dist)
+					max = dist;
+				mean += dist;
 			}
-			fprintf(fp,"--------------------\n\n");
-			memset(count2, 0, sizeof(count2));
-			for(i=0; i<SCRIPT_HASH_SIZE; i++) {
-				fprintf(fp,"  hash %3d = %d\n",i,count[i]);
-				if(min > count[i])
-					min = count[i];		// minimun count of collision
-				if(max < count[i])
-					max = count[i];		// maximun count of collision
-				if(count[i] == 0)
-					zero++;
-				++count2[count[i]];
-			}
-			fprintf(fp,"\n--------------------\n  items : buckets\n--------------------\n");
-			for( i=min; i <= max; ++i ){
-				fprintf(fp,"  %5d : %7d\n",i,count2[i]);
-				mean += 1.0f*i*count2[i]/SCRIPT_HASH_SIZE; // Note: this will always result in <nr labels>/<nr buckets>
-			}
-			for( i=min; i <= max; ++i ){
-				n += count2[i];
-				if( n*2 >= SCRIPT_HASH_SIZE )
-				{
-					if( SCRIPT_HASH_SIZE%2 == 0 && SCRIPT_HASH_SIZE/2 == n )
-						median = (i+i+1)/2.0f;
-					else
-						median = i;
-					break;
-				}
-			}
-			fprintf(fp,"--------------------\n    min = %d, max = %d, zero = %d\n    mean = %lf, median = %lf\n",min,max,zero,mean,median);
+			if( str_num > LABEL_START )
+				mean /= str_num - LABEL_START;
+			else
+				min = 0;
+			fprintf(fp,"--------------------\n    slots = %d, used = %d\n    min = %d, max = %d, mean = %lf probes\n",str_hash_size,str_hash_count,min,max,mean);
 			fclose(fp);
 		}
 	}
@@ -3787,6 +4448,8 @@ int do_final_script()
 
 	scriptlabel_db->destroy(scriptlabel_db,NULL);
 	userfunc_db->destroy(userfunc_db,do_final_userfunc_sub);
+	if( script_cache_db )
+		script_cache_db->destroy(script_cache_db, script_cache_db_final);
 	autobonus_db->destroy(autobonus_db, do_final_autobonus_sub);
 	if(sleep_db) {
 		struct linkdb_node *n = (struct linkdb_node *)sleep_db;
@@ -3802,6 +4465,8 @@ int do_final_script()
 		aFree(str_data);
 	if (str_buf)
 		aFree(str_buf);
+	if (str_hash)
+		aFree(str_hash);
 
 	return 0;
 }
@@ -11826,7 +12491,6 @@ BUILDIN_FUNC(getmapmobs)
 	const char *str=NULL;
 	int m=-1,bx,by;
 	int count=0;
-	struct block_list *bl;
 
 	str=script_getstr(st,2);
 
@@ -11848,9 +12512,7 @@ BUILDIN_FUNC(getmapmobs)
 
 	for(by=0;by<=(map[m].ys-1)/BLOCK_SIZE;by++)
 		for(bx=0;bx<=(map[m].xs-1)/BLOCK_SIZE;bx++)
-			for( bl = map[m].block_mob[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
-				if(bl->x>=0 && bl->x<=map[m].xs-1 && bl->y>=0 && bl->y<=map[m].ys-1)
-					count++;
+			count += map[m].block_mob[bx+by*map[m].bxs].count;
 
 	script_pushint(st,count);
 	return 0;
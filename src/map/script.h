@@ -31,6 +31,9 @@ extern struct Script_Config {
 
 	const char* ontouch_name;
 	const char* ontouch2_name;
+
+	int script_cache; // 0 = disabled, 1 = enabled, 2 = enabled and checked against a fresh compile
+	char script_cache_file[256];
 } script_config;
 
 typedef enum c_op {
@@ -149,6 +152,11 @@ const char* skip_space(const char* p);
 void script_error(const char* src, const char* file, int start_line, const char* error_msg, const char* error_pos);
 
 struct script_code* parse_script(const char* src,const char* file,int line,int options);
+struct script_code* parse_script_cached(const char* src, int len, const char* file, int line, int options);
+void script_cache_save(bool prune);
+unsigned int script_get_fingerprint(void);
+unsigned char* script_code_export(const struct script_code* code, int* size);
+struct script_code* script_code_import(const unsigned char* buf, int size);
 void run_script_sub(struct script_code *rootscript,int pos,int rid,int oid, char* file, int lineno);
 void run_script(struct script_code*,int,int,int);
 
@@ -2,6 +2,7 @@
 // For more information, see LICENCE in the main folder
 
 #include "../common/cbasetypes.h"
+#include "../common/db.h"  // DBMap, ARR_FIND
 #include "../common/malloc.h"  // aMalloc, aRealloc, aFree
 #include "../common/showmsg.h"  // ShowError, ShowWarning
 #include "../common/strlib.h"  // safestrncpy
@@ -22,13 +23,6 @@ enum e_searchstore_failure
 };
 
 
-enum e_searchstore_searchtype
-{
-	SEARCHTYPE_VENDING      = 0,
-	SEARCHTYPE_BUYING_STORE = 1,
-};
-
-
 enum e_searchstore_effecttype
 {
 	EFFECTTYPE_NORMAL = 0,
@@ -39,7 +33,42 @@ enum e_searchstore_effecttype
 
 /// type for shop search function
 typedef bool (*searchstore_search_t)(struct map_session_data* sd, unsigned short nameid);
-typedef bool (*searchstore_searchall_t)(struct map_session_data* sd, const struct s_search_store_search* s);
+
+
+/// maximum amount of items in a single store
+#define SEARCHSTORE_MAX_STOREITEMS max(MAX_VENDING, MAX_BUYINGSTORE_SLOTS)
+
+
+/// entry of the store index, ordered by price, account id and slot
+struct s_search_store_index_entry
+{
+	unsigned int price;
+	int account_id;
+	int slot;
+};
+
+
+/// all stores, that sell/buy an item
+struct s_search_store_index
+{
+	unsigned int count;
+	unsigned int max;
+	struct s_search_store_index_entry* entries;
+};
+
+
+/// items a store was indexed with
+struct s_search_store_indexed
+{
+	unsigned int count;
+	unsigned short nameid[SEARCHSTORE_MAX_STOREITEMS];
+	struct s_search_store_index_entry entry[SEARCHSTORE_MAX_STOREITEMS];
+};
+
+
+static DBMap* searchstore_index_db[SEARCHTYPE_MAX];  // unsigned short nameid -> struct s_search_store_index*
+static DBMap* searchstore_indexed_db[SEARCHTYPE_MAX];  // int account_id -> struct s_search_store_indexed*
+static const short searchstore_blankslots[MAX_SLOTS] = { 0 };
 
 
 /// retrieves search function by type
@@ -54,18 +83,6 @@ static searchstore_search_t searchstore_getsearchfunc(unsigned char type)
 }
 
 
-/// retrieves search-all function by type
-static searchstore_searchall_t searchstore_getsearchallfunc(unsigned char type)
-{
-	switch( type )
-	{
-		case SEARCHTYPE_VENDING:      return &vending_searchall;
-		case SEARCHTYPE_BUYING_STORE: return &buyingstore_searchall;
-	}
-	return NULL;
-}
-
-
 /// checks if the player has a store by type
 static bool searchstore_hasstore(struct map_session_data* sd, unsigned char type)
 {
@@ -90,6 +107,314 @@ static int searchstore_getstoreid(struct map_session_data* sd, unsigned char typ
 }
 
 
+/// returns amount of item slots in player's store by type
+static int searchstore_getslotcount(struct map_session_data* sd, unsigned char type)
+{
+	switch( type )
+	{
+		case SEARCHTYPE_VENDING:      return sd->vend_num;
+		case SEARCHTYPE_BUYING_STORE: return sd->buyingstore.slots;
+	}
+	return 0;
+}
+
+
+/// retrieves an item slot of player's store by type
+/// @return Whether or not the slot holds an item, that is being sold/bought.
+static bool searchstore_getslot(struct map_session_data* sd, unsigned char type, int slot, unsigned short* nameid, unsigned short* amount, unsigned int* price)
+{
+	switch( type )
+	{
+		case SEARCHTYPE_VENDING:
+			*nameid = sd->status.cart[sd->vending[slot].index].nameid;
+			*amount = sd->vending[slot].amount;
+			*price  = sd->vending[slot].value;
+			return (bool)( *nameid && *amount );
+		case SEARCHTYPE_BUYING_STORE:
+			*nameid = sd->buyingstore.items[slot].nameid;
+			*amount = sd->buyingstore.items[slot].amount;
+			*price  = (unsigned int)sd->buyingstore.items[slot].price;
+			return (bool)( *nameid && *amount );
+	}
+	return false;
+}
+
+
+/// compares an index entry with given key
+static int searchstore_index_cmp(const struct s_search_store_index_entry* entry, unsigned int price, int account_id, int slot)
+{
+	if( entry->price != price )
+	{
+		return entry->price < price ? -1 : 1;
+	}
+	if( entry->account_id != account_id )
+	{
+		return entry->account_id < account_id ? -1 : 1;
+	}
+	if( entry->slot != slot )
+	{
+		return entry->slot < slot ? -1 : 1;
+	}
+	return 0;
+}
+
+
+/// returns position of the first entry, that is not less than given key (or greater, if strict)
+static unsigned int searchstore_index_find(const struct s_search_store_index* idx, unsigned int price, int account_id, int slot, bool strict)
+{
+	unsigned int lo = 0, hi = idx->count;
+
+	while( lo < hi )
+	{
+		unsigned int mid = lo+(hi-lo)/2;
+		int cmp = searchstore_index_cmp(&idx->entries[mid], price, account_id, slot);
+
+		if( cmp < 0 || ( strict && cmp == 0 ) )
+		{
+			lo = mid+1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+
+static void searchstore_index_insert(unsigned char type, unsigned short nameid, const struct s_search_store_index_entry* entry)
+{
+	struct s_search_store_index* idx;
+	unsigned int pos;
+
+	if( ( idx = (struct s_search_store_index*)idb_get(searchstore_index_db[type], nameid) ) == NULL )
+	{
+		CREATE(idx, struct s_search_store_index, 1);
+		idb_put(searchstore_index_db[type], nameid, idx);
+	}
+
+	if( idx->count == idx->max )
+	{
+		idx->max = idx->max ? idx->max*2 : 8;
+		RECREATE(idx->entries, struct s_search_store_index_entry, idx->max);
+	}
+
+	pos = searchstore_index_find(idx, entry->price, entry->account_id, entry->slot, false);
+	memmove(&idx->entries[pos+1], &idx->entries[pos], (idx->count-pos)*sizeof(idx->entries[0]));
+	memcpy(&idx->entries[pos], entry, sizeof(idx->entries[0]));
+	idx->count++;
+}
+
+
+static void searchstore_index_erase(unsigned char type, unsigned short nameid, const struct s_search_store_index_entry* entry)
+{
+	struct s_search_store_index* idx;
+	unsigned int pos;
+
+	if( ( idx = (struct s_search_store_index*)idb_get(searchstore_index_db[type], nameid) ) == NULL )
+	{
+		return;
+	}
+
+	pos = searchstore_index_find(idx, entry->price, entry->account_id, entry->slot, false);
+	if( pos == idx->count || searchstore_index_cmp(&idx->entries[pos], entry->price, entry->account_id, entry->slot) )
+	{// not indexed
+		return;
+	}
+
+	idx->count--;
+	memmove(&idx->entries[pos], &idx->entries[pos+1], (idx->count-pos)*sizeof(idx->entries[0]));
+}
+
+
+/// Updates the store index after a store of given type was opened, changed (sales) or closed.
+void searchstore_update(struct map_session_data* sd, unsigned char type)
+{
+	struct s_search_store_indexed* indexed;
+	unsigned int i;
+	int slot, count;
+
+	if( type >= SEARCHTYPE_MAX )
+	{
+		return;
+	}
+
+	// drop previous entries
+	if( ( indexed = (struct s_search_store_indexed*)idb_get(searchstore_indexed_db[type], sd->status.account_id) ) != NULL )
+	{
+		for( i = 0; i < indexed->count; i++ )
+		{
+			searchstore_index_erase(type, indexed->nameid[i], &indexed->entry[i]);
+		}
+		indexed->count = 0;
+	}
+
+	if( !searchstore_hasstore(sd, type) )
+	{
+		if( indexed )
+		{
+			idb_remove(searchstore_indexed_db[type], sd->status.account_id);
+		}
+		return;
+	}
+
+	if( indexed == NULL )
+	{
+		CREATE(indexed, struct s_search_store_indexed, 1);
+		idb_put(searchstore_indexed_db[type], sd->status.account_id, indexed);
+	}
+
+	// add current items
+	count = min(searchstore_getslotcount(sd, type), SEARCHSTORE_MAX_STOREITEMS);
+
+	for( slot = 0; slot < count; slot++ )
+	{
+		struct s_search_store_index_entry* entry = &indexed->entry[indexed->count];
+		unsigned short nameid, amount;
+		unsigned int price;
+
+		if( !searchstore_getslot(sd, type, slot, &nameid, &amount, &price) )
+		{
+			continue;
+		}
+
+		entry->price      = price;
+		entry->account_id = sd->status.account_id;
+		entry->slot       = slot;
+		indexed->nameid[indexed->count++] = nameid;
+		searchstore_index_insert(type, nameid, entry);
+	}
+}
+
+
+/// checks whether a store item matches the requested cards
+static bool searchstore_checkcards(struct map_session_data* pl_sd, unsigned char type, int slot, const struct s_search_store_search* s)
+{
+	struct item* it;
+	unsigned int cidx;
+	int c, slots;
+
+	if( !s->card_count || type != SEARCHTYPE_VENDING )
+	{// nothing to check, buying stores cannot have cards
+		return true;
+	}
+
+	it = &pl_sd->status.cart[pl_sd->vending[slot].index];
+
+	if( itemdb_isspecial(it->card[0]) )
+	{// something, that is not a carded
+		return false;
+	}
+	slots = itemdb_slot(it->nameid);
+
+	for( c = 0; c < slots && it->card[c]; c++ )
+	{
+		ARR_FIND( 0, s->card_count, cidx, s->cardlist[cidx] == it->card[c] );
+		if( cidx != s->card_count )
+		{// found
+			return true;
+		}
+	}
+
+	// no card match
+	return false;
+}
+
+
+/// adds a store item to the results
+static void searchstore_result(struct map_session_data* sd, struct map_session_data* pl_sd, unsigned char type, int slot)
+{
+	struct s_search_store_info_item* ssitem = &sd->searchstore.items[sd->searchstore.count++];
+	unsigned short nameid, amount;
+	unsigned int price;
+
+	searchstore_getslot(pl_sd, type, slot, &nameid, &amount, &price);
+
+	ssitem->store_id = searchstore_getstoreid(pl_sd, type);
+	ssitem->account_id = pl_sd->status.account_id;
+	safestrncpy(ssitem->store_name, pl_sd->message, sizeof(ssitem->store_name));
+	ssitem->nameid = nameid;
+	ssitem->amount = amount;
+	ssitem->price = price;
+
+	if( type == SEARCHTYPE_VENDING )
+	{
+		struct item* it = &pl_sd->status.cart[pl_sd->vending[slot].index];
+
+		memcpy(ssitem->card, it->card, sizeof(ssitem->card));
+		ssitem->refine = it->refine;
+	}
+	else
+	{
+		memcpy(ssitem->card, searchstore_blankslots, sizeof(ssitem->card));
+		ssitem->refine = 0;
+	}
+}
+
+
+/// Continues the current search, until the result set holds limit results.
+/// Entries are visited in order of price, merged across all requested items.
+/// @return Whether or not there are further results.
+static bool searchstore_fetch(struct map_session_data* sd, unsigned int limit)
+{
+	struct s_search_store_search* s = &sd->searchstore.search;
+	unsigned char type = sd->searchstore.type;
+
+	if( limit > sd->searchstore.count )
+	{
+		RECREATE(sd->searchstore.items, struct s_search_store_info_item, limit);
+	}
+
+	for(;;)
+	{
+		struct s_search_store_index_entry* entry = NULL;
+		struct map_session_data* pl_sd;
+		unsigned int i;
+
+		// next entry after the cursor
+		for( i = 0; i < s->item_count; i++ )
+		{
+			struct s_search_store_index* idx = (struct s_search_store_index*)idb_get(searchstore_index_db[type], s->itemlist[i]);
+			unsigned int pos;
+
+			if( idx == NULL )
+			{
+				continue;
+			}
+
+			pos = searchstore_index_find(idx, s->last_price, s->last_account_id, s->last_slot, true);
+
+			if( pos < idx->count && ( entry == NULL || searchstore_index_cmp(&idx->entries[pos], entry->price, entry->account_id, entry->slot) < 0 ) )
+			{
+				entry = &idx->entries[pos];
+			}
+		}
+
+		if( entry == NULL || ( s->max_price && s->max_price < entry->price ) )
+		{// no more (affordable) entries
+			return false;
+		}
+
+		if( entry->account_id != sd->status.account_id  // skip own shop, if any
+		&&  ( pl_sd = map_id2sd(entry->account_id) ) != NULL
+		&&  searchstore_checkcards(pl_sd, type, entry->slot, s) )
+		{
+			if( sd->searchstore.count >= limit )
+			{// result set full, keep entry for next time
+				return true;
+			}
+
+			searchstore_result(sd, pl_sd, type, entry->slot);
+		}
+
+		s->last_price = entry->price;
+		s->last_account_id = entry->account_id;
+		s->last_slot = entry->slot;
+	}
+}
+
+
 bool searchstore_open(struct map_session_data* sd, unsigned int uses, unsigned short effect)
 {
 	if( !battle_config.feature_search_stores || sd->searchstore.open )
@@ -114,11 +439,8 @@ bool searchstore_open(struct map_session_data* sd, unsigned int uses, unsigned s
 
 void searchstore_query(struct map_session_data* sd, unsigned char type, unsigned int min_price, unsigned int max_price, const unsigned short* itemlist, unsigned int item_count, const unsigned short* cardlist, unsigned int card_count)
 {
-	unsigned int i;
-	struct map_session_data* pl_sd;
-	struct s_mapiterator* iter;
-	struct s_search_store_search s;
-	searchstore_searchall_t store_searchall;
+	unsigned int i, j;
+	struct s_search_store_search* s;
 	time_t querytime;
 
 	if( !battle_config.feature_search_stores )
@@ -131,7 +453,7 @@ void searchstore_query(struct map_session_data* sd, unsigned char type, unsigned
 		return;
 	}
 
-	if( ( store_searchall = searchstore_getsearchallfunc(type) ) == NULL )
+	if( type >= SEARCHTYPE_MAX )
 	{
 		ShowError("searchstore_query: Unknown search type %u (account_id=%d).\n", (unsigned int)type, sd->bl.id);
 		return;
@@ -183,39 +505,38 @@ void searchstore_query(struct map_session_data* sd, unsigned char type, unsigned
 	// drop previous results
 	searchstore_clear(sd);
 
-	// allocate max. amount of results
-	sd->searchstore.items = (struct s_search_store_info_item*)aMalloc(sizeof(struct s_search_store_info_item)*battle_config.searchstore_maxresults);
+	// setup search, the lists are kept for the following pages
+	s = &sd->searchstore.search;
+	CREATE(s->itemlist, unsigned short, max(item_count, 1));
+	CREATE(s->cardlist, unsigned short, max(card_count, 1));
 
-	// search
-	s.search_sd  = sd;
-	s.itemlist   = itemlist;
-	s.cardlist   = cardlist;
-	s.item_count = item_count;
-	s.card_count = card_count;
-	s.min_price  = min_price;
-	s.max_price  = max_price;
-	iter         = mapit_geteachpc();
-
-	for( pl_sd = (struct map_session_data*)mapit_first(iter); mapit_exists(iter);  pl_sd = (struct map_session_data*)mapit_next(iter) )
+	for( i = 0; i < item_count; i++ )
 	{
-		if( sd == pl_sd )
-		{// skip own shop, if any
-			continue;
-		}
-
-		if( !store_searchall(pl_sd, &s) )
-		{// exceeded result size
-			clif_search_store_info_failed(sd, SSI_FAILED_OVER_MAXCOUNT);
-			break;
+		ARR_FIND( 0, s->item_count, j, s->itemlist[j] == itemlist[i] );
+		if( j == s->item_count )
+		{// skip duplicates
+			s->itemlist[s->item_count++] = itemlist[i];
 		}
 	}
+	memcpy(s->cardlist, cardlist, card_count*sizeof(cardlist[0]));
+	s->card_count = card_count;
+	s->min_price  = min_price;
+	s->max_price  = max_price;
+
+	// start in front of the first entry within price range
+	s->last_price      = min_price;
+	s->last_account_id = 0;
+	s->last_slot       = 0;
 
-	mapit_free(iter);
+	// search first page
+	s->more = searchstore_fetch(sd, min(SEARCHSTORE_RESULTS_PER_PAGE, (unsigned int)battle_config.searchstore_maxresults));
 
 	if( sd->searchstore.count )
 	{
-		// reclaim unused memory
-		sd->searchstore.items = (struct s_search_store_info_item*)aRealloc(sd->searchstore.items, sizeof(struct s_search_store_info_item)*sd->searchstore.count);
+		if( !searchstore_querynext(sd) && s->more )
+		{// exceeded result size
+			clif_search_store_info_failed(sd, SSI_FAILED_OVER_MAXCOUNT);
+		}
 
 		// present results
 		clif_search_store_info_ack(sd);
@@ -240,7 +561,7 @@ void searchstore_query(struct map_session_data* sd, unsigned char type, unsigned
 /// checks whether or not more results are available for the client
 bool searchstore_querynext(struct map_session_data* sd)
 {
-	if( sd->searchstore.count && ( sd->searchstore.count-1 )/SEARCHSTORE_RESULTS_PER_PAGE < sd->searchstore.pages )
+	if( sd->searchstore.search.more && sd->searchstore.count < (unsigned int)battle_config.searchstore_maxresults )
 	{
 		return true;
 	}
@@ -251,11 +572,28 @@ bool searchstore_querynext(struct map_session_data* sd)
 
 void searchstore_next(struct map_session_data* sd)
 {
-	if( !battle_config.feature_search_stores || !sd->searchstore.open || sd->searchstore.count <= sd->searchstore.pages*SEARCHSTORE_RESULTS_PER_PAGE )
+	unsigned int limit;
+
+	if( !battle_config.feature_search_stores || !sd->searchstore.open || !searchstore_querynext(sd) )
 	{// nothing (more) to display
 		return;
 	}
 
+	// search next page
+	limit = min((sd->searchstore.pages+1)*SEARCHSTORE_RESULTS_PER_PAGE, (unsigned int)battle_config.searchstore_maxresults);
+	sd->searchstore.search.more = searchstore_fetch(sd, limit);
+
+	if( sd->searchstore.count <= sd->searchstore.pages*SEARCHSTORE_RESULTS_PER_PAGE )
+	{// remaining stores were closed in the mean time
+		clif_search_store_info_failed(sd, SSI_FAILED_NOTHING_SEARCH_ITEM);
+		return;
+	}
+
+	if( !searchstore_querynext(sd) && sd->searchstore.search.more )
+	{// exceeded result size
+		clif_search_store_info_failed(sd, SSI_FAILED_OVER_MAXCOUNT);
+	}
+
 	// present results
 	clif_search_store_info_ack(sd);
 
@@ -274,6 +612,13 @@ void searchstore_clear(struct map_session_data* sd)
 		sd->searchstore.items = NULL;
 	}
 
+	if( sd->searchstore.search.itemlist )
+	{// release search
+		aFree(sd->searchstore.search.itemlist);
+		aFree(sd->searchstore.search.cardlist);
+	}
+	memset(&sd->searchstore.search, 0, sizeof(sd->searchstore.search));
+
 	sd->searchstore.count = 0;
 	sd->searchstore.pages = 0;
 }
@@ -381,25 +726,36 @@ void searchstore_clearremote(struct map_session_data* sd)
 }
 
 
-/// receives results from a store-specific callback
-bool searchstore_result(struct map_session_data* sd, int store_id, int account_id, const char* store_name, unsigned short nameid, unsigned short amount, unsigned int price, const short* card, unsigned char refine)
+static int searchstore_index_final(DBKey key, void* data, va_list ap)
 {
-	struct s_search_store_info_item* ssitem;
+	struct s_search_store_index* idx = (struct s_search_store_index*)data;
 
-	if( sd->searchstore.count >= (unsigned int)battle_config.searchstore_maxresults )
-	{// no more
-		return false;
+	aFree(idx->entries);
+	aFree(idx);
+
+	return 0;
+}
+
+
+void do_init_searchstore(void)
+{
+	int i;
+
+	for( i = 0; i < SEARCHTYPE_MAX; i++ )
+	{
+		searchstore_index_db[i] = idb_alloc(DB_OPT_BASE);
+		searchstore_indexed_db[i] = idb_alloc(DB_OPT_RELEASE_DATA);
 	}
+}
 
-	ssitem = &sd->searchstore.items[sd->searchstore.count++];
-	ssitem->store_id = store_id;
-	ssitem->account_id = account_id;
-	safestrncpy(ssitem->store_name, store_name, sizeof(ssitem->store_name));
-	ssitem->nameid = nameid;
-	ssitem->amount = amount;
-	ssitem->price = price;
-	memcpy(ssitem->card, card, sizeof(ssitem->card));
-	ssitem->refine = refine;
 
-	return true;
+void do_final_searchstore(void)
+{
+	int i;
+
+	for( i = 0; i < SEARCHTYPE_MAX; i++ )
+	{
+		searchstore_index_db[i]->destroy(searchstore_index_db[i], searchstore_index_final);
+		db_destroy(searchstore_indexed_db[i]);
+	}
 }
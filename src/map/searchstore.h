@@ -6,16 +6,29 @@
 
 #define SEARCHSTORE_RESULTS_PER_PAGE 10
 
-/// information about the search being performed
+
+enum e_searchstore_searchtype
+{
+	SEARCHTYPE_VENDING      = 0,
+	SEARCHTYPE_BUYING_STORE = 1,
+	SEARCHTYPE_MAX
+};
+
+
+/// information about the search being performed, doubles as cursor into the store index
 struct s_search_store_search
 {
-	struct map_session_data* search_sd;  // sd of the searching player
-	const unsigned short* itemlist;
-	const unsigned short* cardlist;
+	unsigned short* itemlist;
+	unsigned short* cardlist;
 	unsigned int item_count;
 	unsigned int card_count;
 	unsigned int min_price;
 	unsigned int max_price;
+	// last visited index entry (price, account id, slot)
+	unsigned int last_price;
+	int last_account_id;
+	int last_slot;
+	bool more;  // further results are available
 };
 
 struct s_search_store_info_item
@@ -41,6 +54,7 @@ struct s_search_store_info
 	unsigned short effect;  // 0 = Normal (display coords), 1 = Cash (remote open store)
 	unsigned char type;  // 0 = Vending, 1 = Buying Store
 	bool open;
+	struct s_search_store_search search;
 };
 
 bool searchstore_open(struct map_session_data* sd, unsigned int uses, unsigned short effect);
@@ -52,6 +66,9 @@ void searchstore_close(struct map_session_data* sd);
 void searchstore_click(struct map_session_data* sd, int account_id, int store_id, unsigned short nameid);
 bool searchstore_queryremote(struct map_session_data* sd, int account_id);
 void searchstore_clearremote(struct map_session_data* sd);
-bool searchstore_result(struct map_session_data* sd, int store_id, int account_id, const char* store_name, unsigned short nameid, unsigned short amount, unsigned int price, const short* card, unsigned char refine);
+void searchstore_update(struct map_session_data* sd, unsigned char type);
+
+void do_init_searchstore(void);
+void do_final_searchstore(void);
 
 #endif  // _SEARCHSTORE_H_
@@ -0,0 +1,155 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "../common/cbasetypes.h"
+#include "../common/malloc.h"
+#include "../common/showmsg.h"
+#include "../common/thread.h"
+#include "shard.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SHARDS 64
+
+int map_shards = 0;
+
+struct shard_worker {
+	athread* thread;
+	int shard;
+	unsigned int generation; // last job done
+};
+
+static struct {
+	int count; // number of shards, 0 if disabled
+	struct shard_worker* workers; // workers of shards 1..count-1
+	amutex* mutex;
+	acond* wake; // signaled when there is a new job
+	acond* done; // signaled when the last worker finishes the job
+	ShardFunc func;
+	void* param;
+	unsigned int generation; // current job
+	int pending; // workers still running the current job
+	bool stop;
+} shard_pool;
+
+/// Returns the number of shards, or 0 if sharding is disabled.
+int shard_count(void)
+{
+	return shard_pool.count;
+}
+
+/// Worker thread, runs the jobs of its shard until the pool stops.
+static void* shard_worker(void* param)
+{
+	struct shard_worker* w = (struct shard_worker*)param;
+
+	for(;;)
+	{
+		ShardFunc func;
+		void* fparam;
+
+		amutex_lock(shard_pool.mutex);
+		while( w->generation == shard_pool.generation && !shard_pool.stop )
+			acond_wait(shard_pool.wake, shard_pool.mutex);
+		if( shard_pool.stop )
+		{
+			amutex_unlock(shard_pool.mutex);
+			break;
+		}
+		w->generation = shard_pool.generation;
+		func = shard_pool.func;
+		fparam = shard_pool.param;
+		amutex_unlock(shard_pool.mutex);
+
+		func(w->shard, fparam);
+
+		amutex_lock(shard_pool.mutex);
+		if( --shard_pool.pending == 0 )
+			acond_signal(shard_pool.done);
+		amutex_unlock(shard_pool.mutex);
+	}
+	return NULL;
+}
+
+/// Runs func(shard, param) for every shard and waits for all of them to finish.
+/// The main thread runs shard 0 itself.
+/// Returns false without calling func if sharding is disabled.
+bool shard_run(ShardFunc func, void* param)
+{
+	if( shard_pool.count == 0 )
+		return false;
+
+	if( shard_pool.count > 1 )
+	{
+		amutex_lock(shard_pool.mutex);
+		shard_pool.func = func;
+		shard_pool.param = param;
+		shard_pool.pending = shard_pool.count - 1;
+		++shard_pool.generation;
+		acond_broadcast(shard_pool.wake);
+		amutex_unlock(shard_pool.mutex);
+	}
+
+	func(0, param);
+
+	if( shard_pool.count > 1 )
+	{
+		amutex_lock(shard_pool.mutex);
+		while( shard_pool.pending > 0 )
+			acond_wait(shard_pool.done, shard_pool.mutex);
+		amutex_unlock(shard_pool.mutex);
+	}
+	return true;
+}
+
+/// Starts the workers.
+void do_init_shard(void)
+{
+	int i;
+
+	shard_pool.count = ( map_shards < 0 ? athread_cpu_count() : map_shards );
+	if( shard_pool.count > MAX_SHARDS )
+		shard_pool.count = MAX_SHARDS;
+	if( shard_pool.count < 1 )
+	{
+		shard_pool.count = 0;
+		return;
+	}
+
+	if( shard_pool.count > 1 )
+	{
+		shard_pool.mutex = amutex_create();
+		shard_pool.wake = acond_create();
+		shard_pool.done = acond_create();
+		CREATE(shard_pool.workers, struct shard_worker, shard_pool.count - 1);
+		for( i = 1; i < shard_pool.count; ++i )
+		{
+			struct shard_worker* w = &shard_pool.workers[i-1];
+			w->shard = i;
+			w->thread = athread_create(shard_worker, w);
+		}
+	}
+	ShowStatus("Running batch jobs in '"CL_WHITE"%d"CL_RESET"' shards.\n", shard_pool.count);
+}
+
+/// Stops the workers.
+void do_final_shard(void)
+{
+	int i;
+
+	if( shard_pool.count > 1 )
+	{
+		amutex_lock(shard_pool.mutex);
+		shard_pool.stop = true;
+		acond_broadcast(shard_pool.wake);
+		amutex_unlock(shard_pool.mutex);
+		for( i = 0; i < shard_pool.count - 1; ++i )
+			athread_join(shard_pool.workers[i].thread);
+		aFree(shard_pool.workers);
+		acond_destroy(shard_pool.done);
+		acond_destroy(shard_pool.wake);
+		amutex_destroy(shard_pool.mutex);
+	}
+	memset(&shard_pool, 0, sizeof(shard_pool));
+}
@@ -0,0 +1,25 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include "../common/cbasetypes.h"
+
+// Shards, a pool of workers for batch jobs (the main thread runs the first shard).
+// A shard job runs on all the shards at once and only reads the server state,
+// except for data of the objects it was given (its part of the batch);
+// its results are applied by the main thread afterwards, in shard order.
+// Workers must only use the system allocator (see thread.h).
+
+extern int map_shards; // number of shards (0 = disabled, everything runs on the main thread)
+
+typedef void (*ShardFunc)(int shard, void* param);
+
+int shard_count(void);
+bool shard_run(ShardFunc func, void* param);
+
+void do_init_shard(void);
+void do_final_shard(void);
+
+#endif /* _SHARD_H_ */
@@ -32,6 +32,7 @@
 #include "guild.h"
 #include "date.h"
 #include "unit.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,8 +53,6 @@
 static struct eri *skill_unit_ers = NULL; //For handling skill_unit's [Skotlex]
 static struct eri *skill_timer_ers = NULL; //For handling skill_timerskills [Skotlex]
 
-DBMap* skillunit_db = NULL; // int id -> struct skill_unit*
-
 DBMap* skilldb_name2id = NULL;
 struct s_skill_db skill_db[MAX_SKILL_DB];
 struct s_skill_produce_db skill_produce_db[MAX_SKILL_PRODUCE_DB];
@@ -194,6 +193,7 @@ struct skill_unit_group_tickset *skill_unitgrouptickset_search(struct block_list
 static int skill_unit_onplace(struct skill_unit *src,struct block_list *bl,unsigned int tick);
 static int skill_unit_onleft(int skill_id, struct block_list *bl,unsigned int tick);
 static int skill_unit_effect(struct block_list *bl,va_list ap);
+static void skill_unitgroup_wakeup(struct skill_unit_group* group);
 
 int enchant_eff[5] = { 10, 14, 17, 19, 20 };
 int deluge_eff[5] = { 5, 9, 12, 14, 15 };
@@ -1712,8 +1712,7 @@ int skill_attack (int attack_type, struct block_list* src, struct block_list *ds
 			  	{	//Extend combo time.
 					sce->val1 = skillid; //Update combo-skill
 					sce->val3 = skillid;
-					delete_timer(sce->timer, status_change_timer);
-					sce->timer = add_timer(tick+sce->val4, status_change_timer, src->id, SC_COMBO);
+					sc_timer_settick(sce->timer, tick+sce->val4);
 					break;
 				}
 				unit_cancel_combo(src); // Cancel combo wait
@@ -1965,22 +1964,10 @@ int skill_attack (int attack_type, struct block_list* src, struct block_list *ds
  *------------------------------------------*/
 static int skill_area_temp[8];
 typedef int (*SkillFunc)(struct block_list *, struct block_list *, int, int, unsigned int, int);
-int skill_area_sub (struct block_list *bl, va_list ap)
+static int skill_area_apply (struct block_list *bl, struct block_list *src, int skill_id, int skill_lv, unsigned int tick, int flag, SkillFunc func)
 {
-	struct block_list *src;
-	int skill_id,skill_lv,flag;
-	unsigned int tick;
-	SkillFunc func;
-
 	nullpo_ret(bl);
 
-	src=va_arg(ap,struct block_list *);
-	skill_id=va_arg(ap,int);
-	skill_lv=va_arg(ap,int);
-	tick=va_arg(ap,unsigned int);
-	flag=va_arg(ap,int);
-	func=va_arg(ap,SkillFunc);
-
 	if(battle_check_target(src,bl,flag) > 0)
 	{
 		// several splash skills need this initial dummy packet to display correctly
@@ -1995,6 +1982,23 @@ int skill_area_sub (struct block_list *bl, va_list ap)
 	return 0;
 }
 
+int skill_area_sub (struct block_list *bl, va_list ap)
+{
+	struct block_list *src;
+	int skill_id,skill_lv,flag;
+	unsigned int tick;
+	SkillFunc func;
+
+	src=va_arg(ap,struct block_list *);
+	skill_id=va_arg(ap,int);
+	skill_lv=va_arg(ap,int);
+	tick=va_arg(ap,unsigned int);
+	flag=va_arg(ap,int);
+	func=va_arg(ap,SkillFunc);
+
+	return skill_area_apply(bl,src,skill_id,skill_lv,tick,flag,func);
+}
+
 static int skill_check_unit_range_sub (struct block_list *bl, va_list ap)
 {
 	struct skill_unit *unit;
@@ -2773,6 +2777,9 @@ int skill_castend_damage_id (struct block_list* src, struct block_list *bl, int
 		}
 		else
 		{
+			struct s_mapquery q;
+			struct block_list* tbl;
+
 			if ( skillid == NJ_BAKUENRYU )
 				clif_skill_nodamage(src,bl,skillid,skilllv,1);
 
@@ -2787,7 +2794,10 @@ int skill_castend_damage_id (struct block_list* src, struct block_list *bl, int
 				skill_area_temp[0] = map_foreachinrange(skill_area_sub, bl, (skillid == AS_SPLASHER)?1:skill_get_splash(skillid, skilllv), BL_CHAR, src, skillid, skilllv, tick, BCT_ENEMY, skill_area_sub_count);
 
 			// recursive invocation of skill_castend_damage_id() with flag|1
-			map_foreachinrange(skill_area_sub, bl, skill_get_splash(skillid, skilllv), splash_target(src), src, skillid, skilllv, tick, flag|BCT_ENEMY|SD_SPLASH|1, skill_castend_damage_id);
+			map_query_inrange(&q, bl, skill_get_splash(skillid, skilllv), splash_target(src));
+			map_query_foreach(&q, tbl)
+				skill_area_apply(tbl, src, skillid, skilllv, tick, flag|BCT_ENEMY|SD_SPLASH|1, skill_castend_damage_id);
+			map_query_end(&q);
 
 			//FIXME: Isn't EarthQuake a ground skill after all?
 			if( skillid == NPC_EARTHQUAKE )
@@ -5110,6 +5120,7 @@ int skill_castend_nodamage_id (struct block_list *src, struct block_list *bl, in
 						clif_changetraplook(bl, UNT_USED_TRAPS);
 						su->group->limit=DIFF_TICK(tick+1500,su->group->tick);
 						su->limit=DIFF_TICK(tick+1500,su->group->tick);
+						skill_unitgroup_wakeup(su->group);
 				}
 			}
 		}
@@ -5862,8 +5873,8 @@ int skill_castend_id(int tid, unsigned int tick, int id, intptr_t data)
 			case NPC_GRANDDARKNESS:
 				if( (sc = status_get_sc(src)) && sc->data[SC_STRIPSHIELD] )
 				{
-					const struct TimerData *timer = get_timer(sc->data[SC_STRIPSHIELD]->timer);
-					if( timer && timer->func == status_change_timer && DIFF_TICK(timer->tick,gettick()+skill_get_time(ud->skillid, ud->skilllv)) > 0 )
+					const unsigned int* timer = sc_timer_gettick(sc->data[SC_STRIPSHIELD]->timer);
+					if( timer && DIFF_TICK(*timer,gettick()+skill_get_time(ud->skillid, ud->skilllv)) > 0 )
 						break;
 				}
 				sc_start2(src, SC_STRIPSHIELD, 100, 0, 1, skill_get_time(ud->skillid, ud->skilllv));
@@ -6187,7 +6198,10 @@ int skill_castend_pos2(struct block_list* src, int x, int y, int skillid, int sk
 				return 0; // not to consume items
 			}
 			else
+			{
 				sg->limit = 0; //Disable it.
+				skill_unitgroup_wakeup(sg);
+			}
 		}
 		skill_unitsetting(src,skillid,skilllv,x,y,0);
 		break;
@@ -6671,6 +6685,7 @@ static int skill_dance_overlap_sub(struct block_list* bl, va_list ap)
 		target->val2 |= UF_ENSEMBLE; //Add ensemble to signal this unit is overlapping.
 	else //Remove dissonance
 		target->val2 &= ~UF_ENSEMBLE;
+	skill_unitgroup_wakeup(target->group);
 
 	clif_skill_setunit(target); //Update look of affected cell.
 
@@ -7162,9 +7177,9 @@ static int skill_unit_onplace (struct skill_unit *src, struct block_list *bl, un
 			int sec = skill_get_time2(sg->skill_id,sg->skill_lv);
 			if( status_change_start(bl,type,10000,sg->skill_lv,1,sg->group_id,0,sec,8) )
 			{
-				const struct TimerData* td = sc->data[type]?get_timer(sc->data[type]->timer):NULL; 
+				const unsigned int* td = sc->data[type]?sc_timer_gettick(sc->data[type]->timer):NULL; 
 				if( td )
-					sec = DIFF_TICK(td->tick, tick);
+					sec = DIFF_TICK(*td, tick);
 				map_moveblock(bl, src->bl.x, src->bl.y, tick);
 				clif_fixpos(bl);
 				sg->val2 = bl->id;
@@ -7172,6 +7187,7 @@ static int skill_unit_onplace (struct skill_unit *src, struct block_list *bl, un
 			else
 				sec = 3000; //Couldn't trap it?
 			sg->limit = DIFF_TICK(tick,sg->tick)+sec;
+			skill_unitgroup_wakeup(sg);
 		}
 		break;
 	case UNT_SAFETYWALL:
@@ -7260,8 +7276,7 @@ static int skill_unit_onplace (struct skill_unit *src, struct block_list *bl, un
 		else if (sce->val4 == 1) {
 			//Readjust timers since the effect will not last long.
 			sce->val4 = 0;
-			delete_timer(sce->timer, status_change_timer);
-			sce->timer = add_timer(tick+sg->limit, status_change_timer, bl->id, type);
+			sc_timer_settick(sce->timer, tick+sg->limit);
 		}
 		break;
 
@@ -7498,9 +7513,9 @@ int skill_unit_onplace_timer (struct skill_unit *src, struct block_list *bl, uns
 				int sec = skill_get_time2(sg->skill_id,sg->skill_lv);
 				if( status_change_start(bl,type,10000,sg->skill_lv,sg->group_id,0,0,sec, 8) )
 				{
-					const struct TimerData* td = tsc->data[type]?get_timer(tsc->data[type]->timer):NULL; 
+					const unsigned int* td = tsc->data[type]?sc_timer_gettick(tsc->data[type]->timer):NULL; 
 					if( td )
-						sec = DIFF_TICK(td->tick, tick);
+						sec = DIFF_TICK(*td, tick);
 					unit_movepos(bl, src->bl.x, src->bl.y, 0, 0);
 					clif_fixpos(bl);
 					sg->val2 = bl->id;
@@ -7767,6 +7782,7 @@ int skill_unit_onout (struct skill_unit *src, struct block_list *bl, unsigned in
 				if (sce && sce->val3 == sg->group_id)
 					status_change_end(bl, type, INVALID_TIMER);
 				sg->limit = DIFF_TICK(tick,sg->tick)+1000;
+				skill_unitgroup_wakeup(sg);
 			}
 			break;
 		}
@@ -7838,11 +7854,10 @@ static int skill_unit_onleft (int skill_id, struct block_list *bl, unsigned int
 		case DC_SERVICEFORYOU:
 			if (sce)
 			{
-				delete_timer(sce->timer, status_change_timer);
 				//NOTE: It'd be nice if we could get the skill_lv for a more accurate extra time, but alas...
 				//not possible on our current implementation.
 				sce->val4 = 1; //Store the fact that this is a "reduced" duration effect.
-				sce->timer = add_timer(tick+skill_get_time2(skill_id,1), status_change_timer, bl->id, type);
+				sc_timer_settick(sce->timer, tick+skill_get_time2(skill_id,1));
 			}
 			break;
 		case PF_FOGWALL:
@@ -7854,8 +7869,7 @@ static int skill_unit_onleft (int skill_id, struct block_list *bl, unsigned int
 					if (bl->type == BL_PC) //Players get blind ended inmediately, others have it still for 30 secs. [Skotlex]
 						status_change_end(bl, SC_BLIND, INVALID_TIMER);
 					else {
-						delete_timer(sce->timer, status_change_timer);
-						sce->timer = add_timer(30000+tick, status_change_timer, bl->id, SC_BLIND);
+						sc_timer_settick(sce->timer, 30000+tick);
 					}
 				}
 			}
@@ -7934,6 +7948,7 @@ int skill_unit_ondamaged (struct skill_unit *src, struct block_list *bl, int dam
 	case UNT_ANKLESNARE:
 	case UNT_ICEWALL:
 		src->val1-=damage;
+		skill_unitgroup_wakeup(sg);
 		break;
 	case UNT_BLASTMINE:
 	case UNT_CLAYMORETRAP:
@@ -9975,7 +9990,6 @@ struct skill_unit *skill_initunit (struct skill_unit_group *group, int idx, int
 	unit->val1=val1;
 	unit->val2=val2;
 
-	idb_put(skillunit_db, unit->bl.id, unit);
 	map_addiddb(&unit->bl);
 	map_addblock(&unit->bl);
 
@@ -10049,7 +10063,6 @@ int skill_delunit (struct skill_unit* unit)
 	unit->group=NULL;
 	map_delblock(&unit->bl); // don't free yet
 	map_deliddb(&unit->bl);
-	idb_remove(skillunit_db, unit->bl.id);
 	if(--group->alive_count==0)
 		skill_delunitgroup(group);
 
@@ -10060,6 +10073,65 @@ int skill_delunit (struct skill_unit* unit)
  *------------------------------------------*/
 static DBMap* group_db = NULL;// int group_id -> struct skill_unit_group*
 
+/// Schedule of skill_unit_timer, a timing wheel of skill unit groups.
+/// Groups with an interval are due on every call, the others sleep until
+/// one of their units expires or something changes them (see skill_unitgroup_wakeup).
+#define SKILLUNIT_WHEEL_SHIFT 6 // 64ms slots
+#define SKILLUNIT_WHEEL_SIZE 256 // must be a power of 2
+#define skillunit_wheel_slot(tick) ( ((tick)>>SKILLUNIT_WHEEL_SHIFT)&(SKILLUNIT_WHEEL_SIZE-1) )
+static struct skill_unit_group* skillunit_wheel[SKILLUNIT_WHEEL_SIZE];
+static struct skill_unit_group* skillunit_due = NULL; // groups left to visit in the current skill_unit_timer call
+static struct skill_unit_group* skillunit_visiting = NULL; // group being visited, NULL if it was deleted
+static unsigned int skillunit_wheel_tick = 0; // tick of the last skill_unit_timer call
+
+/// Removes a group from the schedule.
+static void skill_unitgroup_unschedule(struct skill_unit_group* group)
+{
+	if( group == skillunit_visiting )
+		skillunit_visiting = NULL;
+	if( group->timer_list == NULL )
+		return;
+	if( group->timer_prev )
+		group->timer_prev->timer_next = group->timer_next;
+	else
+		*group->timer_list = group->timer_next;
+	if( group->timer_next )
+		group->timer_next->timer_prev = group->timer_prev;
+	group->timer_list = NULL;
+	group->timer_prev = group->timer_next = NULL;
+}
+
+/// Adds a group to a list of the schedule.
+static void skill_unitgroup_link(struct skill_unit_group* group, struct skill_unit_group** list)
+{
+	group->timer_list = list;
+	group->timer_prev = NULL;
+	group->timer_next = *list;
+	if( *list )
+		(*list)->timer_prev = group;
+	*list = group;
+}
+
+/// Schedules the next visit of a group.
+static void skill_unitgroup_schedule(struct skill_unit_group* group, unsigned int tick)
+{
+	skill_unitgroup_unschedule(group);
+	group->timer_tick = tick;
+	skill_unitgroup_link(group, &skillunit_wheel[skillunit_wheel_slot(tick)]);
+}
+
+/// Makes a sleeping group due on the next skill_unit_timer call.
+/// Must be called when the expiration of a group or the need to visit it every call may have changed.
+static void skill_unitgroup_wakeup(struct skill_unit_group* group)
+{
+	unsigned int tick = gettick()+1;
+
+	if( group == NULL || group->timer_list == NULL || group->timer_list == &skillunit_due )
+		return;// being visited or already due
+	if( DIFF_TICK(group->timer_tick, tick) > 0 )
+		skill_unitgroup_schedule(group, tick);
+}
+
 /// Returns the target skill_unit_group or NULL if not found.
 struct skill_unit_group* skill_id2group(int group_id)
 {
@@ -10145,6 +10217,8 @@ struct skill_unit_group* skill_initunitgroup (struct block_list* src, int count,
 		group->tick += 1500;
 
 	idb_put(group_db, group->group_id, group);
+	group->timer_list = NULL;
+	skill_unitgroup_schedule(group, gettick()+1);
 	return group;
 }
 
@@ -10217,6 +10291,7 @@ int skill_delunitgroup_(struct skill_unit_group *group, const char* file, int li
 	}
 
 	idb_remove(group_db, group->group_id);
+	skill_unitgroup_unschedule(group);
 	map_freeblock(&group->unit->bl); // schedules deallocation of whole array (HACK)
 	group->unit=NULL;
 	group->group_id=0;
@@ -10296,11 +10371,9 @@ struct skill_unit_group_tickset *skill_unitgrouptickset_search (struct block_lis
 /*==========================================
  *
  *------------------------------------------*/
-int skill_unit_timer_sub_onplace (struct block_list* bl, va_list ap)
+static int skill_unit_timer_onplace (struct skill_unit* unit, struct block_list* bl, unsigned int tick)
 {
-	struct skill_unit* unit = va_arg(ap,struct skill_unit *);
 	struct skill_unit_group* group = unit->group;
-	unsigned int tick = va_arg(ap,unsigned int);
 
 	if( !unit->alive || bl->prev == NULL )
 		return 0;
@@ -10318,21 +10391,24 @@ int skill_unit_timer_sub_onplace (struct block_list* bl, va_list ap)
 	return 1;
 }
 
+int skill_unit_timer_sub_onplace (struct block_list* bl, va_list ap)
+{
+	struct skill_unit* unit = va_arg(ap,struct skill_unit *);
+	unsigned int tick = va_arg(ap,unsigned int);
+
+	return skill_unit_timer_onplace(unit, bl, tick);
+}
+
 /*==========================================
- *
+ * Expiration and per call effects of a unit.
  *------------------------------------------*/
-static int skill_unit_timer_sub (DBKey key, void* data, va_list ap)
+static void skill_unit_timer_sub (struct skill_unit* unit, unsigned int tick)
 {
-	struct skill_unit* unit = (struct skill_unit*)data;
 	struct skill_unit_group* group = unit->group;
-	unsigned int tick = va_arg(ap,unsigned int);
-  	bool dissonance;
 	struct block_list* bl = &unit->bl;
 
-	if( !unit->alive )
-		return 0;
-
-	nullpo_ret(group);
+	if( !unit->alive || group == NULL )
+		return;
 
 	// check for expiration
 	if( (DIFF_TICK(tick,group->tick) >= group->limit || DIFF_TICK(tick,group->tick) >= unit->limit) )
@@ -10443,45 +10519,114 @@ static int skill_unit_timer_sub (DBKey key, void* data, va_list ap)
 		}
 	}
 
-	//Don't continue if unit or even group is expired and has been deleted.
-	if( !group || !unit->alive )
-		return 0;
+}
 
-	dissonance = skill_dance_switch(unit, 0);
+/*==========================================
+ * Visits a group that is due and schedules its next visit.
+ *------------------------------------------*/
+static void skill_unit_timer_group (struct skill_unit_group* group, unsigned int tick)
+{
+	struct skill_unit* unit;
+	int i, limit;
+	bool active;
+
+	skillunit_visiting = group;
 
-	if( unit->range >= 0 && group->interval != -1 )
+	// each unit expires and then affects the objects in its range before the next one,
+	// so objects moved by a unit (knockback, traps) are found where they ended up
+	for( i = 0; skillunit_visiting && i < group->unit_count; i++ )
 	{
-		if( battle_config.skill_wall_check )
-			map_foreachinshootrange(skill_unit_timer_sub_onplace, bl, unit->range, group->bl_flag, bl,tick);
-		else
-			map_foreachinrange(skill_unit_timer_sub_onplace, bl, unit->range, group->bl_flag, bl,tick);
+		bool dissonance;
+
+		unit = &group->unit[i];
+		skill_unit_timer_sub(unit, tick);
+		if( !skillunit_visiting || !unit->alive )
+			continue;
 
-		if(unit->range == -1) //Unit disabled, but it should not be deleted yet.
-			group->unit_id = UNT_USED_TRAPS;
+		dissonance = skill_dance_switch(unit, 0);
 
-		if( group->unit_id == UNT_TATAMIGAESHI )
+		if( unit->range >= 0 && group->interval != -1 )
 		{
-			unit->range = -1; //Disable processed cell.
-			if (--group->val1 <= 0) // number of live cells
-	  		{	//All tiles were processed, disable skill.
-				group->target_flag=BCT_NOONE;
-				group->bl_flag= BL_NUL;
+			if( battle_config.skill_wall_check )
+				map_foreachinshootrange(skill_unit_timer_sub_onplace, &unit->bl, unit->range, group->bl_flag, unit,tick);
+			else
+				map_foreachinrange(skill_unit_timer_sub_onplace, &unit->bl, unit->range, group->bl_flag, unit,tick);
+
+			if( skillunit_visiting )
+			{
+				if(unit->range == -1) //Unit disabled, but it should not be deleted yet.
+					group->unit_id = UNT_USED_TRAPS;
+
+				if( group->unit_id == UNT_TATAMIGAESHI )
+				{
+					unit->range = -1; //Disable processed cell.
+					if (--group->val1 <= 0) // number of live cells
+					{	//All tiles were processed, disable skill.
+						group->target_flag=BCT_NOONE;
+						group->bl_flag= BL_NUL;
+					}
+				}
 			}
 		}
+
+		if( dissonance && skillunit_visiting && unit->group )
+			skill_dance_switch(unit, 1);
 	}
 
-  	if( dissonance ) skill_dance_switch(unit, 1);
+	if( !skillunit_visiting )
+		return;// deleted
+	skillunit_visiting = NULL;
 
-	return 0;
+	// groups that do something on every call are visited again on the next one,
+	// the others when their first unit expires
+	active = ( group->interval != -1 || group->unit_id == UNT_ICEWALL );
+	limit = group->limit;
+	for( i = 0; i < group->unit_count; i++ )
+	{
+		unit = &group->unit[i];
+		if( !unit->alive )
+			continue;
+		if( group->state.song_dance&0x1 && unit->val2&UF_ENSEMBLE )
+			active = true;
+		limit = min(limit, unit->limit);
+	}
+	limit -= DIFF_TICK(tick, group->tick);
+	skill_unitgroup_schedule(group, ( active || limit <= 1 ) ? tick+1 : tick+limit);
 }
+
 /*==========================================
- * Executes on all skill units every SKILLUNITTIMER_INTERVAL miliseconds.
+ * Executes on the skill unit groups that are due every SKILLUNITTIMER_INTERVAL miliseconds.
  *------------------------------------------*/
 int skill_unit_timer(int tid, unsigned int tick, int id, intptr_t data)
 {
+	struct skill_unit_group* group;
+	int slot, n;
+
 	map_freeblock_lock();
 
-	skillunit_db->foreach(skillunit_db, skill_unit_timer_sub, tick);
+	// collect the groups that are due, callbacks can add, move and delete groups
+	n = (int)(tick>>SKILLUNIT_WHEEL_SHIFT) - (int)(skillunit_wheel_tick>>SKILLUNIT_WHEEL_SHIFT) + 1;
+	if( n < 1 || n > SKILLUNIT_WHEEL_SIZE )
+		n = SKILLUNIT_WHEEL_SIZE;
+	for( slot = skillunit_wheel_slot(skillunit_wheel_tick); n > 0; slot = (slot+1)&(SKILLUNIT_WHEEL_SIZE-1), n-- )
+	{
+		struct skill_unit_group* next;
+		for( group = skillunit_wheel[slot]; group; group = next )
+		{
+			next = group->timer_next;
+			if( DIFF_TICK(tick, group->timer_tick) < 0 )
+				continue;
+			skill_unitgroup_unschedule(group);
+			skill_unitgroup_link(group, &skillunit_due);
+		}
+	}
+	skillunit_wheel_tick = tick;
+
+	while( (group = skillunit_due) != NULL )
+	{
+		skill_unitgroup_unschedule(group);
+		skill_unit_timer_group(group, tick);
+	}
 
 	map_freeblock_unlock();
 
@@ -10492,15 +10637,10 @@ static int skill_unit_temp[20];  // temporary storage for tracking skill unit sk
 /*==========================================
  *
  *------------------------------------------*/
-int skill_unit_move_sub (struct block_list* bl, va_list ap)
+static int skill_unit_move_sub (struct skill_unit* unit, struct block_list* target, unsigned int tick, int flag)
 {
-	struct skill_unit* unit = (struct skill_unit *)bl;
 	struct skill_unit_group* group = unit->group;
 
-	struct block_list* target = va_arg(ap,struct block_list*);
-	unsigned int tick = va_arg(ap,unsigned int);
-	int flag = va_arg(ap,int);
-
 	bool dissonance;
 	int skill_id;
 	int i;
@@ -10606,6 +10746,9 @@ int skill_unit_move_sub (struct block_list* bl, va_list ap)
  *------------------------------------------*/
 int skill_unit_move (struct block_list *bl, unsigned int tick, int flag)
 {
+	struct s_mapquery q;
+	struct block_list* ubl;
+
 	nullpo_ret(bl);
 
 	if( bl->prev == NULL )
@@ -10616,7 +10759,10 @@ int skill_unit_move (struct block_list *bl, unsigned int tick, int flag)
 		memset(skill_unit_temp, 0, sizeof(skill_unit_temp));
 	}
 
-	map_foreachincell(skill_unit_move_sub,bl->m,bl->x,bl->y,BL_SKILL,bl,tick,flag);
+	map_query_incell(&q, bl->m, bl->x, bl->y, BL_SKILL);
+	map_query_foreach(&q, ubl)
+		skill_unit_move_sub((struct skill_unit*)ubl, bl, tick, flag);
+	map_query_end(&q);
 
 	if( flag&2 && flag&1 )
 	{	//Onplace, check any skill units you have left.
@@ -11837,8 +11983,138 @@ static bool skill_parse_row_abradb(char* split[], int columns, int current)
 	return true;
 }
 
+static const struct snapshot_field skill_snapshot_fields[] = {
+	SNAPSHOT_FIELD(struct s_skill_db, name),
+	SNAPSHOT_FIELD(struct s_skill_db, desc),
+	SNAPSHOT_FIELD(struct s_skill_db, range),
+	SNAPSHOT_FIELD(struct s_skill_db, hit),
+	SNAPSHOT_FIELD(struct s_skill_db, inf),
+	SNAPSHOT_FIELD(struct s_skill_db, element),
+	SNAPSHOT_FIELD(struct s_skill_db, nk),
+	SNAPSHOT_FIELD(struct s_skill_db, splash),
+	SNAPSHOT_FIELD(struct s_skill_db, max),
+	SNAPSHOT_FIELD(struct s_skill_db, num),
+	SNAPSHOT_FIELD(struct s_skill_db, cast),
+	SNAPSHOT_FIELD(struct s_skill_db, walkdelay),
+	SNAPSHOT_FIELD(struct s_skill_db, delay),
+	SNAPSHOT_FIELD(struct s_skill_db, upkeep_time),
+	SNAPSHOT_FIELD(struct s_skill_db, upkeep_time2),
+	SNAPSHOT_FIELD(struct s_skill_db, castcancel),
+	SNAPSHOT_FIELD(struct s_skill_db, cast_def_rate),
+	SNAPSHOT_FIELD(struct s_skill_db, inf2),
+	SNAPSHOT_FIELD(struct s_skill_db, maxcount),
+	SNAPSHOT_FIELD(struct s_skill_db, skill_type),
+	SNAPSHOT_FIELD(struct s_skill_db, blewcount),
+	SNAPSHOT_FIELD(struct s_skill_db, hp),
+	SNAPSHOT_FIELD(struct s_skill_db, sp),
+	SNAPSHOT_FIELD(struct s_skill_db, mhp),
+	SNAPSHOT_FIELD(struct s_skill_db, hp_rate),
+	SNAPSHOT_FIELD(struct s_skill_db, sp_rate),
+	SNAPSHOT_FIELD(struct s_skill_db, zeny),
+	SNAPSHOT_FIELD(struct s_skill_db, weapon),
+	SNAPSHOT_FIELD(struct s_skill_db, ammo),
+	SNAPSHOT_FIELD(struct s_skill_db, ammo_qty),
+	SNAPSHOT_FIELD(struct s_skill_db, state),
+	SNAPSHOT_FIELD(struct s_skill_db, spiritball),
+	SNAPSHOT_FIELD(struct s_skill_db, itemid),
+	SNAPSHOT_FIELD(struct s_skill_db, amount),
+	SNAPSHOT_FIELD(struct s_skill_db, castnodex),
+	SNAPSHOT_FIELD(struct s_skill_db, delaynodex),
+	SNAPSHOT_FIELD(struct s_skill_db, nocast),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_id),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_layout_type),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_range),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_interval),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_target),
+	SNAPSHOT_FIELD(struct s_skill_db, unit_flag),
+};
+
+/// Reads, writes or checks the skill databases in the db snapshot.
+static void skill_snapshot(struct snapshot* s)
+{
+	static struct s_skill_db empty;
+	char label[32];
+	int count, i, j;
+
+	// skills, most of the table is unused
+	count = 0;
+	if( s->op != SNAPSHOT_READ )
+		for( i = 0; i < MAX_SKILL_DB; ++i )
+			if( memcmp(&skill_db[i], &empty, sizeof(empty)) != 0 )
+				++count;
+	j = snapshot_key(s, "skill count", count);
+	if( s->op == SNAPSHOT_CHECK && j != count )
+		snapshot_mismatch(s, "skill count: snapshot %d, text %d", j, count);
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		for( i = 0; i < MAX_SKILL_DB; ++i )
+		{
+			if( memcmp(&skill_db[i], &empty, sizeof(empty)) == 0 )
+				continue;
+			snapshot_key(s, "skill index", i);
+			snapshot_structs(s, "skill_db", &skill_db[i], sizeof(skill_db[0]), 1, skill_snapshot_fields, ARRAYLENGTH(skill_snapshot_fields));
+		}
+	}
+	else
+	{
+		for( count = j, j = 0; j < count && !s->failed; ++j )
+		{
+			i = snapshot_key(s, "skill index", 0);
+			if( i < 0 || i >= MAX_SKILL_DB )
+			{
+				s->failed = true;
+				break;
+			}
+			snprintf(label, sizeof(label), "skill_db[%d]", i);
+			snapshot_structs(s, label, &skill_db[i], sizeof(skill_db[0]), 1, skill_snapshot_fields, ARRAYLENGTH(skill_snapshot_fields));
+		}
+	}
+
+	snapshot_array(s, "produce_db", skill_produce_db, sizeof(skill_produce_db[0]), ARRAYLENGTH(skill_produce_db));
+	snapshot_array(s, "create_arrow_db", skill_arrow_db, sizeof(skill_arrow_db[0]), ARRAYLENGTH(skill_arrow_db));
+	snapshot_array(s, "abra_db", skill_abra_db, sizeof(skill_abra_db[0]), ARRAYLENGTH(skill_abra_db));
+
+	// skill name lookup
+	count = snapshot_key(s, "name count", s->op == SNAPSHOT_READ ? 0 : skilldb_name2id->size(skilldb_name2id));
+	if( s->op == SNAPSHOT_CHECK && count != (int)skilldb_name2id->size(skilldb_name2id) )
+		snapshot_mismatch(s, "skill name count: snapshot %d, text %d", count, skilldb_name2id->size(skilldb_name2id));
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		DBIterator* iter = db_iterator(skilldb_name2id);
+		DBKey key;
+		void* data;
+
+		for( data = iter->first(iter,&key); dbi_exists(iter); data = iter->next(iter,&key) )
+		{
+			char name[NAME_LENGTH];
+
+			memset(name, 0, sizeof(name));
+			safestrncpy(name, key.str, sizeof(name));
+			snapshot_key(s, "skill id", (int)(intptr_t)data);
+			snapshot_key_str(s, "skill name", name, sizeof(name));
+		}
+		dbi_destroy(iter);
+	}
+	else
+	{
+		for( i = 0; i < count && !s->failed; ++i )
+		{
+			char name[NAME_LENGTH];
+			int id = snapshot_key(s, "skill id", 0);
+
+			snapshot_key_str(s, "skill name", name, sizeof(name));
+			if( s->op == SNAPSHOT_READ )
+				strdb_put(skilldb_name2id, name, (void*)(intptr_t)id);
+			else if( (int)(intptr_t)strdb_get(skilldb_name2id, name) != id )
+				snapshot_mismatch(s, "skill name '%s': snapshot %d, text %d", name, id, (int)(intptr_t)strdb_get(skilldb_name2id, name));
+		}
+	}
+}
+
 static void skill_readdb(void)
 {
+	struct snapshot* s;
+
 	// init skill db structures
 	db_clear(skilldb_name2id);
 	memset(skill_db,0,sizeof(skill_db));
@@ -11846,19 +12122,39 @@ static void skill_readdb(void)
 	memset(skill_arrow_db,0,sizeof(skill_arrow_db));
 	memset(skill_abra_db,0,sizeof(skill_abra_db));
 
+	if( (s = snapshot_open(SNAPSHOT_SKILLDB)) != NULL )
+	{
+		skill_snapshot(s);
+		if( snapshot_close(s) )
+		{
+			skill_init_unit_layout();
+			return;
+		}
+		db_clear(skilldb_name2id);
+		memset(skill_db,0,sizeof(skill_db));
+	}
+
+	s = snapshot_create(SNAPSHOT_SKILLDB);
+
 	// load skill databases
 	safestrncpy(skill_db[0].name, "UNKNOWN_SKILL", sizeof(skill_db[0].name));
 	safestrncpy(skill_db[0].desc, "Unknown Skill", sizeof(skill_db[0].desc));
-	sv_readdb(db_path, "skill_db.txt"          , ',',  17, 17, MAX_SKILL_DB, skill_parse_row_skilldb);
-	sv_readdb(db_path, "skill_require_db.txt"  , ',',  32, 32, MAX_SKILL_DB, skill_parse_row_requiredb);
-	sv_readdb(db_path, "skill_cast_db.txt"     , ',',   6,  6, MAX_SKILL_DB, skill_parse_row_castdb);
-	sv_readdb(db_path, "skill_castnodex_db.txt", ',',   2,  3, MAX_SKILL_DB, skill_parse_row_castnodexdb);
-	sv_readdb(db_path, "skill_nocast_db.txt"   , ',',   2,  2, MAX_SKILL_DB, skill_parse_row_nocastdb);
-	sv_readdb(db_path, "skill_unit_db.txt"     , ',',   8,  8, MAX_SKILL_DB, skill_parse_row_unitdb);
+	snapshot_readdb(db_path, "skill_db.txt"          , ',',  17, 17, MAX_SKILL_DB, skill_parse_row_skilldb);
+	snapshot_readdb(db_path, "skill_require_db.txt"  , ',',  32, 32, MAX_SKILL_DB, skill_parse_row_requiredb);
+	snapshot_readdb(db_path, "skill_cast_db.txt"     , ',',   6,  6, MAX_SKILL_DB, skill_parse_row_castdb);
+	snapshot_readdb(db_path, "skill_castnodex_db.txt", ',',   2,  3, MAX_SKILL_DB, skill_parse_row_castnodexdb);
+	snapshot_readdb(db_path, "skill_nocast_db.txt"   , ',',   2,  2, MAX_SKILL_DB, skill_parse_row_nocastdb);
+	snapshot_readdb(db_path, "skill_unit_db.txt"     , ',',   8,  8, MAX_SKILL_DB, skill_parse_row_unitdb);
 	skill_init_unit_layout();
-	sv_readdb(db_path, "produce_db.txt"        , ',',   4,  4+2*MAX_PRODUCE_RESOURCE, MAX_SKILL_PRODUCE_DB, skill_parse_row_producedb);
-	sv_readdb(db_path, "create_arrow_db.txt"   , ',', 1+2,  1+2*MAX_ARROW_RESOURCE, MAX_SKILL_ARROW_DB, skill_parse_row_createarrowdb);
-	sv_readdb(db_path, "abra_db.txt"           , ',',   4,  4, MAX_SKILL_ABRA_DB, skill_parse_row_abradb);
+	snapshot_readdb(db_path, "produce_db.txt"        , ',',   4,  4+2*MAX_PRODUCE_RESOURCE, MAX_SKILL_PRODUCE_DB, skill_parse_row_producedb);
+	snapshot_readdb(db_path, "create_arrow_db.txt"   , ',', 1+2,  1+2*MAX_ARROW_RESOURCE, MAX_SKILL_ARROW_DB, skill_parse_row_createarrowdb);
+	snapshot_readdb(db_path, "abra_db.txt"           , ',',   4,  4, MAX_SKILL_ABRA_DB, skill_parse_row_abradb);
+
+	if( s != NULL )
+	{
+		skill_snapshot(s);
+		snapshot_close(s);
+	}
 }
 
 void skill_reload (void)
@@ -11875,7 +12171,6 @@ int do_init_skill (void)
 	skill_readdb();
 
 	group_db = idb_alloc(DB_OPT_BASE);
-	skillunit_db = idb_alloc(DB_OPT_BASE);
 	skill_unit_ers = ers_new(sizeof(struct skill_unit_group));
 	skill_timer_ers  = ers_new(sizeof(struct skill_timerskill));
 
@@ -11894,7 +12189,6 @@ int do_final_skill(void)
 {
 	db_destroy(skilldb_name2id);
 	db_destroy(group_db);
-	db_destroy(skillunit_db);
 	ers_destroy(skill_unit_ers);
 	ers_destroy(skill_timer_ers);
 	return 0;
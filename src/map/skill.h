@@ -149,6 +149,8 @@ struct skill_unit_group {
 	int group_id;
 	int unit_count,alive_count;
 	struct skill_unit *unit;
+	unsigned int timer_tick; // next time skill_unit_timer visits this group
+	struct skill_unit_group **timer_list, *timer_prev, *timer_next; // list of the schedule the group is in
 	struct {
 		unsigned ammo_consume : 1;
 		unsigned magic_power : 1;
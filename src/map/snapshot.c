@@ -0,0 +1,765 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "../common/cbasetypes.h"
+#include "../common/db.h"  // ARR_FIND
+#include "../common/malloc.h"  // aMalloc, aRealloc, aFree
+#include "../common/showmsg.h"  // ShowStatus, ShowWarning
+#include "../common/strlib.h"  // sv_readdb, safestrncpy
+#include "battle.h"  // battle_config
+#include "itemdb.h"  // struct item_data
+#include "map.h"  // db_path
+#include "mob.h"  // struct mob_db
+#include "script.h"  // script_get_fingerprint, script_code_export, script_code_import
+#include "skill.h"  // struct s_skill_db
+#include "snapshot.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_MAGIC "EASS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_ERRORS 20 // mismatches shown per section by the check
+
+int db_snapshot = 1;
+char db_snapshot_file[256] = "db/db_snapshot.dat";
+
+static const char* snapshot_section_name[SNAPSHOT_SECTION_MAX] = { "item_db", "skill_db", "mob_db", "job_db" };
+
+/// Text file a section was loaded from.
+struct snapshot_source
+{
+	char* path;
+	bool exists;
+	int size;
+	unsigned int hash;
+};
+
+/// Section as stored in the snapshot file.
+struct snapshot_stored
+{
+	struct snapshot_source* sources;
+	int source_count;
+	unsigned char* data; // points into snapshot_file_data unless written during this run
+	size_t len;
+	bool present; // loaded from the file or written during this run
+	bool written; // data was allocated during this run
+};
+
+static bool snapshot_active = false; // between snapshot_init and snapshot_final
+static bool snapshot_dirty = false; // the file needs to be rewritten
+static bool snapshot_text_loaded = false; // an earlier section was loaded from the text files
+static unsigned int snapshot_fingerprint = 0;
+static unsigned char* snapshot_file_data = NULL;
+static struct snapshot_stored snapshot_sections[SNAPSHOT_SECTION_MAX];
+static struct snapshot* snapshot_building = NULL; // section that records the sources being read
+
+
+/// FNV-1a hash.
+static unsigned int snapshot_hash(unsigned int h, const void* data, size_t len)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	size_t i;
+
+	for( i = 0; i < len; ++i )
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+/// Hashes everything outside of the text files that affects the loaded tables.
+static unsigned int snapshot_calc_fingerprint(void)
+{
+	unsigned int h = 2166136261U;
+	int sizes[] = {
+		SNAPSHOT_VERSION, (int)sizeof(void*), (int)sizeof(long),
+		(int)sizeof(struct item_data), (int)sizeof(struct mob_db), (int)sizeof(struct mob_chat),
+		(int)sizeof(struct s_skill_db), (int)sizeof(struct s_skill_produce_db), (int)sizeof(struct s_skill_arrow_db), (int)sizeof(struct s_skill_abra_db),
+		MAX_ITEMGROUP, MAX_MOB_DB, MAX_SKILL_DB,
+	};
+	unsigned int script_fingerprint = script_get_fingerprint();
+
+	h = snapshot_hash(h, sizes, sizeof(sizes));
+	h = snapshot_hash(h, &script_fingerprint, sizeof(script_fingerprint));
+	h = snapshot_hash(h, &battle_config, sizeof(battle_config));
+	h = snapshot_hash(h, db_path, strlen(db_path));
+
+	return h;
+}
+
+/// Fills the size and hash of a source from the current file.
+static void snapshot_source_stat(struct snapshot_source* src)
+{
+	unsigned char buf[4096];
+	unsigned int h = 2166136261U;
+	size_t n;
+	int size = 0;
+	FILE* fp;
+
+	if( (fp = fopen(src->path, "rb")) == NULL )
+	{
+		src->exists = false;
+		src->size = 0;
+		src->hash = 0;
+		return;
+	}
+	while( (n = fread(buf, 1, sizeof(buf), fp)) > 0 )
+	{
+		h = snapshot_hash(h, buf, n);
+		size += (int)n;
+	}
+	fclose(fp);
+
+	src->exists = true;
+	src->size = size;
+	src->hash = h;
+}
+
+/// Returns true if none of the text files of a section changed.
+static bool snapshot_sources_match(const struct snapshot_stored* stored)
+{
+	int i;
+
+	for( i = 0; i < stored->source_count; ++i )
+	{
+		struct snapshot_source cur;
+
+		cur.path = stored->sources[i].path;
+		snapshot_source_stat(&cur);
+		if( cur.exists != stored->sources[i].exists || cur.size != stored->sources[i].size || cur.hash != stored->sources[i].hash )
+			return false;
+	}
+	return true;
+}
+
+static void snapshot_sources_free(struct snapshot_stored* stored)
+{
+	int i;
+
+	for( i = 0; i < stored->source_count; ++i )
+		aFree(stored->sources[i].path);
+	if( stored->sources )
+		aFree(stored->sources);
+	stored->sources = NULL;
+	stored->source_count = 0;
+}
+
+static void snapshot_stored_free(struct snapshot_stored* stored)
+{
+	snapshot_sources_free(stored);
+	if( stored->written )
+		aFree(stored->data);
+	memset(stored, 0, sizeof(*stored));
+}
+
+
+/*==========================================
+ * Snapshot file
+ *------------------------------------------*/
+
+/// Cursor over the snapshot file.
+struct snapshot_reader
+{
+	const unsigned char* data;
+	size_t len;
+	size_t pos;
+};
+
+static bool snapshot_reader_int(struct snapshot_reader* r, int* value)
+{
+	if( r->len - r->pos < 4 )
+		return false;
+	memcpy(value, r->data + r->pos, 4);
+	r->pos += 4;
+	return true;
+}
+
+static const char* snapshot_reader_str(struct snapshot_reader* r)
+{
+	const char* str = (const char*)r->data + r->pos;
+	size_t n = strnlen(str, r->len - r->pos);
+
+	if( r->pos + n >= r->len )
+		return NULL;
+	r->pos += n + 1;
+	return str;
+}
+
+/// Parses the sections of the snapshot file.
+static bool snapshot_parse(struct snapshot_reader* r)
+{
+	int count, i, j;
+
+	if( !snapshot_reader_int(r, &count) )
+		return false;
+	for( i = 0; i < count; ++i )
+	{
+		struct snapshot_stored* stored;
+		int section, source_count, len;
+
+		if( !snapshot_reader_int(r, &section) || section < 0 || section >= SNAPSHOT_SECTION_MAX ||
+			!snapshot_reader_int(r, &source_count) || source_count < 0 || (size_t)source_count > r->len )
+			return false;
+		stored = &snapshot_sections[section];
+		snapshot_stored_free(stored);
+		CREATE(stored->sources, struct snapshot_source, max(source_count,1));
+		for( j = 0; j < source_count; ++j )
+		{
+			struct snapshot_source* src = &stored->sources[j];
+			const char* path = snapshot_reader_str(r);
+			int exists;
+
+			if( path == NULL || !snapshot_reader_int(r, &exists) || !snapshot_reader_int(r, &src->size) || !snapshot_reader_int(r, (int*)&src->hash) )
+				return false;
+			src->path = aStrdup(path);
+			src->exists = ( exists != 0 );
+			stored->source_count++;
+		}
+		if( !snapshot_reader_int(r, &len) || len < 0 || (size_t)len > r->len - r->pos )
+			return false;
+		stored->data = (unsigned char*)r->data + r->pos;
+		stored->len = (size_t)len;
+		stored->present = true;
+		r->pos += len;
+	}
+	return ( r->pos == r->len );
+}
+
+/// Loads the snapshot file, it's read in one go and the sections point into it.
+static void snapshot_load(void)
+{
+	struct snapshot_reader r;
+	unsigned char header[20];
+	unsigned int fingerprint, hash;
+	int version, len;
+	FILE* fp;
+
+	if( (fp = fopen(db_snapshot_file, "rb")) == NULL )
+		return;
+
+	if( fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, SNAPSHOT_MAGIC, 4) != 0 )
+	{
+		ShowWarning("snapshot_load: '%s' is not a db snapshot, ignoring it.\n", db_snapshot_file);
+		fclose(fp);
+		return;
+	}
+	memcpy(&version, header+4, 4);
+	memcpy(&fingerprint, header+8, 4);
+	memcpy(&len, header+12, 4);
+	memcpy(&hash, header+16, 4);
+	if( version != SNAPSHOT_VERSION || fingerprint != snapshot_fingerprint || len < 0 )
+	{
+		ShowInfo("DB snapshot '"CL_WHITE"%s"CL_RESET"' is outdated, rebuilding it.\n", db_snapshot_file);
+		fclose(fp);
+		snapshot_dirty = true;
+		return;
+	}
+
+	snapshot_file_data = (unsigned char*)aMalloc(max(len,1));
+	if( fread(snapshot_file_data, 1, len, fp) != (size_t)len || snapshot_hash(2166136261U, snapshot_file_data, len) != hash )
+	{
+		ShowWarning("snapshot_load: '%s' is truncated or corrupt, rebuilding it.\n", db_snapshot_file);
+		fclose(fp);
+		aFree(snapshot_file_data);
+		snapshot_file_data = NULL;
+		snapshot_dirty = true;
+		return;
+	}
+	fclose(fp);
+
+	r.data = snapshot_file_data;
+	r.len = (size_t)len;
+	r.pos = 0;
+	if( !snapshot_parse(&r) )
+	{
+		int i;
+
+		ShowWarning("snapshot_load: '%s' is corrupt, rebuilding it.\n", db_snapshot_file);
+		for( i = 0; i < SNAPSHOT_SECTION_MAX; ++i )
+			snapshot_stored_free(&snapshot_sections[i]);
+		snapshot_dirty = true;
+	}
+}
+
+static void snapshot_write_int(FILE* fp, unsigned int* hash, int value)
+{
+	fwrite(&value, 1, 4, fp);
+	*hash = snapshot_hash(*hash, &value, 4);
+}
+
+static void snapshot_write_data(FILE* fp, unsigned int* hash, const void* data, size_t len)
+{
+	fwrite(data, 1, len, fp);
+	*hash = snapshot_hash(*hash, data, len);
+}
+
+/// Writes the sections used during this run to the snapshot file.
+static void snapshot_save(void)
+{
+	unsigned char header[20];
+	unsigned int hash = 2166136261U;
+	int count = 0, len = 0, version = SNAPSHOT_VERSION;
+	int i, j;
+	FILE* fp;
+
+	if( (fp = fopen(db_snapshot_file, "wb")) == NULL )
+	{
+		ShowError("snapshot_save: can't write to '%s'.\n", db_snapshot_file);
+		return;
+	}
+
+	// header is completed once the body is written
+	memset(header, 0, sizeof(header));
+	fwrite(header, 1, sizeof(header), fp);
+
+	for( i = 0; i < SNAPSHOT_SECTION_MAX; ++i )
+		if( snapshot_sections[i].present )
+			++count;
+	snapshot_write_int(fp, &hash, count);
+	len += 4;
+	for( i = 0; i < SNAPSHOT_SECTION_MAX; ++i )
+	{
+		struct snapshot_stored* stored = &snapshot_sections[i];
+
+		if( !stored->present )
+			continue;
+		snapshot_write_int(fp, &hash, i);
+		snapshot_write_int(fp, &hash, stored->source_count);
+		len += 8;
+		for( j = 0; j < stored->source_count; ++j )
+		{
+			struct snapshot_source* src = &stored->sources[j];
+
+			snapshot_write_data(fp, &hash, src->path, strlen(src->path)+1);
+			snapshot_write_int(fp, &hash, src->exists ? 1 : 0);
+			snapshot_write_int(fp, &hash, src->size);
+			snapshot_write_int(fp, &hash, (int)src->hash);
+			len += (int)strlen(src->path) + 1 + 12;
+		}
+		snapshot_write_int(fp, &hash, (int)stored->len);
+		snapshot_write_data(fp, &hash, stored->data, stored->len);
+		len += 4 + (int)stored->len;
+	}
+
+	memcpy(header, SNAPSHOT_MAGIC, 4);
+	memcpy(header+4, &version, 4);
+	memcpy(header+8, &snapshot_fingerprint, 4);
+	memcpy(header+12, &len, 4);
+	memcpy(header+16, &hash, 4);
+	fseek(fp, 0, SEEK_SET);
+	fwrite(header, 1, sizeof(header), fp);
+	fclose(fp);
+
+	ShowStatus("Saved '"CL_WHITE"%d"CL_RESET"' sections to the db snapshot '"CL_WHITE"%s"CL_RESET"'.\n", count, db_snapshot_file);
+}
+
+
+/*==========================================
+ * Sections
+ *------------------------------------------*/
+
+/// Opens a section for reading.
+/// Returns NULL if the tables have to be loaded from the text files.
+struct snapshot* snapshot_open(enum snapshot_section section)
+{
+	struct snapshot_stored* stored = &snapshot_sections[section];
+	struct snapshot* s;
+
+	if( !snapshot_active || db_snapshot != 1 || snapshot_text_loaded || !stored->present )
+		return NULL;
+
+	if( !snapshot_sources_match(stored) )
+	{
+		ShowInfo("DB snapshot of '"CL_WHITE"%s"CL_RESET"' is outdated, loading the text files.\n", snapshot_section_name[section]);
+		return NULL;
+	}
+
+	CREATE(s, struct snapshot, 1);
+	s->section = section;
+	s->op = SNAPSHOT_READ;
+	s->data = stored->data;
+	s->len = stored->len;
+	return s;
+}
+
+/// Opens a section before the tables are loaded from the text files.
+/// In check mode the tables are compared with the snapshot, otherwise they're written to it.
+/// Returns NULL if neither applies.
+struct snapshot* snapshot_create(enum snapshot_section section)
+{
+	struct snapshot_stored* stored = &snapshot_sections[section];
+	struct snapshot* s;
+
+	if( !snapshot_active )
+		return NULL;
+
+	snapshot_text_loaded = true;
+	CREATE(s, struct snapshot, 1);
+	s->section = section;
+
+	if( db_snapshot == 2 )
+	{
+		if( !stored->present || !snapshot_sources_match(stored) )
+		{
+			ShowWarning("DB snapshot of '%s' is missing or outdated, not checking it.\n", snapshot_section_name[section]);
+			aFree(s);
+			return NULL;
+		}
+		s->op = SNAPSHOT_CHECK;
+		s->data = stored->data;
+		s->len = stored->len;
+		return s;
+	}
+
+	s->op = SNAPSHOT_WRITE;
+	s->max = 65536;
+	s->data = (unsigned char*)aMalloc(s->max);
+	snapshot_stored_free(stored);
+	CREATE(stored->sources, struct snapshot_source, 1);
+	snapshot_building = s;
+	return s;
+}
+
+/// Closes a section. Returns false if it didn't match the tables.
+bool snapshot_close(struct snapshot* s)
+{
+	struct snapshot_stored* stored = &snapshot_sections[s->section];
+	bool ok = ( !s->failed && (s->op == SNAPSHOT_WRITE || s->pos == s->len) );
+	int i;
+
+	switch( s->op )
+	{
+	case SNAPSHOT_READ:
+		if( ok )
+			ShowStatus("Done reading '"CL_WHITE"%s"CL_RESET"' from the db snapshot.\n", snapshot_section_name[s->section]);
+		else
+		{
+			ShowError("snapshot_close: db snapshot of '%s' doesn't match the tables, loading the text files.\n", snapshot_section_name[s->section]);
+			snapshot_stored_free(stored);
+			snapshot_dirty = true;
+		}
+		break;
+	case SNAPSHOT_WRITE:
+		snapshot_building = NULL;
+		if( !ok )
+		{
+			snapshot_stored_free(stored);
+			aFree(s->data);
+			break;
+		}
+		for( i = 0; i < stored->source_count; ++i )
+			snapshot_source_stat(&stored->sources[i]);
+		stored->data = s->data;
+		stored->len = s->len;
+		stored->present = true;
+		stored->written = true;
+		snapshot_dirty = true;
+		break;
+	case SNAPSHOT_CHECK:
+		if( !ok )
+			ShowError("DB snapshot of '%s' has a different layout than the tables.\n", snapshot_section_name[s->section]);
+		else if( s->errors )
+			ShowError("DB snapshot of '%s' differs from the text files in '"CL_WHITE"%d"CL_RESET"' values.\n", snapshot_section_name[s->section], s->errors);
+		else
+			ShowStatus("DB snapshot of '"CL_WHITE"%s"CL_RESET"' matches the text files.\n", snapshot_section_name[s->section]);
+		ok = ( ok && s->errors == 0 );
+		break;
+	}
+
+	aFree(s);
+	return ok;
+}
+
+/// Records a text file the section being written depends on.
+void snapshot_addsource(const char* path)
+{
+	struct snapshot_stored* stored;
+	int i;
+
+	if( snapshot_building == NULL )
+		return;
+
+	stored = &snapshot_sections[snapshot_building->section];
+	ARR_FIND(0, stored->source_count, i, strcmp(stored->sources[i].path, path) == 0);
+	if( i < stored->source_count )
+		return;
+	RECREATE(stored->sources, struct snapshot_source, stored->source_count+1);
+	memset(&stored->sources[stored->source_count], 0, sizeof(struct snapshot_source));
+	stored->sources[stored->source_count++].path = aStrdup(path);
+}
+
+/// sv_readdb that records the file as a source of the section being written.
+bool snapshot_readdb(const char* directory, const char* filename, char delim, int mincols, int maxcols, int maxrows, bool (*parseproc)(char* fields[], int columns, int current))
+{
+	char path[1024];
+
+	snprintf(path, sizeof(path), "%s/%s", directory, filename);
+	snapshot_addsource(path);
+	return sv_readdb(directory, filename, delim, mincols, maxcols, maxrows, parseproc);
+}
+
+
+/*==========================================
+ * Records
+ *------------------------------------------*/
+
+/// Appends a record to the section being written.
+static void snapshot_put(struct snapshot* s, const void* data, size_t len)
+{
+	int n = (int)len;
+
+	if( s->len + 4 + len > s->max )
+	{
+		while( s->len + 4 + len > s->max )
+			s->max *= 2;
+		RECREATE(s->data, unsigned char, s->max);
+	}
+	memcpy(s->data + s->len, &n, 4);
+	if( len )
+		memcpy(s->data + s->len + 4, data, len);
+	s->len += 4 + len;
+}
+
+/// Returns the next record of the section and its length.
+static const unsigned char* snapshot_get(struct snapshot* s, size_t* len)
+{
+	const unsigned char* data;
+	int n;
+
+	if( s->failed || s->len - s->pos < 4 )
+	{
+		s->failed = true;
+		return NULL;
+	}
+	memcpy(&n, s->data + s->pos, 4);
+	if( n < 0 || (size_t)n > s->len - s->pos - 4 )
+	{
+		s->failed = true;
+		return NULL;
+	}
+	data = s->data + s->pos + 4;
+	s->pos += 4 + n;
+	*len = (size_t)n;
+	return data;
+}
+
+/// Returns the next record of the section, which must have the given length.
+static const unsigned char* snapshot_get_fixed(struct snapshot* s, size_t len)
+{
+	size_t n;
+	const unsigned char* data = snapshot_get(s, &n);
+
+	if( data != NULL && n != len )
+	{
+		s->failed = true;
+		return NULL;
+	}
+	return data;
+}
+
+/// Reports a difference between the snapshot and the text files.
+void snapshot_mismatch(struct snapshot* s, const char* fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	if( ++s->errors > SNAPSHOT_MAX_ERRORS )
+		return;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	ShowWarning("DB snapshot of '%s' differs: %s\n", snapshot_section_name[s->section], buf);
+}
+
+/// Reports a difference in a value of the given size.
+static void snapshot_mismatch_value(struct snapshot* s, const char* name, int index, const char* field, const void* stored, const void* current, size_t size)
+{
+	char label[256];
+
+	if( index >= 0 && field )
+		snprintf(label, sizeof(label), "%s[%d].%s", name, index, field);
+	else if( index >= 0 )
+		snprintf(label, sizeof(label), "%s[%d]", name, index);
+	else if( field )
+		snprintf(label, sizeof(label), "%s.%s", name, field);
+	else
+		safestrncpy(label, name, sizeof(label));
+
+	if( size == sizeof(int) )
+		snapshot_mismatch(s, "%s: snapshot %d, text %d", label, *(const int*)stored, *(const int*)current);
+	else if( size == sizeof(short) )
+		snapshot_mismatch(s, "%s: snapshot %d, text %d", label, *(const short*)stored, *(const short*)current);
+	else if( size == sizeof(char) )
+		snapshot_mismatch(s, "%s: snapshot %d, text %d", label, *(const signed char*)stored, *(const signed char*)current);
+	else
+		snapshot_mismatch(s, "%s: values differ", label);
+}
+
+/// Stores a key, like a count or an id. Returns the stored key, which isn't checked.
+int snapshot_key(struct snapshot* s, const char* name, int value)
+{
+	const unsigned char* data;
+
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		snapshot_put(s, &value, sizeof(value));
+		return value;
+	}
+	if( (data = snapshot_get_fixed(s, sizeof(value))) == NULL )
+		return 0;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/// Stores a string key, like a name. Fills str with the stored key, which isn't checked.
+void snapshot_key_str(struct snapshot* s, const char* name, char* str, size_t size)
+{
+	const unsigned char* data;
+
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		snapshot_put(s, str, size);
+		return;
+	}
+	if( (data = snapshot_get_fixed(s, size)) == NULL )
+	{
+		str[0] = '\0';
+		return;
+	}
+	safestrncpy(str, (const char*)data, size);
+}
+
+/// Stores an int.
+void snapshot_int(struct snapshot* s, const char* name, int* value)
+{
+	snapshot_array(s, name, value, sizeof(*value), 1);
+}
+
+/// Stores an array, checking it element by element.
+void snapshot_array(struct snapshot* s, const char* name, void* ptr, size_t elemsize, int count)
+{
+	const unsigned char* data;
+	int i;
+
+	if( s->op == SNAPSHOT_WRITE )
+	{
+		snapshot_put(s, ptr, elemsize*count);
+		return;
+	}
+	if( (data = snapshot_get_fixed(s, elemsize*count)) == NULL )
+		return;
+	if( s->op == SNAPSHOT_READ )
+	{
+		memcpy(ptr, data, elemsize*count);
+		return;
+	}
+	for( i = 0; i < count; ++i )
+	{
+		const unsigned char* cur = (const unsigned char*)ptr + i*elemsize;
+
+		if( memcmp(data + i*elemsize, cur, elemsize) != 0 )
+			snapshot_mismatch_value(s, name, count > 1 ? i : -1, NULL, data + i*elemsize, cur, elemsize);
+	}
+}
+
+/// Stores an array of structs, checking it field by field.
+void snapshot_structs(struct snapshot* s, const char* name, void* ptr, size_t elemsize, int count, const struct snapshot_field* fields, int field_count)
+{
+	const unsigned char* data;
+	int i, j;
+
+	if( s->op != SNAPSHOT_CHECK )
+	{
+		snapshot_array(s, name, ptr, elemsize, count);
+		return;
+	}
+	if( (data = snapshot_get_fixed(s, elemsize*count)) == NULL )
+		return;
+	for( i = 0; i < count; ++i )
+	{
+		const unsigned char* stored = data + i*elemsize;
+		const unsigned char* cur = (const unsigned char*)ptr + i*elemsize;
+
+		for( j = 0; j < field_count; ++j )
+		{
+			const struct snapshot_field* f = &fields[j];
+
+			if( memcmp(stored + f->offset, cur + f->offset, f->size) != 0 )
+				snapshot_mismatch_value(s, name, count > 1 ? i : -1, f->name, stored + f->offset, cur + f->offset, f->size);
+		}
+	}
+}
+
+/// Stores compiled script code.
+void snapshot_script(struct snapshot* s, const char* name, int index, struct script_code** code)
+{
+	const unsigned char* data;
+	unsigned char* buf = NULL;
+	size_t len;
+	int size = 0;
+
+	if( s->op != SNAPSHOT_READ && *code != NULL )
+		buf = script_code_export(*code, &size);
+
+	switch( s->op )
+	{
+	case SNAPSHOT_WRITE:
+		snapshot_put(s, buf, size);
+		break;
+	case SNAPSHOT_READ:
+		if( (data = snapshot_get(s, &len)) == NULL )
+			break;
+		*code = NULL;
+		if( len > 0 && (*code = script_code_import(data, (int)len)) == NULL )
+			s->failed = true;
+		break;
+	case SNAPSHOT_CHECK:
+		if( (data = snapshot_get(s, &len)) == NULL )
+			break;
+		if( len != (size_t)size || (len > 0 && memcmp(data, buf, len) != 0) )
+			snapshot_mismatch(s, "%s[%d]: compiled script differs", name, index);
+		break;
+	}
+
+	if( buf )
+		aFree(buf);
+}
+
+
+/*==========================================
+ * Initialize / Finalize
+ *------------------------------------------*/
+
+/// Loads the snapshot, must be called before the static databases are read.
+void snapshot_init(void)
+{
+	if( !db_snapshot )
+		return;
+
+	memset(snapshot_sections, 0, sizeof(snapshot_sections));
+	snapshot_active = true;
+	snapshot_dirty = false;
+	snapshot_text_loaded = false;
+	snapshot_fingerprint = snapshot_calc_fingerprint();
+	snapshot_load();
+}
+
+/// Writes the snapshot if it changed and frees it. Databases reloaded later are read from the text files.
+void snapshot_final(void)
+{
+	int i;
+
+	if( !snapshot_active )
+		return;
+
+	if( db_snapshot == 1 && snapshot_dirty )
+		snapshot_save();
+
+	for( i = 0; i < SNAPSHOT_SECTION_MAX; ++i )
+		snapshot_stored_free(&snapshot_sections[i]);
+	if( snapshot_file_data )
+		aFree(snapshot_file_data);
+	snapshot_file_data = NULL;
+	snapshot_active = false;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) Athena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "../common/cbasetypes.h"
+#include <stddef.h> // offsetof
+
+struct script_code;
+
+/// Static databases stored in the snapshot, in load order.
+/// A section is only used if all the sections before it were used too.
+enum snapshot_section
+{
+	SNAPSHOT_ITEMDB,
+	SNAPSHOT_SKILLDB,
+	SNAPSHOT_MOBDB,
+	SNAPSHOT_STATUSDB,
+	SNAPSHOT_SECTION_MAX
+};
+
+enum snapshot_op
+{
+	SNAPSHOT_READ,  // tables are filled from the snapshot
+	SNAPSHOT_WRITE, // tables were loaded from text and are stored in the snapshot
+	SNAPSHOT_CHECK  // tables were loaded from text and are compared with the snapshot
+};
+
+/// Describes a member of a struct, for field by field comparisons.
+struct snapshot_field
+{
+	const char* name;
+	size_t offset;
+	size_t size;
+};
+#define SNAPSHOT_FIELD(type,field) { #field, offsetof(type,field), sizeof(((type*)0)->field) }
+
+/// Section of the snapshot being read, written or checked.
+struct snapshot
+{
+	enum snapshot_section section;
+	enum snapshot_op op;
+	unsigned char* data;
+	size_t len; // used length of data
+	size_t max; // allocated length of data (write only)
+	size_t pos; // read position
+	bool failed; // the data doesn't match the tables' layout
+	int errors; // mismatches found by the check
+};
+
+extern int db_snapshot; // 0: disabled, 1: enabled, 2: check the snapshot against the text files
+extern char db_snapshot_file[256];
+
+void snapshot_init(void);
+void snapshot_final(void);
+
+struct snapshot* snapshot_open(enum snapshot_section section);
+struct snapshot* snapshot_create(enum snapshot_section section);
+bool snapshot_close(struct snapshot* s);
+
+void snapshot_addsource(const char* path);
+bool snapshot_readdb(const char* directory, const char* filename, char delim, int mincols, int maxcols, int maxrows, bool (*parseproc)(char* fields[], int columns, int current));
+
+int snapshot_key(struct snapshot* s, const char* name, int value);
+void snapshot_key_str(struct snapshot* s, const char* name, char* str, size_t size);
+void snapshot_int(struct snapshot* s, const char* name, int* value);
+void snapshot_array(struct snapshot* s, const char* name, void* ptr, size_t elemsize, int count);
+void snapshot_structs(struct snapshot* s, const char* name, void* ptr, size_t elemsize, int count, const struct snapshot_field* fields, int field_count);
+void snapshot_script(struct snapshot* s, const char* name, int index, struct script_code** code);
+void snapshot_mismatch(struct snapshot* s, const char* fmt, ...);
+
+#endif /* _SNAPSHOT_H_ */
@@ -30,6 +30,8 @@
 #include "homunculus.h"
 #include "mercenary.h"
 #include "vending.h"
+#include "shard.h"
+#include "snapshot.h"
 
 #include <time.h>
 #include <stdio.h>
@@ -5762,8 +5764,7 @@ int status_change_start(struct block_list* bl,enum sc_type type,int rate,int val
 					sc_start4(src,SC_CLOSECONFINE,100,val1,1,0,0,tick+1000);
 				else { //Increase count of locked enemies and refresh time.
 					(sce2->val2)++;
-					delete_timer(sce2->timer, status_change_timer);
-					sce2->timer = add_timer(gettick()+tick+1000, status_change_timer, src->id, SC_CLOSECONFINE);
+					sc_timer_settick(sce2->timer, gettick()+tick+1000);
 				}
 			} else //Status failed.
 				return 0;
@@ -6287,23 +6288,30 @@ int status_change_start(struct block_list* bl,enum sc_type type,int rate,int val
 
 	//Don't trust the previous sce assignment, in case the SC ended somewhere between there and here.
 	if((sce=sc->data[type]))
-	{// reuse old sc
-		if( sce->timer != INVALID_TIMER )
-			delete_timer(sce->timer, status_change_timer);
+	{// reuse old sc, its timer is just moved
+		if( sce->timer != INVALID_TIMER && tick < 0 )
+		{
+			sc_timer_delete(sce->timer);
+			sce->timer = INVALID_TIMER; //Infinite duration
+		}
 	}
 	else
 	{// new sc
 		++(sc->count);
 		sce = sc->data[type] = ers_alloc(sc_data_ers, struct status_change_entry);
+		sce->timer = INVALID_TIMER;
 	}
 	sce->val1 = val1;
 	sce->val2 = val2;
 	sce->val3 = val3;
 	sce->val4 = val4;
 	if (tick >= 0)
-		sce->timer = add_timer(gettick() + tick, status_change_timer, bl->id, type);
-	else
-		sce->timer = INVALID_TIMER; //Infinite duration
+	{
+		if( sce->timer != INVALID_TIMER )
+			sc_timer_settick(sce->timer, gettick() + tick);
+		else
+			sce->timer = sc_timer_add(gettick() + tick, bl->id, type);
+	}
 
 	if (calc_flag)
 		status_calc_bl(bl,calc_flag);
@@ -6429,7 +6437,7 @@ int status_change_clear(struct block_list* bl, int type)
 		{	//If for some reason status_change_end decides to still keep the status when quitting. [Skotlex]
 			(sc->count)--;
 			if (sc->data[i]->timer != INVALID_TIMER)
-				delete_timer(sc->data[i]->timer, status_change_timer);
+				sc_timer_delete(sc->data[i]->timer);
 			ers_free(sc_data_ers, sc->data[i]);
 			sc->data[i] = NULL;
 		}
@@ -6476,7 +6484,7 @@ int status_change_end_(struct block_list* bl, enum sc_type type, int tid, const
 			//Do not end infinite endure.
 			return 0;
 		if (sce->timer != INVALID_TIMER) //Could be a SC with infinite duration
-			delete_timer(sce->timer,status_change_timer);
+			sc_timer_delete(sce->timer);
 		if (sc->opt1)
 		switch (type) {
 			//"Ugly workaround"  [Skotlex]
@@ -6492,7 +6500,7 @@ int status_change_end_(struct block_list* bl, enum sc_type type, int tid, const
 				//since these SC are not affected by it, and it lets us know
 				//if we have already delayed this attack or not.
 				sce->val1 = 0;
-				sce->timer = add_timer(gettick()+10, status_change_timer, bl->id, type);
+				sce->timer = sc_timer_add(gettick()+10, bl->id, type);
 				return 1;
 			}
 		}
@@ -7015,6 +7023,268 @@ int kaahi_heal_timer(int tid, unsigned int tick, int id, intptr_t data)
 	return 1;
 }
 
+/*==========================================
+ * Status change expiry wheel.
+ * All status change timers share one hashed timing wheel instead of
+ * using a heap timer each, so starting, refreshing and ending a
+ * status change only links or unlinks a list node.
+ * sce->timer holds the node index and is passed as tid to
+ * status_change_timer when the node expires.
+ *------------------------------------------*/
+#define SC_WHEEL_SHIFT 4 // slot width: 16ms
+#define SC_WHEEL_SIZE 1024 // slots per revolution (~16s)
+#define SC_WHEEL_MASK (SC_WHEEL_SIZE-1)
+#define SC_WHEEL_SLOT(tick) ((tick)>>SC_WHEEL_SHIFT)
+
+enum sc_timer_state { SCT_FREE, SCT_LINKED, SCT_EXPIRED, SCT_RUNNING, SCT_DELETED };
+
+struct sc_timer {
+	unsigned int tick; // expiry tick
+	int id; // block list id
+	short type; // sc_type
+	unsigned char state; // enum sc_timer_state
+	int slot; // wheel slot index the node is linked in
+	int prev, next; // slot or expired list, or free list through next
+};
+
+static struct sc_timer* sc_timer_data = NULL;
+static int sc_timer_max = 0;
+static int sc_timer_free = -1; // first free node
+static int sc_wheel[SC_WHEEL_SIZE]; // first node of each slot
+static int sc_expired = -1, sc_expired_last = -1; // nodes waiting for their callback
+static unsigned int sc_wheel_next; // next slot number to process
+static int sc_wheel_tid = INVALID_TIMER; // heap timer that drives the wheel
+static unsigned int sc_wheel_tick; // tick of sc_wheel_tid
+
+static int sc_wheel_timer(int tid, unsigned int tick, int id, intptr_t data);
+
+/// Makes sure the wheel is processed by the end of the given slot.
+static void sc_wheel_schedule(unsigned int slot)
+{
+	unsigned int tick = ((slot+1)<<SC_WHEEL_SHIFT) - 1;
+
+	if( sc_wheel_tid == INVALID_TIMER )
+	{
+		sc_wheel_tid = add_timer(tick, sc_wheel_timer, 0, 0);
+		sc_wheel_tick = tick;
+	}
+	else if( DIFF_TICK(tick, sc_wheel_tick) < 0 )
+	{
+		settick_timer(sc_wheel_tid, tick);
+		sc_wheel_tick = tick;
+	}
+}
+
+static void sc_wheel_link(int tid)
+{
+	struct sc_timer* t = &sc_timer_data[tid];
+	unsigned int slot = SC_WHEEL_SLOT(t->tick);
+	int* head;
+
+	if( (int)(slot - sc_wheel_next) < 0 )
+		slot = sc_wheel_next; // already expired, process it with the next slot
+	head = &sc_wheel[slot&SC_WHEEL_MASK];
+
+	t->state = SCT_LINKED;
+	t->slot = slot&SC_WHEEL_MASK;
+	t->prev = -1;
+	t->next = *head;
+	if( *head >= 0 )
+		sc_timer_data[*head].prev = tid;
+	*head = tid;
+
+	sc_wheel_schedule(slot);
+}
+
+static void sc_wheel_unlink(int tid)
+{
+	struct sc_timer* t = &sc_timer_data[tid];
+
+	if( t->prev >= 0 )
+		sc_timer_data[t->prev].next = t->next;
+	else if( t->state == SCT_EXPIRED )
+		sc_expired = t->next;
+	else
+		sc_wheel[t->slot] = t->next;
+	if( t->next >= 0 )
+		sc_timer_data[t->next].prev = t->prev;
+	else if( t->state == SCT_EXPIRED )
+		sc_expired_last = t->prev;
+}
+
+static void sc_timer_release(int tid)
+{
+	sc_timer_data[tid].state = SCT_FREE;
+	sc_timer_data[tid].next = sc_timer_free;
+	sc_timer_free = tid;
+}
+
+/// Schedules status change 'type' of 'id' to expire at 'tick'.
+/// Returns the handle to store in sce->timer.
+int sc_timer_add(unsigned int tick, int id, enum sc_type type)
+{
+	int tid;
+
+	if( sc_timer_free < 0 )
+	{// grow the node pool
+		int i;
+		RECREATE(sc_timer_data, struct sc_timer, sc_timer_max+256);
+		for( i = sc_timer_max+255; i >= sc_timer_max; --i )
+		{
+			sc_timer_data[i].state = SCT_FREE;
+			sc_timer_data[i].next = sc_timer_free;
+			sc_timer_free = i;
+		}
+		sc_timer_max += 256;
+	}
+
+	tid = sc_timer_free;
+	sc_timer_free = sc_timer_data[tid].next;
+	sc_timer_data[tid].tick = tick;
+	sc_timer_data[tid].id = id;
+	sc_timer_data[tid].type = type;
+	sc_wheel_link(tid);
+	return tid;
+}
+
+/// Moves the expiry of a status change timer to 'tick'.
+/// A timer that is currently running is re-armed instead of released.
+int sc_timer_settick(int tid, unsigned int tick)
+{
+	struct sc_timer* t;
+
+	if( tid < 0 || tid >= sc_timer_max || sc_timer_data[tid].state == SCT_FREE )
+	{
+		ShowError("sc_timer_settick: no such timer %d\n", tid);
+		return -1;
+	}
+	t = &sc_timer_data[tid];
+	if( t->state == SCT_LINKED || t->state == SCT_EXPIRED )
+		sc_wheel_unlink(tid);
+	t->tick = tick;
+	sc_wheel_link(tid);
+	return tid;
+}
+
+/// Removes a status change timer.
+int sc_timer_delete(int tid)
+{
+	struct sc_timer* t;
+
+	if( tid < 0 || tid >= sc_timer_max || sc_timer_data[tid].state == SCT_FREE )
+	{
+		ShowError("sc_timer_delete: no such timer %d\n", tid);
+		return -1;
+	}
+	t = &sc_timer_data[tid];
+	if( t->state == SCT_LINKED || t->state == SCT_EXPIRED )
+	{
+		sc_wheel_unlink(tid);
+		sc_timer_release(tid);
+	}
+	else // running, released once the callback returns
+		t->state = SCT_DELETED;
+	return 0;
+}
+
+/// Returns the expiry tick of a status change timer, or NULL if it doesn't exist.
+const unsigned int* sc_timer_gettick(int tid)
+{
+	if( tid < 0 || tid >= sc_timer_max )
+		return NULL;
+	switch( sc_timer_data[tid].state )
+	{
+	case SCT_LINKED:
+	case SCT_EXPIRED:
+	case SCT_RUNNING:
+		return &sc_timer_data[tid].tick;
+	}
+	return NULL;
+}
+
+/// Expires all status change timers of the slots that have passed.
+static int sc_wheel_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	unsigned int last = SC_WHEEL_SLOT(tick);
+	int count;
+
+	if( tid != sc_wheel_tid )
+		return 0;
+	sc_wheel_tid = INVALID_TIMER;
+
+	for( count = 0; count < SC_WHEEL_SIZE && (int)(sc_wheel_next - last) <= 0; ++count )
+	{
+		int i = sc_wheel[sc_wheel_next&SC_WHEEL_MASK];
+
+		// move the due nodes of the slot to the expired list
+		while( i >= 0 )
+		{
+			struct sc_timer* t = &sc_timer_data[i];
+			int next = t->next;
+
+			if( DIFF_TICK(t->tick, tick) <= 0 )
+			{
+				sc_wheel_unlink(i);
+				t->state = SCT_EXPIRED;
+				t->prev = sc_expired_last;
+				t->next = -1;
+				if( sc_expired_last >= 0 )
+					sc_timer_data[sc_expired_last].next = i;
+				else
+					sc_expired = i;
+				sc_expired_last = i;
+			}
+			i = next;
+		}
+		++sc_wheel_next; // timers added by the callbacks go to later slots
+
+		// callbacks may start, move or end any timer, so always take the first one
+		while( (i = sc_expired) >= 0 )
+		{
+			struct sc_timer* t = &sc_timer_data[i];
+			// same rules as do_timer for the tick passed to the callback
+			unsigned int t_tick = ( DIFF_TICK(tick, t->tick) > 1000 ? tick : t->tick );
+
+			sc_wheel_unlink(i);
+			t->state = SCT_RUNNING;
+			status_change_timer(i, t_tick, t->id, t->type);
+			t = &sc_timer_data[i]; // the pool may have grown
+			if( t->state == SCT_RUNNING || t->state == SCT_DELETED )
+				sc_timer_release(i);
+		}
+	}
+	if( (int)(sc_wheel_next - last) <= 0 )
+		sc_wheel_next = last + 1; // every slot was visited
+
+	// schedule the next non-empty slot
+	for( count = 0; count < SC_WHEEL_SIZE; ++count )
+	{
+		unsigned int slot = sc_wheel_next + count;
+		if( sc_wheel[slot&SC_WHEEL_MASK] >= 0 )
+		{
+			sc_wheel_schedule(slot);
+			break;
+		}
+	}
+	return 0;
+}
+
+static void sc_wheel_init(void)
+{
+	int i;
+	for( i = 0; i < SC_WHEEL_SIZE; ++i )
+		sc_wheel[i] = -1;
+	sc_wheel_next = SC_WHEEL_SLOT(gettick());
+}
+
+static void sc_wheel_final(void)
+{
+	aFree(sc_timer_data);
+	sc_timer_data = NULL;
+	sc_timer_max = 0;
+	sc_timer_free = -1;
+}
+
 /*==========================================
  * Xe[^XُI^C}[
  *------------------------------------------*/
@@ -7053,7 +7323,7 @@ int status_change_timer(int tid, unsigned int tick, int id, intptr_t data)
 // set the next timer of the sce (don't assume the status still exists)
 #define sc_timer_next(t,f,i,d) \
 	if( (sce=sc->data[type]) ) \
-		sce->timer = add_timer(t,f,i,d); \
+		sce->timer = sc_timer_add(t,i,(sc_type)d); \
 	else \
 		ShowError("status_change_timer: Unexpected NULL status change id: %d data: %d\n", id, data)
 
@@ -7508,7 +7778,19 @@ int status_change_clear_buffs (struct block_list* bl, int type)
 
 //Natural regen related stuff.
 static unsigned int natural_heal_prev_tick,natural_heal_diff_tick;
-static int status_natural_heal(struct block_list* bl, va_list args)
+
+// Minimum number of units to spread the regen over the shards.
+#define REGEN_SHARD_MIN 1024
+
+// Units of the current natural heal run, packed.
+static struct {
+	struct block_list** bl;
+	int* id;
+	bool* heal; // true if the unit heals this time (or loses hp/sp)
+	int count, max;
+} regen_batch;
+
+static int status_natural_heal(struct block_list* bl)
 {
 	struct regen_data *regen;
 	struct status_data *status;
@@ -7698,11 +7980,191 @@ static int status_natural_heal(struct block_list* bl, va_list args)
 	return flag;
 }
 
+/// Advances the regen ticks of a unit that doesn't heal this time.
+/// Follows status_natural_heal without its side effects, so it can run in the shards.
+/// Returns true, leaving the unit untouched, if it heals or loses hp/sp.
+static bool status_natural_heal_tick(struct block_list* bl)
+{
+	struct regen_data *regen;
+	struct status_data *status;
+	struct status_change *sc;
+	struct unit_data *ud;
+	struct view_data *vd = NULL;
+	struct regen_data_sub *sregen;
+	struct map_session_data *sd;
+	unsigned int sit_hp = 0, sit_sp = 0, skill_hp = 0, skill_sp = 0;
+	int val,rate,bonus = 0,flag;
+	int hp = 0, sp = 0;
+
+	regen = status_get_regen_data(bl);
+	if (!regen) return false;
+	status = status_get_status_data(bl);
+	sc = status_get_sc(bl);
+	if (sc && !sc->count)
+		sc = NULL;
+	sd = BL_CAST(BL_PC,bl);
+
+	flag = regen->flag;
+	if (flag&RGN_HP && (status->hp >= status->max_hp || regen->state.block&1))
+		flag&=~(RGN_HP|RGN_SHP);
+	if (flag&RGN_SP && (status->sp >= status->max_sp || regen->state.block&2))
+		flag&=~(RGN_SP|RGN_SSP);
+
+	if (flag && (
+		status_isdead(bl) ||
+		(sc && sc->option&(OPTION_HIDE|OPTION_CLOAK|OPTION_CHASEWALK))
+	))
+		flag=0;
+
+	if (sd && (sd->hp_loss.value || sd->sp_loss.value || sd->hp_regen.value || sd->sp_regen.value))
+		return true;
+
+	if(flag&(RGN_SHP|RGN_SSP) && regen->ssregen &&
+		(vd = status_get_viewdata(bl)) && vd->dead_sit == 2)
+	{	//Sitting regen
+		sregen = regen->ssregen;
+		if(flag&(RGN_SHP))
+		{
+			val = natural_heal_diff_tick * sregen->rate.hp;
+			if (regen->state.overweight)
+				val>>=1;
+			sit_hp = val;
+			if(sregen->tick.hp + sit_hp >= (unsigned int)battle_config.natural_heal_skill_interval)
+				return true;
+		}
+		if(flag&(RGN_SSP))
+		{
+			val = natural_heal_diff_tick * sregen->rate.sp;
+			if (regen->state.overweight)
+				val>>=1;
+			sit_sp = val;
+			if(sregen->tick.sp + sit_sp >= (unsigned int)battle_config.natural_heal_skill_interval)
+				return true;
+		}
+	}
+
+	if (flag && regen->state.overweight)
+		flag=0;
+
+	ud = unit_bl2ud(bl);
+
+	if (flag&(RGN_HP|RGN_SHP|RGN_SSP) && ud && ud->walktimer != INVALID_TIMER)
+	{
+		flag&=~(RGN_SHP|RGN_SSP);
+		if(!regen->state.walk)
+			flag&=~RGN_HP;
+	}
+
+	if (flag&(RGN_HP|RGN_SP))
+	{
+		if(!vd) vd = status_get_viewdata(bl);
+		if(vd && vd->dead_sit == 2)
+			bonus++;
+		if(regen->state.gc)
+			bonus++;
+	}
+
+	if (flag&RGN_HP)
+	{	//Natural Hp regen
+		rate = natural_heal_diff_tick*(regen->rate.hp+bonus);
+		if (ud && ud->walktimer != INVALID_TIMER)
+			rate/=2;
+		if(bl->type==BL_HOM) rate *=2;
+		hp = rate;
+		if(regen->tick.hp + hp >= (unsigned int)battle_config.natural_healhp_interval)
+			return true;
+	}
+
+	if(flag&RGN_SP)
+	{	//Natural SP regen
+		rate = natural_heal_diff_tick*(regen->rate.sp+bonus);
+		if(bl->type==BL_HOM) rate *=2;
+		sp = rate;
+		if(regen->tick.sp + sp >= (unsigned int)battle_config.natural_healsp_interval)
+			return true;
+	}
+
+	if (regen->sregen)
+	{	//Skill regen
+		sregen = regen->sregen;
+		if(flag&RGN_SHP)
+		{
+			skill_hp = natural_heal_diff_tick * sregen->rate.hp;
+			if(sregen->tick.hp + skill_hp >= (unsigned int)battle_config.natural_heal_skill_interval)
+				return true;
+		}
+		if(flag&RGN_SSP)
+		{
+			skill_sp = natural_heal_diff_tick * sregen->rate.sp;
+			if(sregen->tick.sp + skill_sp >= (unsigned int)battle_config.natural_heal_skill_interval)
+				return true;
+		}
+	}
+
+	//Nothing to heal yet.
+	if (sit_hp) regen->ssregen->tick.hp += sit_hp;
+	if (sit_sp) regen->ssregen->tick.sp += sit_sp;
+	regen->tick.hp += hp;
+	regen->tick.sp += sp;
+	if (skill_hp) regen->sregen->tick.hp += skill_hp;
+	if (skill_sp) regen->sregen->tick.sp += skill_sp;
+	return false;
+}
+
+/// Advances the regen of the shard's part of the batch.
+static void status_natural_heal_shard(int shard, void* param)
+{
+	int count = shard_count();
+	int i = regen_batch.count*shard/count;
+	int end = regen_batch.count*(shard+1)/count;
+
+	for( ; i < end; ++i )
+	{
+		regen_batch.id[i] = regen_batch.bl[i]->id;
+		regen_batch.heal[i] = status_natural_heal_tick(regen_batch.bl[i]);
+	}
+}
+
 //Natural heal main timer.
+//The regen of all the units is advanced first, in the shards if there are enough units,
+//then the units that heal are processed in order.
 static int status_natural_heal_timer(int tid, unsigned int tick, int id, intptr_t data)
 {
+	struct block_list** list;
+	int i, count;
+
 	natural_heal_diff_tick = DIFF_TICK(tick,natural_heal_prev_tick);
-	map_foreachregen(status_natural_heal);
+
+	// copy the units, healing can add or remove some
+	list = map_getregenlist(&count);
+	if( count > regen_batch.max )
+	{
+		regen_batch.max = count;
+		RECREATE(regen_batch.bl, struct block_list*, regen_batch.max);
+		RECREATE(regen_batch.id, int, regen_batch.max);
+		RECREATE(regen_batch.heal, bool, regen_batch.max);
+	}
+	memcpy(regen_batch.bl, list, count*sizeof(struct block_list*));
+	regen_batch.count = count;
+
+	if( count < REGEN_SHARD_MIN || !shard_run(status_natural_heal_shard, NULL) )
+	{
+		for( i = 0; i < count; ++i )
+		{
+			regen_batch.id[i] = regen_batch.bl[i]->id;
+			regen_batch.heal[i] = status_natural_heal_tick(regen_batch.bl[i]);
+		}
+	}
+
+	for( i = 0; i < count; ++i )
+	{
+		if( !regen_batch.heal[i] )
+			continue;
+		if( map_id2bl(regen_batch.id[i]) != regen_batch.bl[i] )
+			continue;// gone while others healed
+		status_natural_heal(regen_batch.bl[i]);
+	}
+
 	natural_heal_prev_tick = tick;
 	return 0;
 }
@@ -7786,10 +8248,32 @@ static bool status_readdb_refine(char* fields[], int columns, int current)
 	return true;
 }
 
+/// Reads, writes or checks the job tables in the db snapshot.
+static void status_snapshot(struct snapshot* s)
+{
+	snapshot_array(s, "max_weight_base", max_weight_base, sizeof(max_weight_base[0]), ARRAYLENGTH(max_weight_base));
+	snapshot_array(s, "hp_coefficient", hp_coefficient, sizeof(hp_coefficient[0]), ARRAYLENGTH(hp_coefficient));
+	snapshot_array(s, "hp_coefficient2", hp_coefficient2, sizeof(hp_coefficient2[0]), ARRAYLENGTH(hp_coefficient2));
+	snapshot_array(s, "sp_coefficient", sp_coefficient, sizeof(sp_coefficient[0]), ARRAYLENGTH(sp_coefficient));
+	snapshot_array(s, "aspd_base", aspd_base, sizeof(aspd_base[0][0]), ARRAYLENGTH(aspd_base)*MAX_WEAPON_TYPE);
+	snapshot_array(s, "job_bonus", job_bonus, sizeof(job_bonus[0][0]), ARRAYLENGTH(job_bonus)*MAX_LEVEL);
+	snapshot_array(s, "atkmods", atkmods, sizeof(atkmods[0][0]), ARRAYLENGTH(atkmods)*MAX_WEAPON_TYPE);
+	snapshot_array(s, "percentrefinery", percentrefinery, sizeof(percentrefinery[0][0]), ARRAYLENGTH(percentrefinery)*(MAX_REFINE+1));
+	snapshot_array(s, "refinebonus", refinebonus, sizeof(refinebonus[0][0]), ARRAYLENGTH(refinebonus)*3);
+}
+
 int status_readdb(void)
 {
+	struct snapshot* s;
 	int i, j;
 
+	if( (s = snapshot_open(SNAPSHOT_STATUSDB)) != NULL )
+	{
+		status_snapshot(s);
+		if( snapshot_close(s) )
+			return 0;
+	}
+
 	// initialize databases to default
 	//
 
@@ -7821,10 +8305,17 @@ int status_readdb(void)
 	// read databases
 	//
 
-	sv_readdb(db_path, "job_db1.txt",   ',', 5+MAX_WEAPON_TYPE, 5+MAX_WEAPON_TYPE, -1,                            &status_readdb_job1);
-	sv_readdb(db_path, "job_db2.txt",   ',', 1,                 1+MAX_LEVEL,       -1,                            &status_readdb_job2);
-	sv_readdb(db_path, "size_fix.txt",  ',', MAX_WEAPON_TYPE,   MAX_WEAPON_TYPE,    ARRAYLENGTH(atkmods),         &status_readdb_sizefix);
-	sv_readdb(db_path, "refine_db.txt", ',', 3+MAX_REFINE+1,    3+MAX_REFINE+1,     ARRAYLENGTH(percentrefinery), &status_readdb_refine);
+	s = snapshot_create(SNAPSHOT_STATUSDB);
+	snapshot_readdb(db_path, "job_db1.txt",   ',', 5+MAX_WEAPON_TYPE, 5+MAX_WEAPON_TYPE, -1,                            &status_readdb_job1);
+	snapshot_readdb(db_path, "job_db2.txt",   ',', 1,                 1+MAX_LEVEL,       -1,                            &status_readdb_job2);
+	snapshot_readdb(db_path, "size_fix.txt",  ',', MAX_WEAPON_TYPE,   MAX_WEAPON_TYPE,    ARRAYLENGTH(atkmods),         &status_readdb_sizefix);
+	snapshot_readdb(db_path, "refine_db.txt", ',', 3+MAX_REFINE+1,    3+MAX_REFINE+1,     ARRAYLENGTH(percentrefinery), &status_readdb_refine);
+
+	if( s != NULL )
+	{
+		status_snapshot(s);
+		snapshot_close(s);
+	}
 
 	return 0;
 }
@@ -7834,7 +8325,7 @@ int status_readdb(void)
  *------------------------------------------*/
 int do_init_status(void)
 {
-	add_timer_func_list(status_change_timer,"status_change_timer");
+	add_timer_func_list(sc_wheel_timer,"sc_wheel_timer");
 	add_timer_func_list(kaahi_heal_timer,"kaahi_heal_timer");
 	add_timer_func_list(status_natural_heal_timer,"status_natural_heal_timer");
 	initChangeTables();
@@ -7843,10 +8334,16 @@ int do_init_status(void)
 	status_calc_sigma();
 	natural_heal_prev_tick = gettick();
 	sc_data_ers = ers_new(sizeof(struct status_change_entry));
+	sc_wheel_init();
 	add_timer_interval(natural_heal_prev_tick + NATURAL_HEAL_INTERVAL, status_natural_heal_timer, 0, 0, NATURAL_HEAL_INTERVAL);
 	return 0;
 }
 void do_final_status(void)
 {
 	ers_destroy(sc_data_ers);
+	sc_wheel_final();
+	aFree(regen_batch.bl);
+	aFree(regen_batch.id);
+	aFree(regen_batch.heal);
+	memset(&regen_batch, 0, sizeof(regen_batch));
 }
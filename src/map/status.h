@@ -1285,6 +1285,10 @@ int status_change_end_(struct block_list* bl, enum sc_type type, int tid, const
 #define status_change_end(bl,type,tid) status_change_end_(bl,type,tid,__FILE__,__LINE__)
 int kaahi_heal_timer(int tid, unsigned int tick, int id, intptr_t data);
 int status_change_timer(int tid, unsigned int tick, int id, intptr_t data);
+int sc_timer_add(unsigned int tick, int id, enum sc_type type);
+int sc_timer_settick(int tid, unsigned int tick);
+int sc_timer_delete(int tid);
+const unsigned int* sc_timer_gettick(int tid);
 int status_change_timer_sub(struct block_list* bl, va_list ap);
 int status_change_clear(struct block_list* bl, int type);
 int status_change_clear_buffs(struct block_list* bl, int type);
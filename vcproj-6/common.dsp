@@ -228,6 +228,14 @@ SOURCE=..\src\common\strlib.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\common\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\common\thread.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\common\timer.c
 # End Source File
 # Begin Source File
@@ -94,6 +94,14 @@ SOURCE=..\src\login\account_sql.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\login\dnsbl.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\login\dnsbl.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\login\ipban.h
 # End Source File
 # Begin Source File
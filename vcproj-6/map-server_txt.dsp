@@ -102,6 +102,14 @@ SOURCE=..\src\map\battle.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\map\battle_bench.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\map\battle_bench.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\map\battleground.c
 # End Source File
 # Begin Source File
@@ -326,10 +334,18 @@ SOURCE=..\src\map\searchstore.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\map\shard.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\map\searchstore.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\map\shard.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\map\skill.c
 # End Source File
 # Begin Source File
@@ -338,6 +354,14 @@ SOURCE=..\src\map\skill.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\map\snapshot.c
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\map\snapshot.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\map\status.c
 # End Source File
 # Begin Source File